@@ -23,12 +23,52 @@
  ******************************************************************************/
 size_t tpm_context_v1_size(void);
 uta_rc tpm_open(const uta_context_v1_t *tpm_context);
+uta_rc tpm_open_pool(const uta_context_v1_t *tpm_context,
+        size_t num_connections);
+uta_rc tpm_open_devices(const uta_context_v1_t *tpm_context,
+        const char * const *device_files, size_t num_devices,
+        size_t connections_per_device);
 uta_rc tpm_close(const uta_context_v1_t *tpm_context);
 uta_rc tpm_derive_key(const uta_context_v1_t *tpm_context, uint8_t *key,
         size_t len_key, const uint8_t *dv, size_t len_dv, uint8_t key_slot);
+uta_rc tpm_derive_key_batch(const uta_context_v1_t *tpm_context,
+        uta_derive_request_v1_t *requests, size_t num_requests);
 uta_rc tpm_get_random(const uta_context_v1_t *tpm_context, uint8_t *random,
         size_t len_random);
+uta_rc tpm_set_random_mode(const uta_context_v1_t *tpm_context,
+        const uta_random_config_v1_t *config);
+uta_rc tpm_get_poll_fd(const uta_context_v1_t *tpm_context, int *fd);
+uta_rc tpm_derive_key_submit(const uta_context_v1_t *tpm_context,
+        uint8_t *key, size_t len_key, const uint8_t *dv, size_t len_dv,
+        uint8_t key_slot);
+uta_rc tpm_get_random_submit(const uta_context_v1_t *tpm_context,
+        uint8_t *random, size_t len_random);
+uta_rc tpm_async_complete(const uta_context_v1_t *tpm_context);
+uta_rc tpm_set_key_cache(const uta_context_v1_t *tpm_context,
+        const uta_key_cache_config_v1_t *config);
+uta_rc tpm_flush_key_cache(const uta_context_v1_t *tpm_context);
+uta_rc tpm_get_stats(const uta_context_v1_t *tpm_context,
+        uta_stats_v1_t *stats);
+uta_rc tpm_reset_stats(const uta_context_v1_t *tpm_context);
+uta_rc tpm_derive_key_expand(const uta_context_v1_t *tpm_context,
+        uta_expand_request_v1_t *requests, size_t num_requests,
+        const uint8_t *dv, size_t len_dv, uint8_t key_slot);
 uta_rc tpm_get_device_uuid(const uta_context_v1_t *tpm_context, uint8_t *uuid);
 uta_rc tpm_self_test(const uta_context_v1_t *tpm_context);
+uta_rc tpm_start_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode);
+uta_rc tpm_get_self_test_result(const uta_context_v1_t *tpm_context,
+        uta_self_test_result_v1_t *result);
+uta_rc tpm_get_random_v(const uta_context_v1_t *tpm_context,
+        const uta_random_buffer_v1_t *buffers, size_t num_buffers);
+uta_rc tpm_set_timeout(const uta_context_v1_t *tpm_context,
+        uint32_t timeout_ms);
+uta_rc tpm_get_capabilities(const uta_context_v1_t *tpm_context,
+        uta_capabilities_v1_t *capabilities);
+uta_rc tpm_set_param_encryption(const uta_context_v1_t *tpm_context,
+        const uta_param_enc_policy_v1_t *policy);
+#ifdef ENABLE_TEST_HOOKS
+uint32_t tpm_flush_sessions(uint32_t count);
+#endif
 
 #endif /* TPM_TCG_H */
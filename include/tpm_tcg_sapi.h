@@ -0,0 +1,69 @@
+/** @file tpm_tcg_sapi.h
+*
+* @brief Unified Trust Anchor (UTA) allocation free fast path of the TCG TSS
+* for HMAC and GetRandom on top of the system API (SAPI)
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef TPM_TCG_SAPI_H
+#define TPM_TCG_SAPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <tss2/tss2_sys.h>
+
+#include <uta.h>
+#include <uta_sched.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Number of key slots, whose names are kept for the cpHash */
+#define TPM_SAPI_KEY_SLOTS      2
+/* Length of the session key, the nonces and the HMACs (SHA256) */
+#define TPM_SAPI_DIGEST_LEN     32
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief SAPI context with its command and response buffer and the salted
+ *      session of one connection. The fast path is active, as long as
+ *      sys_context is not NULL.
+ */
+typedef struct
+{
+    TSS2_SYS_CONTEXT *sys_context;
+    TPMI_SH_AUTH_SESSION session;
+    uint8_t session_key[TPM_SAPI_DIGEST_LEN];
+    /* Last nonce of the TPM, the nonceOlder of the next command */
+    TPM2B_NONCE nonce_tpm;
+    TPM2_HANDLE key_handles[TPM_SAPI_KEY_SLOTS];
+    /* Names of the keys, size 0 if not read yet */
+    TPM2B_NAME key_names[TPM_SAPI_KEY_SLOTS];
+    /* Most random bytes of one TPM2_GetRandom response, see get_capabilities */
+    UINT16 max_random;
+} tpm_sapi_t;
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+TSS2_RC tpm_sapi_open(tpm_sapi_t *sapi, TSS2_TCTI_CONTEXT *tcti_ctx,
+        TPM2_HANDLE salt_handle, const TPM2_HANDLE *key_handles);
+void tpm_sapi_close(tpm_sapi_t *sapi);
+void tpm_sapi_forget(tpm_sapi_t *sapi);
+TSS2_RC tpm_sapi_read_name(tpm_sapi_t *sapi, uint8_t key_slot);
+TSS2_RC tpm_sapi_hmac(tpm_sapi_t *sapi, uint8_t key_slot,
+        const uint8_t *data, size_t len_data, uint8_t *hmac, size_t len_hmac,
+        TPMA_SESSION attributes);
+TSS2_RC tpm_sapi_get_random(tpm_sapi_t *sapi, uta_random_cursor_t *cursor,
+        size_t len_random, TPMA_SESSION attributes);
+
+#endif /* TPM_TCG_SAPI_H */
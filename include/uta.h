@@ -31,6 +31,9 @@ typedef uint32_t uta_rc;
 #define UTA_INVALID_KEY_LENGTH 0x01 /**< @brief Invalid len_key parameter */
 #define UTA_INVALID_DV_LENGTH  0x02 /**< @brief Invalid len_dv parameter */
 #define UTA_INVALID_KEY_SLOT   0x03 /**< @brief Invalid key_slot parameter */
+#define UTA_NOT_SUPPORTED      0x04 /**< @brief Not supported by this build */
+#define UTA_TRY_AGAIN          0x05 /**< @brief Asynchronous call pending */
+#define UTA_TIMEOUT            0x06 /**< @brief Timeout of the context passed */
 #define UTA_TA_ERROR           0x10 /**< @brief General trust anchor error */
 
 /**
@@ -43,7 +46,8 @@ typedef struct{
 	enum{
 		UTA_SIM=0, /**< UTA Software Simulator for development purposes */
 		TPM_IBM=1, /**< TPM based on the IBM TSS */
-        TPM_TCG=2  /**< TPM based on the TCG TSS */
+        TPM_TCG=2, /**< TPM based on the TCG TSS */
+        UTA_CLIENT=3 /**< Client of the utad daemon */
 	} uta_type;    	  
 	uint32_t major; /**< Major version number of the library. */
 	uint32_t minor; /**< Minor version number of the library. */
@@ -126,17 +130,486 @@ typedef struct {
 	
 } uta_api_v1_t;
 
+/**
+ * @brief Single entry of a batched key derivation, see derive_key_batch.
+ */
+typedef struct {
+	uint8_t *key;           /**< Buffer the derived key is written to. */
+	size_t len_key;         /**< Number of bytes to write to key. */
+	const uint8_t *dv;      /**< Derivation value. */
+	size_t len_dv;          /**< Length of the derivation value. */
+	uint8_t key_slot;       /**< Key slot used for the derivation. */
+	uta_rc rc;              /**< Result of this entry (output). */
+} uta_derive_request_v1_t;
+
+/**
+ * @brief Single subkey of a key expansion, see derive_key_expand.
+ */
+typedef struct {
+	uint8_t *key;           /**< Buffer the subkey is written to. */
+	size_t len_key;         /**< Number of bytes to write to key. */
+	const uint8_t *info;    /**< Label of the subkey (HKDF info). */
+	size_t len_info;        /**< Length of the label, may be 0. */
+} uta_expand_request_v1_t;
+
+/**
+ * @brief Single buffer of a vectored random request, see get_random_v.
+ */
+typedef struct {
+	uint8_t *random;        /**< Buffer the random bytes are written to. */
+	size_t len_random;      /**< Number of bytes to write to random, may be
+	                             0. */
+} uta_random_buffer_v1_t;
+
+/**
+ * @brief Random mode of a context, see set_random_mode.
+ */
+typedef struct {
+	/**
+	 * Source of the get_random output.
+	 */
+	enum{
+		UTA_RANDOM_TA=0,   /**< Every request is served by the trust anchor */
+		UTA_RANDOM_DRBG=1, /**< Requests are served by a host CTR_DRBG, which
+		                        is seeded by the trust anchor */
+		UTA_RANDOM_PREFETCH=2 /**< Requests are served from a ring of trust
+		                           anchor output, which a background thread
+		                           refills */
+	} mode;
+	/**
+	 * Number of output bytes after which the DRBG is reseeded from the trust
+	 * anchor. 0 selects the default of 1 MiB.
+	 */
+	uint64_t reseed_bytes;
+	/**
+	 * Time in seconds after which the DRBG is reseeded from the trust anchor.
+	 * 0 selects the default of 60 seconds.
+	 */
+	uint32_t reseed_interval;
+} uta_random_config_v1_t;
+
+/**
+ * @brief Operations counted in uta_stats_v1_t.
+ */
+typedef enum {
+	UTA_STATS_OPEN=0,          /**< open, open_pool and open_devices */
+	UTA_STATS_CLOSE=1,         /**< close */
+	UTA_STATS_DERIVE_KEY=2,    /**< derive_key, each batch entry and
+	                                asynchronous derivations */
+	UTA_STATS_GET_RANDOM=3,    /**< get_random and asynchronous requests */
+	UTA_STATS_GET_DEVICE_UUID=4, /**< get_device_uuid */
+	UTA_STATS_SELF_TEST=5,     /**< self_test */
+	UTA_STATS_NUM_OPS=6
+} uta_stats_op_t;
+
+/**
+ * @brief Number of return code counters in uta_stats_v1_t. The counter i
+ * counts the return code i for UTA_SUCCESS up to UTA_TIMEOUT, the last
+ * counter counts UTA_TA_ERROR.
+ */
+#define UTA_STATS_NUM_RC	8
+
+/**
+ * @brief Call counters of one operation, see get_stats.
+ */
+typedef struct {
+	uint64_t calls;         /**< Number of finished calls. */
+	uint64_t errors;        /**< Number of calls not returning UTA_SUCCESS. */
+} uta_op_stats_v1_t;
+
+/**
+ * @brief Statistics of a context, see get_stats. All times are in ns.
+ */
+typedef struct {
+	uta_op_stats_v1_t ops[UTA_STATS_NUM_OPS]; /**< Calls by operation. */
+	uint64_t rc[UTA_STATS_NUM_RC]; /**< Finished calls by return code. */
+	uint64_t random_bytes;  /**< Random bytes returned by get_random. */
+	uint64_t ta_accesses;   /**< Number of trust anchor accesses. */
+	uint64_t ta_time;       /**< Cumulative time of the accesses. */
+	uint64_t ta_time_max;   /**< Longest access. */
+	uint64_t lock_waits;    /**< Number of calls, which had to wait for a lock
+	                             or a free connection. */
+	uint64_t lock_wait_time; /**< Cumulative waiting time. */
+	uint64_t lock_wait_max; /**< Longest wait. */
+	uint64_t key_cache_hits; /**< derive_key calls served by the key cache. */
+	uint64_t key_cache_misses; /**< derive_key calls not found in the enabled
+	                                key cache. */
+} uta_stats_v1_t;
+
+/**
+ * @brief Configuration of the key cache, see set_key_cache.
+ */
+typedef struct {
+	/**
+	 * Maximum number of cached keys, rounded up to a power of two. 0
+	 * disables the cache. Up to 65536 entries are supported.
+	 */
+	size_t max_entries;
+	/**
+	 * Time in seconds after which a cached key expires. 0 selects the
+	 * default of 60 seconds.
+	 */
+	uint32_t ttl;
+} uta_key_cache_config_v1_t;
+
+/**
+ * @brief Mode of a self test started with start_self_test.
+ */
+typedef enum {
+	UTA_SELF_TEST_FULL=0,        /**< All functions of the trust anchor */
+	UTA_SELF_TEST_INCREMENTAL=1  /**< Only the algorithms used by UTA:
+	                                  SHA256, HMAC, AES-CFB, ECC and ECDH */
+} uta_self_test_mode_t;
+
+/**
+ * @brief Cached result of the last self test, see get_self_test_result.
+ */
+typedef struct {
+	/**
+	 * UTA_SUCCESS if the last self test passed, UTA_TA_ERROR if it failed,
+	 * UTA_TRY_AGAIN while it is running and UTA_NOT_SUPPORTED if no self
+	 * test has been run since open.
+	 */
+	uta_rc rc;
+	uta_self_test_mode_t mode; /**< Mode of the last self test. */
+	uint64_t age;   /**< Time in ns since the result was determined, 0 while
+	                     the self test is running. */
+} uta_self_test_result_v1_t;
+
+/**
+ * @brief Capabilities and limits of the trust anchor of a context, see
+ * get_capabilities. Properties, which the trust anchor does not report, are 0.
+ */
+typedef struct {
+	uint32_t manufacturer;  /**< TPM2_PT_MANUFACTURER, the vendor ID as four
+	                             ASCII characters, e.g. 0x49424D00 for
+	                             "IBM". */
+	uint32_t firmware_version_1; /**< TPM2_PT_FIRMWARE_VERSION_1. */
+	uint32_t firmware_version_2; /**< TPM2_PT_FIRMWARE_VERSION_2. */
+	uint32_t max_digest;    /**< TPM2_PT_MAX_DIGEST, which is also the largest
+	                             response of one TPM2_GetRandom. */
+	uint32_t input_buffer;  /**< TPM2_PT_INPUT_BUFFER, the largest data
+	                             buffer of one command. */
+	uint32_t len_key_max;   /**< Longest key of derive_key, see
+	                             len_key_max. */
+	uint32_t num_key_slots; /**< Number of key slots. */
+	uint32_t resource_manager; /**< 1 if the trust anchor is accessed through
+	                                the kernel resource manager
+	                                (/dev/tpmrm*), 0 otherwise. */
+	uint32_t num_devices;   /**< Number of devices of the context. */
+	uint32_t num_connections; /**< Number of connections of the context,
+	                               the calls, which can be served in
+	                               parallel. */
+} uta_capabilities_v1_t;
+
+/**
+ * @brief Parameter encryption of the salted session of an operation, see
+ * set_param_encryption.
+ */
+typedef enum {
+	UTA_PARAM_ENC_FULL=0,     /**< Command and response parameters are
+	                               encrypted, the default */
+	UTA_PARAM_ENC_RESPONSE=1, /**< Only the response parameters, i.e. the key
+	                               or the random bytes, are encrypted */
+	UTA_PARAM_ENC_AUDIT=2     /**< No parameter is encrypted, the session
+	                               only authenticates the command and the
+	                               response */
+} uta_param_enc_t;
+
+/**
+ * @brief Parameter encryption policy of a context, see set_param_encryption.
+ */
+typedef struct {
+	uta_param_enc_t derive_key; /**< Key derivations of all derive_key
+	                                 calls. */
+	uta_param_enc_t get_random; /**< Random requests of get_random and
+	                                 get_random_v and the reads of the DRBG
+	                                 and prefetch modes. TPM2_GetRandom has
+	                                 no command parameter, so
+	                                 UTA_PARAM_ENC_RESPONSE equals
+	                                 UTA_PARAM_ENC_FULL. */
+} uta_param_enc_policy_v1_t;
+
+/**
+ * @brief Struct containing pointers to the extension functions of version 1
+ * of the library. The struct uta_api_v1_t is left untouched, so that binaries
+ * built against earlier releases keep working.
+ */
+typedef struct {
+	/**
+	 * Derives num_requests keys in one trust anchor transaction. Every entry
+	 * is validated like a derive_key call before the trust anchor is
+	 * accessed and the result of each entry is written to its rc member.
+	 * Invalid entries do not prevent the derivation of the valid ones. The
+	 * function returns UTA_SUCCESS if all entries succeeded, otherwise the
+	 * rc of the first failed entry.
+	 */
+	uta_rc (*derive_key_batch)(const uta_context_v1_t *uta_context,
+            uta_derive_request_v1_t *requests, size_t num_requests);
+
+	/**
+	 * Selects the source of the get_random output for the given context. In
+	 * the UTA_RANDOM_DRBG mode an SP 800-90A CTR_DRBG is kept in the context,
+	 * which is seeded from the trust anchor immediately and reseeded after
+	 * reseed_bytes output bytes or reseed_interval seconds, whichever comes
+	 * first. Small requests are then served without accessing the trust
+	 * anchor. Calling the function again reseeds the DRBG. The function
+	 * returns UTA_NOT_SUPPORTED if the library was built without
+	 * --enable-drbg. In the UTA_RANDOM_PREFETCH mode a background thread
+	 * keeps a ring of trust anchor output filled, which is refilled as soon
+	 * as less than half of it is left. get_random takes the bytes from the
+	 * ring, wipes them there, and reads only the rest from the trust anchor.
+	 * The reseed limits are ignored in this mode, which is supported by the
+	 * TPM backends only. The default after open is UTA_RANDOM_TA.
+	 */
+	uta_rc (*set_random_mode)(const uta_context_v1_t *uta_context,
+            const uta_random_config_v1_t *config);
+
+	/**
+	 * Returns a file descriptor in fd, which becomes readable when the
+	 * pending asynchronous operation of the context may have completed. The
+	 * descriptor can be added to poll, select or epoll, but must not be read
+	 * or closed by the caller. It stays valid until close.
+	 */
+	uta_rc (*get_poll_fd)(const uta_context_v1_t *uta_context, int *fd);
+
+	/**
+	 * Submits an asynchronous derive_key call with the same parameters. The
+	 * parameters are checked immediately. The key buffer must stay valid
+	 * until complete returned a value other than UTA_TRY_AGAIN. Only one
+	 * asynchronous operation can be pending per context, otherwise
+	 * UTA_TRY_AGAIN is returned. While it is pending, the context must not be
+	 * used for other calls, unless it has been opened with open_pool.
+	 */
+	uta_rc (*derive_key_submit)(const uta_context_v1_t *uta_context,
+            uint8_t *key, size_t len_key, const uint8_t *dv, size_t len_dv,
+            uint8_t key_slot);
+
+	/**
+	 * Submits an asynchronous get_random call with the same parameters. The
+	 * random numbers are always read from the trust anchor, independent of
+	 * the random mode. The same restrictions as for derive_key_submit apply.
+	 */
+	uta_rc (*get_random_submit)(const uta_context_v1_t *uta_context,
+            uint8_t *random, size_t len_random);
+
+	/**
+	 * Completes the pending asynchronous operation without blocking. Returns
+	 * UTA_TRY_AGAIN while the operation is still running, otherwise the
+	 * uta_rc of the operation. Requests, which need several trust anchor
+	 * commands, are continued by this function. It returns UTA_TA_ERROR if
+	 * no operation is pending.
+	 */
+	uta_rc (*complete)(const uta_context_v1_t *uta_context);
+
+	/**
+	 * Opens the context like open, but with num_connections independent
+	 * connections to the trust anchor, each with its own session. Up to
+	 * num_connections threads are then served in parallel instead of one
+	 * after the other; further threads block until a connection is free.
+	 * The context is released with close. A pending asynchronous operation
+	 * of the TPM_TCG backend holds the first connection, so that other calls
+	 * proceed on the remaining ones. With a single connection, synchronous
+	 * calls then block until the pending operation is completed.
+	 * UTA_NOT_SUPPORTED is returned if num_connections is 0 or exceeds the
+	 * configured TPM_POOL_MAX. The simulator has no connections and accepts
+	 * any num_connections of at least 1.
+	 */
+	uta_rc (*open_pool)(const uta_context_v1_t *uta_context,
+            size_t num_connections);
+
+	/**
+	 * Opens the context like open_pool, but with connections_per_device
+	 * connections to each of the num_devices trust anchors in device_files.
+	 * All devices must be provisioned with identical keys. Each request is
+	 * sent to the device with the fewest outstanding requests, ties are
+	 * resolved round-robin. If a device fails, the request is repeated on
+	 * the next device and the failed device is avoided for 5 seconds. The
+	 * device UUID is always read from the first device, self_test checks
+	 * all devices and asynchronous operations use the first device. All
+	 * devices must be opened successfully. UTA_NOT_SUPPORTED is returned if
+	 * num_devices or connections_per_device is 0 or the total number of
+	 * connections exceeds the configured TPM_POOL_MAX. The TPM_IBM backend
+	 * keeps the state of device n > 0 in the subdirectory device<n> of
+	 * TPM_IBM_DATA_DIR. The simulator ignores device_files.
+	 */
+	uta_rc (*open_devices)(const uta_context_v1_t *uta_context,
+            const char * const *device_files, size_t num_devices,
+            size_t connections_per_device);
+
+	/**
+	 * Copies the statistics of the context to stats. The counters are
+	 * updated with atomic operations by all threads using the context, the
+	 * copy is therefore not a consistent snapshot of all counters. A trust
+	 * anchor access is the time a thread holds the TSS context (or the
+	 * simulated trust anchor), from which the calls of the TSS account for
+	 * nearly all. Uncontended locks are not timed and the time is read with
+	 * clock_gettime(CLOCK_MONOTONIC), which needs no system call on common
+	 * platforms. The statistics are cleared on open and kept after close.
+	 */
+	uta_rc (*get_stats)(const uta_context_v1_t *uta_context,
+            uta_stats_v1_t *stats);
+
+	/**
+	 * Clears the statistics of the context.
+	 */
+	uta_rc (*reset_stats)(const uta_context_v1_t *uta_context);
+
+	/**
+	 * Derives a 32 byte key from dv and key_slot like derive_key and uses it
+	 * as pseudorandom key of HKDF-Expand (RFC 5869) with HMAC-SHA256. Each
+	 * of the num_requests entries receives len_key bytes of the expansion
+	 * with its own info label, so that any number of subkeys is obtained
+	 * from a single trust anchor access. Different labels yield independent
+	 * subkeys, equal labels the same subkey. len_key must be between 1 and
+	 * 8160 (255 * 32) bytes, otherwise UTA_INVALID_KEY_LENGTH is returned
+	 * before the trust anchor is accessed. The call is counted as one
+	 * derive_key call in the statistics. The function returns
+	 * UTA_NOT_SUPPORTED if the library was built without --enable-hkdf.
+	 */
+	uta_rc (*derive_key_expand)(const uta_context_v1_t *uta_context,
+            uta_expand_request_v1_t *requests, size_t num_requests,
+            const uint8_t *dv, size_t len_dv, uint8_t key_slot);
+
+	/**
+	 * Enables the key cache of the context with the given configuration or
+	 * disables it. While it is enabled, derive_key and derive_key_expand
+	 * keep the full 32 byte result of each key slot and dv for ttl seconds
+	 * and serve repeated derivations without accessing the trust anchor. The
+	 * lookup takes no lock. The cache is held in memory, which is locked into
+	 * RAM and excluded from core dumps, and entries are cleared when they
+	 * are replaced, expire or are flushed. UTA_TA_ERROR is returned if the
+	 * memory cannot be locked (see RLIMIT_MEMLOCK, 64 bytes per entry) and
+	 * UTA_NOT_SUPPORTED if max_entries exceeds the maximum. Calling the
+	 * function again replaces the cache by an empty one. It must not be
+	 * called while other threads use the context. The cache is disabled
+	 * after open and cleared on close.
+	 */
+	uta_rc (*set_key_cache)(const uta_context_v1_t *uta_context,
+            const uta_key_cache_config_v1_t *config);
+
+	/**
+	 * Clears all entries of the key cache, e.g. after a key slot has been
+	 * provisioned again. Other threads may use the context meanwhile.
+	 */
+	uta_rc (*flush_key_cache)(const uta_context_v1_t *uta_context);
+
+	/**
+	 * Starts a self test of the trust anchor and returns without waiting for
+	 * its result. In the UTA_SELF_TEST_INCREMENTAL mode the TPM backends send
+	 * TPM2_IncrementalSelfTest for the algorithms used by UTA, which the TPM
+	 * may test in the background, while the other calls proceed. Commands,
+	 * which need an algorithm under test, are delayed by the TPM until it
+	 * has been tested. The UTA_SELF_TEST_FULL mode sends TPM2_SelfTest with
+	 * fullTest set; depending on the TPM, the call then blocks one connection
+	 * of each device until all functions have been tested. The result is
+	 * queried with get_self_test_result. If the library is built with
+	 * --enable-self-test-on-open, open starts an incremental self test.
+	 */
+	uta_rc (*start_self_test)(const uta_context_v1_t *uta_context,
+            uta_self_test_mode_t mode);
+
+	/**
+	 * Copies the result of the last self test of the context to result,
+	 * which is either started with start_self_test or run by self_test.
+	 * While the self test is running, the TPM backends ask each device for
+	 * its test result, but only on a connection, which is free at the time
+	 * of the call; the function never waits for the trust anchor. Health
+	 * checks can therefore call it at any rate without delaying the other
+	 * calls on the context.
+	 */
+	uta_rc (*get_self_test_result)(const uta_context_v1_t *uta_context,
+            uta_self_test_result_v1_t *result);
+
+	/**
+	 * Fills num_buffers caller buffers with random bytes like get_random.
+	 * The TPM backends fetch the total number of bytes on one connection
+	 * with as few TPM2_GetRandom commands as the TPM allows and write each
+	 * response directly to the buffers, so that many small requests cost
+	 * no more trust anchor commands than a single request of their total
+	 * size. In the UTA_RANDOM_DRBG mode all buffers are generated under one
+	 * hold of the DRBG lock. The call is counted as one get_random call of
+	 * the total size in the statistics. If it fails, the contents of the
+	 * buffers are undefined.
+	 */
+	uta_rc (*get_random_v)(const uta_context_v1_t *uta_context,
+            const uta_random_buffer_v1_t *buffers, size_t num_buffers);
+
+	/**
+	 * Sets the timeout in milliseconds of the calls on the context, 0 waits
+	 * without limit, which is the default after open. Each derive_key,
+	 * derive_key_batch, derive_key_expand, get_random, get_random_v,
+	 * get_device_uuid, self_test and set_random_mode call must then finish
+	 * within timeout_ms of its start, otherwise it returns UTA_TIMEOUT, so
+	 * that the caller can shed load or fail over. The timeout bounds the
+	 * wait for the context lock and for a free connection in all backends.
+	 * In the TPM_TCG backend TPM2_HMAC and TPM2_GetRandom are sent
+	 * asynchronously and bounded by the ESAPI timeout. The response of a
+	 * command, which timed out, is discarded by the next call on that
+	 * connection, which returns UTA_TIMEOUT as well while the TPM does not
+	 * answer. The TPM_IBM backend cannot interrupt a command, which has been
+	 * sent to the TPM, and the UTA_CLIENT backend also bounds the round trip to
+	 * the daemon and reconnects afterwards. Other threads may use the context
+	 * meanwhile.
+	 */
+	uta_rc (*set_timeout)(const uta_context_v1_t *uta_context,
+            uint32_t timeout_ms);
+
+	/**
+	 * Copies the capabilities and limits of the trust anchor of the context
+	 * to capabilities. The TPM backends read the TPM properties with
+	 * TPM2_GetCapability once on open, from the first device of the
+	 * context, and use them to size the TPM2_GetRandom commands. The call
+	 * never accesses the trust anchor. The UTA_CLIENT backend returns the
+	 * capabilities, which the daemon read on its start, with the number of
+	 * connections of the client context. The UTA_SIM backend reports the
+	 * simulated limits and no TPM properties.
+	 */
+	uta_rc (*get_capabilities)(const uta_context_v1_t *uta_context,
+            uta_capabilities_v1_t *capabilities);
+
+	/**
+	 * Selects the parameter encryption of the salted session per
+	 * operation. After open, all parameters are encrypted
+	 * (UTA_PARAM_ENC_FULL). A derivation value, which is no secret, or
+	 * random bytes, which only seed a DRBG, may be sent with a weaker mode
+	 * to save the AES-CFB on the host and on the TPM. With
+	 * UTA_PARAM_ENC_AUDIT the derived keys are sent in the clear. The
+	 * policy applies to the subsequent calls of all threads; it should be
+	 * chosen right after open. The UTA_SIM backend accepts all policies,
+	 * it has no session. The UTA_CLIENT backend only accepts the default,
+	 * the session to the TPM belongs to the daemon. An invalid mode returns
+	 * UTA_NOT_SUPPORTED.
+	 */
+	uta_rc (*set_param_encryption)(const uta_context_v1_t *uta_context,
+            const uta_param_enc_policy_v1_t *policy);
+
+} uta_api_v1_ext_t;
+
 /**
  * @brief Makro for the implemented DV length in version 1 of the API.
  * (8 Bytes)
  */
 #define UTA_LEN_DV_V1	8
 
+/**
+ * @brief Makro for the longest key of derive_key in version 1 of the API.
+ * (32 Bytes)
+ */
+#define UTA_LEN_KEY_MAX_V1	32
+
 /**
  * @brief Entry point to UTA version 1. This function returns the struct
  * uta_api_v1_t, containing pointers to the functions explained above.
  */
 extern uta_rc uta_init_v1(uta_api_v1_t *uta);
 
+/**
+ * @brief Entry point to the extensions of UTA version 1. This function returns
+ * the struct uta_api_v1_ext_t, containing pointers to the functions explained
+ * above. The extension functions use the same context as uta_api_v1_t.
+ */
+extern uta_rc uta_init_v1_ext(uta_api_v1_ext_t *uta_ext);
+
 #endif /* _UTA_H_ */
 
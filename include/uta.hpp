@@ -0,0 +1,293 @@
+/** @file uta.hpp
+*
+* @brief Unified Trust Anchor (UTA) C++ wrapper. The header only wraps the C
+* API of uta.h: uta::Context keeps the library context in its own storage,
+* so that no allocation is needed, and closes it on destruction. The calls
+* take std::span and never throw. By default the functions are called
+* through the tables of uta_init_v1 and uta_init_v1_ext. If
+* UTA_HPP_DIRECT_CALL is defined before the include, the functions of the
+* configured backend are called directly instead, which allows the compiler
+* to inline them into the application with link time optimization, when
+* libuta is linked statically. Needs C++20.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef _UTA_HPP_
+#define _UTA_HPP_
+
+#if __cplusplus < 202002L
+#error "uta.hpp needs C++20 (std::span)"
+#endif
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <span>
+
+extern "C" {
+#include <uta.h>
+#include <uta_config.h>
+}
+
+/*******************************************************************************
+ * Direct calls of the configured backend
+ ******************************************************************************/
+#ifdef UTA_HPP_DIRECT_CALL
+#if defined(UTA_CONFIG_HARDWARE_TPM_IBM) || \
+    defined(UTA_CONFIG_HARDWARE_TPM_TCG)
+#define UTA_HPP_BACKEND(name) tpm_##name
+#elif defined(UTA_CONFIG_HARDWARE_UTA_SIM)
+#define UTA_HPP_BACKEND(name) sim_##name
+#elif defined(UTA_CONFIG_HARDWARE_UTA_CLIENT)
+#define UTA_HPP_BACKEND(name) client_##name
+#else
+#error "uta_config.h names no backend"
+#endif
+
+/* Functions of the backend, which uta_init_v1 puts into the tables */
+extern "C" {
+size_t UTA_HPP_BACKEND(context_v1_size)(void);
+uta_rc UTA_HPP_BACKEND(open)(const uta_context_v1_t *uta_context);
+uta_rc UTA_HPP_BACKEND(open_pool)(const uta_context_v1_t *uta_context,
+        size_t num_connections);
+uta_rc UTA_HPP_BACKEND(close)(const uta_context_v1_t *uta_context);
+uta_rc UTA_HPP_BACKEND(derive_key)(const uta_context_v1_t *uta_context,
+        uint8_t *key, size_t len_key, const uint8_t *dv, size_t len_dv,
+        uint8_t key_slot);
+uta_rc UTA_HPP_BACKEND(derive_key_batch)(const uta_context_v1_t *uta_context,
+        uta_derive_request_v1_t *requests, size_t num_requests);
+uta_rc UTA_HPP_BACKEND(get_random)(const uta_context_v1_t *uta_context,
+        uint8_t *random, size_t len_random);
+uta_rc UTA_HPP_BACKEND(get_random_v)(const uta_context_v1_t *uta_context,
+        const uta_random_buffer_v1_t *buffers, size_t num_buffers);
+}
+
+#define UTA_HPP_CALL(table, name) UTA_HPP_BACKEND(name)
+#else
+#define UTA_HPP_CALL(table, name) ::uta::detail::api().table.name
+#endif /* UTA_HPP_DIRECT_CALL */
+
+namespace uta {
+
+/**
+ * @brief Bytes reserved for the library context in uta::Context. The bound
+ * is set by configure for the installed backend, see uta_config.h.
+ */
+inline constexpr std::size_t context_storage = UTA_CONTEXT_V1_STORAGE;
+
+namespace detail {
+
+#ifndef UTA_HPP_DIRECT_CALL
+/**
+ * @brief Function tables of the library, filled once on first use.
+ */
+struct api_t
+{
+    uta_api_v1_t v1;
+    uta_api_v1_ext_t ext;
+    uta_rc rc;
+};
+
+inline const api_t &api() noexcept
+{
+    static const api_t table = [] {
+        api_t t{};
+        t.rc = uta_init_v1(&t.v1);
+        if(t.rc == UTA_SUCCESS)
+        {
+            t.rc = uta_init_v1_ext(&t.ext);
+        }
+        return t;
+    }();
+    return table;
+}
+#endif
+
+} /* namespace detail */
+
+/**
+ * @brief Library context in Storage bytes of the object. The context is
+ * opened with open or open_pool and closed by close or the destructor. It
+ * can neither be copied nor moved, because the library keeps locks and
+ * threads in the context, which refer to its address. All calls return the
+ * uta_rc of the C API, UTA_TA_ERROR if the context is not open.
+ */
+template<std::size_t Storage = context_storage>
+class BasicContext
+{
+public:
+    BasicContext() noexcept = default;
+    ~BasicContext() { (void)close(); }
+
+    BasicContext(const BasicContext &) = delete;
+    BasicContext &operator=(const BasicContext &) = delete;
+
+    /**
+     * @brief Opens the context, see open of uta_api_v1_t.
+     * @return UTA return code, UTA_NOT_SUPPORTED if the context is already
+     *      open or the library needs more than Storage bytes.
+     */
+    uta_rc open() noexcept
+    {
+        uta_rc rc = prepare();
+        if(rc == UTA_SUCCESS)
+        {
+            rc = UTA_HPP_CALL(v1, open)(context());
+            open_ = (rc == UTA_SUCCESS);
+        }
+        return rc;
+    }
+
+    /**
+     * @brief Opens the context with num_connections connections, see
+     *      open_pool of uta_api_v1_ext_t.
+     * @param[in] num_connections Number of connections to the trust anchor.
+     * @return UTA return code, UTA_NOT_SUPPORTED if the context is already
+     *      open or the library needs more than Storage bytes.
+     */
+    uta_rc open_pool(std::size_t num_connections) noexcept
+    {
+        uta_rc rc = prepare();
+        if(rc == UTA_SUCCESS)
+        {
+            rc = UTA_HPP_CALL(ext, open_pool)(context(), num_connections);
+            open_ = (rc == UTA_SUCCESS);
+        }
+        return rc;
+    }
+
+    /**
+     * @brief Closes the context. Closing a closed context succeeds.
+     * @return UTA return code.
+     */
+    uta_rc close() noexcept
+    {
+        if(!open_)
+        {
+            return UTA_SUCCESS;
+        }
+        open_ = false;
+        return UTA_HPP_CALL(v1, close)(context());
+    }
+
+    /**
+     * @brief Derives key.size() bytes from dv with the key in key_slot, see
+     *      derive_key of uta_api_v1_t.
+     */
+    uta_rc derive(std::span<std::uint8_t> key,
+            std::span<const std::uint8_t> dv, std::uint8_t key_slot) noexcept
+    {
+        if(!open_)
+        {
+            return UTA_TA_ERROR;
+        }
+        return UTA_HPP_CALL(v1, derive_key)(context(), key.data(), key.size(),
+            dv.data(), dv.size(), key_slot);
+    }
+
+    /**
+     * @brief Derives all requests in one trust anchor transaction, see
+     *      derive_key_batch of uta_api_v1_ext_t. The result of each entry is
+     *      written to its rc member.
+     */
+    uta_rc derive(std::span<uta_derive_request_v1_t> requests) noexcept
+    {
+        if(!open_)
+        {
+            return UTA_TA_ERROR;
+        }
+        return UTA_HPP_CALL(ext, derive_key_batch)(context(), requests.data(),
+            requests.size());
+    }
+
+    /**
+     * @brief Fills random with random bytes, see get_random of uta_api_v1_t.
+     */
+    uta_rc random(std::span<std::uint8_t> random) noexcept
+    {
+        if(!open_)
+        {
+            return UTA_TA_ERROR;
+        }
+        return UTA_HPP_CALL(v1, get_random)(context(), random.data(),
+            random.size());
+    }
+
+    /**
+     * @brief Fills all buffers with random bytes on one connection, see
+     *      get_random_v of uta_api_v1_ext_t.
+     */
+    uta_rc random(std::span<const uta_random_buffer_v1_t> buffers) noexcept
+    {
+        if(!open_)
+        {
+            return UTA_TA_ERROR;
+        }
+        return UTA_HPP_CALL(ext, get_random_v)(context(), buffers.data(),
+            buffers.size());
+    }
+
+    /**
+     * @brief Returns whether the context is open.
+     */
+    bool is_open() const noexcept { return open_; }
+
+    /**
+     * @brief Returns the C context for the other functions of the API,
+     *      nullptr if the context is not open.
+     */
+    const uta_context_v1_t *get() const noexcept
+    {
+        return open_ ? context() : nullptr;
+    }
+
+private:
+    const uta_context_v1_t *context() const noexcept
+    {
+        return reinterpret_cast<const uta_context_v1_t *>(storage_);
+    }
+
+    /* The bound is checked, in case another build of libuta is loaded */
+    uta_rc prepare() const noexcept
+    {
+        if(open_)
+        {
+            return UTA_NOT_SUPPORTED;
+        }
+#ifndef UTA_HPP_DIRECT_CALL
+        if(detail::api().rc != UTA_SUCCESS)
+        {
+            return detail::api().rc;
+        }
+#endif
+        if(UTA_HPP_CALL(v1, context_v1_size)() > Storage)
+        {
+            return UTA_NOT_SUPPORTED;
+        }
+        return UTA_SUCCESS;
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[Storage];
+    bool open_ = false;
+};
+
+/**
+ * @brief Context with the storage of the configured backend.
+ */
+using Context = BasicContext<>;
+
+} /* namespace uta */
+
+#undef UTA_HPP_CALL
+#undef UTA_HPP_BACKEND
+
+#endif /* _UTA_HPP_ */
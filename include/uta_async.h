@@ -0,0 +1,41 @@
+/** @file uta_async.h
+* 
+* @brief Unified Trust Anchor (UTA) emulation of the asynchronous API for
+* backends without native asynchronous commands
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License 
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_ASYNC_H
+#define UTA_ASYNC_H
+
+#include <stdint.h>
+
+#include <uta.h>
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+typedef struct
+{
+    int fds[2];
+    uint8_t pending;
+    uta_rc result;
+} uta_async_t;
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+uta_rc uta_async_init(uta_async_t *async);
+void uta_async_free(uta_async_t *async);
+int uta_async_fd(const uta_async_t *async);
+uta_rc uta_async_claim(uta_async_t *async);
+void uta_async_post(uta_async_t *async, uta_rc result);
+uta_rc uta_async_collect(uta_async_t *async);
+
+#endif /* UTA_ASYNC_H */
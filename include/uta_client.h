@@ -0,0 +1,71 @@
+/** @file uta_client.h
+*
+* @brief Unified Trust Anchor (UTA) client backend, which forwards the calls
+* to the utad daemon over a Unix domain socket
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_CLIENT_H
+#define UTA_CLIENT_H
+
+#include <uta.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+size_t client_context_v1_size(void);
+uta_rc client_open(const uta_context_v1_t *client_context);
+uta_rc client_open_pool(const uta_context_v1_t *client_context,
+        size_t num_connections);
+uta_rc client_open_devices(const uta_context_v1_t *client_context,
+        const char * const *device_files, size_t num_devices,
+        size_t connections_per_device);
+uta_rc client_close(const uta_context_v1_t *client_context);
+uta_rc client_derive_key(const uta_context_v1_t *client_context, uint8_t *key,
+        size_t len_key, const uint8_t *dv, size_t len_dv, uint8_t key_slot);
+uta_rc client_derive_key_batch(const uta_context_v1_t *client_context,
+        uta_derive_request_v1_t *requests, size_t num_requests);
+uta_rc client_get_random(const uta_context_v1_t *client_context,
+        uint8_t *random, size_t len_random);
+uta_rc client_set_random_mode(const uta_context_v1_t *client_context,
+        const uta_random_config_v1_t *config);
+uta_rc client_get_poll_fd(const uta_context_v1_t *client_context, int *fd);
+uta_rc client_derive_key_submit(const uta_context_v1_t *client_context,
+        uint8_t *key, size_t len_key, const uint8_t *dv, size_t len_dv,
+        uint8_t key_slot);
+uta_rc client_get_random_submit(const uta_context_v1_t *client_context,
+        uint8_t *random, size_t len_random);
+uta_rc client_async_complete(const uta_context_v1_t *client_context);
+uta_rc client_set_key_cache(const uta_context_v1_t *client_context,
+        const uta_key_cache_config_v1_t *config);
+uta_rc client_flush_key_cache(const uta_context_v1_t *client_context);
+uta_rc client_get_stats(const uta_context_v1_t *client_context,
+        uta_stats_v1_t *stats);
+uta_rc client_reset_stats(const uta_context_v1_t *client_context);
+uta_rc client_derive_key_expand(const uta_context_v1_t *client_context,
+        uta_expand_request_v1_t *requests, size_t num_requests,
+        const uint8_t *dv, size_t len_dv, uint8_t key_slot);
+uta_rc client_get_device_uuid(const uta_context_v1_t *client_context,
+        uint8_t *uuid);
+uta_rc client_self_test(const uta_context_v1_t *client_context);
+uta_rc client_start_self_test(const uta_context_v1_t *client_context,
+        uta_self_test_mode_t mode);
+uta_rc client_get_self_test_result(const uta_context_v1_t *client_context,
+        uta_self_test_result_v1_t *result);
+uta_rc client_get_random_v(const uta_context_v1_t *client_context,
+        const uta_random_buffer_v1_t *buffers, size_t num_buffers);
+uta_rc client_set_timeout(const uta_context_v1_t *client_context,
+        uint32_t timeout_ms);
+uta_rc client_get_capabilities(const uta_context_v1_t *client_context,
+        uta_capabilities_v1_t *capabilities);
+uta_rc client_set_param_encryption(const uta_context_v1_t *client_context,
+        const uta_param_enc_policy_v1_t *policy);
+
+#endif /* UTA_CLIENT_H */
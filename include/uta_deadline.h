@@ -0,0 +1,38 @@
+/** @file uta_deadline.h
+*
+* @brief Unified Trust Anchor (UTA) deadlines of the calls on a context with a
+* timeout
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_DEADLINE_H
+#define UTA_DEADLINE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <uta.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Deadline of a call without timeout */
+#define UTA_DEADLINE_NONE   0
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+void uta_deadline_set_timeout(uint32_t *timeout_ms, uint32_t value);
+uint64_t uta_deadline_start(const uint32_t *timeout_ms);
+int uta_deadline_expired(uint64_t deadline);
+int32_t uta_deadline_remaining_ms(uint64_t deadline);
+void uta_deadline_abstime(uint64_t deadline, struct timespec *abstime);
+uta_rc uta_deadline_rc(uint64_t deadline);
+
+#endif /* UTA_DEADLINE_H */
@@ -0,0 +1,57 @@
+/** @file uta_drbg.h
+* 
+* @brief Unified Trust Anchor (UTA) host CTR_DRBG seeded by the trust anchor
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License 
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_DRBG_H
+#define UTA_DRBG_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <uta.h>
+#include <mbedtls/ctr_drbg.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define UTA_DRBG_RESEED_BYTES       (1024 * 1024)
+#define UTA_DRBG_RESEED_INTERVAL    60
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief Entropy source of the DRBG. Returns 0 on success, like the mbedtls
+ *      entropy callbacks.
+ */
+typedef int (*uta_drbg_entropy_t)(void *p_entropy, unsigned char *output,
+        size_t len);
+
+typedef struct
+{
+    mbedtls_ctr_drbg_context ctr_drbg;
+    uint64_t reseed_bytes;
+    uint32_t reseed_interval;
+    uint64_t bytes_since_reseed;
+    struct timespec last_reseed;
+    uint8_t seeded;
+} uta_drbg_t;
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+void uta_drbg_init(uta_drbg_t *drbg);
+uta_rc uta_drbg_seed(uta_drbg_t *drbg, uta_drbg_entropy_t f_entropy,
+        void *p_entropy, uint64_t reseed_bytes, uint32_t reseed_interval);
+uta_rc uta_drbg_generate(uta_drbg_t *drbg, uint8_t *output, size_t len);
+void uta_drbg_free(uta_drbg_t *drbg);
+
+#endif /* UTA_DRBG_H */
@@ -0,0 +1,29 @@
+/** @file uta_fork.h
+*
+* @brief Unified Trust Anchor (UTA) detection of contexts, which a child
+* process inherited over fork
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_FORK_H
+#define UTA_FORK_H
+
+#include <stdint.h>
+
+#include <uta.h>
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+uta_rc uta_fork_init(uint32_t *generation);
+int uta_fork_detected(const uint32_t *generation);
+void uta_fork_lock(void);
+void uta_fork_unlock(void);
+
+#endif /* UTA_FORK_H */
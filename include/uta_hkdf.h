@@ -0,0 +1,53 @@
+/** @file uta_hkdf.h
+* 
+* @brief Unified Trust Anchor (UTA) host HKDF-Expand (RFC 5869) of a key
+* derived by the trust anchor
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License 
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_HKDF_H
+#define UTA_HKDF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <uta.h>
+#include <uta_stats.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Length of the pseudorandom key, which is derived by the trust anchor */
+#define UTA_HKDF_LEN_PRK            32
+/* Maximum output length of HKDF-Expand with SHA256 (255 * HashLen) */
+#define UTA_HKDF_LEN_KEY_MAX        (255 * 32)
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief derive_key function of a backend, see uta_api_v1_t.
+ */
+typedef uta_rc (*uta_hkdf_derive_t)(const uta_context_v1_t *uta_context,
+        uint8_t *key, size_t len_key, const uint8_t *dv, size_t len_dv,
+        uint8_t key_slot);
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+uta_rc uta_hkdf_check(const uta_expand_request_v1_t *requests,
+        size_t num_requests);
+uta_rc uta_hkdf_derive_key_expand(uta_hkdf_derive_t derive_key,
+        const uta_context_v1_t *uta_context, uta_stats_v1_t *stats,
+        uta_expand_request_v1_t *requests, size_t num_requests,
+        const uint8_t *dv, size_t len_dv, uint8_t key_slot);
+uta_rc uta_hkdf_expand(const uint8_t *prk, size_t len_prk,
+        uta_expand_request_v1_t *requests, size_t num_requests);
+
+#endif /* UTA_HKDF_H */
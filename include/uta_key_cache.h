@@ -0,0 +1,70 @@
+/** @file uta_key_cache.h
+*
+* @brief Unified Trust Anchor (UTA) cache of derived keys in locked memory
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_KEY_CACHE_H
+#define UTA_KEY_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <uta.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define UTA_KEY_CACHE_LEN_KEY       32
+#define UTA_KEY_CACHE_LEN_DV        8
+#define UTA_KEY_CACHE_TTL           60
+#define UTA_KEY_CACHE_MAX_ENTRIES   65536
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief Entry of the cache, which fills one cache line. All members are
+ *      accessed atomically. seq is odd while a writer changes the entry, tag
+ *      is the key slot + 1 and 0 for an empty entry.
+ */
+typedef struct
+{
+    uint64_t seq;
+    uint64_t tag;
+    uint64_t dv;
+    uint64_t expiry;
+    uint64_t key[UTA_KEY_CACHE_LEN_KEY / sizeof(uint64_t)];
+} uta_key_cache_entry_t;
+
+typedef struct
+{
+    uta_key_cache_entry_t *entries;
+    size_t num_entries;
+    size_t len_map;
+    uint64_t ttl;
+} uta_key_cache_t;
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+void uta_key_cache_init(uta_key_cache_t *cache);
+uta_rc uta_key_cache_configure(uta_key_cache_t *cache, size_t max_entries,
+        uint32_t ttl);
+uint8_t uta_key_cache_enabled(const uta_key_cache_t *cache);
+uint8_t uta_key_cache_lookup(uta_key_cache_t *cache, uint8_t key_slot,
+        const uint8_t *dv, uint8_t *key, size_t len_key);
+void uta_key_cache_store(uta_key_cache_t *cache, uint8_t key_slot,
+        const uint8_t *dv, const uint8_t *key);
+void uta_key_cache_flush(uta_key_cache_t *cache);
+void uta_key_cache_free(uta_key_cache_t *cache);
+void uta_key_cache_after_fork(uta_key_cache_t *cache);
+void uta_key_cache_zeroize(void *buf, size_t len);
+
+#endif /* UTA_KEY_CACHE_H */
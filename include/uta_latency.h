@@ -0,0 +1,89 @@
+/** @file uta_latency.h
+*
+* @brief Unified Trust Anchor (UTA) latency profiles of the simulator and
+* latency recording of the TPM backends
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_LATENCY_H
+#define UTA_LATENCY_H
+
+#include <uta.h>
+#include <stdint.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Recorded buckets, four per power of two of the latency in microseconds */
+#define UTA_LATENCY_NUM_BUCKETS     96
+/* Maximum number of bins of a histogram in a profile */
+#define UTA_LATENCY_MAX_BINS        UTA_LATENCY_NUM_BUCKETS
+/* Random bytes consumed by uta_latency_sample */
+#define UTA_LATENCY_RANDOM_LEN      24
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief Latency model of one operation.
+ */
+typedef enum
+{
+    UTA_LATENCY_NONE = 0,       /**< No emulated latency */
+    UTA_LATENCY_FIXED = 1,      /**< Always value_a */
+    UTA_LATENCY_UNIFORM = 2,    /**< Uniform between value_a and value_b */
+    UTA_LATENCY_NORMAL = 3,     /**< Mean value_a, standard deviation value_b */
+    UTA_LATENCY_HISTOGRAM = 4   /**< Weighted bins, e.g. recorded */
+} uta_latency_model_t;
+
+/**
+ * @brief Latency of one operation. All values are in ns.
+ */
+typedef struct
+{
+    uta_latency_model_t model;
+    uint64_t value_a;
+    uint64_t value_b;
+    size_t num_bins;
+    uint64_t bin_value[UTA_LATENCY_MAX_BINS];
+    uint64_t bin_cumulative[UTA_LATENCY_MAX_BINS];
+} uta_latency_op_t;
+
+/**
+ * @brief Latency profile with one entry per operation of uta_stats_op_t.
+ */
+typedef struct
+{
+    uta_latency_op_t ops[UTA_STATS_NUM_OPS];
+} uta_latency_profile_t;
+
+/**
+ * @brief Recorded latency histograms, updated with atomic operations.
+ */
+typedef struct
+{
+    uint64_t counts[UTA_STATS_NUM_OPS][UTA_LATENCY_NUM_BUCKETS];
+} uta_latency_record_t;
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+uta_rc uta_latency_load(uta_latency_profile_t *profile, const char *path);
+int uta_latency_enabled(const uta_latency_profile_t *profile,
+        uta_stats_op_t op);
+uint64_t uta_latency_sample(const uta_latency_profile_t *profile,
+        uta_stats_op_t op, const uint8_t *random);
+void uta_latency_sleep(uint64_t duration);
+void uta_latency_record_init(uta_latency_record_t *record);
+void uta_latency_record_add(uta_latency_record_t *record, uta_stats_op_t op,
+        uint64_t duration);
+int uta_latency_record_save(const uta_latency_record_t *record,
+        const char *path);
+
+#endif /* UTA_LATENCY_H */
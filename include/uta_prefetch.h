@@ -0,0 +1,74 @@
+/** @file uta_prefetch.h
+*
+* @brief Unified Trust Anchor (UTA) ring of random bytes, which a background
+* thread prefetches from the trust anchor
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_PREFETCH_H
+#define UTA_PREFETCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <uta.h>
+#include <uta_sched.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Random bytes read from the trust anchor per refill step */
+#define UTA_PREFETCH_CHUNK          UTA_SCHED_SLICE_LEN
+
+/* Seconds until a failed refill is repeated */
+#define UTA_PREFETCH_RETRY_INTERVAL 1
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief Source of the prefetched random bytes. Returns 0 on success, like
+ *      the entropy callback of the DRBG.
+ */
+typedef int (*uta_prefetch_fill_t)(void *p_fill, uint8_t *output, size_t len);
+
+/**
+ * @brief Ring of count random bytes starting at head. The background thread
+ *      refills the ring, as soon as less than half of it is left, until it is
+ *      full. Each byte is handed out once and wiped afterwards.
+ */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    uta_prefetch_fill_t f_fill;
+    void *p_fill;
+    uint8_t *ring;
+    size_t size;
+    size_t head;
+    size_t count;
+    uint8_t running;
+    uint8_t stop;
+} uta_prefetch_t;
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+uta_rc uta_prefetch_init(uta_prefetch_t *prefetch);
+uta_rc uta_prefetch_start(uta_prefetch_t *prefetch, uta_prefetch_fill_t f_fill,
+        void *p_fill, size_t size);
+void uta_prefetch_stop(uta_prefetch_t *prefetch);
+size_t uta_prefetch_take(uta_prefetch_t *prefetch,
+        uta_random_cursor_t *cursor);
+size_t uta_prefetch_after_fork(uta_prefetch_t *prefetch);
+void uta_prefetch_free(uta_prefetch_t *prefetch);
+
+#endif /* UTA_PREFETCH_H */
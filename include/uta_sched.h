@@ -0,0 +1,86 @@
+/** @file uta_sched.h
+*
+* @brief Unified Trust Anchor (UTA) priority scheduling of the connections of
+* a TPM device and preemptible bulk random requests
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_SCHED_H
+#define UTA_SCHED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <uta.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Priority classes, key derivations and other short calls run first */
+#define UTA_SCHED_HIGH          0
+#define UTA_SCHED_BULK          1
+#define UTA_SCHED_NUM_CLASSES   2
+
+/* Grants to the high class, after which a waiting bulk call is served */
+#define UTA_SCHED_BULK_SHARE    4
+
+/* Random bytes of a bulk request between two checks for waiting calls */
+#define UTA_SCHED_SLICE_LEN     256
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief Counting semaphore for the connections of a device, which serves the
+ *      waiting calls by priority class. After UTA_SCHED_BULK_SHARE grants to
+ *      the high class in a row, a waiting bulk call is served, so that bulk
+ *      work is never starved.
+ */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond[UTA_SCHED_NUM_CLASSES];
+    uint32_t free;
+    /* Number of waiting calls per class, read without the mutex */
+    uint32_t waiting[UTA_SCHED_NUM_CLASSES];
+    /* Grants to the high class, since a bulk call has been served */
+    uint32_t high_grants;
+} uta_sched_t;
+
+/**
+ * @brief Position of a random request in its buffers, so that the request can
+ *      be continued on another connection.
+ */
+typedef struct
+{
+    const uta_random_buffer_v1_t *buffers;
+    size_t index;
+    size_t offset;
+    size_t remaining;
+} uta_random_cursor_t;
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+int uta_sched_init(uta_sched_t *sched, uint32_t slots);
+void uta_sched_destroy(uta_sched_t *sched);
+int uta_sched_class(uta_stats_op_t op);
+uta_rc uta_sched_acquire(uta_sched_t *sched, uta_stats_v1_t *stats,
+        int prio, uint64_t deadline);
+int uta_sched_try_acquire(uta_sched_t *sched, int prio);
+void uta_sched_release(uta_sched_t *sched);
+int uta_sched_preempted(const uta_sched_t *sched);
+void uta_random_cursor_init(uta_random_cursor_t *cursor,
+        const uta_random_buffer_v1_t *buffers, size_t num_buffers);
+size_t uta_random_cursor_slice(const uta_random_cursor_t *cursor);
+void uta_random_cursor_scatter(uta_random_cursor_t *cursor,
+        const uint8_t *random, size_t len_random);
+
+#endif /* UTA_SCHED_H */
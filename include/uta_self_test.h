@@ -0,0 +1,45 @@
+/** @file uta_self_test.h
+*
+* @brief Unified Trust Anchor (UTA) cached result of the last self test
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_SELF_TEST_H
+#define UTA_SELF_TEST_H
+
+#include <stdint.h>
+
+#include <uta.h>
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief Result of the last self test. Both members are accessed atomically,
+ *      state holds the uta_rc in the lower and the mode in the upper 16 bits.
+ */
+typedef struct
+{
+    uint32_t state;
+    uint64_t finished;
+} uta_self_test_t;
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+void uta_self_test_init(uta_self_test_t *self_test);
+void uta_self_test_started(uta_self_test_t *self_test,
+        uta_self_test_mode_t mode);
+uta_rc uta_self_test_finished(uta_self_test_t *self_test,
+        uta_self_test_mode_t mode, uta_rc rc);
+int uta_self_test_running(const uta_self_test_t *self_test);
+void uta_self_test_read(const uta_self_test_t *self_test,
+        uta_self_test_result_v1_t *result);
+
+#endif /* UTA_SELF_TEST_H */
@@ -0,0 +1,52 @@
+/** @file uta_session_cache.h
+* 
+* @brief Unified Trust Anchor (UTA) persisted TPM session context
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License 
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_SESSION_CACHE_H
+#define UTA_SESSION_CACHE_H
+
+#include <stdint.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define UTA_SESSION_CACHE_LEN_BLOB  8192
+#define UTA_SESSION_CACHE_LEN_STATE 4096
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief Members of a TPMS_CONTEXT, independent of the TSS, and the state,
+ *      which the TSS keeps outside of the TPMS_CONTEXT for the session. Only
+ *      the IBM TSS with a private state directory needs it, len_state is 0
+ *      otherwise.
+ */
+typedef struct
+{
+    uint64_t sequence;
+    uint32_t saved_handle;
+    uint32_t hierarchy;
+    uint16_t len_blob;
+    uint8_t blob[UTA_SESSION_CACHE_LEN_BLOB];
+    uint16_t len_state;
+    uint8_t state[UTA_SESSION_CACHE_LEN_STATE];
+} uta_saved_session_t;
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+int uta_session_cache_exists(const char *path);
+int uta_session_cache_take(const char *path, uta_saved_session_t *session);
+int uta_session_cache_put(const char *path,
+        const uta_saved_session_t *session);
+
+#endif /* UTA_SESSION_CACHE_H */
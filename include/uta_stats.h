@@ -0,0 +1,40 @@
+/** @file uta_stats.h
+*
+* @brief Unified Trust Anchor (UTA) statistics of a context, updated with
+* atomic operations
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_STATS_H
+#define UTA_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <uta.h>
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+void uta_stats_reset(uta_stats_v1_t *stats);
+void uta_stats_read(const uta_stats_v1_t *stats, uta_stats_v1_t *copy);
+uta_rc uta_stats_call(uta_stats_v1_t *stats, uta_stats_op_t op, uta_rc rc);
+void uta_stats_random(uta_stats_v1_t *stats, size_t len_random);
+void uta_stats_key_cache(uta_stats_v1_t *stats, uint8_t hit);
+uint64_t uta_stats_now(void);
+void uta_stats_ta_access(uta_stats_v1_t *stats, uint64_t start);
+void uta_stats_lock_wait(uta_stats_v1_t *stats, uint64_t start);
+uta_rc uta_stats_mutex_lock(uta_stats_v1_t *stats, pthread_mutex_t *mutex,
+        uint64_t deadline);
+uta_rc uta_stats_sem_wait(uta_stats_v1_t *stats, sem_t *sem,
+        uint64_t deadline);
+
+#endif /* UTA_STATS_H */
@@ -0,0 +1,61 @@
+/** @file uta_trace.h
+*
+* @brief Unified Trust Anchor (UTA) static tracepoints. With --enable-usdt the
+* probes are USDT probes of the provider "uta" (sys/sdt.h), which are a single
+* nop until a tracer like bpftrace or perf attaches to them. Otherwise the
+* macros expand to nothing and the arguments are not evaluated.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_TRACE_H
+#define UTA_TRACE_H
+
+#include <config.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define UTA_TRACE1(name, a1) \
+        DTRACE_PROBE1(uta, name, a1)
+#define UTA_TRACE2(name, a1, a2) \
+        DTRACE_PROBE2(uta, name, a1, a2)
+#define UTA_TRACE3(name, a1, a2, a3) \
+        DTRACE_PROBE3(uta, name, a1, a2, a3)
+#else
+#define UTA_TRACE1(name, a1)
+#define UTA_TRACE2(name, a1, a2)
+#define UTA_TRACE3(name, a1, a2, a3)
+#endif
+
+/*
+ * Entry of a public function: operation (uta_stats_op_t), key slot and byte
+ * count. The matching op_return (operation, return code) is fired where the
+ * call is counted in the statistics.
+ */
+#define UTA_TRACE_OP_ENTRY(op, key_slot, len) \
+        UTA_TRACE3(op_entry, (int)(op), (int)(key_slot), (size_t)(len))
+#define UTA_TRACE_OP_RETURN(op, rc) \
+        UTA_TRACE2(op_return, (int)(op), (int)(rc))
+
+/* TPM command with its command code and the return code of the TSS */
+#define UTA_TRACE_TPM_ENTRY(cc) \
+        UTA_TRACE1(tpm_entry, (uint32_t)(cc))
+#define UTA_TRACE_TPM_RETURN(cc, rc) \
+        UTA_TRACE2(tpm_return, (uint32_t)(cc), (uint32_t)(rc))
+
+/* Lock of a mutex or wait for a free pool connection, identified by address */
+#define UTA_TRACE_LOCK_ENTRY(lock) \
+        UTA_TRACE1(lock_entry, (void *)(lock))
+#define UTA_TRACE_LOCK_RETURN(lock, ret) \
+        UTA_TRACE2(lock_return, (void *)(lock), (int)(ret))
+
+#endif /* UTA_TRACE_H */
@@ -0,0 +1,29 @@
+/** @file uta_uuid_cache.h
+* 
+* @brief Unified Trust Anchor (UTA) persisted device UUID cache
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License 
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTA_UUID_CACHE_H
+#define UTA_UUID_CACHE_H
+
+#include <stdint.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define UTA_UUID_LEN    16
+
+/*******************************************************************************
+ * Function Prototypes
+ ******************************************************************************/
+int uta_uuid_cache_read(const char *path, uint8_t *uuid);
+int uta_uuid_cache_write(const char *path, const uint8_t *uuid);
+
+#endif /* UTA_UUID_CACHE_H */
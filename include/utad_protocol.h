@@ -0,0 +1,90 @@
+/** @file utad_protocol.h
+*
+* @brief Unified Trust Anchor (UTA) messages between the utad daemon and the
+* UTA_CLIENT backend. Both ends run on the same host, so all members are in
+* host byte order. Each request is answered by one response, which is
+* followed by len payload bytes (the key, the random bytes, the UUID or the
+* self test result).
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef UTAD_PROTOCOL_H
+#define UTAD_PROTOCOL_H
+
+#include <stdint.h>
+
+#include <uta.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* "UTD1", changed with every incompatible change of the messages */
+#define UTAD_MAGIC              0x55544431u
+
+/* Operations of a request */
+#define UTAD_OP_DERIVE_KEY      1
+#define UTAD_OP_GET_RANDOM      2
+#define UTAD_OP_GET_DEVICE_UUID 3
+#define UTAD_OP_SELF_TEST       4
+#define UTAD_OP_START_SELF_TEST 5
+#define UTAD_OP_GET_SELF_TEST_RESULT 6
+#define UTAD_OP_GET_CAPABILITIES 7
+
+/* Longest payload of a response, larger random requests are split */
+#define UTAD_LEN_KEY_MAX        32
+#define UTAD_LEN_UUID           16
+#define UTAD_LEN_RANDOM_MAX     1024
+#define UTAD_LEN_SELF_TEST_RESULT   16
+#define UTAD_LEN_CAPABILITIES   40
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief Request of a client. len is the key length of UTAD_OP_DERIVE_KEY,
+ *      the number of bytes of UTAD_OP_GET_RANDOM, UTAD_LEN_SELF_TEST_RESULT
+ *      for UTAD_OP_GET_SELF_TEST_RESULT and UTAD_LEN_CAPABILITIES for
+ *      UTAD_OP_GET_CAPABILITIES, whose payload is uta_capabilities_v1_t.
+ *      key_slot and dv are only used by UTAD_OP_DERIVE_KEY, except that
+ *      key_slot carries the mode of UTAD_OP_START_SELF_TEST.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t op;
+    uint32_t len;
+    uint8_t key_slot;
+    uint8_t reserved[3];
+    uint8_t dv[UTA_LEN_DV_V1];
+} utad_request_t;
+
+/**
+ * @brief Response of the daemon with the uta_rc of the operation. The payload
+ *      is only sent, if rc is UTA_SUCCESS.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t rc;
+    uint32_t len;
+    uint32_t reserved;
+} utad_response_t;
+
+/**
+ * @brief Payload of the response to UTAD_OP_GET_SELF_TEST_RESULT, see
+ *      uta_self_test_result_v1_t.
+ */
+typedef struct
+{
+    uint32_t rc;
+    uint32_t mode;
+    uint64_t age;
+} utad_self_test_result_t;
+
+#endif /* UTAD_PROTOCOL_H */
@@ -113,24 +113,130 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
+#include <semaphore.h>
 
 #include <config.h>
+#include <uta_config.h>
 #include <tpm_ibm.h>
+#include <uta_uuid_cache.h>
+#include <uta_key_cache.h>
+#ifdef CONFIGURED_SESSION_CACHE_FILE
+#include <uta_session_cache.h>
+#endif
+#include <uta_async.h>
+#include <uta_stats.h>
+#include <uta_deadline.h>
+#include <uta_sched.h>
+#include <uta_prefetch.h>
+#include <uta_fork.h>
+#include <uta_self_test.h>
+#include <uta_trace.h>
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+#include <uta_latency.h>
+#endif
+#ifdef ENABLE_DRBG
+#include <uta_drbg.h>
+#endif
+#ifdef ENABLE_HKDF
+#include <uta_hkdf.h>
+#endif
 
 #include <tss2/tss.h>
 
 /*******************************************************************************
  * Data types
  ******************************************************************************/
-struct _uta_context_v1_t
+/**
+ * @brief Connection to the TPM with its own TSS context and salted session.
+ */
+typedef struct
 {
     TSS_CONTEXT *tssContext;
     TPMI_SH_AUTH_SESSION authSessionHandle;
+    size_t device;
+    uint64_t acquired;
+    uta_stats_op_t op;
+    /* Most random bytes of one TPM2_GetRandom response, 0 if not reported */
+    uint32_t max_random;
+} tpm_connection_t;
+
+/**
+ * @brief TPM device with the connections first_connection up to
+ *      first_connection + num_connections - 1 of the pool. The IBM TSS keeps
+ *      pointers to the device file and data directory.
+ */
+typedef struct
+{
+    char *device_file;
+    char *data_dir;
+    size_t first_connection;
+    size_t num_connections;
+    uta_sched_t sched;
+    uint32_t outstanding;
+    int64_t failed_until;
+} tpm_device_t;
+
+struct _uta_context_v1_t
+{
+    /* Pool of connections, free_mask has one bit per free connection */
+    tpm_connection_t connections[CONFIGURED_TPM_POOL_MAX];
+    size_t num_connections;
+    uint64_t free_mask;
+    /* Devices of the pool, outstanding counts the taken and awaited
+     * connections */
+    tpm_device_t devices[CONFIGURED_TPM_POOL_MAX];
+    size_t num_devices;
+    uint32_t next_device;
+    /* Fork generation of the process, which opened the connections */
+    uint32_t fork_generation;
+#ifdef CONFIGURED_TPM_STATE_DIR
+    /* Private directory of the TSS state, removed on close */
+    char *state_dir;
+#endif
+    /* Statistics, updated with atomic operations */
+    uta_stats_v1_t stats;
+    /* Timeout of the calls in ms, 0 for none, accessed atomically */
+    uint32_t timeout_ms;
+    /* Cache of derived keys, read without a lock */
+    uta_key_cache_t key_cache;
+    /* Result of the last self test, read without a lock */
+    uta_self_test_t self_test;
+    /* Capabilities of the first device, read on open */
+    uta_capabilities_v1_t capabilities;
+    /* Session attributes of TPM2_HMAC and TPM2_GetRandom, see
+     * set_param_encryption, accessed atomically */
+    uint8_t attributes_hmac;
+    uint8_t attributes_random;
+    /* Ring of the random prefetch mode, protected by its own mutex */
+    uta_prefetch_t prefetch;
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+    /* Latency histograms of the trust anchor accesses, saved on close */
+    uta_latency_record_t latency_record;
+#endif
+    /* Context wide state, protected by the accesslock */
+    uint8_t uuid[UTA_UUID_LEN];
+    uint8_t uuid_cached;
+#ifdef ENABLE_DRBG
+    /* DRBG of the DRBG mode, protected by the drbglock, which is taken after
+     * the accesslock. drbg_active is set while the DRBG is seeded and read
+     * atomically, so that random requests of the other modes take no lock */
+    uta_drbg_t drbg;
+    /* Deadline of the call, which (re)seeds the DRBG */
+    uint64_t drbg_deadline;
+    uint8_t drbg_active;
+    pthread_mutex_t drbglock;
+#endif
+    /* Emulated asynchronous operation, protected by the asynclock */
+    uta_async_t async;
+    pthread_mutex_t asynclock;
     pthread_mutex_t accesslock;
 };
 
@@ -140,31 +246,123 @@ struct _uta_context_v1_t
 #define DERIV_STR_LEN   8     /* 8 Bytes */
 #define USED_KEY_SLOTS  2
 
+/* Seconds until a failed device is preferred again */
+#define DEVICE_RETRY_INTERVAL   5
+
+/* Penalties of the device selection, added to the outstanding requests */
+#define DEVICE_SCORE_FAILED     ((uint64_t)1 << 32)
+#define DEVICE_SCORE_TRIED      ((uint64_t)1 << 33)
+
+/* Session attributes, see TPMA_SESSION */
+#define SESSION_CONTINUE        0x01
+#define SESSION_DECRYPT         0x20  /* Command encryption */
+#define SESSION_ENCRYPT         0x40  /* Response encryption */
+#define SESSION_AUDIT           0x80
+
 /*******************************************************************************
  * Private function prototypes
  ******************************************************************************/
-static uint32_t tpm_start_hmac_session(const uta_context_v1_t *tpm_context);
-static uint32_t tpm_flush_context(const uta_context_v1_t *tpm_context,
+static uta_rc tpm_check_derive_args(size_t len_key, size_t len_dv,
+        uint8_t key_slot);
+static uint32_t tpm_key_slot_handle(uint8_t key_slot);
+static uint32_t tpm_open_connections(const uta_context_v1_t *tpm_context,
+        const char * const *device_files, size_t num_devices,
+        size_t connections_per_device);
+static uint32_t tpm_open_connection(tpm_connection_t *connection,
+        const tpm_device_t *device);
+static void tpm_close_connection(tpm_connection_t *connection,
+        const tpm_device_t *device);
+static void tpm_forget_connection(tpm_connection_t *connection);
+static uta_rc tpm_check_fork(const uta_context_v1_t *tpm_context, int reopen);
+static void tpm_close_devices(const uta_context_v1_t *tpm_context);
+static uint32_t tpm_read_capabilities(const tpm_connection_t *connection,
+        uta_capabilities_v1_t *capabilities);
+static char *tpm_device_dir(const char *base_dir, size_t device);
+static char *tpm_device_data_dir(const uta_context_v1_t *tpm_context,
+        size_t device);
+#ifdef CONFIGURED_TPM_STATE_DIR
+static void tpm_copy_provisioned(const char *src_dir, const char *dst_dir);
+static void tpm_remove_dir(int parent_fd, const char *path, int depth);
+#endif
+static tpm_connection_t *tpm_acquire_connection(
+        const uta_context_v1_t *tpm_context, uint64_t tried_devices,
+        uta_stats_op_t op, uint64_t deadline);
+static tpm_connection_t *tpm_acquire_device_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op, uint64_t deadline);
+static tpm_connection_t *tpm_try_acquire_device_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op);
+static tpm_connection_t *tpm_claim_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op);
+static void tpm_release_connection(const uta_context_v1_t *tpm_context,
+        tpm_connection_t *connection);
+static void tpm_device_failed(const uta_context_v1_t *tpm_context,
+        const tpm_connection_t *connection);
+static int64_t tpm_now(void);
+static uint32_t tpm_start_hmac_session(tpm_connection_t *connection);
+static uint32_t tpm_recover_session(tpm_connection_t *connection);
+static int tpm_is_session_error(TPM_RC rc);
+#ifdef CONFIGURED_SESSION_CACHE_FILE
+static uint32_t tpm_load_session(tpm_connection_t *connection,
+        const tpm_device_t *device);
+static void tpm_save_session(tpm_connection_t *connection,
+        const tpm_device_t *device);
+static int tpm_read_session_state(const tpm_device_t *device,
+        uint32_t handle, uta_saved_session_t *saved);
+static int tpm_restore_session_state(const tpm_device_t *device,
+        const uta_saved_session_t *saved);
+#endif
+static uint32_t tpm_flush_context(const tpm_connection_t *connection,
         uint32_t handle_number);
-static uint32_t tpm_calc_hmac(const uta_context_v1_t *tpm_context,
-        uint8_t *hmac, const uint8_t *deriv_val, uint32_t hmacKeyHandle);
-static uint32_t tpm_get_rand(const uta_context_v1_t *tpm_context,
-        uint8_t *randomNumber, size_t len_random);
-static uint32_t tpm_create_endosement_key(const uta_context_v1_t *tpm_context,
+static uint32_t tpm_calc_hmac(tpm_connection_t *connection,
+        uint8_t *hmac, const uint8_t *deriv_val, uint32_t hmacKeyHandle,
+        unsigned int attributes);
+static uint32_t tpm_get_rand(tpm_connection_t *connection,
+        uta_random_cursor_t *cursor, size_t len_random,
+        unsigned int attributes);
+static uint8_t tpm_session_attributes(uta_param_enc_t mode);
+static uint32_t tpm_pool_get_rand(const uta_context_v1_t *tpm_context,
+        uta_random_cursor_t *cursor, uint64_t deadline);
+static int tpm_prefetch_fill(void *p_fill, uint8_t *output, size_t len);
+#ifdef ENABLE_DRBG
+static uta_rc tpm_drbg_start(const uta_context_v1_t *tpm_context,
+        uint64_t reseed_bytes, uint32_t reseed_interval, uint64_t deadline);
+static void tpm_drbg_stop(const uta_context_v1_t *tpm_context);
+static int tpm_drbg_entropy(void *p_entropy, unsigned char *output,
+        size_t len);
+#endif
+static uint32_t tpm_create_endosement_key(const tpm_connection_t *connection,
         uint32_t *handle);
-static uint32_t tpm_start_selftest(const uta_context_v1_t *tpm_context);
-static uint32_t tpm_get_test_result(const uta_context_v1_t *tpm_context,
+static uint32_t tpm_start_selftest(const tpm_connection_t *connection);
+static uint32_t tpm_incremental_selftest(const tpm_connection_t *connection);
+static uint32_t tpm_get_test_result(const tpm_connection_t *connection,
         TPM_RC *testResult);
+static uta_rc tpm_begin_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode);
+static void tpm_poll_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode);
+static uta_rc tpm_test_result_rc(TPM_RC testResult);
         
 /*******************************************************************************
  * Public function bodies
  ******************************************************************************/        
 /**
  * @brief Return the size of the opaque struct uta_context_v1_t.
+ * The bound UTA_CONTEXT_V1_STORAGE of configure.ac is 1024 bytes for the
+ * context without connections and devices (about 650 bytes on x86_64), plus
+ * 320 bytes per connection of the pool (one tpm_connection_t and
+ * tpm_device_t, about 240 bytes), plus 5120 bytes for the latency record
+ * (4608 bytes) and 256 bytes for the DRBG (168 bytes).
  * @return Size of the opaque struct uta_context_v1_t .
  */
 size_t tpm_context_v1_size(void)
 {
+    /* Applications may store the context in UTA_CONTEXT_V1_STORAGE bytes,
+     * see above */
+    _Static_assert(sizeof(uta_context_v1_t) <= UTA_CONTEXT_V1_STORAGE,
+        "UTA_CONTEXT_V1_STORAGE of configure is too small");
     return(sizeof(uta_context_v1_t));
 }
 
@@ -174,77 +372,173 @@ size_t tpm_context_v1_size(void)
  * @return UTA return code.
  */
 uta_rc tpm_open(const uta_context_v1_t *tpm_context)
+{
+    return tpm_open_pool(tpm_context, 1);
+}
+
+/**
+ * @brief Opens a pool of connections to the TPM. Each connection has its own
+ *      TSS context and salted session, so that up to num_connections threads
+ *      can access the TPM in parallel.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] num_connections Number of connections between 1 and
+ *      CONFIGURED_TPM_POOL_MAX.
+ * @return UTA return code.
+ */
+uta_rc tpm_open_pool(const uta_context_v1_t *tpm_context,
+        size_t num_connections)
+{
+    const char *device_file = CONFIGURED_TPM_DEVICE;
+
+    return tpm_open_devices(tpm_context, &device_file, 1, num_connections);
+}
+
+/**
+ * @brief Opens connections_per_device connections to each of the TPM devices.
+ *      The devices must be provisioned with the same keys. Requests are sent
+ *      to the device with the least outstanding requests and are repeated on
+ *      another device, if a device fails. The first device uses the
+ *      configured data directory, the others a subdirectory device<N> of it.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] device_files List of num_devices TPM device files.
+ * @param[in] num_devices Number of devices, at least 1.
+ * @param[in] connections_per_device Number of connections per device, at
+ *      least 1. The total must not exceed CONFIGURED_TPM_POOL_MAX.
+ * @return UTA return code.
+ */
+uta_rc tpm_open_devices(const uta_context_v1_t *tpm_context,
+        const char * const *device_files, size_t num_devices,
+        size_t connections_per_device)
 {
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
 
-    TPM_RC rc = 0;
-    int ret;
+    TPM_RC rc;
 
-    /* Initialization of the accesslock mutex */
-    ret = pthread_mutex_init(&tpm_context_w->accesslock, NULL);
-    if (ret != 0)
+    UTA_TRACE_OP_ENTRY(UTA_STATS_OPEN, 0, num_devices);
+
+    /* Each open starts with cleared statistics */
+    uta_stats_reset(&tpm_context_w->stats);
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+    uta_latency_record_init(&tpm_context_w->latency_record);
+#endif
+
+    if((num_devices < 1) || (connections_per_device < 1) ||
+       (connections_per_device > (CONFIGURED_TPM_POOL_MAX / num_devices)))
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_NOT_SUPPORTED);
     }
-    
-    /* Lock the device access with the accesslock mutex */
-    ret = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret != 0)
+
+    /* A child process re-establishes the context on its first call */
+    if(uta_fork_init(&tpm_context_w->fork_generation) != UTA_SUCCESS)
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
 
-    /* Change debug level, return value is ignored */
-    (void)TSS_SetProperty(NULL, TPM_TRACE_LEVEL, "0");
+    /* Initialization of the accesslock mutex */
+    if(pthread_mutex_init(&tpm_context_w->accesslock, NULL) != 0)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
 
-    /* Create context */
-    rc = TSS_Create(&(tpm_context_w->tssContext));
-    if(rc != 0) 
+    /* Initialization of the asynclock mutex */
+    if(pthread_mutex_init(&tpm_context_w->asynclock, NULL) != 0)
     {
-        return UTA_TA_ERROR;
+        (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
 
-    /* Set device type */
-    rc = TSS_SetProperty(tpm_context_w->tssContext, TPM_INTERFACE_TYPE, CONFIGURED_TPM_INTERFACE_TYPE);
-    if(rc != 0)
+#ifdef ENABLE_DRBG
+    /* Initialization of the drbglock mutex */
+    if(pthread_mutex_init(&tpm_context_w->drbglock, NULL) != 0)
     {
-        rc = TSS_Delete(tpm_context->tssContext);
-        return UTA_TA_ERROR;
+        (void)pthread_mutex_destroy(&tpm_context_w->asynclock);
+        (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
+#endif
 
-    /* Set data directory */
-    rc = TSS_SetProperty(tpm_context_w->tssContext, TPM_DATA_DIR, CONFIGURED_TPM_DATA_DIR);
-    if(rc != 0)
+    /* Random numbers are not prefetched until the prefetch mode is selected */
+    if(uta_prefetch_init(&tpm_context_w->prefetch) != UTA_SUCCESS)
     {
-        rc = TSS_Delete(tpm_context->tssContext);
-        return UTA_TA_ERROR;
+#ifdef ENABLE_DRBG
+        (void)pthread_mutex_destroy(&tpm_context_w->drbglock);
+#endif
+        (void)pthread_mutex_destroy(&tpm_context_w->asynclock);
+        (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
 
-    /* Set tpm device file */
-    rc = TSS_SetProperty(tpm_context_w->tssContext, TPM_DEVICE, CONFIGURED_TPM_DEVICE);
+    /* Change debug level, return value is ignored */
+    (void)TSS_SetProperty(NULL, TPM_TRACE_LEVEL, "0");
+
+    rc = tpm_open_connections(tpm_context, device_files, num_devices,
+        connections_per_device);
     if(rc != 0)
     {
-        rc = TSS_Delete(tpm_context->tssContext);
-        return UTA_TA_ERROR;
+        uta_prefetch_free(&tpm_context_w->prefetch);
+#ifdef ENABLE_DRBG
+        (void)pthread_mutex_destroy(&tpm_context_w->drbglock);
+#endif
+        (void)pthread_mutex_destroy(&tpm_context_w->asynclock);
+        (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
 
-    /* Starting HMAC session */
-    rc = tpm_start_hmac_session(tpm_context);
-    if(rc != 0) 
+    /* Completion signal of the emulated asynchronous operations */
+    if(uta_async_init(&tpm_context_w->async) != UTA_SUCCESS)
     {
-        rc = TSS_Delete(tpm_context->tssContext);
-        return UTA_TA_ERROR;
+        /* Close the devices and connections opened so far */
+        tpm_close_devices(tpm_context);
+        uta_prefetch_free(&tpm_context_w->prefetch);
+#ifdef ENABLE_DRBG
+        (void)pthread_mutex_destroy(&tpm_context_w->drbglock);
+#endif
+        (void)pthread_mutex_destroy(&tpm_context_w->asynclock);
+        (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
-    
-    /* Release the accesslock mutex (ignore return code) */
-    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
 
-    return UTA_SUCCESS;
+    /* The device UUID is calculated on the first request */
+    tpm_context_w->uuid_cached = 0;
+
+    /* The calls wait without limit until set_timeout is called */
+    uta_deadline_set_timeout(&tpm_context_w->timeout_ms, 0);
+
+    /* All parameters are encrypted until set_param_encryption is called */
+    tpm_context_w->attributes_hmac =
+        tpm_session_attributes(UTA_PARAM_ENC_FULL);
+    tpm_context_w->attributes_random =
+        tpm_session_attributes(UTA_PARAM_ENC_FULL) & ~SESSION_DECRYPT;
+
+#ifdef ENABLE_DRBG
+    /* Random numbers are read from the TPM until a DRBG mode is selected */
+    uta_drbg_init(&tpm_context_w->drbg);
+    tpm_context_w->drbg_active = 0;
+#endif
+
+    /* Keys are not cached until set_key_cache is called */
+    uta_key_cache_init(&tpm_context_w->key_cache);
+
+    uta_self_test_init(&tpm_context_w->self_test);
+#ifdef ENABLE_SELF_TEST_ON_OPEN
+    /* The result is queried with get_self_test_result (ignore return code) */
+    (void)tpm_begin_self_test(tpm_context, UTA_SELF_TEST_INCREMENTAL);
+#endif
+
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN, UTA_SUCCESS);
 }
 
 /**
- * @brief Closes the connection to the TPM.
+ * @brief Closes the connections to the TPM.
  * @param[in,out] tpm_context Pointer to the internal context struct.
  * @return UTA return code.
  */
@@ -253,37 +547,57 @@ uta_rc tpm_close(const uta_context_v1_t *tpm_context)
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
 
-    TPM_RC    rc = 0;
-    int ret_val;
+    uta_rc uta_ret;
     
-    /* Lock the device access with the accesslock mutex */
-    ret_val = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret_val != 0)
-    {
-        return UTA_TA_ERROR;
-    }
+    UTA_TRACE_OP_ENTRY(UTA_STATS_CLOSE, 0, 0);
 
-    /* Close open HMAC-Session */
-    if(tpm_context->authSessionHandle != 0)
-    {
-        /* Try to close the HMAC session handle */
-        (void)tpm_flush_context(tpm_context, tpm_context->authSessionHandle);
-    }
-    
-    /* Remove the TSS context */
-    rc = TSS_Delete(tpm_context->tssContext);
-    if (rc != 0)
+    /* A child only drops the connections of the parent */
+    (void)tpm_check_fork(tpm_context, 0);
+
+    /* Lock the device access with the accesslock mutex, close always waits */
+    uta_ret = uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->accesslock, UTA_DEADLINE_NONE);
+    if (uta_ret != UTA_SUCCESS)
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_CLOSE,
+            uta_ret);
     }
+
+    /* The background thread reads from the devices until it is stopped */
+    uta_prefetch_free(&tpm_context_w->prefetch);
+
+    tpm_close_devices(tpm_context);
+
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+    /* Add the recorded latencies to the file (ignore errors) */
+    (void)uta_latency_record_save(&tpm_context_w->latency_record,
+        CONFIGURED_LATENCY_RECORD_FILE);
+#endif
+
+#ifdef ENABLE_DRBG
+    /* Clear the DRBG state */
+    tpm_drbg_stop(tpm_context);
+#endif
+    uta_async_free(&tpm_context_w->async);
+
+    /* Clear and release the key cache */
+    uta_key_cache_free(&tpm_context_w->key_cache);
     
     /* Release the accesslock mutex (ignore return code) */
     (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+
+    /* Destroy the asynclock mutex (ignore return code) */
+    (void)pthread_mutex_destroy(&tpm_context_w->asynclock);
+
+#ifdef ENABLE_DRBG
+    /* Destroy the drbglock mutex (ignore return code) */
+    (void)pthread_mutex_destroy(&tpm_context_w->drbglock);
+#endif
     
     /* Destroy the accesslog mutex (ignore return code) */
     (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
 
-    return UTA_SUCCESS;
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_CLOSE, UTA_SUCCESS);
 }
 
 /**
@@ -303,223 +617,2000 @@ uta_rc tpm_derive_key(const uta_context_v1_t *tpm_context, uint8_t *key,
 {
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
-    
-    TPM_RC    rc = 0;
-    TPMI_DH_OBJECT hmacKeyHandle;
+
+    tpm_connection_t *connection;
+    TPM_RC    rc = TSS_RC_NO_CONNECTION;
     uint8_t key_buffer[32];
-    int ret_val;
+    uint64_t tried_devices = 0;
+    uint64_t deadline;
+    size_t attempt;
+    uta_rc uta_ret;
     
-    /* Check key_slot */
-    if(key_slot > (USED_KEY_SLOTS-1))
+    UTA_TRACE_OP_ENTRY(UTA_STATS_DERIVE_KEY, key_slot, len_key);
+
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
+
+    /* Check key_slot, len_dv and len_key */
+    uta_ret = tpm_check_derive_args(len_key, len_dv, key_slot);
+    if(uta_ret != UTA_SUCCESS)
     {
-        return UTA_INVALID_KEY_SLOT;
-    }
-    
-    switch(key_slot)
-    {
-        case 0x00:
-            hmacKeyHandle = TPM_KEY0_HANDLE;
-        break;
-            
-        case 0x01:
-            hmacKeyHandle = TPM_KEY1_HANDLE;
-        break;
-            
-        default:
-            return UTA_INVALID_KEY_SLOT;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            uta_ret);
     }
-    
-    if(len_dv != 8)
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
-        return UTA_INVALID_DV_LENGTH;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            UTA_TA_ERROR);
     }
-    
-    if(len_key > 32)
+
+    /* Serve repeated derivations from the key cache without a lock */
+    if(uta_key_cache_enabled(&tpm_context_w->key_cache) != 0)
     {
-        return UTA_INVALID_KEY_LENGTH;
+        if(uta_key_cache_lookup(&tpm_context_w->key_cache, key_slot, dv, key,
+            len_key) != 0)
+        {
+            uta_stats_key_cache(&tpm_context_w->stats, 1);
+            return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+                UTA_SUCCESS);
+        }
+        uta_stats_key_cache(&tpm_context_w->stats, 0);
     }
-    
-    /* Lock the device access with the accesslock mutex */
-    ret_val = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret_val != 0)
+
+    /* Try each device once, if the previous one failed */
+    for(attempt = 0; attempt < tpm_context->num_devices; attempt++)
     {
-        return UTA_TA_ERROR;
-    }
+        /* Take a free connection from the pool */
+        connection = tpm_acquire_connection(tpm_context, tried_devices,
+            UTA_STATS_DERIVE_KEY, deadline);
+        if (connection == NULL)
+        {
+            return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+                uta_deadline_rc(deadline));
+        }
 
-    /* Calculate HMAC using TPM key */
-    rc = tpm_calc_hmac(tpm_context, key_buffer, dv, hmacKeyHandle);
+        /* Calculate HMAC using TPM key */
+        rc = tpm_calc_hmac(connection, key_buffer, dv,
+            tpm_key_slot_handle(key_slot),
+            __atomic_load_n(&tpm_context->attributes_hmac, __ATOMIC_RELAXED));
+        if(rc != 0)
+        {
+            tpm_device_failed(tpm_context, connection);
+            tried_devices |= (uint64_t)1 << connection->device;
+        }
     
-    /* Release the accesslock mutex (ignore return code) */
-    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+        /* Return the connection to the pool */
+        tpm_release_connection(tpm_context, connection);
+
+        /* No time is left for another device after the deadline */
+        if((rc == 0) || (uta_deadline_expired(deadline) != 0))
+        {
+            break;
+        }
+    }
     
     if(rc != 0)
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            uta_deadline_rc(deadline));
     }
+    uta_key_cache_store(&tpm_context_w->key_cache, key_slot, dv, key_buffer);
     memcpy(key,key_buffer,len_key);
 
-    return UTA_SUCCESS;
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+        UTA_SUCCESS);
 }
 
 /**
- * @brief Gets random numbers from the TPM.
+ * @brief Derives multiple keys using the TPMs HMAC function while holding one
+ *      connection of the pool. If the device fails, the remaining requests are
+ *      repeated on another device.
  * @param[in,out] tpm_context Pointer to the internal context struct.
- * @param[out] random Pointer to the buffer where the random numbers are written
- *      to.
- * @param[in] len_random Defines the desired number of random bytes.
- * @return UTA return code.
+ * @param[in,out] requests Array of derivation requests. The result of each
+ *      request is written to its rc member.
+ * @param[in] num_requests Number of entries in requests.
+ * @return UTA return code of the first failed request, UTA_SUCCESS otherwise.
  */
-uta_rc tpm_get_random(const uta_context_v1_t *tpm_context, uint8_t *random,
-        size_t len_random)
+uta_rc tpm_derive_key_batch(const uta_context_v1_t *tpm_context,
+        uta_derive_request_v1_t *requests, size_t num_requests)
 {
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
-    
+
+    tpm_connection_t *connection;
     TPM_RC    rc = 0;
-    int ret_val;
-    
-    /* Lock the device access with the accesslock mutex */
-    ret_val = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret_val != 0)
+    uint8_t key_buffer[32];
+    uint64_t tried_devices = 0;
+    uint64_t deadline;
+    size_t attempt;
+    uta_rc uta_ret = UTA_SUCCESS;
+    uta_rc failed_rc;
+    unsigned int attributes =
+        __atomic_load_n(&tpm_context->attributes_hmac, __ATOMIC_RELAXED);
+    size_t i;
+
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
+
+    /*
+     * Validate all requests before the TPM is accessed. The valid requests
+     * are marked with UTA_TA_ERROR until they have been derived.
+     */
+    for(i = 0; i < num_requests; i++)
     {
-        return UTA_TA_ERROR;
+        UTA_TRACE_OP_ENTRY(UTA_STATS_DERIVE_KEY, requests[i].key_slot,
+            requests[i].len_key);
+        requests[i].rc = tpm_check_derive_args(requests[i].len_key,
+            requests[i].len_dv, requests[i].key_slot);
+        if(requests[i].rc == UTA_SUCCESS)
+        {
+            requests[i].rc = UTA_TA_ERROR;
+        }
     }
-    
-    /* Get Random numbers from TPM */
-    rc = tpm_get_rand(tpm_context, random, len_random);
-    
-    /* Release the accesslock mutex (ignore return code) */
-    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
 
-    if(rc != 0)
+    /*
+     * A context inherited over fork is re-established first. If this fails,
+     * no device is left and the valid requests fail.
+     */
+    (void)tpm_check_fork(tpm_context, 1);
+
+    /* Try each device once, if the previous one failed */
+    for(attempt = 0; attempt < tpm_context->num_devices; attempt++)
     {
-        return UTA_TA_ERROR;
+        /* Take a free connection from the pool. A batch covers several keys,
+         * so its access is not recorded */
+        connection = tpm_acquire_connection(tpm_context, tried_devices,
+            UTA_STATS_NUM_OPS, deadline);
+        if (connection == NULL)
+        {
+            break;
+        }
+
+        for(i = 0; (rc == 0) && (i < num_requests); i++)
+        {
+            if(requests[i].rc != UTA_TA_ERROR)
+            {
+                continue;
+            }
+
+            /* Calculate HMAC using TPM key */
+            rc = tpm_calc_hmac(connection, key_buffer, requests[i].dv,
+                tpm_key_slot_handle(requests[i].key_slot), attributes);
+            if(rc == 0)
+            {
+                memcpy(requests[i].key, key_buffer, requests[i].len_key);
+                requests[i].rc = UTA_SUCCESS;
+            }
+        }
+
+        if(rc != 0)
+        {
+            tpm_device_failed(tpm_context, connection);
+            tried_devices |= (uint64_t)1 << connection->device;
+        }
+
+        /* Return the connection to the pool */
+        tpm_release_connection(tpm_context, connection);
+
+        /* No time is left for another device after the deadline */
+        if((rc == 0) || (uta_deadline_expired(deadline) != 0))
+        {
+            break;
+        }
+        rc = 0;
     }
 
-    return UTA_SUCCESS;
+    /* Count each request and report the first failed one */
+    failed_rc = uta_deadline_rc(deadline);
+    for(i = 0; i < num_requests; i++)
+    {
+        if(requests[i].rc == UTA_TA_ERROR)
+        {
+            requests[i].rc = failed_rc;
+        }
+        (void)uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            requests[i].rc);
+        if((requests[i].rc != UTA_SUCCESS) && (uta_ret == UTA_SUCCESS))
+        {
+            uta_ret = requests[i].rc;
+        }
+    }
+
+    return uta_ret;
 }
 
 /**
- * @brief Gets the UUID of the device.
+ * @brief Gets random numbers from the TPM.
  * @param[in,out] tpm_context Pointer to the internal context struct.
- * @param[out] uuid Pointer to the buffer where the UUID should be written to.
+ * @param[out] random Pointer to the buffer where the random numbers are written
+ *      to.
+ * @param[in] len_random Defines the desired number of random bytes.
  * @return UTA return code.
  */
-uta_rc tpm_get_device_uuid(const uta_context_v1_t *tpm_context, uint8_t *uuid)
+uta_rc tpm_get_random(const uta_context_v1_t *tpm_context, uint8_t *random,
+        size_t len_random)
+{
+    uta_random_buffer_v1_t buffer = { .random = random,
+                                      .len_random = len_random };
+
+    return tpm_get_random_v(tpm_context, &buffer, 1);
+}
+
+/**
+ * @brief Gets random numbers from the TPM for several buffers. The total
+ *      number of bytes is read on one connection and scattered to the
+ *      buffers. In the DRBG mode, all buffers are generated under one hold
+ *      of the drbglock mutex, the other modes take no lock of the context.
+ *      In the prefetch mode, the bytes are taken from the ring first and
+ *      only the rest is read from the TPM.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] buffers Buffers, where the random numbers are written to.
+ * @param[in] num_buffers Number of entries in buffers.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_random_v(const uta_context_v1_t *tpm_context,
+        const uta_random_buffer_v1_t *buffers, size_t num_buffers)
 {
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
-    
-    TPM_RC    rc = 0;
-    uint32_t handle = 0;
-    /* "DEVICEID" in hexadecimal representation */
-    uint8_t derive_value[] = {0x44, 0x45, 0x56, 0x49, 0x43, 0x45, 0x49, 0x44};
-    uint8_t hmac_output[32];
-    int ret_val;
-    
-    /* Lock the device access with the accesslock mutex */
-    ret_val = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret_val != 0)
+
+    uta_random_cursor_t cursor;
+    size_t len_random;
+    uint64_t deadline;
+#ifdef ENABLE_DRBG
+    uta_rc uta_ret;
+    size_t i;
+#endif
+
+    uta_random_cursor_init(&cursor, buffers, num_buffers);
+    len_random = cursor.remaining;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_GET_RANDOM, 0, len_random);
+
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+            UTA_TA_ERROR);
     }
-    
-    /* Create an endorsement key */
-    rc = tpm_create_endosement_key(tpm_context, &handle);
-    if(rc != 0)
+
+#ifdef ENABLE_DRBG
+    /* Serve the request from the DRBG, if it has been selected */
+    if(__atomic_load_n(&tpm_context->drbg_active, __ATOMIC_ACQUIRE) != 0)
     {
-        /* Release the accesslock mutex (ignore return code) */
-        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
-        return UTA_TA_ERROR;
+        /* Lock the DRBG state with the drbglock mutex */
+        uta_ret = uta_stats_mutex_lock(&tpm_context_w->stats,
+            &tpm_context_w->drbglock, deadline);
+        if(uta_ret != UTA_SUCCESS)
+        {
+            return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+                uta_ret);
+        }
+
+        /* The DRBG mode may have been left meanwhile */
+        if(tpm_context->drbg.seeded != 0)
+        {
+            /* A reseed reads the entropy before the deadline of this call */
+            tpm_context_w->drbg_deadline = deadline;
+
+            for(i = 0; (uta_ret == UTA_SUCCESS) && (i < num_buffers); i++)
+            {
+                uta_ret = uta_drbg_generate(&tpm_context_w->drbg,
+                    buffers[i].random, buffers[i].len_random);
+            }
+            if(uta_ret != UTA_SUCCESS)
+            {
+                uta_ret = uta_deadline_rc(deadline);
+            }
+
+            /* Release the drbglock mutex (ignore return code) */
+            (void)pthread_mutex_unlock(&tpm_context_w->drbglock);
+            if(uta_ret == UTA_SUCCESS)
+            {
+                uta_stats_random(&tpm_context_w->stats, len_random);
+            }
+            return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+                uta_ret);
+        }
+
+        /* Release the drbglock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->drbglock);
     }
-    
-    /* Calculate HMAC using TPM endorsement key */
-    rc = tpm_calc_hmac(tpm_context, hmac_output, derive_value, handle);
-    
-    /* Try to flush the EK, ignore the return value */
-    (void)tpm_flush_context(tpm_context, handle);
-    
-    /* Release the accesslock mutex (ignore return code) */
-    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
-        
-    if(rc != 0)
+#endif
+
+    /* Prefetched bytes are used first, an empty ring falls back to the TPM */
+    (void)uta_prefetch_take(&tpm_context_w->prefetch, &cursor);
+
+    /* Get Random numbers from TPM */
+    if(tpm_pool_get_rand(tpm_context, &cursor, deadline) != 0)
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+            uta_deadline_rc(deadline));
     }
-    
-    /* Copy the first 16 bytes to uuid */
-    memcpy(uuid, hmac_output, 16);
-    
-    /* Format UUID as described in RFC 4122 */
-    uuid[6] &= 0x0F;    // 0b00001111;
-    uuid[6] |= 0x40;    // 0b01000000;
-    
-    uuid[8] &= 0x3F;    // 0b00111111;
-    uuid[8] |= 0x80;    // 0b10000000;
 
-    return UTA_SUCCESS;
+    uta_stats_random(&tpm_context_w->stats, len_random);
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+        UTA_SUCCESS);
 }
 
 /**
- * @brief Performs the TPM self test.
+ * @brief Selects the random mode of the context. In the DRBG mode, the DRBG is
+ *      seeded from the TPM immediately. In the prefetch mode, the background
+ *      thread starts to fill the ring. Leaving a mode clears its state.
  * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] config Random mode and reseed limits.
  * @return UTA return code.
  */
-uta_rc tpm_self_test(const uta_context_v1_t *tpm_context)
+uta_rc tpm_set_random_mode(const uta_context_v1_t *tpm_context,
+        const uta_random_config_v1_t *config)
 {
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
-    
-    TPM_RC    rc = 0;
-    TPM_RC  testResult;
-    int ret_val;
-    
-    /* Lock the device access with the accesslock mutex */
-    ret_val = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret_val != 0)
+
+    uint64_t deadline;
+    uta_rc uta_ret;
+
+#ifdef ENABLE_DRBG
+    if((config->mode != UTA_RANDOM_TA) && (config->mode != UTA_RANDOM_DRBG) &&
+       (config->mode != UTA_RANDOM_PREFETCH))
+#else
+    /* Without DRBG support, the TPM is the only source of random numbers */
+    if((config->mode != UTA_RANDOM_TA) && (config->mode != UTA_RANDOM_PREFETCH))
+#endif
+    {
+        return UTA_NOT_SUPPORTED;
+    }
+
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    /* Lock the device access with the accesslock mutex */
+    uta_ret = uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->accesslock, deadline);
+    if(uta_ret != UTA_SUCCESS)
+    {
+        return uta_ret;
+    }
+
+    if(config->mode == UTA_RANDOM_PREFETCH)
+    {
+#ifdef ENABLE_DRBG
+        tpm_drbg_stop(tpm_context);
+#endif
+        /* Selecting the mode again discards the prefetched bytes */
+        uta_ret = uta_prefetch_start(&tpm_context_w->prefetch,
+            tpm_prefetch_fill, tpm_context_w, CONFIGURED_RANDOM_PREFETCH_SIZE);
+    }
+    else
+    {
+        uta_prefetch_stop(&tpm_context_w->prefetch);
+#ifdef ENABLE_DRBG
+        if(config->mode == UTA_RANDOM_DRBG)
+        {
+            uta_ret = tpm_drbg_start(tpm_context, config->reseed_bytes,
+                config->reseed_interval, deadline);
+        }
+        else
+        {
+            tpm_drbg_stop(tpm_context);
+        }
+#endif
+    }
+
+    /* Release the accesslock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+
+    return uta_ret;
+}
+
+/**
+ * @brief Sets the timeout of the calls of the context. The deadline of a call
+ *      bounds the wait for the locks and for a free connection. A command,
+ *      which has been sent to the TPM, is always completed.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] timeout_ms Timeout of each call in ms, 0 for no limit.
+ * @return UTA return code.
+ */
+uta_rc tpm_set_timeout(const uta_context_v1_t *tpm_context,
+        uint32_t timeout_ms)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    uta_deadline_set_timeout(&tpm_context_w->timeout_ms, timeout_ms);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Copies the capabilities, which have been read from the TPM on open.
+ * @param[in] tpm_context Pointer to the internal context struct.
+ * @param[out] capabilities Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_capabilities(const uta_context_v1_t *tpm_context,
+        uta_capabilities_v1_t *capabilities)
+{
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    *capabilities = tpm_context->capabilities;
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Selects the parameter encryption of the HMAC sessions per
+ *      operation. The attributes are read by each call, so that a call,
+ *      which has already started, keeps its policy.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] policy Parameter encryption of the operations.
+ * @return UTA return code.
+ */
+uta_rc tpm_set_param_encryption(const uta_context_v1_t *tpm_context,
+        const uta_param_enc_policy_v1_t *policy)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    if((policy->derive_key > UTA_PARAM_ENC_AUDIT) ||
+       (policy->get_random > UTA_PARAM_ENC_AUDIT))
+    {
+        return UTA_NOT_SUPPORTED;
+    }
+
+    /* TPM2_GetRandom has no command parameter to decrypt */
+    __atomic_store_n(&tpm_context_w->attributes_hmac,
+        tpm_session_attributes(policy->derive_key), __ATOMIC_RELAXED);
+    __atomic_store_n(&tpm_context_w->attributes_random,
+        tpm_session_attributes(policy->get_random) & ~SESSION_DECRYPT,
+        __ATOMIC_RELAXED);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Returns the file descriptor of the emulated asynchronous operations.
+ *      The IBM TSS has no asynchronous interface, so the operations are
+ *      executed on submission.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[out] fd File descriptor for poll, select or epoll.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_poll_fd(const uta_context_v1_t *tpm_context, int *fd)
+{
+    /* A child gets the completion signal of its own pipe */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    *fd = uta_async_fd(&tpm_context->async);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Emulates an asynchronous key derivation. The HMAC is calculated
+ *      immediately and the completion is signalled on the poll fd.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[out] key Pointer to the buffer where the derived key is written to.
+ * @param[in] len_key Number of bytes, which should be written to key.
+ * @param[in] dv Pointer to the derivation value.
+ * @param[in] len_dv Length of the derivation value.
+ * @param[in] key_slot Key slot used for the HMAC function.
+ * @return UTA return code.
+ */
+uta_rc tpm_derive_key_submit(const uta_context_v1_t *tpm_context,
+        uint8_t *key, size_t len_key, const uint8_t *dv, size_t len_dv,
+        uint8_t key_slot)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_connection_t *connection;
+    TPM_RC    rc = 0;
+    uint8_t key_buffer[32];
+    uta_rc uta_ret;
+
+    /* Check key_slot, len_dv and len_key */
+    uta_ret = tpm_check_derive_args(len_key, len_dv, key_slot);
+    if(uta_ret != UTA_SUCCESS)
+    {
+        return uta_ret;
+    }
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    /* Lock the asynchronous state with the asynclock mutex */
+    if(uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->asynclock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    uta_ret = uta_async_claim(&tpm_context_w->async);
+    if(uta_ret == UTA_SUCCESS)
+    {
+        UTA_TRACE_OP_ENTRY(UTA_STATS_DERIVE_KEY, key_slot, len_key);
+
+        /* Calculate HMAC using TPM key */
+        rc = TSS_RC_NO_CONNECTION;
+        connection = tpm_acquire_connection(tpm_context, 0,
+            UTA_STATS_DERIVE_KEY, UTA_DEADLINE_NONE);
+        if(connection != NULL)
+        {
+            rc = tpm_calc_hmac(connection, key_buffer, dv,
+                tpm_key_slot_handle(key_slot),
+                __atomic_load_n(&tpm_context->attributes_hmac,
+                __ATOMIC_RELAXED));
+            tpm_release_connection(tpm_context, connection);
+        }
+        if(rc == 0)
+        {
+            memcpy(key, key_buffer, len_key);
+        }
+        uta_async_post(&tpm_context_w->async,
+            uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            (rc == 0) ? UTA_SUCCESS : UTA_TA_ERROR));
+    }
+
+    /* Release the asynclock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+
+    return uta_ret;
+}
+
+/**
+ * @brief Emulates an asynchronous random request. The random numbers are read
+ *      from the TPM immediately and the completion is signalled on the poll fd.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[out] random Pointer to the buffer where the random numbers are written
+ *      to.
+ * @param[in] len_random Defines the desired number of random bytes.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_random_submit(const uta_context_v1_t *tpm_context,
+        uint8_t *random, size_t len_random)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    TPM_RC    rc = 0;
+    uta_rc uta_ret;
+    uta_random_buffer_v1_t buffer = { .random = random,
+                                      .len_random = len_random };
+    uta_random_cursor_t cursor;
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    /* Lock the asynchronous state with the asynclock mutex */
+    if(uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->asynclock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    uta_ret = uta_async_claim(&tpm_context_w->async);
+    if(uta_ret == UTA_SUCCESS)
+    {
+        UTA_TRACE_OP_ENTRY(UTA_STATS_GET_RANDOM, 0, len_random);
+
+        /* Get Random numbers from TPM */
+        uta_random_cursor_init(&cursor, &buffer, 1);
+        rc = tpm_pool_get_rand(tpm_context, &cursor, UTA_DEADLINE_NONE);
+        if(rc == 0)
+        {
+            uta_stats_random(&tpm_context_w->stats, len_random);
+        }
+        uta_async_post(&tpm_context_w->async,
+            uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+            (rc == 0) ? UTA_SUCCESS : UTA_TA_ERROR));
+    }
+
+    /* Release the asynclock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+
+    return uta_ret;
+}
+
+/**
+ * @brief Returns the result of the emulated asynchronous operation.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @return UTA return code of the operation.
+ */
+uta_rc tpm_async_complete(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    uta_rc uta_ret;
+
+    /* An operation of the parent is not pending in a child */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    /* Lock the asynchronous state with the asynclock mutex */
+    if(uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->asynclock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    uta_ret = uta_async_collect(&tpm_context_w->async);
+
+    /* Release the asynclock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+
+    return uta_ret;
+}
+
+/**
+ * @brief Enables, replaces or disables the key cache of the context.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] config Size and TTL of the cache.
+ * @return UTA return code.
+ */
+uta_rc tpm_set_key_cache(const uta_context_v1_t *tpm_context,
+        const uta_key_cache_config_v1_t *config)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    return uta_key_cache_configure(&tpm_context_w->key_cache,
+        config->max_entries, config->ttl);
+}
+
+/**
+ * @brief Clears all entries of the key cache.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc tpm_flush_key_cache(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
         return UTA_TA_ERROR;
     }
-    
-    rc = tpm_start_selftest(tpm_context);
-    if(rc != 0)
+
+    uta_key_cache_flush(&tpm_context_w->key_cache);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Copies the statistics of the context.
+ * @param[in] tpm_context Pointer to the internal context struct.
+ * @param[out] stats Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_stats(const uta_context_v1_t *tpm_context,
+        uta_stats_v1_t *stats)
+{
+    uta_stats_read(&tpm_context->stats, stats);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Clears the statistics of the context.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc tpm_reset_stats(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    uta_stats_reset(&tpm_context_w->stats);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Derives a key like tpm_derive_key and expands it with HKDF-Expand
+ *      into the subkeys of all requests.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in,out] requests Array of expand requests.
+ * @param[in] num_requests Number of entries in requests.
+ * @param[in] dv Pointer to the buffer in which the derivation value is handed
+ *      over.
+ * @param[in] len_dv Specifies the length in bytes of the derivation value.
+ * @param[in] key_slot Defines which master key is used for the HMAC function.
+ * @return UTA return code.
+ */
+uta_rc tpm_derive_key_expand(const uta_context_v1_t *tpm_context,
+        uta_expand_request_v1_t *requests, size_t num_requests,
+        const uint8_t *dv, size_t len_dv, uint8_t key_slot)
+{
+#ifdef ENABLE_HKDF
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    return uta_hkdf_derive_key_expand(tpm_derive_key, tpm_context,
+        &tpm_context_w->stats, requests, num_requests, dv, len_dv, key_slot);
+#else
+    /* Without HKDF support, the subkeys cannot be expanded */
+    return UTA_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * @brief Gets the UUID of the device.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[out] uuid Pointer to the buffer where the UUID should be written to.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_device_uuid(const uta_context_v1_t *tpm_context, uint8_t *uuid)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+    
+    tpm_connection_t *connection;
+    TPM_RC    rc = 0;
+    uint32_t handle = 0;
+    /* "DEVICEID" in hexadecimal representation */
+    uint8_t derive_value[] = {0x44, 0x45, 0x56, 0x49, 0x43, 0x45, 0x49, 0x44};
+    uint8_t hmac_output[32];
+    uint64_t deadline;
+    uta_rc uta_ret;
+    
+    UTA_TRACE_OP_ENTRY(UTA_STATS_GET_DEVICE_UUID, 0, UTA_UUID_LEN);
+
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_TA_ERROR);
+    }
+
+    /* Lock the device access with the accesslock mutex */
+    uta_ret = uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->accesslock, deadline);
+    if (uta_ret != UTA_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            uta_ret);
+    }
+    
+    /* Use the UUID of a previous call or of the persisted cache */
+    if(tpm_context->uuid_cached == 0)
+    {
+#ifdef CONFIGURED_UUID_CACHE_FILE
+        if(uta_uuid_cache_read(CONFIGURED_UUID_CACHE_FILE,
+            tpm_context_w->uuid) == 0)
+        {
+            tpm_context_w->uuid_cached = 1;
+        }
+#endif
+    }
+    if(tpm_context->uuid_cached != 0)
+    {
+        memcpy(uuid, tpm_context->uuid, UTA_UUID_LEN);
+        /* Release the accesslock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_SUCCESS);
+    }
+    
+    /*
+     * Keep the accesslock, so that concurrent callers wait for this result.
+     * The UUID is always read from the first device.
+     */
+    connection = tpm_acquire_device_connection(tpm_context, 0,
+        UTA_STATS_GET_DEVICE_UUID, deadline);
+    if(connection == NULL)
+    {
+        /* Release the accesslock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            uta_deadline_rc(deadline));
+    }
+
+    /* Create an endorsement key */
+    rc = tpm_create_endosement_key(connection, &handle);
+    if(rc != 0)
+    {
+        tpm_release_connection(tpm_context, connection);
+        /* Release the accesslock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_TA_ERROR);
+    }
+    
+    /* Calculate HMAC using TPM endorsement key */
+    rc = tpm_calc_hmac(connection, hmac_output, derive_value, handle,
+        tpm_session_attributes(UTA_PARAM_ENC_FULL));
+    
+    /* Try to flush the EK, ignore the return value */
+    (void)tpm_flush_context(connection, handle);
+
+    /* Return the connection to the pool */
+    tpm_release_connection(tpm_context, connection);
+        
+    if(rc != 0)
+    {
+        /* Release the accesslock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_TA_ERROR);
+    }
+    
+    /* Copy the first 16 bytes to the context */
+    memcpy(tpm_context_w->uuid, hmac_output, UTA_UUID_LEN);
+    
+    /* Format UUID as described in RFC 4122 */
+    tpm_context_w->uuid[6] &= 0x0F;    // 0b00001111;
+    tpm_context_w->uuid[6] |= 0x40;    // 0b01000000;
+    
+    tpm_context_w->uuid[8] &= 0x3F;    // 0b00111111;
+    tpm_context_w->uuid[8] |= 0x80;    // 0b10000000;
+
+    tpm_context_w->uuid_cached = 1;
+
+#ifdef CONFIGURED_UUID_CACHE_FILE
+    /* Persist the UUID for later processes (ignore return code) */
+    (void)uta_uuid_cache_write(CONFIGURED_UUID_CACHE_FILE, tpm_context->uuid);
+#endif
+
+    memcpy(uuid, tpm_context->uuid, UTA_UUID_LEN);
+    
+    /* Release the accesslock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+        UTA_SUCCESS);
+}
+
+/**
+ * @brief Performs the TPM self test on each device of the context.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc tpm_self_test(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_connection_t *connection;
+    TPM_RC    rc = 0;
+    TPM_RC  testResult;
+    size_t device;
+    uint64_t deadline;
+    uta_rc uta_ret = UTA_SUCCESS;
+    
+    UTA_TRACE_OP_ENTRY(UTA_STATS_SELF_TEST, 0, 0);
+
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_SELF_TEST,
+            UTA_TA_ERROR);
+    }
+
+    /* The result is cached for get_self_test_result */
+    uta_self_test_started(&tpm_context_w->self_test, UTA_SELF_TEST_FULL);
+
+    for(device = 0;
+        (uta_ret == UTA_SUCCESS) && (device < tpm_context->num_devices);
+        device++)
+    {
+        /* Take a free connection of the device from the pool */
+        connection = tpm_acquire_device_connection(tpm_context, device,
+            UTA_STATS_SELF_TEST, deadline);
+        if (connection == NULL)
+        {
+            uta_ret = uta_deadline_rc(deadline);
+            break;
+        }
+        
+        rc = tpm_start_selftest(connection);
+        if(rc == 0)
+        {
+            rc = tpm_get_test_result(connection, &testResult);
+        }
+        
+        if(rc != 0)
+        {
+            tpm_device_failed(tpm_context, connection);
+        }
+        
+        /* Return the connection to the pool */
+        tpm_release_connection(tpm_context, connection);
+        
+        if((rc != 0) || (testResult != 0))
+        {
+            uta_ret = UTA_TA_ERROR;
+        }
+    }
+    
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_SELF_TEST,
+        uta_self_test_finished(&tpm_context_w->self_test, UTA_SELF_TEST_FULL,
+        uta_ret));
+}
+
+/**
+ * @brief Starts the TPM self test on each device of the context without
+ *      waiting for its result.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] mode UTA_SELF_TEST_INCREMENTAL for the algorithms used by UTA
+ *      or UTA_SELF_TEST_FULL.
+ * @return UTA return code.
+ */
+uta_rc tpm_start_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_SELF_TEST, 0, 0);
+
+    if((mode != UTA_SELF_TEST_FULL) && (mode != UTA_SELF_TEST_INCREMENTAL))
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_SELF_TEST,
+            UTA_NOT_SUPPORTED);
+    }
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_SELF_TEST,
+            UTA_TA_ERROR);
+    }
+
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_SELF_TEST,
+        tpm_begin_self_test(tpm_context, mode));
+}
+
+/**
+ * @brief Copies the result of the last self test. A running self test is
+ *      polled on the connections, which are free.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[out] result Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_self_test_result(const uta_context_v1_t *tpm_context,
+        uta_self_test_result_v1_t *result)
+{
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    uta_self_test_read(&tpm_context->self_test, result);
+    if(result->rc == UTA_TRY_AGAIN)
+    {
+        tpm_poll_self_test(tpm_context, result->mode);
+        uta_self_test_read(&tpm_context->self_test, result);
+    }
+
+    return UTA_SUCCESS;
+}
+        
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Opens connections_per_device connections to each of the TPM devices
+ *      and sets up the pool. Used by tpm_open_devices and to re-establish a
+ *      context in a child process.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] device_files List of num_devices TPM device files.
+ * @param[in] num_devices Number of devices, at least 1.
+ * @param[in] connections_per_device Number of connections per device.
+ * @return TSS return code. On error, no device is left open.
+ */
+static uint32_t tpm_open_connections(const uta_context_v1_t *tpm_context,
+        const char * const *device_files, size_t num_devices,
+        size_t connections_per_device)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    TPM_RC rc = 0;
+    uta_capabilities_v1_t capabilities;
+    tpm_device_t *device;
+    size_t i;
+    size_t j;
+
+    tpm_context_w->num_devices = 0;
+    tpm_context_w->num_connections = 0;
+    tpm_context_w->free_mask = 0;
+    tpm_context_w->next_device = 0;
+
+#ifdef CONFIGURED_TPM_STATE_DIR
+    /* The TSS state of this context is kept in a private directory */
+    tpm_context_w->state_dir = malloc(strlen(CONFIGURED_TPM_STATE_DIR) + 16);
+    if(tpm_context_w->state_dir != NULL)
+    {
+        (void)sprintf(tpm_context_w->state_dir, "%s/uta-XXXXXX",
+            CONFIGURED_TPM_STATE_DIR);
+        if(mkdtemp(tpm_context_w->state_dir) == NULL)
+        {
+            free(tpm_context_w->state_dir);
+            tpm_context_w->state_dir = NULL;
+        }
+    }
+    if(tpm_context_w->state_dir == NULL)
+    {
+        return TSS_RC_OUT_OF_MEMORY;
+    }
+#endif
+
+    for(i = 0; (rc == 0) && (i < num_devices); i++)
+    {
+        device = &tpm_context_w->devices[i];
+
+        device->device_file = strdup(device_files[i]);
+        device->data_dir = tpm_device_data_dir(tpm_context, i);
+        if((device->device_file == NULL) || (device->data_dir == NULL))
+        {
+            free(device->device_file);
+            free(device->data_dir);
+            rc = TSS_RC_OUT_OF_MEMORY;
+            break;
+        }
+
+        /* Initialization of the scheduler of the device connections */
+        if(uta_sched_init(&device->sched, connections_per_device) != 0)
+        {
+            free(device->device_file);
+            free(device->data_dir);
+            rc = TSS_RC_OUT_OF_MEMORY;
+            break;
+        }
+        device->first_connection = tpm_context->num_connections;
+        device->num_connections = 0;
+        device->outstanding = 0;
+        device->failed_until = 0;
+        tpm_context_w->num_devices++;
+
+        while(device->num_connections < connections_per_device)
+        {
+            tpm_context_w->connections[tpm_context->num_connections].device = i;
+            rc = tpm_open_connection(
+                &tpm_context_w->connections[tpm_context->num_connections],
+                device);
+            if(rc != 0)
+            {
+                break;
+            }
+            tpm_context_w->free_mask |=
+                (uint64_t)1 << tpm_context->num_connections;
+            tpm_context_w->num_connections++;
+            device->num_connections++;
+        }
+        if(rc != 0)
+        {
+            break;
+        }
+
+        /* A TPM without the properties gets responses of the largest size */
+        memset(&capabilities, 0, sizeof(capabilities));
+        (void)tpm_read_capabilities(
+            &tpm_context->connections[device->first_connection],
+            &capabilities);
+        for(j = 0; j < device->num_connections; j++)
+        {
+            tpm_context_w->connections[device->first_connection +
+                j].max_random = capabilities.max_digest;
+        }
+        if(i == 0)
+        {
+            tpm_context_w->capabilities = capabilities;
+        }
+    }
+
+    if(rc != 0)
+    {
+        /* Close the devices and connections opened so far */
+        tpm_close_devices(tpm_context);
+        return rc;
+    }
+
+    tpm_context_w->capabilities.len_key_max = UTA_LEN_KEY_MAX_V1;
+    tpm_context_w->capabilities.num_key_slots = USED_KEY_SLOTS;
+    tpm_context_w->capabilities.resource_manager =
+        (strstr(device_files[0], "tpmrm") != NULL) ? 1 : 0;
+    tpm_context_w->capabilities.num_devices = (uint32_t)num_devices;
+    tpm_context_w->capabilities.num_connections =
+        (uint32_t)tpm_context->num_connections;
+
+    return rc;
+}
+
+/**
+ * @brief Opens one connection to the TPM: TSS context and a salted HMAC
+ *      session, or the session saved by a previous process. On failure,
+ *      everything opened so far is released again.
+ * @param[out] connection Pointer to the connection.
+ * @param[in] device Device of the connection, its strings must stay valid
+ *      until the connection is closed.
+ * @return IBM TSS return code.
+ */
+static uint32_t tpm_open_connection(tpm_connection_t *connection,
+        const tpm_device_t *device)
+{
+    TPM_RC rc = 0;
+
+    connection->authSessionHandle = 0;
+
+    /* Create context */
+    rc = TSS_Create(&connection->tssContext);
+    if(rc != 0) 
+    {
+        return rc;
+    }
+
+    /* Set device type */
+    rc = TSS_SetProperty(connection->tssContext, TPM_INTERFACE_TYPE,
+        CONFIGURED_TPM_INTERFACE_TYPE);
+
+#ifndef TPM_IBM_TSS_NOFILE
+    /* Set data directory */
+    if(rc == 0)
+    {
+        rc = TSS_SetProperty(connection->tssContext, TPM_DATA_DIR,
+            device->data_dir);
+    }
+#endif
+
+    /* Set tpm device file */
+    if(rc == 0)
+    {
+        rc = TSS_SetProperty(connection->tssContext, TPM_DEVICE,
+            device->device_file);
+    }
+
+#ifdef CONFIGURED_SESSION_CACHE_FILE
+    /* Resume the session, which a previous process saved on the first device */
+    if((rc == 0) && (connection->device == 0))
+    {
+        (void)tpm_load_session(connection, device);
+    }
+#endif
+
+    /* Starting HMAC session */
+    if((rc == 0) && (connection->authSessionHandle == 0))
+    {
+        rc = tpm_start_hmac_session(connection);
+    }
+
+    if(rc != 0)
+    {
+        (void)TSS_Delete(connection->tssContext);
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Closes one connection to the TPM, which has been opened by
+ *      tpm_open_connection.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[in] device Device of the connection.
+ */
+static void tpm_close_connection(tpm_connection_t *connection,
+        const tpm_device_t *device)
+{
+#ifdef CONFIGURED_SESSION_CACHE_FILE
+    /* Keep the session of the first device for the next process */
+    if((connection->device == 0) && (connection->authSessionHandle != 0))
+    {
+        tpm_save_session(connection, device);
+    }
+#else
+    (void)device;
+#endif
+
+    /* Close open HMAC-Session */
+    if(connection->authSessionHandle != 0)
+    {
+        /* Try to close the HMAC session handle */
+        (void)tpm_flush_context(connection, connection->authSessionHandle);
+    }
+
+    /* Remove the TSS context (ignore return code) */
+    (void)TSS_Delete(connection->tssContext);
+}
+
+/**
+ * @brief Releases a connection, which the calling process inherited over fork,
+ *      without a TPM command. The session stays valid for the parent and
+ *      closing the inherited file descriptor does not close its connection.
+ * @param[in,out] connection Pointer to the connection.
+ */
+static void tpm_forget_connection(tpm_connection_t *connection)
+{
+    /* Remove the TSS context (ignore return code) */
+    (void)TSS_Delete(connection->tssContext);
+}
+
+/**
+ * @brief Closes all connections and releases all devices of the context, which
+ *      have been opened by tpm_open_devices.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ */
+static void tpm_close_devices(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    size_t i;
+
+    for(i = 0; i < tpm_context->num_connections; i++)
+    {
+        tpm_close_connection(&tpm_context_w->connections[i],
+            &tpm_context->devices[tpm_context->connections[i].device]);
+    }
+    tpm_context_w->num_connections = 0;
+
+    /* The strings are freed after the connections, which point to them */
+    for(i = 0; i < tpm_context->num_devices; i++)
+    {
+        /* Destroy the scheduler of the device connections */
+        uta_sched_destroy(&tpm_context_w->devices[i].sched);
+        free(tpm_context_w->devices[i].device_file);
+        free(tpm_context_w->devices[i].data_dir);
+    }
+    tpm_context_w->num_devices = 0;
+
+#ifdef CONFIGURED_TPM_STATE_DIR
+    /* The session state is not needed after the connections are closed */
+    if(tpm_context_w->state_dir != NULL)
+    {
+        tpm_remove_dir(AT_FDCWD, tpm_context_w->state_dir, 0);
+        free(tpm_context_w->state_dir);
+        tpm_context_w->state_dir = NULL;
+    }
+#endif
+}
+
+/**
+ * @brief Reads the fixed TPM properties of the capabilities from the device
+ *      of a connection. Properties, which the TPM does not report, are left
+ *      unchanged.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[in,out] capabilities Pointer to the capabilities.
+ * @return IBM TSS return code.
+ */
+static uint32_t tpm_read_capabilities(const tpm_connection_t *connection,
+        uta_capabilities_v1_t *capabilities)
+{
+    TPM_RC rc = 0;
+    GetCapability_In in;
+    GetCapability_Out out;
+    const TPMS_TAGGED_PROPERTY *property;
+    UINT32 i;
+
+    /* All properties of interest are read with one command */
+    in.capability = TPM_CAP_TPM_PROPERTIES;
+    in.property = TPM_PT_MANUFACTURER;
+    in.propertyCount = TPM_PT_MAX_DIGEST - TPM_PT_MANUFACTURER + 1;
+
+    /* call TSS to execute the command */
+    UTA_TRACE_TPM_ENTRY(TPM_CC_GetCapability);
+    rc = TSS_Execute(connection->tssContext,
+        (RESPONSE_PARAMETERS *)&out,
+        (COMMAND_PARAMETERS *)&in,
+        NULL,
+        TPM_CC_GetCapability,
+        TPM_RH_NULL, NULL, 0);
+    UTA_TRACE_TPM_RETURN(TPM_CC_GetCapability, rc);
+
+    if(rc != 0)
+    {
+        return rc;
+    }
+
+    for(i = 0; i < out.capabilityData.data.tpmProperties.count; i++)
+    {
+        property = &out.capabilityData.data.tpmProperties.tpmProperty[i];
+        switch(property->property)
+        {
+        case TPM_PT_MANUFACTURER:
+            capabilities->manufacturer = property->value;
+            break;
+        case TPM_PT_FIRMWARE_VERSION_1:
+            capabilities->firmware_version_1 = property->value;
+            break;
+        case TPM_PT_FIRMWARE_VERSION_2:
+            capabilities->firmware_version_2 = property->value;
+            break;
+        case TPM_PT_INPUT_BUFFER:
+            capabilities->input_buffer = property->value;
+            break;
+        case TPM_PT_MAX_DIGEST:
+            capabilities->max_digest = property->value;
+            break;
+        default:
+            break;
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Re-establishes a context, which the calling process inherited over
+ *      fork. The connections of the parent are dropped without a TPM command,
+ *      so that its sessions stay valid, and the locks, the pending
+ *      asynchronous operation, the key cache and the statistics are reset.
+ *      With reopen, the child opens its own connections to the same devices,
+ *      with its own state directory, and seeds a selected DRBG again or
+ *      restarts the prefetch, so that it does not repeat the random numbers
+ *      of the parent. If the
+ *      connections cannot be opened, all calls fail until the context is
+ *      closed.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] reopen 1 to open new connections, 0 if the context is closed.
+ * @return UTA return code.
+ */
+static uta_rc tpm_check_fork(const uta_context_v1_t *tpm_context, int reopen)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    char *device_files[CONFIGURED_TPM_POOL_MAX];
+    size_t connections_per_device;
+    size_t num_devices;
+    size_t prefetch_size;
+    TPM_RC rc = 0;
+    uta_rc uta_ret = UTA_SUCCESS;
+    size_t i;
+
+    /* Fast path in the process, which opened the context */
+    if(uta_fork_detected(&tpm_context->fork_generation) == 0)
+    {
+        return UTA_SUCCESS;
+    }
+
+    uta_fork_lock();
+
+    /* Another thread of the child may have been faster */
+    if(uta_fork_detected(&tpm_context->fork_generation) == 0)
+    {
+        uta_fork_unlock();
+        return UTA_SUCCESS;
+    }
+
+    /* No device is left, if opening the connections failed before */
+    num_devices = tpm_context->num_devices;
+    if(num_devices == 0)
+    {
+        if(reopen == 0)
+        {
+            (void)uta_fork_init(&tpm_context_w->fork_generation);
+        }
+        uta_fork_unlock();
+        return (reopen == 0) ? UTA_SUCCESS : UTA_TA_ERROR;
+    }
+    connections_per_device = tpm_context->devices[0].num_connections;
+
+    for(i = 0; i < tpm_context->num_connections; i++)
+    {
+        tpm_forget_connection(&tpm_context_w->connections[i]);
+    }
+    tpm_context_w->num_connections = 0;
+    tpm_context_w->free_mask = 0;
+
+    for(i = 0; i < num_devices; i++)
+    {
+        /* The scheduler may be locked, it is initialized again on reopen */
+        device_files[i] = tpm_context->devices[i].device_file;
+        free(tpm_context_w->devices[i].data_dir);
+    }
+    tpm_context_w->num_devices = 0;
+
+#ifdef CONFIGURED_TPM_STATE_DIR
+    /* The state directory belongs to the parent and is removed by it */
+    free(tpm_context_w->state_dir);
+    tpm_context_w->state_dir = NULL;
+#endif
+
+    /* Threads of the parent may have held the locks during the fork */
+    (void)pthread_mutex_init(&tpm_context_w->accesslock, NULL);
+    (void)pthread_mutex_init(&tpm_context_w->asynclock, NULL);
+#ifdef ENABLE_DRBG
+    (void)pthread_mutex_init(&tpm_context_w->drbglock, NULL);
+#endif
+
+    /* The pipe is shared with the parent */
+    uta_async_free(&tpm_context_w->async);
+    if(uta_async_init(&tpm_context_w->async) != UTA_SUCCESS)
+    {
+        rc = TSS_RC_OUT_OF_MEMORY;
+    }
+
+    uta_key_cache_after_fork(&tpm_context_w->key_cache);
+    prefetch_size = uta_prefetch_after_fork(&tpm_context_w->prefetch);
+    uta_stats_reset(&tpm_context_w->stats);
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+    uta_latency_record_init(&tpm_context_w->latency_record);
+#endif
+
+    if((rc == 0) && (reopen != 0))
+    {
+        rc = tpm_open_connections(tpm_context,
+            (const char * const *)device_files, num_devices,
+            connections_per_device);
+    }
+
+    for(i = 0; i < num_devices; i++)
+    {
+        free(device_files[i]);
+    }
+
+#ifdef ENABLE_DRBG
+    /* Without new connections, the DRBG is cleared on close */
+    if((reopen != 0) && (tpm_context->drbg.seeded != 0))
+    {
+        if(rc == 0)
+        {
+            uta_ret = tpm_drbg_start(tpm_context,
+                tpm_context->drbg.reseed_bytes,
+                tpm_context->drbg.reseed_interval, UTA_DEADLINE_NONE);
+        }
+        else
+        {
+            tpm_drbg_stop(tpm_context);
+        }
+    }
+#endif
+
+    /* The child fills its own ring, the bytes of the parent are wiped */
+    if((reopen != 0) && (rc == 0) && (prefetch_size != 0))
+    {
+        uta_ret = uta_prefetch_start(&tpm_context_w->prefetch,
+            tpm_prefetch_fill, tpm_context_w, prefetch_size);
+    }
+
+    if(rc != 0)
+    {
+        uta_ret = UTA_TA_ERROR;
+    }
+    else
+    {
+        (void)uta_fork_init(&tpm_context_w->fork_generation);
+    }
+
+    uta_fork_unlock();
+
+    return uta_ret;
+}
+
+/**
+ * @brief Returns the directory of a device below base_dir. The first device
+ *      uses base_dir itself, every further device the subdirectory device<n>.
+ * @param[in] base_dir Directory of the first device.
+ * @param[in] device Index of the device.
+ * @return Allocated path, which must be freed by the caller, NULL on error.
+ */
+static char *tpm_device_dir(const char *base_dir, size_t device)
+{
+    char *dir;
+    size_t len;
+
+    if(device == 0)
+    {
+        return strdup(base_dir);
+    }
+
+    len = strlen(base_dir) + 32;
+    dir = malloc(len);
+    if(dir == NULL)
+    {
+        return NULL;
+    }
+    (void)snprintf(dir, len, "%s/device%zu", base_dir, device);
+
+    return dir;
+}
+
+/**
+ * @brief Returns the data directory of a device. Without TPM_IBM_STATE_DIR,
+ *      it is the directory of the device below the configured data directory.
+ *      Otherwise it is the directory of the device below the private state
+ *      directory of the context, into which the files of the provisioned
+ *      persistent keys are copied. The directory of a device n > 0 is created
+ *      if it does not exist. With a TSS built with TPM_TSS_NOFILE, the
+ *      directory is not used.
+ * @param[in] tpm_context Pointer to the internal context struct.
+ * @param[in] device Index of the device.
+ * @return Allocated path, which must be freed by the caller, NULL on error.
+ */
+static char *tpm_device_data_dir(const uta_context_v1_t *tpm_context,
+        size_t device)
+{
+#ifdef TPM_IBM_TSS_NOFILE
+    return tpm_device_dir(CONFIGURED_TPM_DATA_DIR, device);
+#else
+#ifdef CONFIGURED_TPM_STATE_DIR
+    char *provisioned_dir;
+#endif
+    char *data_dir;
+
+#ifdef CONFIGURED_TPM_STATE_DIR
+    data_dir = tpm_device_dir(tpm_context->state_dir, device);
+#else
+    data_dir = tpm_device_dir(CONFIGURED_TPM_DATA_DIR, device);
+#endif
+    if(data_dir == NULL)
+    {
+        return NULL;
+    }
+
+    /* The TSS stores the session state in the data directory */
+    if((device != 0) && (mkdir(data_dir, 0700) != 0) && (errno != EEXIST))
+    {
+        free(data_dir);
+        return NULL;
+    }
+
+#ifdef CONFIGURED_TPM_STATE_DIR
+    /* Missing files are recreated by the TSS, so errors are ignored */
+    provisioned_dir = tpm_device_dir(CONFIGURED_TPM_DATA_DIR, device);
+    if(provisioned_dir != NULL)
+    {
+        tpm_copy_provisioned(provisioned_dir, data_dir);
+        free(provisioned_dir);
+    }
+#endif
+
+    return data_dir;
+#endif
+}
+
+#ifdef CONFIGURED_TPM_STATE_DIR
+/**
+ * @brief Copies the names and public areas of the persistent objects (the
+ *      files h81*.bin and hp81*.bin), which the TSS stored during the
+ *      provisioning.
+ * @param[in] src_dir Configured data directory of the device.
+ * @param[in] dst_dir Data directory of the device in the state directory.
+ */
+static void tpm_copy_provisioned(const char *src_dir, const char *dst_dir)
+{
+    uint8_t buffer[4096];
+    struct dirent *entry;
+    struct stat st;
+    ssize_t len;
+    DIR *dir;
+    int dst_fd;
+    int src_fd;
+    int out_fd;
+    int in_fd;
+
+    dir = opendir(src_dir);
+    if(dir == NULL)
+    {
+        return;
+    }
+    src_fd = dirfd(dir);
+    dst_fd = open(dst_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dst_fd < 0)
+    {
+        (void)closedir(dir);
+        return;
+    }
+
+    while((entry = readdir(dir)) != NULL)
+    {
+        if((strncmp(entry->d_name, "h81", 3) != 0) &&
+           (strncmp(entry->d_name, "hp81", 4) != 0))
+        {
+            continue;
+        }
+
+        in_fd = openat(src_fd, entry->d_name, O_RDONLY | O_NOFOLLOW |
+            O_CLOEXEC);
+        if(in_fd < 0)
+        {
+            continue;
+        }
+        if((fstat(in_fd, &st) != 0) || !S_ISREG(st.st_mode) ||
+           (st.st_size > (off_t)sizeof(buffer)))
+        {
+            (void)close(in_fd);
+            continue;
+        }
+
+        len = read(in_fd, buffer, sizeof(buffer));
+        (void)close(in_fd);
+        if(len < 0)
+        {
+            continue;
+        }
+
+        out_fd = openat(dst_fd, entry->d_name, O_WRONLY | O_CREAT | O_EXCL |
+            O_NOFOLLOW | O_CLOEXEC, 0600);
+        if(out_fd < 0)
+        {
+            continue;
+        }
+        if(write(out_fd, buffer, (size_t)len) != len)
+        {
+            /* An incomplete copy is removed, the TSS reads the object */
+            (void)unlinkat(dst_fd, entry->d_name, 0);
+        }
+        (void)close(out_fd);
+    }
+
+    (void)close(dst_fd);
+    (void)closedir(dir);
+}
+
+/**
+ * @brief Removes a state directory with its files and the directories of the
+ *      further devices.
+ * @param[in] parent_fd Directory, relative to which path is opened.
+ * @param[in] path Path of the directory.
+ * @param[in] depth 0 for the state directory, 1 for a device directory.
+ */
+static void tpm_remove_dir(int parent_fd, const char *path, int depth)
+{
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+    int fd;
+
+    fd = openat(parent_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+        O_CLOEXEC);
+    if(fd < 0)
+    {
+        return;
+    }
+    dir = fdopendir(fd);
+    if(dir == NULL)
+    {
+        (void)close(fd);
+        return;
+    }
+
+    while((entry = readdir(dir)) != NULL)
+    {
+        if((strcmp(entry->d_name, ".") == 0) ||
+           (strcmp(entry->d_name, "..") == 0) ||
+           (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0))
+        {
+            continue;
+        }
+
+        if(S_ISDIR(st.st_mode))
+        {
+            if(depth == 0)
+            {
+                tpm_remove_dir(fd, entry->d_name, depth + 1);
+            }
+        }
+        else
+        {
+            (void)unlinkat(fd, entry->d_name, 0);
+        }
+    }
+    (void)closedir(dir);
+
+    (void)unlinkat(parent_fd, path, AT_REMOVEDIR);
+}
+#endif
+
+/**
+ * @brief Takes a free connection from the pool. The device is selected by the
+ *      number of outstanding requests, where failed devices and the devices
+ *      in tried_devices are only used if no other device is left. Ties are
+ *      resolved round-robin.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] tried_devices Bit mask of the devices, which already failed for
+ *      the current request.
+ * @param[in] op Operation of the access for the latency recording,
+ *      UTA_STATS_NUM_OPS if it is not recorded.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return Pointer to the connection, NULL on error or timeout.
+ */
+static tpm_connection_t *tpm_acquire_connection(
+        const uta_context_v1_t *tpm_context, uint64_t tried_devices,
+        uta_stats_op_t op, uint64_t deadline)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    uint64_t score;
+    uint64_t best_score = 0;
+    size_t best = 0;
+    size_t start;
+    size_t device;
+    size_t i;
+    int64_t now;
+
+    /* A single device needs no selection */
+    if(tpm_context->num_devices == 1)
+    {
+        return tpm_acquire_device_connection(tpm_context, 0, op, deadline);
+    }
+
+    now = tpm_now();
+    start = __atomic_fetch_add(&tpm_context_w->next_device, 1,
+        __ATOMIC_RELAXED);
+
+    for(i = 0; i < tpm_context->num_devices; i++)
+    {
+        device = (start + i) % tpm_context->num_devices;
+
+        score = __atomic_load_n(&tpm_context->devices[device].outstanding,
+            __ATOMIC_RELAXED);
+        if(__atomic_load_n(&tpm_context->devices[device].failed_until,
+            __ATOMIC_RELAXED) > now)
+        {
+            score += DEVICE_SCORE_FAILED;
+        }
+        if((tried_devices & ((uint64_t)1 << device)) != 0)
+        {
+            score += DEVICE_SCORE_TRIED;
+        }
+
+        if((i == 0) || (score < best_score))
+        {
+            best = device;
+            best_score = score;
+        }
+    }
+
+    return tpm_acquire_device_connection(tpm_context, best, op, deadline);
+}
+
+/**
+ * @brief Takes a free connection of the given device. Blocks until a
+ *      connection of the device is returned by another thread, if all of them
+ *      are in use, but not beyond the deadline.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] device Index of the device.
+ * @param[in] op Operation of the access for the latency recording.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return Pointer to the connection, NULL on error or timeout.
+ */
+static tpm_connection_t *tpm_acquire_device_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op, uint64_t deadline)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_device_t *tpm_device = &tpm_context_w->devices[device];
+
+    (void)__atomic_add_fetch(&tpm_device->outstanding, 1, __ATOMIC_RELAXED);
+
+    /*
+     * Wait until a connection is granted to the priority class of the call,
+     * the scheduler counts the bits in free_mask
+     */
+    if(uta_sched_acquire(&tpm_device->sched, &tpm_context_w->stats,
+        uta_sched_class(op), deadline) != UTA_SUCCESS)
     {
-        /* Release the accesslock mutex (ignore return code) */
-        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
-        return UTA_TA_ERROR;
+        (void)__atomic_sub_fetch(&tpm_device->outstanding, 1,
+            __ATOMIC_RELAXED);
+        return NULL;
     }
-    
-    rc = tpm_get_test_result(tpm_context, &testResult);
-    
-    /* Release the accesslock mutex (ignore return code) */
-    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
-    
-    if(rc != 0)
+
+    return tpm_claim_connection(tpm_context, device, op);
+}
+
+/**
+ * @brief Takes a free connection of the given device without blocking.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] device Index of the device.
+ * @param[in] op Operation of the access for the latency recording.
+ * @return Pointer to the connection, NULL if all connections are in use.
+ */
+static tpm_connection_t *tpm_try_acquire_device_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_device_t *tpm_device = &tpm_context_w->devices[device];
+
+    if(uta_sched_try_acquire(&tpm_device->sched, uta_sched_class(op)) != 0)
     {
-        return UTA_TA_ERROR;
+        return NULL;
     }
-    
-    if(testResult != 0)
+
+    (void)__atomic_add_fetch(&tpm_device->outstanding, 1, __ATOMIC_RELAXED);
+
+    return tpm_claim_connection(tpm_context, device, op);
+}
+
+/**
+ * @brief Claims a free connection of the given device, after the caller took
+ *      one unit of the scheduler of the device.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] device Index of the device.
+ * @param[in] op Operation of the access for the latency recording.
+ * @return Pointer to the connection.
+ */
+static tpm_connection_t *tpm_claim_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_device_t *tpm_device = &tpm_context_w->devices[device];
+    uint64_t device_mask;
+    uint64_t mask;
+    int index;
+
+    device_mask = (tpm_device->num_connections == 64) ? ~(uint64_t)0 :
+        (((uint64_t)1 << tpm_device->num_connections) - 1);
+    device_mask <<= tpm_device->first_connection;
+
+    /* Claim the highest free bit of the device */
+    mask = __atomic_load_n(&tpm_context_w->free_mask, __ATOMIC_ACQUIRE);
+    do
     {
-        return UTA_TA_ERROR;
+        index = 63 - __builtin_clzll(mask & device_mask);
+    } while(!__atomic_compare_exchange_n(&tpm_context_w->free_mask, &mask,
+        mask & ~((uint64_t)1 << index), 0, __ATOMIC_ACQUIRE,
+        __ATOMIC_ACQUIRE));
+
+    /* The trust anchor access is timed until the release */
+    tpm_context_w->connections[index].acquired = uta_stats_now();
+    tpm_context_w->connections[index].op = op;
+
+    return &tpm_context_w->connections[index];
+}
+
+/**
+ * @brief Returns a connection to the pool.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] connection Connection taken by tpm_acquire_connection or
+ *      tpm_acquire_device_connection.
+ */
+static void tpm_release_connection(const uta_context_v1_t *tpm_context,
+        tpm_connection_t *connection)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_device_t *tpm_device = &tpm_context_w->devices[connection->device];
+    size_t index = connection - tpm_context_w->connections;
+
+    uta_stats_ta_access(&tpm_context_w->stats, connection->acquired);
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+    uta_latency_record_add(&tpm_context_w->latency_record, connection->op,
+        uta_stats_now() - connection->acquired);
+#endif
+
+    (void)__atomic_fetch_or(&tpm_context_w->free_mask, (uint64_t)1 << index,
+        __ATOMIC_RELEASE);
+    uta_sched_release(&tpm_device->sched);
+    (void)__atomic_sub_fetch(&tpm_device->outstanding, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Marks the device of a connection as failed, so that other devices
+ *      are preferred for DEVICE_RETRY_INTERVAL seconds.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] connection Connection, on which a command failed.
+ */
+static void tpm_device_failed(const uta_context_v1_t *tpm_context,
+        const tpm_connection_t *connection)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    __atomic_store_n(&tpm_context_w->devices[connection->device].failed_until,
+        tpm_now() + DEVICE_RETRY_INTERVAL, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the seconds of the monotonic clock.
+ * @return Seconds since an unspecified starting point.
+ */
+static int64_t tpm_now(void)
+{
+    struct timespec now;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+    {
+        return 0;
     }
-    
+
+    return (int64_t)now.tv_sec;
+}
+
+/**
+ * @brief Checks the parameters of a key derivation.
+ * @param[in] len_key Requested number of key bytes.
+ * @param[in] len_dv Length in bytes of the derivation value.
+ * @param[in] key_slot Requested key slot.
+ * @return UTA return code.
+ */
+static uta_rc tpm_check_derive_args(size_t len_key, size_t len_dv,
+        uint8_t key_slot)
+{
+    if(key_slot > (USED_KEY_SLOTS-1))
+    {
+        return UTA_INVALID_KEY_SLOT;
+    }
+
+    if(len_dv != DERIV_STR_LEN)
+    {
+        return UTA_INVALID_DV_LENGTH;
+    }
+
+    if(len_key > 32)
+    {
+        return UTA_INVALID_KEY_LENGTH;
+    }
+
     return UTA_SUCCESS;
 }
-        
-/*******************************************************************************
- * Private function bodies
- ******************************************************************************/ 
+
+/**
+ * @brief Maps a key slot to the handle of the persistent TPM key.
+ * @param[in] key_slot Key slot, which has already been checked.
+ * @return Handle of the persistent TPM key.
+ */
+static uint32_t tpm_key_slot_handle(uint8_t key_slot)
+{
+    if(key_slot == 0x00)
+    {
+        return TPM_KEY0_HANDLE;
+    }
+    return TPM_KEY1_HANDLE;
+}
+
 /**
  * @brief Starts an HMAC session with the TPM.
- * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in,out] connection Pointer to the connection.
  * @return IBM TSS return code.
  */
-static uint32_t tpm_start_hmac_session(const uta_context_v1_t *tpm_context)
+static uint32_t tpm_start_hmac_session(tpm_connection_t *connection)
 {
-    /* This function needs writing access to the context */
-    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
-    
     TPM_RC rc = 0;
     StartAuthSession_In in;
     StartAuthSession_Out out;
@@ -530,57 +2621,372 @@ static uint32_t tpm_start_hmac_session(const uta_context_v1_t *tpm_context)
     TPMI_ALG_HASH halg = TPM_ALG_SHA256;
     TPMI_ALG_SYM algorithm = TPM_ALG_AES;
 
-    // Set up TPM input data structure
-    in.sessionType = TPM_SE_HMAC;
-    /* salt key */
-    in.tpmKey = tpmKey;
-    /* encryptedSalt (not required) */
-    in.encryptedSalt.b.size = 0;
-    /* bind handle */
-    in.bind = bindHandle;
-    /* nonceCaller (not required) */
-    in.nonceCaller.t.size = 0;
-    /* for parameter encryption */
-    in.symmetric.algorithm = algorithm;
-    /* authHash */
-    in.authHash = halg;
-    
-    /* Table 61 - Definition of (TPM_ALG_ID) TPMI_ALG_SYM Type */
-    /* Table 125 - Definition of TPMU_SYM_KEY_BITS Union */
-    in.symmetric.keyBits.aes = 128;
-    /* Table 126 - Definition of TPMU_SYM_MODE Union */
-    /* Table 63 - Definition of (TPM_ALG_ID) TPMI_ALG_SYM_MODE Type */
-    in.symmetric.mode.aes = TPM_ALG_CFB;
-    
-    /* 
-     * pass the bind password to the TSS post processor for the session key
-     * calculation 
-     */
-    extra.bindPassword = bindPassword;
+    // Set up TPM input data structure
+    in.sessionType = TPM_SE_HMAC;
+    /* salt key */
+    in.tpmKey = tpmKey;
+    /* encryptedSalt (not required) */
+    in.encryptedSalt.b.size = 0;
+    /* bind handle */
+    in.bind = bindHandle;
+    /* nonceCaller (not required) */
+    in.nonceCaller.t.size = 0;
+    /* for parameter encryption */
+    in.symmetric.algorithm = algorithm;
+    /* authHash */
+    in.authHash = halg;
+    
+    /* Table 61 - Definition of (TPM_ALG_ID) TPMI_ALG_SYM Type */
+    /* Table 125 - Definition of TPMU_SYM_KEY_BITS Union */
+    in.symmetric.keyBits.aes = 128;
+    /* Table 126 - Definition of TPMU_SYM_MODE Union */
+    /* Table 63 - Definition of (TPM_ALG_ID) TPMI_ALG_SYM_MODE Type */
+    in.symmetric.mode.aes = TPM_ALG_CFB;
+    
+    /* 
+     * pass the bind password to the TSS post processor for the session key
+     * calculation 
+     */
+    extra.bindPassword = bindPassword;
+
+    // Execute the command
+    UTA_TRACE_TPM_ENTRY(TPM_CC_StartAuthSession);
+    rc = TSS_Execute(connection->tssContext,
+             (RESPONSE_PARAMETERS *)&out, 
+             (COMMAND_PARAMETERS *)&in,
+             (EXTRA_PARAMETERS *)&extra,
+             TPM_CC_StartAuthSession,
+             TPM_RH_NULL, NULL, 0);
+    UTA_TRACE_TPM_RETURN(TPM_CC_StartAuthSession, rc);
+
+    if(rc == 0)
+    {
+        connection->authSessionHandle = out.sessionHandle;
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Replaces the HMAC session of a connection, which the TPM no longer
+ *      accepts, e.g. after a TPM reset or an eviction by the resource
+ *      manager. The TSS context is kept. The caller must own the connection.
+ * @param[in,out] connection Pointer to the connection. Without a session on
+ *      failure, so that the next call tries again.
+ * @return IBM TSS return code.
+ */
+static uint32_t tpm_recover_session(tpm_connection_t *connection)
+{
+    /* The old session may still be loaded, if only its nonces are lost */
+    if(connection->authSessionHandle != 0)
+    {
+        /* Try to close the HMAC session handle */
+        (void)tpm_flush_context(connection, connection->authSessionHandle);
+        connection->authSessionHandle = 0;
+    }
+
+    return tpm_start_hmac_session(connection);
+}
+
+/**
+ * @brief Checks if a TPM response code reports, that the HMAC session of a
+ *      connection cannot be used any more: the TPM does not know the session
+ *      or the nonces of the session are out of sync.
+ * @param[in] rc IBM TSS return code.
+ * @return 1 in case of a session error, 0 otherwise.
+ */
+static int tpm_is_session_error(TPM_RC rc)
+{
+    /* Return codes of the TSS itself are above the TPM response codes */
+    if(rc > 0xFFF)
+    {
+        return 0;
+    }
+
+    /* Session, which is not loaded */
+    if((rc >= TPM_RC_REFERENCE_S0) && (rc <= TPM_RC_REFERENCE_S6))
+    {
+        return 1;
+    }
+
+    /* Format one error of a session, a parameter number may also set bit 11 */
+    if(((rc & RC_FMT1) == 0) || ((rc & TPM_RC_P) != 0) ||
+       ((rc & TPM_RC_S) == 0))
+    {
+        return 0;
+    }
+    switch(rc & (RC_FMT1 | 0x3F))
+    {
+    case TPM_RC_HANDLE:
+    case TPM_RC_NONCE:
+    case TPM_RC_BAD_AUTH:
+    case TPM_RC_EXPIRED:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+#ifdef CONFIGURED_SESSION_CACHE_FILE
+/**
+ * @brief Loads the session saved by a previous process with ContextLoad. The
+ *      IBM TSS keeps the session state in its data directory, so the state
+ *      of the saved session is restored there first. A saved session, whose
+ *      state cannot be restored, is flushed. The session cache file is
+ *      removed in any case.
+ * @param[in,out] connection Pointer to the connection. The session is set on
+ *      success.
+ * @param[in] device Device of the connection.
+ * @return IBM TSS return code.
+ */
+static uint32_t tpm_load_session(tpm_connection_t *connection,
+        const tpm_device_t *device)
+{
+    uta_saved_session_t saved;
+    ContextLoad_In in;
+    ContextLoad_Out out;
+    TPM_RC rc = TSS_RC_NO_CONNECTION;
+
+    if(uta_session_cache_take(CONFIGURED_SESSION_CACHE_FILE, &saved) != 0)
+    {
+        return rc;
+    }
+
+    /* The TSS could not use the loaded session without its state */
+    if(tpm_restore_session_state(device, &saved) != 0)
+    {
+        (void)tpm_flush_context(connection, saved.saved_handle);
+    }
+    else if(saved.len_blob <= sizeof(in.context.contextBlob.t.buffer))
+    {
+        memset(&in, 0, sizeof(in));
+        in.context.sequence = saved.sequence;
+        in.context.savedHandle = saved.saved_handle;
+        in.context.hierarchy = saved.hierarchy;
+        in.context.contextBlob.t.size = saved.len_blob;
+        memcpy(in.context.contextBlob.t.buffer, saved.blob, saved.len_blob);
+
+        UTA_TRACE_TPM_ENTRY(TPM_CC_ContextLoad);
+        rc = TSS_Execute(connection->tssContext,
+                 (RESPONSE_PARAMETERS *)&out,
+                 (COMMAND_PARAMETERS *)&in,
+                 NULL,
+                 TPM_CC_ContextLoad,
+                 TPM_RH_NULL, NULL, 0);
+        UTA_TRACE_TPM_RETURN(TPM_CC_ContextLoad, rc);
+        if(rc == 0)
+        {
+            connection->authSessionHandle = out.loadedHandle;
+        }
+
+        uta_key_cache_zeroize(&in, sizeof(in));
+    }
+
+    uta_key_cache_zeroize(&saved, sizeof(saved));
+
+    return rc;
+}
+
+/**
+ * @brief Saves the session with ContextSave to the session cache file, unless
+ *      another process has already saved one. The state of the session in
+ *      the data directory of the TSS is saved along. If the session cannot be
+ *      stored, it is loaded again, so that it is flushed on close.
+ * @param[in,out] connection Pointer to the connection. The session is reset
+ *      to 0, if it has been saved.
+ * @param[in] device Device of the connection.
+ */
+static void tpm_save_session(tpm_connection_t *connection,
+        const tpm_device_t *device)
+{
+    uta_saved_session_t saved;
+    ContextSave_In in;
+    ContextSave_Out out;
+    ContextLoad_In load_in;
+    ContextLoad_Out load_out;
+    TPM_RC rc;
+    int stored = 1;
+
+    if(uta_session_cache_exists(CONFIGURED_SESSION_CACHE_FILE) != 0)
+    {
+        return;
+    }
+
+    in.saveHandle = connection->authSessionHandle;
+
+    UTA_TRACE_TPM_ENTRY(TPM_CC_ContextSave);
+    rc = TSS_Execute(connection->tssContext,
+             (RESPONSE_PARAMETERS *)&out,
+             (COMMAND_PARAMETERS *)&in,
+             NULL,
+             TPM_CC_ContextSave,
+             TPM_RH_NULL, NULL, 0);
+    UTA_TRACE_TPM_RETURN(TPM_CC_ContextSave, rc);
+    if(rc != 0)
+    {
+        return;
+    }
+
+    /* A saved session is not loaded anymore */
+    connection->authSessionHandle = 0;
+
+    if(out.context.contextBlob.t.size <= sizeof(saved.blob))
+    {
+        saved.sequence = out.context.sequence;
+        saved.saved_handle = out.context.savedHandle;
+        saved.hierarchy = out.context.hierarchy;
+        saved.len_blob = out.context.contextBlob.t.size;
+        memcpy(saved.blob, out.context.contextBlob.t.buffer, saved.len_blob);
+        stored = tpm_read_session_state(device, in.saveHandle, &saved);
+        if(stored == 0)
+        {
+            stored = uta_session_cache_put(CONFIGURED_SESSION_CACHE_FILE,
+                &saved);
+        }
+        uta_key_cache_zeroize(&saved, sizeof(saved));
+    }
+
+    if(stored != 0)
+    {
+        load_in.context = out.context;
+
+        UTA_TRACE_TPM_ENTRY(TPM_CC_ContextLoad);
+        rc = TSS_Execute(connection->tssContext,
+                 (RESPONSE_PARAMETERS *)&load_out,
+                 (COMMAND_PARAMETERS *)&load_in,
+                 NULL,
+                 TPM_CC_ContextLoad,
+                 TPM_RH_NULL, NULL, 0);
+        UTA_TRACE_TPM_RETURN(TPM_CC_ContextLoad, rc);
+        if(rc == 0)
+        {
+            connection->authSessionHandle = load_out.loadedHandle;
+        }
+        uta_key_cache_zeroize(&load_in, sizeof(load_in));
+    }
+
+    uta_key_cache_zeroize(&out, sizeof(out));
+}
+
+/**
+ * @brief Reads the state of a session, which the IBM TSS keeps in the file
+ *      h<handle>.bin of its data directory. Only the private state directory
+ *      of a context is removed on close, the configured data directory keeps
+ *      the file for the next process.
+ * @param[in] device Device of the session.
+ * @param[in] handle Handle of the session.
+ * @param[out] saved Saved session, whose state is set.
+ * @return 0 on success, 1 otherwise.
+ */
+static int tpm_read_session_state(const tpm_device_t *device,
+        uint32_t handle, uta_saved_session_t *saved)
+{
+#ifdef CONFIGURED_TPM_STATE_DIR
+    char path[4096];
+    struct stat st;
+    ssize_t len;
+    int fd;
+    int ret;
+
+    saved->len_state = 0;
+
+    ret = snprintf(path, sizeof(path), "%s/h%08x.bin", device->data_dir,
+        (unsigned int)handle);
+    if((ret < 0) || ((size_t)ret >= sizeof(path)))
+    {
+        return 1;
+    }
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return 1;
+    }
+    if((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) ||
+       (st.st_size > (off_t)sizeof(saved->state)))
+    {
+        (void)close(fd);
+        return 1;
+    }
+
+    len = read(fd, saved->state, sizeof(saved->state));
+    (void)close(fd);
+    if((len < 0) || (len != st.st_size))
+    {
+        return 1;
+    }
+    saved->len_state = (uint16_t)len;
+
+    return 0;
+#else
+    (void)device;
+    (void)handle;
+
+    saved->len_state = 0;
+
+    return 0;
+#endif
+}
+
+/**
+ * @brief Writes the state of a saved session into the data directory of the
+ *      TSS, where tpm_read_session_state has read it in the previous process.
+ * @param[in] device Device of the connection, which loads the session.
+ * @param[in] saved Saved session.
+ * @return 0 on success, 1 otherwise.
+ */
+static int tpm_restore_session_state(const tpm_device_t *device,
+        const uta_saved_session_t *saved)
+{
+#ifdef CONFIGURED_TPM_STATE_DIR
+    char path[4096];
+    int fd;
+    int ret;
 
-    // Execute the command
-    rc = TSS_Execute(tpm_context->tssContext,
-             (RESPONSE_PARAMETERS *)&out, 
-             (COMMAND_PARAMETERS *)&in,
-             (EXTRA_PARAMETERS *)&extra,
-             TPM_CC_StartAuthSession,
-             TPM_RH_NULL, NULL, 0);
+    if(saved->len_state == 0)
+    {
+        return 1;
+    }
 
-    if(rc == 0)
+    ret = snprintf(path, sizeof(path), "%s/h%08x.bin", device->data_dir,
+        (unsigned int)saved->saved_handle);
+    if((ret < 0) || ((size_t)ret >= sizeof(path)))
     {
-        tpm_context_w->authSessionHandle = out.sessionHandle;
+        return 1;
     }
 
-    return rc;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+        0600);
+    if(fd < 0)
+    {
+        return 1;
+    }
+    ret = (write(fd, saved->state, saved->len_state) ==
+        (ssize_t)saved->len_state) ? 0 : 1;
+    (void)close(fd);
+    if(ret != 0)
+    {
+        /* An incomplete file is removed, the session is not loaded */
+        (void)unlink(path);
+    }
+
+    return ret;
+#else
+    (void)device;
+    (void)saved;
+
+    return 0;
+#endif
 }
+#endif
 
 /**
  * @brief Closes an HMAC session with the TPM.
- * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in,out] connection Pointer to the connection.
  * @param[in] handle_number Specifies the session to close.
  * @return IBM TSS return code.
  */
-static uint32_t tpm_flush_context(const uta_context_v1_t *tpm_context,
+static uint32_t tpm_flush_context(const tpm_connection_t *connection,
         uint32_t handle_number)
 {
     TPM_RC rc = 0;
@@ -588,26 +2994,31 @@ static uint32_t tpm_flush_context(const uta_context_v1_t *tpm_context,
     in.flushHandle = handle_number;
 
     /* call TSS to execute the command */
-    rc = TSS_Execute(tpm_context->tssContext,
+    UTA_TRACE_TPM_ENTRY(TPM_CC_FlushContext);
+    rc = TSS_Execute(connection->tssContext,
              NULL, 
              (COMMAND_PARAMETERS *)&in,
              NULL,
              TPM_CC_FlushContext,
              TPM_RH_NULL, NULL, 0);
+    UTA_TRACE_TPM_RETURN(TPM_CC_FlushContext, rc);
 
     return rc;
 }
 
 /**
- * @brief Calculates an HMAC-SHA256 on the TPM.
- * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @brief Calculates an HMAC-SHA256 on the TPM. If the TPM reports a session
+ *      error, the session is started again and the HMAC is retried once.
+ * @param[in,out] connection Pointer to the connection.
  * @param[out] hmac Pointer to the output buffer.
  * @param[in] deriv_val Pointer to the buffer containing the derivation value.
  * @param[in] hmacKeyHandle Specifies the master key of the HMAC function.
+ * @param[in] attributes Attributes of the HMAC session.
  * @return IBM TSS return code.
  */
-static uint32_t tpm_calc_hmac(const uta_context_v1_t *tpm_context,
-        uint8_t *hmac, const uint8_t *deriv_val, uint32_t hmacKeyHandle)
+static uint32_t tpm_calc_hmac(tpm_connection_t *connection,
+        uint8_t *hmac, const uint8_t *deriv_val, uint32_t hmacKeyHandle,
+        unsigned int attributes)
 {
     TPM_RC rc = 0;
     HMAC_In in;
@@ -615,13 +3026,23 @@ static uint32_t tpm_calc_hmac(const uta_context_v1_t *tpm_context,
     TPMI_DH_OBJECT keyHandle = hmacKeyHandle;
     TPMI_ALG_HASH halg = TPM_ALG_SHA256;
     const char *keyPassword = NULL;
-    TPMI_SH_AUTH_SESSION sessionHandle0 = tpm_context->authSessionHandle;
-     /* Command/Response encryption */
-    unsigned int sessionAttributes0 = 0x61;
+    TPMI_SH_AUTH_SESSION sessionHandle0;
+    unsigned int sessionAttributes0 = attributes;
     TPMI_SH_AUTH_SESSION sessionHandle1 = TPM_RH_NULL;
     unsigned int sessionAttributes1 = 0;
     TPMI_SH_AUTH_SESSION sessionHandle2 = TPM_RH_NULL;
     unsigned int sessionAttributes2 = 0;
+    int retry;
+
+    /* Start the session again, if an earlier recovery has failed */
+    if(connection->authSessionHandle == 0)
+    {
+        rc = tpm_recover_session(connection);
+        if(rc != 0)
+        {
+            return rc;
+        }
+    }
 
     // Set up TPM input data structure
     in.handle = keyHandle;
@@ -629,16 +3050,35 @@ static uint32_t tpm_calc_hmac(const uta_context_v1_t *tpm_context,
     memcpy(in.buffer.t.buffer, deriv_val, DERIV_STR_LEN);
     in.hashAlg = halg;
 
-    // Execute the command
-    rc = TSS_Execute(tpm_context->tssContext,
-                     (RESPONSE_PARAMETERS *)&out,
-                     (COMMAND_PARAMETERS *)&in,
-                     NULL,
-                     TPM_CC_HMAC,
-                     sessionHandle0, keyPassword, sessionAttributes0,
-                     sessionHandle1, NULL, sessionAttributes1,
-                     sessionHandle2, NULL, sessionAttributes2,
-                     TPM_RH_NULL, NULL, 0);
+    for(retry = 0; retry < 2; retry++)
+    {
+        sessionHandle0 = connection->authSessionHandle;
+
+        // Execute the command
+        UTA_TRACE_TPM_ENTRY(TPM_CC_HMAC);
+        rc = TSS_Execute(connection->tssContext,
+                         (RESPONSE_PARAMETERS *)&out,
+                         (COMMAND_PARAMETERS *)&in,
+                         NULL,
+                         TPM_CC_HMAC,
+                         sessionHandle0, keyPassword, sessionAttributes0,
+                         sessionHandle1, NULL, sessionAttributes1,
+                         sessionHandle2, NULL, sessionAttributes2,
+                         TPM_RH_NULL, NULL, 0);
+        UTA_TRACE_TPM_RETURN(TPM_CC_HMAC, rc);
+
+        if((rc == 0) || (retry > 0) || (tpm_is_session_error(rc) == 0))
+        {
+            break;
+        }
+
+        /* The TPM lost the session, start a new one */
+        rc = tpm_recover_session(connection);
+        if(rc != 0)
+        {
+            break;
+        }
+    }
 
     if(rc == 0)
     {
@@ -650,71 +3090,189 @@ static uint32_t tpm_calc_hmac(const uta_context_v1_t *tpm_context,
 }
 
 /**
- * @brief Requests random numbers from the TPM.
- * @param[in,out] tpm_context Pointer to the internal context struct.
- * @param[out] randomValue Pointer to the output buffer.
- * @param[in] len_random Desired number of random bytes.
+ * @brief Requests the next len_random random bytes of a request from the TPM.
+ *      Each command requests as many of these bytes as fit into a response
+ *      and the response is scattered directly to the buffers at the cursor.
+ *      If the TPM reports a session error, the session is started again and
+ *      the failed command is retried once.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[in,out] cursor Position of the request in its buffers, which is
+ *      advanced by the bytes read.
+ * @param[in] len_random Number of bytes, at most the remaining bytes of the
+ *      request.
+ * @param[in] attributes Attributes of the HMAC session.
  * @return IBM TSS return code.
  */
-static uint32_t tpm_get_rand(const uta_context_v1_t *tpm_context,
-        uint8_t *randomValue, size_t len_random)
+static uint32_t tpm_get_rand(tpm_connection_t *connection,
+        uta_random_cursor_t *cursor, size_t len_random,
+        unsigned int attributes)
 {
     TPM_RC rc = 0;
     GetRandom_In in;
     GetRandom_Out out;
-    uint32_t bytesRequested = len_random;
-    uint32_t bytesCopied;
-    TPMI_SH_AUTH_SESSION sessionHandle0 = tpm_context->authSessionHandle;
-    unsigned int sessionAttributes0 = 0x41; /* Response encryption */
+    size_t remaining = len_random;
+    TPMI_SH_AUTH_SESSION sessionHandle0;
+    unsigned int sessionAttributes0 = attributes;
     TPMI_SH_AUTH_SESSION sessionHandle1 = TPM_RH_NULL;
     unsigned int sessionAttributes1 = 0;
     TPMI_SH_AUTH_SESSION sessionHandle2 = TPM_RH_NULL;
     unsigned int sessionAttributes2 = 0;
-    
+    uint8_t recovered = 0;
+
+    /* Start the session again, if an earlier recovery has failed */
+    if(connection->authSessionHandle == 0)
+    {
+        rc = tpm_recover_session(connection);
+    }
+
     /* Get random bytes from TPM */
-    for (bytesCopied = 0; (rc == 0) && (bytesCopied < bytesRequested) ; )
+    while ((rc == 0) && (remaining > 0))
     {
-        /* Request whatever is left */
-        if (rc == 0)
+        sessionHandle0 = connection->authSessionHandle;
+
+        /* Request whatever is left, up to the size of a response */
+        in.bytesRequested = (remaining > sizeof(out.randomBytes.t.buffer)) ?
+            sizeof(out.randomBytes.t.buffer) : (UINT16)remaining;
+        if((connection->max_random > 0) &&
+           (in.bytesRequested > connection->max_random))
         {
-            in.bytesRequested = bytesRequested - bytesCopied;
+            in.bytesRequested = (UINT16)connection->max_random;
         }
+
         /* call TSS to execute the command */
-        if (rc == 0)
+        UTA_TRACE_TPM_ENTRY(TPM_CC_GetRandom);
+        rc = TSS_Execute(connection->tssContext,
+                 (RESPONSE_PARAMETERS *)&out,
+                 (COMMAND_PARAMETERS *)&in,
+                 NULL,
+                 TPM_CC_GetRandom,
+                 sessionHandle0, NULL, sessionAttributes0,
+                 sessionHandle1, NULL, sessionAttributes1,
+                 sessionHandle2, NULL, sessionAttributes2,
+                 TPM_RH_NULL, NULL, 0);
+        UTA_TRACE_TPM_RETURN(TPM_CC_GetRandom, rc);
+
+        /* The TPM lost the session, start a new one and repeat the command */
+        if ((rc != 0) && (recovered == 0) && (tpm_is_session_error(rc) != 0))
         {
-            rc = TSS_Execute(tpm_context->tssContext,
-                     (RESPONSE_PARAMETERS *)&out, 
-                     (COMMAND_PARAMETERS *)&in,
-                     NULL,
-                     TPM_CC_GetRandom,
-                     sessionHandle0, NULL, sessionAttributes0,
-                     sessionHandle1, NULL, sessionAttributes1,
-                     sessionHandle2, NULL, sessionAttributes2,
-                     TPM_RH_NULL, NULL, 0);
+            recovered = 1;
+            rc = tpm_recover_session(connection);
+            continue;
         }
+
+        /* An empty response would never complete the request */
+        if ((rc == 0) && ((out.randomBytes.t.size == 0) ||
+            (out.randomBytes.t.size > in.bytesRequested)))
+        {
+            rc = TSS_RC_MALFORMED_RESPONSE;
+        }
+
         if (rc == 0)
         {
-            size_t br;
-            /* copy as many bytes as were received or until bytes requested */
-            for (br = 0 ; (br < out.randomBytes.t.size) &&
-                    (bytesCopied < bytesRequested) ; br++)
-            {
-                randomValue[bytesCopied] = out.randomBytes.t.buffer[br];
-                bytesCopied++;
-            }
+            /* Scatter the response, empty buffers are skipped */
+            uta_random_cursor_scatter(cursor, out.randomBytes.t.buffer,
+                out.randomBytes.t.size);
+            remaining -= out.randomBytes.t.size;
+
+            /* Each command of the request may be retried once */
+            recovered = 0;
         }
     }
-    
+
     return rc;
 }
 
 /**
- * @brief Creates a new primary key under the endorsement hierarchy.
+ * @brief Returns the session attributes of a parameter encryption mode for a
+ *      command with a command and a response parameter.
+ * @param[in] mode Parameter encryption mode.
+ * @return Session attributes, which continue the session.
+ */
+static uint8_t tpm_session_attributes(uta_param_enc_t mode)
+{
+    switch(mode)
+    {
+    case UTA_PARAM_ENC_RESPONSE:
+        return SESSION_CONTINUE | SESSION_ENCRYPT;
+    case UTA_PARAM_ENC_AUDIT:
+        /* A session without authorization needs one of the attributes */
+        return SESSION_CONTINUE | SESSION_AUDIT;
+    default:
+        return SESSION_CONTINUE | SESSION_ENCRYPT | SESSION_DECRYPT;
+    }
+}
+
+/**
+ * @brief Reads random numbers from a connection of the pool. The request is
+ *      read in slices of UTA_SCHED_SLICE_LEN bytes. Between two slices, the
+ *      connection is given back to the pool, while a call of the high
+ *      priority class waits for the device, and the request continues on
+ *      the next connection granted to it. If the device fails, the rest of
+ *      the request is repeated on another device.
  * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in,out] cursor Position in the buffers, where the random numbers are
+ *      written to. Nothing is read, if no bytes are remaining.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return IBM TSS return code.
+ */
+static uint32_t tpm_pool_get_rand(const uta_context_v1_t *tpm_context,
+        uta_random_cursor_t *cursor, uint64_t deadline)
+{
+    tpm_connection_t *connection;
+    TPM_RC rc = 0;
+    uint64_t tried_devices = 0;
+    size_t attempt = 0;
+    unsigned int attributes =
+        __atomic_load_n(&tpm_context->attributes_random, __ATOMIC_RELAXED);
+
+    /* Continue on the next connection, each device is tried once on failure */
+    while(cursor->remaining > 0)
+    {
+        /* Take a free connection from the pool */
+        connection = tpm_acquire_connection(tpm_context, tried_devices,
+            UTA_STATS_GET_RANDOM, deadline);
+        if (connection == NULL)
+        {
+            return TSS_RC_NO_CONNECTION;
+        }
+
+        do
+        {
+            rc = tpm_get_rand(connection, cursor,
+                uta_random_cursor_slice(cursor), attributes);
+        } while((rc == 0) && (cursor->remaining > 0) &&
+            (uta_sched_preempted(
+            &tpm_context->devices[connection->device].sched) == 0));
+
+        if(rc != 0)
+        {
+            tpm_device_failed(tpm_context, connection);
+            tried_devices |= (uint64_t)1 << connection->device;
+            attempt++;
+        }
+
+        /* Return the connection to the pool */
+        tpm_release_connection(tpm_context, connection);
+
+        /* No time is left for another device after the deadline */
+        if((rc != 0) && ((uta_deadline_expired(deadline) != 0) ||
+           (attempt == tpm_context->num_devices)))
+        {
+            break;
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Creates a new primary key under the endorsement hierarchy.
+ * @param[in,out] connection Pointer to the connection.
  * @param[out] handle Handle number of the created key.
  * @return IBM TSS return code.
  */
-static uint32_t tpm_create_endosement_key(const uta_context_v1_t *tpm_context,
+static uint32_t tpm_create_endosement_key(const tpm_connection_t *connection,
         uint32_t *handle)
 {
     TPM_RC rc = 0;
@@ -764,7 +3322,8 @@ static uint32_t tpm_create_endosement_key(const uta_context_v1_t *tpm_context,
     in.creationPCR.count = 0;
     
     /* call TSS to execute the command */
-    rc = TSS_Execute(tpm_context->tssContext,
+    UTA_TRACE_TPM_ENTRY(TPM_CC_CreatePrimary);
+    rc = TSS_Execute(connection->tssContext,
         (RESPONSE_PARAMETERS *)&out,
         (COMMAND_PARAMETERS *)&in,
         NULL,
@@ -773,6 +3332,7 @@ static uint32_t tpm_create_endosement_key(const uta_context_v1_t *tpm_context,
         sessionHandle1, NULL, sessionAttributes1,
         sessionHandle2, NULL, sessionAttributes2,
         TPM_RH_NULL, NULL, 0);
+    UTA_TRACE_TPM_RETURN(TPM_CC_CreatePrimary, rc);
 
     if (rc == 0)
     {
@@ -784,10 +3344,10 @@ static uint32_t tpm_create_endosement_key(const uta_context_v1_t *tpm_context,
 
 /**
  * @brief Starts the TPM self test.
- * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in,out] connection Pointer to the connection.
  * @return IBM TSS return code.
  */
-static uint32_t tpm_start_selftest(const uta_context_v1_t *tpm_context)
+static uint32_t tpm_start_selftest(const tpm_connection_t *connection)
 {
     TPM_RC rc = 0;
     SelfTest_In in;
@@ -795,35 +3355,73 @@ static uint32_t tpm_start_selftest(const uta_context_v1_t *tpm_context)
     /* call TSS to execute the command */
     in.fullTest = YES;
 
-    rc = TSS_Execute(tpm_context->tssContext,
+    UTA_TRACE_TPM_ENTRY(TPM_CC_SelfTest);
+    rc = TSS_Execute(connection->tssContext,
         NULL, 
         (COMMAND_PARAMETERS *)&in,
         NULL,
         TPM_CC_SelfTest,
         TPM_RH_NULL, NULL, 0);
+    UTA_TRACE_TPM_RETURN(TPM_CC_SelfTest, rc);
+
+    return rc;
+}
+
+/**
+ * @brief Starts the incremental TPM self test of the algorithms used by UTA:
+ *      HMAC-SHA256 for the key derivation, AES-CFB and ECDH for the salted
+ *      sessions.
+ * @param[in,out] connection Pointer to the connection.
+ * @return IBM TSS return code.
+ */
+static uint32_t tpm_incremental_selftest(const tpm_connection_t *connection)
+{
+    TPM_RC rc = 0;
+    IncrementalSelfTest_In in;
+    IncrementalSelfTest_Out out;
+
+    /* call TSS to execute the command */
+    in.toTest.count = 6;
+    in.toTest.algorithms[0] = TPM_ALG_SHA256;
+    in.toTest.algorithms[1] = TPM_ALG_HMAC;
+    in.toTest.algorithms[2] = TPM_ALG_AES;
+    in.toTest.algorithms[3] = TPM_ALG_CFB;
+    in.toTest.algorithms[4] = TPM_ALG_ECC;
+    in.toTest.algorithms[5] = TPM_ALG_ECDH;
+
+    UTA_TRACE_TPM_ENTRY(TPM_CC_IncrementalSelfTest);
+    rc = TSS_Execute(connection->tssContext,
+        (RESPONSE_PARAMETERS *)&out,
+        (COMMAND_PARAMETERS *)&in,
+        NULL,
+        TPM_CC_IncrementalSelfTest,
+        TPM_RH_NULL, NULL, 0);
+    UTA_TRACE_TPM_RETURN(TPM_CC_IncrementalSelfTest, rc);
 
     return rc;
 }
 
 /**
  * @brief Reads the output of the TPM self test.
- * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in,out] connection Pointer to the connection.
  * @param[out] testResult Output of the TPM self test.
  * @return IBM TSS return code.
  */
-static uint32_t tpm_get_test_result(const uta_context_v1_t *tpm_context,
+static uint32_t tpm_get_test_result(const tpm_connection_t *connection,
         TPM_RC *testResult)
 {
     TPM_RC rc = 0;
     GetTestResult_Out out;
 
     /* call TSS to execute the command */
-    rc = TSS_Execute(tpm_context->tssContext,
+    UTA_TRACE_TPM_ENTRY(TPM_CC_GetTestResult);
+    rc = TSS_Execute(connection->tssContext,
         (RESPONSE_PARAMETERS *)&out,
         NULL,
         NULL,
         TPM_CC_GetTestResult,
         TPM_RH_NULL, NULL, 0);
+    UTA_TRACE_TPM_RETURN(TPM_CC_GetTestResult, rc);
 
     if(rc == 0)
     {
@@ -832,3 +3430,262 @@ static uint32_t tpm_get_test_result(const uta_context_v1_t *tpm_context,
 
     return rc;
 }
+
+/**
+ * @brief Sends the self test command to each device and marks the self test
+ *      as running. The TPM may test in the background, the result is polled
+ *      by tpm_poll_self_test.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] mode Mode of the self test.
+ * @return UTA return code.
+ */
+static uta_rc tpm_begin_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_connection_t *connection;
+    TPM_RC rc;
+    size_t device;
+
+    uta_self_test_started(&tpm_context_w->self_test, mode);
+
+    for(device = 0; device < tpm_context->num_devices; device++)
+    {
+        connection = tpm_acquire_device_connection(tpm_context, device,
+            UTA_STATS_SELF_TEST, UTA_DEADLINE_NONE);
+        if(connection == NULL)
+        {
+            return uta_self_test_finished(&tpm_context_w->self_test, mode,
+                UTA_TA_ERROR);
+        }
+
+        if(mode == UTA_SELF_TEST_INCREMENTAL)
+        {
+            rc = tpm_incremental_selftest(connection);
+        }
+        else
+        {
+            rc = tpm_start_selftest(connection);
+        }
+
+        /* The TPM is still testing since an earlier command */
+        if(rc == TPM_RC_TESTING)
+        {
+            rc = 0;
+        }
+
+        if(rc != 0)
+        {
+            tpm_device_failed(tpm_context, connection);
+        }
+
+        tpm_release_connection(tpm_context, connection);
+
+        if(rc != 0)
+        {
+            return uta_self_test_finished(&tpm_context_w->self_test, mode,
+                UTA_TA_ERROR);
+        }
+    }
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Reads the test result of each device on a free connection. The
+ *      result is stored, as soon as one device failed or all devices finished
+ *      testing. Busy devices are asked again on the next call.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] mode Mode of the running self test.
+ */
+static void tpm_poll_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_connection_t *connection;
+    TPM_RC testResult;
+    TPM_RC rc;
+    size_t device;
+    uta_rc device_rc;
+    uta_rc uta_ret = UTA_SUCCESS;
+
+    for(device = 0; device < tpm_context->num_devices; device++)
+    {
+        connection = tpm_try_acquire_device_connection(tpm_context, device,
+            UTA_STATS_SELF_TEST);
+        if(connection == NULL)
+        {
+            uta_ret = UTA_TRY_AGAIN;
+            continue;
+        }
+
+        rc = tpm_get_test_result(connection, &testResult);
+
+        device_rc = UTA_TA_ERROR;
+        if(rc == 0)
+        {
+            device_rc = tpm_test_result_rc(testResult);
+        }
+        else
+        {
+            tpm_device_failed(tpm_context, connection);
+        }
+
+        tpm_release_connection(tpm_context, connection);
+
+        if(device_rc == UTA_TA_ERROR)
+        {
+            uta_ret = UTA_TA_ERROR;
+            break;
+        }
+        if(device_rc == UTA_TRY_AGAIN)
+        {
+            uta_ret = UTA_TRY_AGAIN;
+        }
+    }
+
+    if(uta_ret != UTA_TRY_AGAIN)
+    {
+        (void)uta_self_test_finished(&tpm_context_w->self_test, mode,
+            uta_ret);
+    }
+}
+
+/**
+ * @brief Maps the testResult of TPM2_GetTestResult to a uta_rc. Algorithms,
+ *      which have not been tested yet, do not fail an incremental self test.
+ * @param[in] testResult Test result of the TPM.
+ * @return UTA_SUCCESS, UTA_TRY_AGAIN while testing or UTA_TA_ERROR.
+ */
+static uta_rc tpm_test_result_rc(TPM_RC testResult)
+{
+    if((testResult == 0) || (testResult == TPM_RC_NEEDS_TEST))
+    {
+        return UTA_SUCCESS;
+    }
+
+    if(testResult == TPM_RC_TESTING)
+    {
+        return UTA_TRY_AGAIN;
+    }
+
+    return UTA_TA_ERROR;
+}
+
+#ifdef ENABLE_DRBG
+/**
+ * @brief Seeds the DRBG from the TPM and selects it for the random requests.
+ *      The caller holds the accesslock or is the only thread of the context.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] reseed_bytes Output bytes until the next reseed.
+ * @param[in] reseed_interval Seconds until the next reseed.
+ * @param[in] deadline Deadline of the call, which seeds the DRBG.
+ * @return UTA return code.
+ */
+static uta_rc tpm_drbg_start(const uta_context_v1_t *tpm_context,
+        uint64_t reseed_bytes, uint32_t reseed_interval, uint64_t deadline)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    uta_rc uta_ret;
+
+    /* Lock the DRBG state with the drbglock mutex */
+    uta_ret = uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->drbglock, deadline);
+    if(uta_ret != UTA_SUCCESS)
+    {
+        return uta_ret;
+    }
+
+    tpm_context_w->drbg_deadline = deadline;
+    uta_ret = uta_drbg_seed(&tpm_context_w->drbg, tpm_drbg_entropy,
+        tpm_context_w, reseed_bytes, reseed_interval);
+    if(uta_ret != UTA_SUCCESS)
+    {
+        uta_ret = uta_deadline_rc(deadline);
+    }
+
+    /* A failed seed leaves the DRBG cleared */
+    __atomic_store_n(&tpm_context_w->drbg_active, tpm_context->drbg.seeded,
+        __ATOMIC_RELEASE);
+
+    /* Release the drbglock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->drbglock);
+
+    return uta_ret;
+}
+
+/**
+ * @brief Clears the DRBG, the random requests are read from the TPM again.
+ *      The caller holds the accesslock or is the only thread of the context.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ */
+static void tpm_drbg_stop(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    /* A running request finishes first (ignore return code) */
+    (void)pthread_mutex_lock(&tpm_context_w->drbglock);
+    __atomic_store_n(&tpm_context_w->drbg_active, 0, __ATOMIC_RELAXED);
+    uta_drbg_free(&tpm_context_w->drbg);
+    (void)pthread_mutex_unlock(&tpm_context_w->drbglock);
+}
+
+/**
+ * @brief Entropy callback of the DRBG, which reads from the TPM. It is called
+ *      while the drbglock is held.
+ * @param[in,out] p_entropy Pointer to the internal context struct.
+ * @param[out] output Buffer for the entropy.
+ * @param[in] len Number of entropy bytes.
+ * @return 0 on success, an mbedtls error code otherwise.
+ */
+static int tpm_drbg_entropy(void *p_entropy, unsigned char *output,
+        size_t len)
+{
+    const uta_context_v1_t *tpm_context = (const uta_context_v1_t *)p_entropy;
+    uta_random_buffer_v1_t buffer = { .random = output, .len_random = len };
+    uta_random_cursor_t cursor;
+
+    uta_random_cursor_init(&cursor, &buffer, 1);
+
+    /* The entropy is read within the deadline of the call, which reseeds */
+    if(tpm_pool_get_rand(tpm_context, &cursor,
+       tpm_context->drbg_deadline) != 0)
+    {
+        return MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+    }
+
+    return 0;
+}
+#endif
+
+/**
+ * @brief Fill callback of the prefetch ring, which reads from the TPM on the
+ *      background thread. It waits for a connection without limit, but gives
+ *      it back between two slices like every bulk random request.
+ * @param[in,out] p_fill Pointer to the internal context struct.
+ * @param[out] output Buffer for the random numbers.
+ * @param[in] len Number of random bytes.
+ * @return 0 on success, -1 otherwise.
+ */
+static int tpm_prefetch_fill(void *p_fill, uint8_t *output, size_t len)
+{
+    const uta_context_v1_t *tpm_context = (const uta_context_v1_t *)p_fill;
+    uta_random_buffer_v1_t buffer = { .random = output, .len_random = len };
+    uta_random_cursor_t cursor;
+
+    uta_random_cursor_init(&cursor, &buffer, 1);
+
+    if(tpm_pool_get_rand(tpm_context, &cursor, UTA_DEADLINE_NONE) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
@@ -56,40 +56,283 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
+#include <semaphore.h>
 
 #include <config.h>
+#include <uta_config.h>
 #include <tpm_tcg.h>
+#include <uta_uuid_cache.h>
+#include <uta_key_cache.h>
+#ifdef CONFIGURED_SESSION_CACHE_FILE
+#include <uta_session_cache.h>
+#endif
+#include <uta_stats.h>
+#include <uta_deadline.h>
+#include <uta_sched.h>
+#include <uta_prefetch.h>
+#include <uta_fork.h>
+#include <uta_self_test.h>
+#include <uta_trace.h>
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+#include <uta_latency.h>
+#endif
+#ifdef ENABLE_DRBG
+#include <uta_drbg.h>
+#endif
+#ifdef ENABLE_HKDF
+#include <uta_hkdf.h>
+#endif
+#ifdef ENABLE_TCG_SAPI
+#include <tpm_tcg_sapi.h>
+#endif
 
 #include <tss2/tss2_esys.h>
 #include <tss2/tss2_tcti_device.h>
 
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define DERIV_STR_LEN   8     /* 8 Bytes */
+#define USED_KEY_SLOTS  2
+
+/* Kind of the pending asynchronous operation */
+#define ASYNC_NONE          0
+#define ASYNC_DERIVE_KEY    1
+#define ASYNC_GET_RANDOM    2
+
+/* The asynchronous operations always use the first connection */
+#define ASYNC_CONNECTION    0
+
+/* Seconds until a failed device is preferred again */
+#define DEVICE_RETRY_INTERVAL   5
+
+/* A deadline, which has always passed, so that a response is polled once */
+#define DEADLINE_POLL           1
+
+/* Penalties of the device selection, added to the outstanding requests */
+#define DEVICE_SCORE_FAILED     ((uint64_t)1 << 32)
+#define DEVICE_SCORE_TRIED      ((uint64_t)1 << 33)
+
 /*******************************************************************************
  * Data types
  ******************************************************************************/
-struct _uta_context_v1_t
+/**
+ * @brief Connection to the TPM with its own ESAPI context and salted session.
+ */
+typedef struct
 {
     ESYS_CONTEXT *esys_context;
     TSS2_TCTI_CONTEXT *tcti_ctx;
     ESYS_TR session;
+    ESYS_TR salt_handle;
+    ESYS_TR key_handles[USED_KEY_SLOTS];
+    size_t device;
+    uint64_t acquired;
+    uta_stats_op_t op;
+    /* Deadline of the call, which owns the connection */
+    uint64_t deadline;
+    /* Command, whose response has not been read before its deadline, or 0 */
+    TPM2_CC pending;
+    /* Most random bytes of one TPM2_GetRandom response of the device */
+    UINT16 max_random;
+#ifdef ENABLE_TCG_SAPI
+    /* SAPI fast path of tpm_calc_hmac and tpm_read_random, with its own
+     * session */
+    tpm_sapi_t sapi;
+#endif
+} tpm_connection_t;
+
+/**
+ * @brief TPM device with the connections first_connection up to
+ *      first_connection + num_connections - 1 of the pool.
+ */
+typedef struct
+{
+    char *device_file;
+    size_t first_connection;
+    size_t num_connections;
+    uta_sched_t sched;
+    uint32_t outstanding;
+    int64_t failed_until;
+} tpm_device_t;
+
+struct _uta_context_v1_t
+{
+    /* Pool of connections, free_mask has one bit per free connection */
+    tpm_connection_t connections[CONFIGURED_TPM_POOL_MAX];
+    size_t num_connections;
+    uint64_t free_mask;
+    /* Devices of the pool, outstanding counts the taken and awaited
+     * connections */
+    tpm_device_t devices[CONFIGURED_TPM_POOL_MAX];
+    size_t num_devices;
+    uint32_t next_device;
+    int poll_fd;
+    /* Fork generation of the process, which opened the connections */
+    uint32_t fork_generation;
+    /* Statistics, updated with atomic operations */
+    uta_stats_v1_t stats;
+    /* Timeout of the calls in ms, 0 for none, accessed atomically */
+    uint32_t timeout_ms;
+    /* Cache of derived keys, read without a lock */
+    uta_key_cache_t key_cache;
+    /* Result of the last self test, read without a lock */
+    uta_self_test_t self_test;
+    /* Capabilities of the first device, read on open */
+    uta_capabilities_v1_t capabilities;
+    /* Session attributes of TPM2_HMAC and TPM2_GetRandom, see
+     * set_param_encryption, accessed atomically */
+    TPMA_SESSION attributes_hmac;
+    TPMA_SESSION attributes_random;
+    /* Ring of the random prefetch mode, protected by its own mutex */
+    uta_prefetch_t prefetch;
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+    /* Latency histograms of the trust anchor accesses, saved on close */
+    uta_latency_record_t latency_record;
+#endif
+    /* Context wide state, protected by the accesslock */
+    uint8_t uuid[UTA_UUID_LEN];
+    uint8_t uuid_cached;
+#ifdef ENABLE_DRBG
+    /* DRBG of the DRBG mode, protected by the drbglock, which is taken after
+     * the accesslock. drbg_active is set while the DRBG is seeded and read
+     * atomically, so that random requests of the other modes take no lock */
+    uta_drbg_t drbg;
+    /* Deadline of the call, which (re)seeds the DRBG */
+    uint64_t drbg_deadline;
+    uint8_t drbg_active;
+    pthread_mutex_t drbglock;
+#endif
+    /* Pending asynchronous operation, protected by the asynclock */
+    uint8_t async_kind;
+    uint8_t async_retried;
+    uint8_t async_key_slot;
+    uint8_t async_dv[DERIV_STR_LEN];
+    uint8_t *async_output;
+    size_t async_len;
+    size_t async_done;
+    pthread_mutex_t asynclock;
     pthread_mutex_t accesslock;
 };
 
+#ifdef ENABLE_TEST_HOOKS
 /*******************************************************************************
- * Defines
+ * Static data declaration
  ******************************************************************************/
-#define DERIV_STR_LEN   8     /* 8 Bytes */
-#define USED_KEY_SLOTS  2
+/* TPM2_HMAC commands, which are still sent with a flushed session */
+static uint32_t test_flushed_sessions = 0;
+#endif
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static TSS2_RC tpm_open_connections(const uta_context_v1_t *tpm_context,
+        const char * const *device_files, size_t num_devices,
+        size_t connections_per_device);
+static TSS2_RC tpm_open_connection(tpm_connection_t *connection,
+        const char *device_file);
+static TSS2_RC tpm_start_session(tpm_connection_t *connection);
+static TSS2_RC tpm_recover_session(tpm_connection_t *connection);
+static void tpm_close_connection(tpm_connection_t *connection);
+static void tpm_forget_connection(tpm_connection_t *connection);
+static uta_rc tpm_check_fork(const uta_context_v1_t *tpm_context, int reopen);
+#ifdef CONFIGURED_SESSION_CACHE_FILE
+static TSS2_RC tpm_load_session(tpm_connection_t *connection);
+static void tpm_save_session(tpm_connection_t *connection);
+#endif
+static void tpm_close_devices(const uta_context_v1_t *tpm_context);
+static TSS2_RC tpm_read_capabilities(tpm_connection_t *connection,
+        uta_capabilities_v1_t *capabilities);
+static tpm_connection_t *tpm_acquire_connection(
+        const uta_context_v1_t *tpm_context, uint64_t tried_devices,
+        uta_stats_op_t op, uint64_t deadline);
+static tpm_connection_t *tpm_acquire_device_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op, uint64_t deadline);
+static tpm_connection_t *tpm_try_acquire_device_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op);
+static tpm_connection_t *tpm_claim_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op, uint64_t deadline);
+static tpm_connection_t *tpm_try_acquire_async_connection(
+        const uta_context_v1_t *tpm_context, uta_stats_op_t op);
+static void tpm_release_connection(const uta_context_v1_t *tpm_context,
+        tpm_connection_t *connection);
+static void tpm_device_failed(const uta_context_v1_t *tpm_context,
+        const tpm_connection_t *connection);
+static int64_t tpm_now(void);
+static uta_rc tpm_check_derive_args(size_t len_key, size_t len_dv,
+        uint8_t key_slot);
+static TSS2_RC tpm_resolve_key_handle(tpm_connection_t *connection,
+        uint8_t key_slot);
+static int tpm_is_handle_error(TSS2_RC ret);
+static int tpm_is_session_error(TSS2_RC ret);
+static int tpm_is_timeout(TSS2_RC ret);
+static TPMA_SESSION tpm_session_attributes(uta_param_enc_t mode);
+static uta_rc tpm_uta_rc(TSS2_RC ret);
+static TSS2_RC tpm_derive_uuid(tpm_connection_t *connection,
+        TPM2B_DIGEST **outHMAC);
+static TSS2_RC tpm_hmac(tpm_connection_t *connection, uint8_t key_slot,
+        const TPM2B_MAX_BUFFER *dv_buffer, TPM2B_DIGEST **outHMAC);
+static TSS2_RC tpm_get_random_command(tpm_connection_t *connection,
+        UINT16 bytesRequested, TPM2B_DIGEST **randomBytes);
+static TSS2_RC tpm_finish(tpm_connection_t *connection, TPM2_CC command,
+        TPM2B_DIGEST **output);
+static TSS2_RC tpm_drain_connection(tpm_connection_t *connection);
+static TSS2_RC tpm_calc_hmac(tpm_connection_t *connection,
+        uint8_t *key, size_t len_key, const uint8_t *dv, uint8_t key_slot,
+        TPMA_SESSION attributes);
+static TSS2_RC tpm_read_random(tpm_connection_t *connection,
+        uta_random_cursor_t *cursor, size_t len_random,
+        TPMA_SESSION attributes);
+#ifdef ENABLE_TCG_SAPI
+static TSS2_RC tpm_calc_hmac_sapi(tpm_connection_t *connection,
+        uint8_t *key, size_t len_key, const uint8_t *dv, uint8_t key_slot,
+        TPMA_SESSION attributes);
+#endif
+static TSS2_RC tpm_pool_read_random(const uta_context_v1_t *tpm_context,
+        uta_random_cursor_t *cursor, uint64_t deadline);
+static int tpm_prefetch_fill(void *p_fill, uint8_t *output, size_t len);
+static TSS2_RC tpm_async_start(const uta_context_v1_t *tpm_context);
+static uta_rc tpm_begin_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode);
+static void tpm_poll_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode);
+static uta_rc tpm_test_result_rc(TPM2_RC testResult);
+#ifdef ENABLE_TEST_HOOKS
+static void tpm_test_flush_session(tpm_connection_t *connection);
+#endif
+#ifdef ENABLE_DRBG
+static uta_rc tpm_drbg_start(const uta_context_v1_t *tpm_context,
+        uint64_t reseed_bytes, uint32_t reseed_interval, uint64_t deadline);
+static void tpm_drbg_stop(const uta_context_v1_t *tpm_context);
+static int tpm_drbg_entropy(void *p_entropy, unsigned char *output,
+        size_t len);
+#endif
 
 /*******************************************************************************
  * Public function bodies
  ******************************************************************************/
 /**
  * @brief Return the size of the opaque struct uta_context_v1_t.
+ * The bound UTA_CONTEXT_V1_STORAGE of configure.ac is 1024 bytes for the
+ * context without connections and devices (about 660 bytes on x86_64), plus
+ * 320 bytes per connection of the pool (one tpm_connection_t and
+ * tpm_device_t, about 264 bytes) or 640 bytes with the SAPI fast path (about
+ * 528 bytes), plus 5120 bytes for the latency record (4608 bytes) and 256
+ * bytes for the DRBG (176 bytes).
  * @return Size of the opaque struct uta_context_v1_t .
  */
 size_t tpm_context_v1_size(void)
 {
+    /* Applications may store the context in UTA_CONTEXT_V1_STORAGE bytes,
+     * see above */
+    _Static_assert(sizeof(uta_context_v1_t) <= UTA_CONTEXT_V1_STORAGE,
+        "UTA_CONTEXT_V1_STORAGE of configure is too small");
     return(sizeof(uta_context_v1_t));
 }
 
@@ -99,103 +342,154 @@ size_t tpm_context_v1_size(void)
  * @return UTA return code.
  */
 uta_rc tpm_open(const uta_context_v1_t *tpm_context)
+{
+    return tpm_open_pool(tpm_context, 1);
+}
+
+/**
+ * @brief Opens a pool of connections to the TPM. Each connection has its own
+ *      TCTI, ESAPI context and salted session, so that up to num_connections
+ *      threads can access the TPM in parallel.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] num_connections Number of connections between 1 and
+ *      CONFIGURED_TPM_POOL_MAX.
+ * @return UTA return code.
+ */
+uta_rc tpm_open_pool(const uta_context_v1_t *tpm_context,
+        size_t num_connections)
+{
+    const char *device_file = CONFIGURED_TPM_DEVICE;
+
+    return tpm_open_devices(tpm_context, &device_file, 1, num_connections);
+}
+
+/**
+ * @brief Opens connections_per_device connections to each of the TPM devices.
+ *      The devices must be provisioned with the same keys. Requests are sent
+ *      to the device with the least outstanding requests and are repeated on
+ *      another device, if a device fails.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] device_files List of num_devices TPM device files.
+ * @param[in] num_devices Number of devices, at least 1.
+ * @param[in] connections_per_device Number of connections per device, at
+ *      least 1. The total must not exceed CONFIGURED_TPM_POOL_MAX.
+ * @return UTA return code.
+ */
+uta_rc tpm_open_devices(const uta_context_v1_t *tpm_context,
+        const char * const *device_files, size_t num_devices,
+        size_t connections_per_device)
 {
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
 
-    TSS2_RC ret;
-    size_t size;
+    UTA_TRACE_OP_ENTRY(UTA_STATS_OPEN, 0, num_devices);
 
-    TPM2_HANDLE TPMKeyHandle = TPM_SALT_HANDLE;
-    ESYS_TR tpmKey_handle = ESYS_TR_NONE;
+    /* Each open starts with cleared statistics */
+    uta_stats_reset(&tpm_context_w->stats);
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+    uta_latency_record_init(&tpm_context_w->latency_record);
+#endif
 
-    /* Initialization of the accesslock mutex */
-    ret = pthread_mutex_init(&tpm_context_w->accesslock, NULL);
-    if (ret != 0)
+    if((num_devices < 1) || (connections_per_device < 1) ||
+       (connections_per_device > (CONFIGURED_TPM_POOL_MAX / num_devices)))
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_NOT_SUPPORTED);
     }
 
-    /* Lock the device access with the accesslock mutex */
-    ret = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret != 0)
+    /* A child process re-establishes the context on its first call */
+    if(uta_fork_init(&tpm_context_w->fork_generation) != UTA_SUCCESS)
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
 
-    ret = Tss2_Tcti_Device_Init(NULL, &size, 0);
-    if(ret != TSS2_RC_SUCCESS)
+    /* Initialization of the accesslock mutex */
+    if(pthread_mutex_init(&tpm_context_w->accesslock, NULL) != 0)
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
-    tpm_context_w->tcti_ctx = (TSS2_TCTI_CONTEXT *) calloc(1, size);
-    if(tpm_context_w->tcti_ctx == NULL)
+
+    /* Initialization of the asynclock mutex */
+    if(pthread_mutex_init(&tpm_context_w->asynclock, NULL) != 0)
     {
-        return UTA_TA_ERROR;
+        (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
 
-    ret = Tss2_Tcti_Device_Init(tpm_context_w->tcti_ctx, &size, CONFIGURED_TPM_DEVICE);
-    if(ret != TSS2_RC_SUCCESS)
+#ifdef ENABLE_DRBG
+    /* Initialization of the drbglock mutex */
+    if(pthread_mutex_init(&tpm_context_w->drbglock, NULL) != 0)
     {
-        return UTA_TA_ERROR;
+        (void)pthread_mutex_destroy(&tpm_context_w->asynclock);
+        (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
+#endif
 
-    ret = Esys_Initialize(&tpm_context_w->esys_context,
-        tpm_context->tcti_ctx,
-        NULL);
-
-    if(ret != TSS2_RC_SUCCESS)
+    /* Random numbers are not prefetched until the prefetch mode is selected */
+    if(uta_prefetch_init(&tpm_context_w->prefetch) != UTA_SUCCESS)
     {
-        return UTA_TA_ERROR;
+#ifdef ENABLE_DRBG
+        (void)pthread_mutex_destroy(&tpm_context_w->drbglock);
+#endif
+        (void)pthread_mutex_destroy(&tpm_context_w->asynclock);
+        (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
 
-    /* Starting HMAC session */
-    const TPMT_SYM_DEF symmetric = {
-        .algorithm = TPM2_ALG_AES,
-        .keyBits = {.aes = 128},
-        .mode = {.aes = TPM2_ALG_CFB}
-    };
-
-    /* get a ESYS_TR handle for tpmKey */
-    ret = Esys_TR_FromTPMPublic(
-        tpm_context->esys_context,
-        TPMKeyHandle, /* required */
-        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
-        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
-        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
-        &tpmKey_handle /* required (non-NULL) */
-    );
-    if(ret != 0)
+    if(tpm_open_connections(tpm_context, device_files, num_devices,
+        connections_per_device) != TSS2_RC_SUCCESS)
     {
-        return UTA_TA_ERROR;
+        uta_prefetch_free(&tpm_context_w->prefetch);
+#ifdef ENABLE_DRBG
+        (void)pthread_mutex_destroy(&tpm_context_w->drbglock);
+#endif
+        (void)pthread_mutex_destroy(&tpm_context_w->asynclock);
+        (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
     }
 
-    ret = Esys_StartAuthSession(
-        tpm_context->esys_context,
-        tpmKey_handle,
-        ESYS_TR_NONE,
-        ESYS_TR_NONE,
-        ESYS_TR_NONE,
-        ESYS_TR_NONE,
-        NULL,
-        TPM2_SE_HMAC,
-        &symmetric,
-        TPM2_ALG_SHA256,
-        &tpm_context_w->session);
+    /* The device UUID is calculated on the first request */
+    tpm_context_w->uuid_cached = 0;
 
-    if(ret != TSS2_RC_SUCCESS)
-    {
-        return UTA_TA_ERROR;
-    }
+    /* The calls wait without limit until set_timeout is called */
+    uta_deadline_set_timeout(&tpm_context_w->timeout_ms, 0);
 
-    /* Release the accesslock mutex (ignore return code) */
-    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+    /* All parameters are encrypted until set_param_encryption is called */
+    tpm_context_w->attributes_hmac =
+        tpm_session_attributes(UTA_PARAM_ENC_FULL);
+    tpm_context_w->attributes_random =
+        tpm_session_attributes(UTA_PARAM_ENC_FULL) & ~TPMA_SESSION_DECRYPT;
 
-    return UTA_SUCCESS;
+#ifdef ENABLE_DRBG
+    /* Random numbers are read from the TPM until a DRBG mode is selected */
+    uta_drbg_init(&tpm_context_w->drbg);
+    tpm_context_w->drbg_active = 0;
+#endif
+
+    /* No asynchronous operation is pending */
+    tpm_context_w->async_kind = ASYNC_NONE;
+
+    /* Keys are not cached until set_key_cache is called */
+    uta_key_cache_init(&tpm_context_w->key_cache);
+
+    uta_self_test_init(&tpm_context_w->self_test);
+#ifdef ENABLE_SELF_TEST_ON_OPEN
+    /* The result is queried with get_self_test_result (ignore return code) */
+    (void)tpm_begin_self_test(tpm_context, UTA_SELF_TEST_INCREMENTAL);
+#endif
+
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_OPEN, UTA_SUCCESS);
 }
 
 /**
- * @brief Closes the connection to the TPM.
+ * @brief Closes the connections to the TPM.
  * @param[in,out] tpm_context Pointer to the internal context struct.
  * @return UTA return code.
  */
@@ -204,32 +498,55 @@ uta_rc tpm_close(const uta_context_v1_t *tpm_context)
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
 
-    int ret_val;
+    uta_rc rc;
 
-    /* Lock the device access with the accesslock mutex */
-    ret_val = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret_val != 0)
+    UTA_TRACE_OP_ENTRY(UTA_STATS_CLOSE, 0, 0);
+
+    /* A child only drops the connections of the parent */
+    (void)tpm_check_fork(tpm_context, 0);
+
+    /* Lock the device access with the accesslock mutex, close always waits */
+    rc = uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->accesslock, UTA_DEADLINE_NONE);
+    if (rc != UTA_SUCCESS)
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_CLOSE, rc);
     }
 
-    /* Close open HMAC-Session */
-    Esys_FlushContext(tpm_context->esys_context, tpm_context->session);
+    /* The background thread reads from the devices until it is stopped */
+    uta_prefetch_free(&tpm_context_w->prefetch);
 
-    /* Remove the TSS context */
-    Esys_Finalize(&tpm_context_w->esys_context);
+    tpm_close_devices(tpm_context);
 
-    /* Remove the TSS context */
-    Tss2_Tcti_Finalize(tpm_context_w->tcti_ctx);
-    free(tpm_context_w->tcti_ctx);
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+    /* Add the recorded latencies to the file (ignore errors) */
+    (void)uta_latency_record_save(&tpm_context_w->latency_record,
+        CONFIGURED_LATENCY_RECORD_FILE);
+#endif
+
+#ifdef ENABLE_DRBG
+    /* Clear the DRBG state */
+    tpm_drbg_stop(tpm_context);
+#endif
+
+    /* Clear and release the key cache */
+    uta_key_cache_free(&tpm_context_w->key_cache);
 
     /* Release the accesslock mutex (ignore return code) */
     (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
 
+    /* Destroy the asynclock mutex (ignore return code) */
+    (void)pthread_mutex_destroy(&tpm_context_w->asynclock);
+
+#ifdef ENABLE_DRBG
+    /* Destroy the drbglock mutex (ignore return code) */
+    (void)pthread_mutex_destroy(&tpm_context_w->drbglock);
+#endif
+
     /* Destroy the accesslog mutex (ignore return code) */
     (void)pthread_mutex_destroy(&tpm_context_w->accesslock);
 
-    return UTA_SUCCESS;
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_CLOSE, UTA_SUCCESS);
 }
 
 /**
@@ -249,112 +566,233 @@ uta_rc tpm_derive_key(const uta_context_v1_t *tpm_context, uint8_t *key,
 {
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
-    TSS2_RC ret;
 
-    int ret_val;
+    tpm_connection_t *connection;
+    TSS2_RC ret = TSS2_ESYS_RC_GENERAL_FAILURE;
+    uint64_t tried_devices = 0;
+    size_t attempt;
+    uint8_t key_buffer[UTA_KEY_CACHE_LEN_KEY];
+    uint8_t *output = key;
+    size_t len_output = len_key;
+    uint64_t deadline;
 
-    TPM2_HANDLE TPMhmacKeyHandle = 0;
-    ESYS_TR hmacKeyHandle = ESYS_TR_NONE;
-    TPM2B_MAX_BUFFER dv_buffer = { .size = len_dv,
-                                   .buffer={0}} ;
-    TPM2B_DIGEST *outHMAC;
+    uta_rc uta_ret;
 
-    /* Check key_slot */
-    if(key_slot > (USED_KEY_SLOTS-1))
+    UTA_TRACE_OP_ENTRY(UTA_STATS_DERIVE_KEY, key_slot, len_key);
+
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
+
+    /* Check key_slot, len_dv and len_key */
+    uta_ret = tpm_check_derive_args(len_key, len_dv, key_slot);
+    if(uta_ret != UTA_SUCCESS)
     {
-        return UTA_INVALID_KEY_SLOT;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            uta_ret);
     }
 
-    switch(key_slot)
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
-        case 0x00:
-            TPMhmacKeyHandle = TPM_KEY0_HANDLE;
-        break;
-
-        case 0x01:
-            TPMhmacKeyHandle = TPM_KEY1_HANDLE;
-        break;
-
-        default:
-            return UTA_INVALID_KEY_SLOT;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            UTA_TA_ERROR);
     }
 
-    if(len_dv != 8)
+    /* Serve repeated derivations from the key cache without a lock */
+    if(uta_key_cache_enabled(&tpm_context_w->key_cache) != 0)
     {
-        return UTA_INVALID_DV_LENGTH;
+        if(uta_key_cache_lookup(&tpm_context_w->key_cache, key_slot, dv, key,
+            len_key) != 0)
+        {
+            uta_stats_key_cache(&tpm_context_w->stats, 1);
+            return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+                UTA_SUCCESS);
+        }
+        uta_stats_key_cache(&tpm_context_w->stats, 0);
     }
 
-    if(len_key > 32)
+    /* The cache keeps the full HMAC, which is truncated afterwards */
+    if(uta_key_cache_enabled(&tpm_context_w->key_cache) != 0)
     {
-        return UTA_INVALID_KEY_LENGTH;
+        output = key_buffer;
+        len_output = sizeof(key_buffer);
     }
 
-    /* Lock the device access with the accesslock mutex */
-    ret_val = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret_val != 0)
+    TPMA_SESSION sessionAttributes =
+        __atomic_load_n(&tpm_context->attributes_hmac, __ATOMIC_RELAXED);
+
+    /* Try each device once, if the previous one failed */
+    for(attempt = 0; attempt < tpm_context->num_devices; attempt++)
     {
-        return UTA_TA_ERROR;
+        /* Take a free connection from the pool */
+        connection = tpm_acquire_connection(tpm_context, tried_devices,
+            UTA_STATS_DERIVE_KEY, deadline);
+        if (connection == NULL)
+        {
+            return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+                uta_deadline_rc(deadline));
+        }
+
+        /* Calculate HMAC using TPM key */
+        ret = tpm_calc_hmac(connection, output, len_output, dv, key_slot,
+            sessionAttributes);
+
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            tpm_device_failed(tpm_context, connection);
+            tried_devices |= (uint64_t)1 << connection->device;
+        }
+
+        /* Return the connection to the pool */
+        tpm_release_connection(tpm_context, connection);
+
+        /* No time is left for another device after a timeout */
+        if((ret == TSS2_RC_SUCCESS) || (tpm_is_timeout(ret) != 0))
+        {
+            break;
+        }
     }
 
-    /* Calculate HMAC using TPM key */
-    memcpy(dv_buffer.buffer, dv, len_dv);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            tpm_uta_rc(ret));
+    }
 
-    ret = Esys_TR_FromTPMPublic(
-        tpm_context->esys_context,
-        TPMhmacKeyHandle, /* required */
-        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
-        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
-        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
-        &hmacKeyHandle /* required (non-NULL) */
-    );
-    if(ret != 0)
+    if(output == key_buffer)
     {
-        /* Release the accesslock mutex (ignore return code) */
-        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
-        return UTA_TA_ERROR;
+        uta_key_cache_store(&tpm_context_w->key_cache, key_slot, dv,
+            key_buffer);
+        memcpy(key, key_buffer, len_key);
+        uta_key_cache_zeroize(key_buffer, sizeof(key_buffer));
     }
 
-    TPMA_SESSION sessionAttributes = TPMA_SESSION_CONTINUESESSION | TPMA_SESSION_ENCRYPT | TPMA_SESSION_DECRYPT;
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+        UTA_SUCCESS);
+}
 
-    ret = Esys_TRSess_SetAttributes(tpm_context->esys_context,
-        tpm_context->session,
-        sessionAttributes,
-        0xff);
+/**
+ * @brief Derives multiple keys using the TPMs HMAC function. One connection is
+ *      taken and the session attributes are set only once for all requests.
+ *      If the device fails, the remaining requests are repeated on another
+ *      device.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in,out] requests Array of derivation requests. The result of each
+ *      request is written to its rc member.
+ * @param[in] num_requests Number of entries in requests.
+ * @return UTA return code of the first failed request, UTA_SUCCESS otherwise.
+ */
+uta_rc tpm_derive_key_batch(const uta_context_v1_t *tpm_context,
+        uta_derive_request_v1_t *requests, size_t num_requests)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
 
-    if(ret != TSS2_RC_SUCCESS)
+    tpm_connection_t *connection;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    uint64_t tried_devices = 0;
+    uint64_t deadline;
+    size_t attempt;
+
+    uta_rc uta_ret = UTA_SUCCESS;
+    uta_rc failed_rc = UTA_TA_ERROR;
+    size_t i;
+
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
+
+    /*
+     * Validate all requests before the TPM is accessed. The valid requests
+     * are marked with UTA_TA_ERROR until they have been derived.
+     */
+    for(i = 0; i < num_requests; i++)
     {
-        /* Release the accesslock mutex (ignore return code) */
-        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
-        return UTA_TA_ERROR;
+        UTA_TRACE_OP_ENTRY(UTA_STATS_DERIVE_KEY, requests[i].key_slot,
+            requests[i].len_key);
+        requests[i].rc = tpm_check_derive_args(requests[i].len_key,
+            requests[i].len_dv, requests[i].key_slot);
+        if(requests[i].rc == UTA_SUCCESS)
+        {
+            requests[i].rc = UTA_TA_ERROR;
+        }
     }
 
-    ret = Esys_HMAC(
-        tpm_context->esys_context,
-        hmacKeyHandle,
-        ESYS_TR_PASSWORD,
-        tpm_context->session,
-        ESYS_TR_NONE,
-        &dv_buffer,
-        TPM2_ALG_SHA256,
-        &outHMAC);
+    /*
+     * A context inherited over fork is re-established first. If this fails,
+     * no device is left and the valid requests fail.
+     */
+    (void)tpm_check_fork(tpm_context, 1);
 
-    /* Release the accesslock mutex (ignore return code) */
-    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+    TPMA_SESSION sessionAttributes =
+        __atomic_load_n(&tpm_context->attributes_hmac, __ATOMIC_RELAXED);
 
-    if(ret != 0)
+    /* Try each device once, if the previous one failed */
+    for(attempt = 0; attempt < tpm_context->num_devices; attempt++)
     {
-        return UTA_TA_ERROR;
+        /* Take a free connection from the pool. A batch covers several keys,
+         * so its access is not recorded */
+        connection = tpm_acquire_connection(tpm_context, tried_devices,
+            UTA_STATS_NUM_OPS, deadline);
+        if (connection == NULL)
+        {
+            failed_rc = uta_deadline_rc(deadline);
+            break;
+        }
+
+        ret = TSS2_RC_SUCCESS;
+        for(i = 0; (ret == TSS2_RC_SUCCESS) && (i < num_requests); i++)
+        {
+            if(requests[i].rc != UTA_TA_ERROR)
+            {
+                continue;
+            }
+
+            /* Calculate HMAC using TPM key */
+            ret = tpm_calc_hmac(connection, requests[i].key,
+                requests[i].len_key, requests[i].dv, requests[i].key_slot,
+                sessionAttributes);
+            if(ret == TSS2_RC_SUCCESS)
+            {
+                requests[i].rc = UTA_SUCCESS;
+            }
+        }
+
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            tpm_device_failed(tpm_context, connection);
+            tried_devices |= (uint64_t)1 << connection->device;
+        }
+
+        /* Return the connection to the pool */
+        tpm_release_connection(tpm_context, connection);
+
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            break;
+        }
+
+        /* No time is left for another device after a timeout */
+        failed_rc = tpm_uta_rc(ret);
+        if(failed_rc == UTA_TIMEOUT)
+        {
+            break;
+        }
     }
 
-    if(outHMAC->size < len_key)
+    /* Count each request and report the first failed one */
+    for(i = 0; i < num_requests; i++)
     {
-        return UTA_TA_ERROR;
+        if((requests[i].rc == UTA_TA_ERROR) && (failed_rc == UTA_TIMEOUT))
+        {
+            requests[i].rc = UTA_TIMEOUT;
+        }
+        (void)uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            requests[i].rc);
+        if((requests[i].rc != UTA_SUCCESS) && (uta_ret == UTA_SUCCESS))
+        {
+            uta_ret = requests[i].rc;
+        }
     }
 
-    memcpy(key,outHMAC->buffer,len_key);
-    free(outHMAC);
-
-    return UTA_SUCCESS;
+    return uta_ret;
 }
 
 /**
@@ -367,294 +805,3392 @@ uta_rc tpm_derive_key(const uta_context_v1_t *tpm_context, uint8_t *key,
  */
 uta_rc tpm_get_random(const uta_context_v1_t *tpm_context, uint8_t *random,
         size_t len_random)
+{
+    uta_random_buffer_v1_t buffer = { .random = random,
+                                      .len_random = len_random };
+
+    return tpm_get_random_v(tpm_context, &buffer, 1);
+}
+
+/**
+ * @brief Gets random numbers from the TPM for several buffers. The total
+ *      number of bytes is read on one connection and scattered to the
+ *      buffers. In the DRBG mode, all buffers are generated under one hold
+ *      of the drbglock mutex, the other modes take no lock of the context.
+ *      In the prefetch mode, the bytes are taken from the ring first and
+ *      only the rest is read from the TPM.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] buffers Buffers, where the random numbers are written to.
+ * @param[in] num_buffers Number of entries in buffers.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_random_v(const uta_context_v1_t *tpm_context,
+        const uta_random_buffer_v1_t *buffers, size_t num_buffers)
 {
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
 
+    uta_random_cursor_t cursor;
+    size_t len_random;
+    uint64_t deadline;
     TSS2_RC ret;
-    int ret_val;
-    TPM2B_DIGEST *randomBytes;
-    uint32_t bytesRequested = len_random;
-    uint32_t bytesCopied;
+#ifdef ENABLE_DRBG
+    uta_rc rc;
+    size_t i;
+#endif
 
-    /* Lock the device access with the accesslock mutex */
-    ret_val = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret_val != 0)
-    {
-        return UTA_TA_ERROR;
-    }
+    uta_random_cursor_init(&cursor, buffers, num_buffers);
+    len_random = cursor.remaining;
 
-    TPMA_SESSION sessionAttributes = TPMA_SESSION_CONTINUESESSION | TPMA_SESSION_ENCRYPT;
+    UTA_TRACE_OP_ENTRY(UTA_STATS_GET_RANDOM, 0, len_random);
 
-    ret = Esys_TRSess_SetAttributes(
-        tpm_context->esys_context,
-        tpm_context->session,
-        sessionAttributes,
-        0xff);
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
 
-    if(ret != TSS2_RC_SUCCESS)
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
-        /* Release the accesslock mutex (ignore return code) */
-        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+            UTA_TA_ERROR);
     }
 
-    for(bytesCopied = 0; bytesCopied < len_random ; )
+#ifdef ENABLE_DRBG
+    /* Serve the request from the DRBG, if it has been selected */
+    if(__atomic_load_n(&tpm_context->drbg_active, __ATOMIC_ACQUIRE) != 0)
     {
-        bytesRequested = len_random - bytesCopied;
-
-        /* Get Random numbers from TPM */
-        ret = Esys_GetRandom(
-            tpm_context->esys_context,
-            tpm_context->session,
-            ESYS_TR_NONE,
-            ESYS_TR_NONE,
-            bytesRequested,
-            &randomBytes);
-
-        if(ret != TSS2_RC_SUCCESS)
+        /* Lock the DRBG state with the drbglock mutex */
+        rc = uta_stats_mutex_lock(&tpm_context_w->stats,
+            &tpm_context_w->drbglock, deadline);
+        if(rc != UTA_SUCCESS)
         {
-            /* Release the accesslock mutex (ignore return code) */
-            (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
-
-            free(randomBytes);
-            return UTA_TA_ERROR;
+            return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+                rc);
         }
 
-        size_t br;
-        /* copy as many bytes as were received or until bytes requested */
-        for (br = 0 ; (br < randomBytes->size) && (bytesCopied < len_random) ; br++)
+        /* The DRBG mode may have been left meanwhile */
+        if(tpm_context->drbg.seeded != 0)
         {
-            random[bytesCopied] = randomBytes->buffer[br];
-            bytesCopied++;
+            /* A reseed reads the entropy before the deadline of this call */
+            tpm_context_w->drbg_deadline = deadline;
+
+            for(i = 0; (rc == UTA_SUCCESS) && (i < num_buffers); i++)
+            {
+                rc = uta_drbg_generate(&tpm_context_w->drbg,
+                    buffers[i].random, buffers[i].len_random);
+            }
+            if(rc != UTA_SUCCESS)
+            {
+                rc = uta_deadline_rc(deadline);
+            }
+
+            /* Release the drbglock mutex (ignore return code) */
+            (void)pthread_mutex_unlock(&tpm_context_w->drbglock);
+            if(rc == UTA_SUCCESS)
+            {
+                uta_stats_random(&tpm_context_w->stats, len_random);
+            }
+            return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+                rc);
         }
-        free(randomBytes);
+
+        /* Release the drbglock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->drbglock);
     }
+#endif
 
-    /* Release the accesslock mutex (ignore return code) */
-    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+    /* Prefetched bytes are used first, an empty ring falls back to the TPM */
+    (void)uta_prefetch_take(&tpm_context_w->prefetch, &cursor);
 
-    if(ret != 0)
+    ret = tpm_pool_read_random(tpm_context, &cursor, deadline);
+    if(ret != TSS2_RC_SUCCESS)
     {
-        return UTA_TA_ERROR;
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+            tpm_uta_rc(ret));
     }
 
-    return UTA_SUCCESS;
+    uta_stats_random(&tpm_context_w->stats, len_random);
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+        UTA_SUCCESS);
 }
 
 /**
- * @brief Gets the UUID of the device.
+ * @brief Selects the random mode of the context. In the DRBG mode, the DRBG is
+ *      seeded from the TPM immediately. In the prefetch mode, the background
+ *      thread starts to fill the ring. Leaving a mode clears its state.
  * @param[in,out] tpm_context Pointer to the internal context struct.
- * @param[out] uuid Pointer to the buffer where the UUID should be written to.
+ * @param[in] config Random mode and reseed limits.
  * @return UTA return code.
  */
-uta_rc tpm_get_device_uuid(const uta_context_v1_t *tpm_context, uint8_t *uuid)
+uta_rc tpm_set_random_mode(const uta_context_v1_t *tpm_context,
+        const uta_random_config_v1_t *config)
 {
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
 
-    TSS2_RC ret;
-    int ret_val;
+    uint64_t deadline;
+    uta_rc rc;
 
-    ESYS_TR primaryHandle = ESYS_TR_NONE;
+#ifdef ENABLE_DRBG
+    if((config->mode != UTA_RANDOM_TA) && (config->mode != UTA_RANDOM_DRBG) &&
+       (config->mode != UTA_RANDOM_PREFETCH))
+#else
+    /* Without DRBG support, the TPM is the only source of random numbers */
+    if((config->mode != UTA_RANDOM_TA) && (config->mode != UTA_RANDOM_PREFETCH))
+#endif
+    {
+        return UTA_NOT_SUPPORTED;
+    }
 
-    TPM2B_AUTH authValuePrimary = {
-        .size = 0,
-        .buffer = {}
-    };
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
 
-    TPM2B_SENSITIVE_CREATE inSensitivePrimary = {
-        .size = 4,
-        .sensitive = {
-            .userAuth = {
-                 .size = 0,
-                 .buffer = {0 },
-             },
-            .data = {
-                 .size = 0,
-                 .buffer = {0},
-             },
-        },
-    };
-    inSensitivePrimary.sensitive.userAuth = authValuePrimary;
-    TPM2B_PUBLIC inPublic = { 0 };
-
-    TPM2B_DATA outsideInfo = {
-        .size = 0,
-        .buffer = {},
-    };
-    TPML_PCR_SELECTION creationPCR = {
-        .count = 0,
-    };
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
 
     /* Lock the device access with the accesslock mutex */
-    ret_val = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret_val != 0)
+    rc = uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->accesslock, deadline);
+    if(rc != UTA_SUCCESS)
     {
-        return UTA_TA_ERROR;
+        return rc;
     }
 
-    inPublic.publicArea.nameAlg = TPM2_ALG_SHA256;
-    inPublic.publicArea.type = TPM2_ALG_KEYEDHASH;
-    inPublic.publicArea.objectAttributes |= TPMA_OBJECT_SIGN_ENCRYPT;
-    inPublic.publicArea.objectAttributes |= TPMA_OBJECT_USERWITHAUTH;
-    inPublic.publicArea.objectAttributes |= TPMA_OBJECT_SENSITIVEDATAORIGIN;
-    inPublic.publicArea.parameters.keyedHashDetail.scheme.scheme = TPM2_ALG_HMAC;
-    inPublic.publicArea.parameters.keyedHashDetail.scheme.details.hmac.hashAlg = TPM2_ALG_SHA256;
+    if(config->mode == UTA_RANDOM_PREFETCH)
+    {
+#ifdef ENABLE_DRBG
+        tpm_drbg_stop(tpm_context);
+#endif
+        /* Selecting the mode again discards the prefetched bytes */
+        rc = uta_prefetch_start(&tpm_context_w->prefetch, tpm_prefetch_fill,
+            tpm_context_w, CONFIGURED_RANDOM_PREFETCH_SIZE);
+    }
+    else
+    {
+        uta_prefetch_stop(&tpm_context_w->prefetch);
+#ifdef ENABLE_DRBG
+        if(config->mode == UTA_RANDOM_DRBG)
+        {
+            rc = tpm_drbg_start(tpm_context, config->reseed_bytes,
+                config->reseed_interval, deadline);
+        }
+        else
+        {
+            tpm_drbg_stop(tpm_context);
+        }
+#endif
+    }
 
-    ret = Esys_CreatePrimary(
-        tpm_context->esys_context,
-        ESYS_TR_RH_ENDORSEMENT,
-        ESYS_TR_PASSWORD,
-        ESYS_TR_NONE,
-        ESYS_TR_NONE,
-        &inSensitivePrimary,
-        &inPublic,
-        &outsideInfo,
-        &creationPCR,
-        &primaryHandle,
-        NULL,
-        NULL,
-        NULL,
-        NULL);
+    /* Release the accesslock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
 
-    if(ret != TSS2_RC_SUCCESS)
+    return rc;
+}
+
+/**
+ * @brief Sets the timeout of the calls of the context. The deadline of a call
+ *      bounds the wait for the locks, for a free connection and for the
+ *      response of HMAC and GetRandom, which are sent asynchronously then.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] timeout_ms Timeout of each call in ms, 0 for no limit.
+ * @return UTA return code.
+ */
+uta_rc tpm_set_timeout(const uta_context_v1_t *tpm_context,
+        uint32_t timeout_ms)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
-        /* Release the accesslock mutex (ignore return code) */
-        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
         return UTA_TA_ERROR;
     }
 
-    ret = Esys_TR_SetAuth(
-        tpm_context->esys_context,
-        primaryHandle,
-        &authValuePrimary);
+    uta_deadline_set_timeout(&tpm_context_w->timeout_ms, timeout_ms);
 
-    if(ret != TSS2_RC_SUCCESS)
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Copies the capabilities, which have been read from the TPM on open.
+ * @param[in] tpm_context Pointer to the internal context struct.
+ * @param[out] capabilities Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_capabilities(const uta_context_v1_t *tpm_context,
+        uta_capabilities_v1_t *capabilities)
+{
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
-        /* Release the accesslock mutex (ignore return code) */
-        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
         return UTA_TA_ERROR;
     }
 
-    TPM2B_MAX_BUFFER dv_buffer = { .size = 8,
-                                   .buffer={0x44, 0x45, 0x56, 0x49, 0x43, 0x45, 0x49, 0x44}} ;
-    TPM2B_DIGEST *outHMAC;
+    *capabilities = tpm_context->capabilities;
+
+    return UTA_SUCCESS;
+}
 
+/**
+ * @brief Selects the parameter encryption of the salted sessions per
+ *      operation. The attributes are read by each call, so that a call,
+ *      which has already started, keeps its policy.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] policy Parameter encryption of the operations.
+ * @return UTA return code.
+ */
+uta_rc tpm_set_param_encryption(const uta_context_v1_t *tpm_context,
+        const uta_param_enc_policy_v1_t *policy)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
 
-    TPMA_SESSION sessionAttributes = TPMA_SESSION_CONTINUESESSION | TPMA_SESSION_ENCRYPT | TPMA_SESSION_DECRYPT;
+    if((policy->derive_key > UTA_PARAM_ENC_AUDIT) ||
+       (policy->get_random > UTA_PARAM_ENC_AUDIT))
+    {
+        return UTA_NOT_SUPPORTED;
+    }
 
-    ret = Esys_TRSess_SetAttributes(
-        tpm_context->esys_context,
-        tpm_context->session,
-        sessionAttributes,
-        0xff);
+    /* TPM2_GetRandom has no command parameter to decrypt */
+    __atomic_store_n(&tpm_context_w->attributes_hmac,
+        tpm_session_attributes(policy->derive_key), __ATOMIC_RELAXED);
+    __atomic_store_n(&tpm_context_w->attributes_random,
+        tpm_session_attributes(policy->get_random) & ~TPMA_SESSION_DECRYPT,
+        __ATOMIC_RELAXED);
 
-    if(ret != TSS2_RC_SUCCESS)
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Returns the poll handle of the TCTI of the asynchronous connection,
+ *      which becomes readable when the response of the pending asynchronous
+ *      command arrives.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[out] fd File descriptor for poll, select or epoll.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_poll_fd(const uta_context_v1_t *tpm_context, int *fd)
+{
+    /* A child gets the poll handle of its own connection */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
-        /* Release the accesslock mutex (ignore return code) */
-        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
         return UTA_TA_ERROR;
     }
 
-    ret = Esys_HMAC(
-        tpm_context->esys_context,
-        primaryHandle,
-        ESYS_TR_PASSWORD,
-        tpm_context->session,
-        ESYS_TR_NONE,
-        &dv_buffer,
-        TPM2_ALG_SHA256,
-        &outHMAC);
+    /* The device TCTI provides exactly one poll handle */
+    if(tpm_context->poll_fd < 0)
+    {
+        return UTA_TA_ERROR;
+    }
 
-    /* Flush endorsement key */
-    (void)Esys_FlushContext(tpm_context->esys_context, primaryHandle);
+    *fd = tpm_context->poll_fd;
 
-    /* Release the accesslock mutex (ignore return code) */
-    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+    return UTA_SUCCESS;
+}
 
-    if(ret != TSS2_RC_SUCCESS)
+/**
+ * @brief Submits the HMAC command of a key derivation to the TPM.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[out] key Buffer for the derived key, written on completion.
+ * @param[in] len_key Number of bytes, which should be written to key.
+ * @param[in] dv Pointer to the derivation value.
+ * @param[in] len_dv Length of the derivation value.
+ * @param[in] key_slot Key slot used for the HMAC function.
+ * @return UTA return code.
+ */
+uta_rc tpm_derive_key_submit(const uta_context_v1_t *tpm_context,
+        uint8_t *key, size_t len_key, const uint8_t *dv, size_t len_dv,
+        uint8_t key_slot)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_connection_t *connection;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    uta_rc uta_ret;
+
+    /* Check key_slot, len_dv and len_key */
+    uta_ret = tpm_check_derive_args(len_key, len_dv, key_slot);
+    if(uta_ret != UTA_SUCCESS)
+    {
+        return uta_ret;
+    }
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
         return UTA_TA_ERROR;
     }
 
-    if(outHMAC->size < 16)
+    /* Lock the asynchronous state with the asynclock mutex */
+    if(uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->asynclock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
     {
         return UTA_TA_ERROR;
     }
 
-    /* Copy the first 16 bytes to uuid */
-    memcpy(uuid, outHMAC->buffer, 16);
+    /* The asynchronous connection must not be busy */
+    connection = NULL;
+    if(tpm_context->async_kind == ASYNC_NONE)
+    {
+        connection = tpm_try_acquire_async_connection(tpm_context,
+            UTA_STATS_DERIVE_KEY);
+    }
+    if(connection == NULL)
+    {
+        /* Release the asynclock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+        return UTA_TRY_AGAIN;
+    }
 
-    free(outHMAC);
+    UTA_TRACE_OP_ENTRY(UTA_STATS_DERIVE_KEY, key_slot, len_key);
 
-    /* Format UUID as described in RFC 4122 */
-    uuid[6] &= 0x0F;    // 0b00001111;
-    uuid[6] |= 0x40;    // 0b01000000;
+    /* Start the session again, if an earlier recovery has failed */
+    if(connection->session == ESYS_TR_NONE)
+    {
+        ret = tpm_recover_session(connection);
+    }
+
+    /* Resolve the key slot, if this has not been possible during open */
+    if((ret == TSS2_RC_SUCCESS) &&
+       (connection->key_handles[key_slot] == ESYS_TR_NONE))
+    {
+        ret = tpm_resolve_key_handle(connection, key_slot);
+    }
+
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        tpm_context_w->async_kind = ASYNC_DERIVE_KEY;
+        tpm_context_w->async_retried = 0;
+        tpm_context_w->async_key_slot = key_slot;
+        memcpy(tpm_context_w->async_dv, dv, DERIV_STR_LEN);
+        tpm_context_w->async_output = key;
+        tpm_context_w->async_len = len_key;
+        tpm_context_w->async_done = 0;
+
+        ret = tpm_async_start(tpm_context);
+    }
 
-    uuid[8] &= 0x3F;    // 0b00111111;
-    uuid[8] |= 0x80;    // 0b10000000;
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        tpm_context_w->async_kind = ASYNC_NONE;
+        tpm_release_connection(tpm_context, connection);
+    }
+
+    /* Release the asynclock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            UTA_TA_ERROR);
+    }
 
     return UTA_SUCCESS;
 }
 
 /**
- * @brief Performs the TPM self test.
+ * @brief Submits the first GetRandom command of a random request to the TPM.
+ *      Further commands are submitted by tpm_async_complete.
  * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[out] random Buffer for the random numbers, written on completion.
+ * @param[in] len_random Defines the desired number of random bytes.
  * @return UTA return code.
  */
-uta_rc tpm_self_test(const uta_context_v1_t *tpm_context)
+uta_rc tpm_get_random_submit(const uta_context_v1_t *tpm_context,
+        uint8_t *random, size_t len_random)
 {
     /* This function needs writing access to the context */
     uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
-    int ret_val;
 
+    tpm_connection_t *connection;
     TSS2_RC ret;
-    TPM2B_MAX_BUFFER *outData;
-    TPM2_RC testResult;
 
-    /* Lock the device access with the accesslock mutex */
-    ret_val = pthread_mutex_lock(&tpm_context_w->accesslock);
-    if (ret_val != 0)
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
         return UTA_TA_ERROR;
     }
 
-    ret = Esys_SelfTest(tpm_context->esys_context,
-        ESYS_TR_NONE,
-        ESYS_TR_NONE,
-        ESYS_TR_NONE,
-        1);
-
-    if(ret != TSS2_RC_SUCCESS)
+    /* Lock the asynchronous state with the asynclock mutex */
+    if(uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->asynclock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
     {
-        /* Release the accesslock mutex (ignore return code) */
-        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
         return UTA_TA_ERROR;
     }
 
-    ret = Esys_GetTestResult(
-        tpm_context->esys_context,
-        ESYS_TR_NONE,
-        ESYS_TR_NONE,
-        ESYS_TR_NONE,
-        &outData,
-        &testResult);
+    /* The asynchronous connection must not be busy */
+    connection = NULL;
+    if(tpm_context->async_kind == ASYNC_NONE)
+    {
+        connection = tpm_try_acquire_async_connection(tpm_context,
+            UTA_STATS_GET_RANDOM);
+    }
+    if(connection == NULL)
+    {
+        /* Release the asynclock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+        return UTA_TRY_AGAIN;
+    }
 
-    /* Release the accesslock mutex (ignore return code) */
-    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+    UTA_TRACE_OP_ENTRY(UTA_STATS_GET_RANDOM, 0, len_random);
+
+    /* Start the session again, if an earlier recovery has failed */
+    ret = TSS2_RC_SUCCESS;
+    if(connection->session == ESYS_TR_NONE)
+    {
+        ret = tpm_recover_session(connection);
+    }
+
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        tpm_context_w->async_kind = ASYNC_GET_RANDOM;
+        tpm_context_w->async_retried = 0;
+        tpm_context_w->async_output = random;
+        tpm_context_w->async_len = len_random;
+        tpm_context_w->async_done = 0;
+
+        ret = tpm_async_start(tpm_context);
+    }
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        tpm_context_w->async_kind = ASYNC_NONE;
+        tpm_release_connection(tpm_context, connection);
+    }
+
+    /* Release the asynclock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
 
     if(ret != TSS2_RC_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+            UTA_TA_ERROR);
+    }
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Completes the pending asynchronous operation without blocking on the
+ *      TCTI. A random request is continued with the next GetRandom command
+ *      until all bytes are copied. A command is retried once with a new
+ *      session, if the TPM lost the session, and a derivation is retried once,
+ *      if the key slot handle is no longer valid. The asynchronous connection
+ *      is returned to the pool, when the operation has completed.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @return UTA_TRY_AGAIN while the operation is running, otherwise its UTA
+ *      return code.
+ */
+uta_rc tpm_async_complete(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_connection_t *connection =
+        &tpm_context_w->connections[ASYNC_CONNECTION];
+    TSS2_RC ret;
+    TPM2B_DIGEST *output = NULL;
+    size_t len;
+
+    /* An operation of the parent is not pending in a child */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
     {
         return UTA_TA_ERROR;
     }
 
-    if(testResult != TSS2_RC_SUCCESS)
+    /* Lock the asynchronous state with the asynclock mutex */
+    if(uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->asynclock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    if(tpm_context->async_kind == ASYNC_NONE)
+    {
+        /* Release the asynclock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+        return UTA_TA_ERROR;
+    }
+
+    /* Poll for the response, the synchronous calls keep blocking */
+    (void)Esys_SetTimeout(connection->esys_context, 0);
+    if(tpm_context->async_kind == ASYNC_DERIVE_KEY)
+    {
+        ret = Esys_HMAC_Finish(connection->esys_context, &output);
+    }
+    else
+    {
+        ret = Esys_GetRandom_Finish(connection->esys_context, &output);
+    }
+    (void)Esys_SetTimeout(connection->esys_context, TSS2_TCTI_TIMEOUT_BLOCK);
+
+    if(tpm_is_timeout(ret) != 0)
+    {
+        /* Release the asynclock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+        return UTA_TRY_AGAIN;
+    }
+
+    UTA_TRACE_TPM_RETURN((tpm_context->async_kind == ASYNC_DERIVE_KEY) ?
+        TPM2_CC_HMAC : TPM2_CC_GetRandom, ret);
+
+    if((ret != TSS2_RC_SUCCESS) && (tpm_context->async_retried == 0) &&
+       (tpm_is_session_error(ret) != 0))
+    {
+        /* The TPM lost the session, start a new one and repeat the command */
+        tpm_context_w->async_retried = 1;
+        ret = tpm_recover_session(connection);
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            ret = tpm_async_start(tpm_context);
+        }
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            /* Release the asynclock mutex (ignore return code) */
+            (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+            return UTA_TRY_AGAIN;
+        }
+    }
+    else if(tpm_context->async_kind == ASYNC_DERIVE_KEY)
+    {
+        if((ret != TSS2_RC_SUCCESS) && (tpm_context->async_retried == 0) &&
+           (tpm_is_handle_error(ret) != 0))
+        {
+            /* The cached handle is no longer valid, get a new one */
+            tpm_context_w->async_retried = 1;
+            ret = tpm_resolve_key_handle(connection,
+                tpm_context->async_key_slot);
+            if(ret == TSS2_RC_SUCCESS)
+            {
+                ret = tpm_async_start(tpm_context);
+            }
+            if(ret == TSS2_RC_SUCCESS)
+            {
+                /* Release the asynclock mutex (ignore return code) */
+                (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+                return UTA_TRY_AGAIN;
+            }
+        }
+        else if(ret == TSS2_RC_SUCCESS)
+        {
+            if(output->size < tpm_context->async_len)
+            {
+                ret = TSS2_ESYS_RC_GENERAL_FAILURE;
+            }
+            else
+            {
+                memcpy(tpm_context->async_output, output->buffer,
+                    tpm_context->async_len);
+            }
+            free(output);
+        }
+    }
+    else if(ret == TSS2_RC_SUCCESS)
+    {
+        /* Copy as many bytes as were received or until bytes requested */
+        len = tpm_context->async_len - tpm_context->async_done;
+        if(output->size < len)
+        {
+            len = output->size;
+        }
+        memcpy(&tpm_context->async_output[tpm_context->async_done],
+            output->buffer, len);
+        tpm_context_w->async_done += len;
+        free(output);
+
+        /* Request the remaining bytes, each command may be retried once */
+        if(tpm_context->async_done < tpm_context->async_len)
+        {
+            tpm_context_w->async_retried = 0;
+            ret = tpm_async_start(tpm_context);
+            if(ret == TSS2_RC_SUCCESS)
+            {
+                /* Release the asynclock mutex (ignore return code) */
+                (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+                return UTA_TRY_AGAIN;
+            }
+        }
+    }
+
+    /* Count the finished operation */
+    if(tpm_context->async_kind == ASYNC_DERIVE_KEY)
+    {
+        (void)uta_stats_call(&tpm_context_w->stats, UTA_STATS_DERIVE_KEY,
+            (ret == TSS2_RC_SUCCESS) ? UTA_SUCCESS : UTA_TA_ERROR);
+    }
+    else
+    {
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            uta_stats_random(&tpm_context_w->stats, tpm_context->async_len);
+        }
+        (void)uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_RANDOM,
+            (ret == TSS2_RC_SUCCESS) ? UTA_SUCCESS : UTA_TA_ERROR);
+    }
+
+    tpm_context_w->async_kind = ASYNC_NONE;
+    tpm_release_connection(tpm_context, connection);
+
+    /* Release the asynclock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->asynclock);
+
+    if(ret != TSS2_RC_SUCCESS)
     {
-        free(outData);
         return UTA_TA_ERROR;
     }
-    free(outData);
 
     return UTA_SUCCESS;
 }
+
+/**
+ * @brief Enables, replaces or disables the key cache of the context.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] config Size and TTL of the cache.
+ * @return UTA return code.
+ */
+uta_rc tpm_set_key_cache(const uta_context_v1_t *tpm_context,
+        const uta_key_cache_config_v1_t *config)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    return uta_key_cache_configure(&tpm_context_w->key_cache,
+        config->max_entries, config->ttl);
+}
+
+/**
+ * @brief Clears all entries of the key cache.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc tpm_flush_key_cache(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    uta_key_cache_flush(&tpm_context_w->key_cache);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Copies the statistics of the context.
+ * @param[in] tpm_context Pointer to the internal context struct.
+ * @param[out] stats Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_stats(const uta_context_v1_t *tpm_context,
+        uta_stats_v1_t *stats)
+{
+    uta_stats_read(&tpm_context->stats, stats);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Clears the statistics of the context.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc tpm_reset_stats(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    uta_stats_reset(&tpm_context_w->stats);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Derives a key like tpm_derive_key and expands it with HKDF-Expand
+ *      into the subkeys of all requests.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in,out] requests Array of expand requests.
+ * @param[in] num_requests Number of entries in requests.
+ * @param[in] dv Pointer to the buffer in which the derivation value is handed
+ *      over.
+ * @param[in] len_dv Specifies the length in bytes of the derivation value.
+ * @param[in] key_slot Defines which master key is used for the HMAC function.
+ * @return UTA return code.
+ */
+uta_rc tpm_derive_key_expand(const uta_context_v1_t *tpm_context,
+        uta_expand_request_v1_t *requests, size_t num_requests,
+        const uint8_t *dv, size_t len_dv, uint8_t key_slot)
+{
+#ifdef ENABLE_HKDF
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    return uta_hkdf_derive_key_expand(tpm_derive_key, tpm_context,
+        &tpm_context_w->stats, requests, num_requests, dv, len_dv, key_slot);
+#else
+    /* Without HKDF support, the subkeys cannot be expanded */
+    return UTA_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * @brief Gets the UUID of the device.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[out] uuid Pointer to the buffer where the UUID should be written to.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_device_uuid(const uta_context_v1_t *tpm_context, uint8_t *uuid)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_connection_t *connection;
+    TPM2B_DIGEST *outHMAC;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    uint64_t deadline;
+    uta_rc rc;
+    int retry;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_GET_DEVICE_UUID, 0, UTA_UUID_LEN);
+
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_TA_ERROR);
+    }
+
+    /* Lock the device access with the accesslock mutex */
+    rc = uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->accesslock, deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            rc);
+    }
+
+    /* Use the UUID of a previous call or of the persisted cache */
+    if(tpm_context->uuid_cached == 0)
+    {
+#ifdef CONFIGURED_UUID_CACHE_FILE
+        if(uta_uuid_cache_read(CONFIGURED_UUID_CACHE_FILE,
+            tpm_context_w->uuid) == 0)
+        {
+            tpm_context_w->uuid_cached = 1;
+        }
+#endif
+    }
+    if(tpm_context->uuid_cached != 0)
+    {
+        memcpy(uuid, tpm_context->uuid, UTA_UUID_LEN);
+        /* Release the accesslock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_SUCCESS);
+    }
+
+    /*
+     * Keep the accesslock, so that concurrent callers wait for this result.
+     * The UUID is always derived by the first device, since each device has
+     * its own endorsement hierarchy.
+     */
+    connection = tpm_acquire_device_connection(tpm_context, 0,
+        UTA_STATS_GET_DEVICE_UUID, deadline);
+    if(connection == NULL)
+    {
+        /* Release the accesslock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            uta_deadline_rc(deadline));
+    }
+
+    /* Start the session again, if an earlier recovery has failed */
+    if(connection->session == ESYS_TR_NONE)
+    {
+        ret = tpm_recover_session(connection);
+    }
+
+    for(retry = 0; (ret == TSS2_RC_SUCCESS) && (retry < 2); retry++)
+    {
+        ret = tpm_derive_uuid(connection, &outHMAC);
+
+        if((ret == TSS2_RC_SUCCESS) || (retry > 0))
+        {
+            break;
+        }
+
+        /* A lost session or key, e.g. after a TPM reset, is set up again */
+        if(((tpm_is_session_error(ret) != 0) ||
+            (tpm_is_handle_error(ret) != 0)) &&
+           (uta_deadline_expired(connection->deadline) == 0))
+        {
+            ret = tpm_recover_session(connection);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        tpm_release_connection(tpm_context, connection);
+        /* Release the accesslock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_TA_ERROR);
+    }
+
+    if(outHMAC->size < UTA_UUID_LEN)
+    {
+        free(outHMAC);
+        tpm_release_connection(tpm_context, connection);
+        /* Release the accesslock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_TA_ERROR);
+    }
+
+    /* Copy the first 16 bytes to the context */
+    memcpy(tpm_context_w->uuid, outHMAC->buffer, UTA_UUID_LEN);
+
+    free(outHMAC);
+
+    tpm_release_connection(tpm_context, connection);
+
+    /* Format UUID as described in RFC 4122 */
+    tpm_context_w->uuid[6] &= 0x0F;    // 0b00001111;
+    tpm_context_w->uuid[6] |= 0x40;    // 0b01000000;
+
+    tpm_context_w->uuid[8] &= 0x3F;    // 0b00111111;
+    tpm_context_w->uuid[8] |= 0x80;    // 0b10000000;
+
+    tpm_context_w->uuid_cached = 1;
+
+#ifdef CONFIGURED_UUID_CACHE_FILE
+    /* Persist the UUID for later processes (ignore return code) */
+    (void)uta_uuid_cache_write(CONFIGURED_UUID_CACHE_FILE, tpm_context->uuid);
+#endif
+
+    memcpy(uuid, tpm_context->uuid, UTA_UUID_LEN);
+
+    /* Release the accesslock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->accesslock);
+
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+        UTA_SUCCESS);
+}
+
+/**
+ * @brief Performs the TPM self test on each device of the context.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc tpm_self_test(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_connection_t *connection;
+    TSS2_RC ret;
+    TPM2B_MAX_BUFFER *outData;
+    TPM2_RC testResult;
+    size_t device;
+    uint64_t deadline;
+    uta_rc rc = UTA_SUCCESS;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_SELF_TEST, 0, 0);
+
+    deadline = uta_deadline_start(&tpm_context->timeout_ms);
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_SELF_TEST,
+            UTA_TA_ERROR);
+    }
+
+    /* The result is cached for get_self_test_result */
+    uta_self_test_started(&tpm_context_w->self_test, UTA_SELF_TEST_FULL);
+
+    for(device = 0; (rc == UTA_SUCCESS) && (device < tpm_context->num_devices);
+        device++)
+    {
+        /* Get exclusive access to one connection of the device */
+        connection = tpm_acquire_device_connection(tpm_context, device,
+            UTA_STATS_SELF_TEST, deadline);
+        if(connection == NULL)
+        {
+            rc = uta_deadline_rc(deadline);
+            break;
+        }
+
+        UTA_TRACE_TPM_ENTRY(TPM2_CC_SelfTest);
+        ret = Esys_SelfTest(connection->esys_context,
+            ESYS_TR_NONE,
+            ESYS_TR_NONE,
+            ESYS_TR_NONE,
+            1);
+        UTA_TRACE_TPM_RETURN(TPM2_CC_SelfTest, ret);
+
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            UTA_TRACE_TPM_ENTRY(TPM2_CC_GetTestResult);
+            ret = Esys_GetTestResult(
+                connection->esys_context,
+                ESYS_TR_NONE,
+                ESYS_TR_NONE,
+                ESYS_TR_NONE,
+                &outData,
+                &testResult);
+            UTA_TRACE_TPM_RETURN(TPM2_CC_GetTestResult, ret);
+        }
+
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            tpm_device_failed(tpm_context, connection);
+        }
+
+        tpm_release_connection(tpm_context, connection);
+
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            rc = UTA_TA_ERROR;
+            break;
+        }
+
+        free(outData);
+
+        if(testResult != TSS2_RC_SUCCESS)
+        {
+            rc = UTA_TA_ERROR;
+        }
+    }
+
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_SELF_TEST,
+        uta_self_test_finished(&tpm_context_w->self_test, UTA_SELF_TEST_FULL,
+        rc));
+}
+
+/**
+ * @brief Starts the TPM self test on each device of the context without
+ *      waiting for its result.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] mode UTA_SELF_TEST_INCREMENTAL for the algorithms used by UTA
+ *      or UTA_SELF_TEST_FULL.
+ * @return UTA return code.
+ */
+uta_rc tpm_start_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_SELF_TEST, 0, 0);
+
+    if((mode != UTA_SELF_TEST_FULL) && (mode != UTA_SELF_TEST_INCREMENTAL))
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_SELF_TEST,
+            UTA_NOT_SUPPORTED);
+    }
+
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&tpm_context_w->stats, UTA_STATS_SELF_TEST,
+            UTA_TA_ERROR);
+    }
+
+    return uta_stats_call(&tpm_context_w->stats, UTA_STATS_SELF_TEST,
+        tpm_begin_self_test(tpm_context, mode));
+}
+
+/**
+ * @brief Copies the result of the last self test. A running self test is
+ *      polled on the connections, which are free.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[out] result Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc tpm_get_self_test_result(const uta_context_v1_t *tpm_context,
+        uta_self_test_result_v1_t *result)
+{
+    /* A context inherited over fork is re-established first */
+    if(tpm_check_fork(tpm_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    uta_self_test_read(&tpm_context->self_test, result);
+    if(result->rc == UTA_TRY_AGAIN)
+    {
+        tpm_poll_self_test(tpm_context, result->mode);
+        uta_self_test_read(&tpm_context->self_test, result);
+    }
+
+    return UTA_SUCCESS;
+}
+
+#ifdef ENABLE_TEST_HOOKS
+/**
+ * @brief Test hook of the regression tests. The session of the next count
+ *      TPM2_HMAC commands is flushed from the TPM, before the command is
+ *      sent. The ESAPI keeps its object of the session, so that the command
+ *      fails with a session error, as after a TPM reset. The setting is
+ *      shared by all contexts of the process.
+ * @param[in] count Number of TPM2_HMAC commands with a flushed session.
+ * @return Number of commands, which were left of the previous setting.
+ */
+uint32_t tpm_flush_sessions(uint32_t count)
+{
+    return __atomic_exchange_n(&test_flushed_sessions, count,
+        __ATOMIC_RELAXED);
+}
+#endif
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Opens connections_per_device connections to each of the TPM devices
+ *      and sets up the pool. Used by tpm_open_devices and to re-establish a
+ *      context in a child process.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] device_files List of num_devices TPM device files.
+ * @param[in] num_devices Number of devices, at least 1.
+ * @param[in] connections_per_device Number of connections per device.
+ * @return TCG TSS return code. On error, no device is left open.
+ */
+static TSS2_RC tpm_open_connections(const uta_context_v1_t *tpm_context,
+        const char * const *device_files, size_t num_devices,
+        size_t connections_per_device)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    TSS2_TCTI_POLL_HANDLE *handles;
+    uta_capabilities_v1_t capabilities;
+    tpm_connection_t *connection;
+    tpm_device_t *device;
+    UINT16 max_random;
+    size_t count;
+    size_t i;
+    size_t j;
+
+    tpm_context_w->num_devices = 0;
+    tpm_context_w->num_connections = 0;
+    tpm_context_w->free_mask = 0;
+    tpm_context_w->next_device = 0;
+
+    for(i = 0; (ret == TSS2_RC_SUCCESS) && (i < num_devices); i++)
+    {
+        device = &tpm_context_w->devices[i];
+
+        device->device_file = strdup(device_files[i]);
+        if(device->device_file == NULL)
+        {
+            ret = TSS2_ESYS_RC_MEMORY;
+            break;
+        }
+
+        /* Initialization of the scheduler of the device connections */
+        if(uta_sched_init(&device->sched, connections_per_device) != 0)
+        {
+            free(device->device_file);
+            ret = TSS2_ESYS_RC_GENERAL_FAILURE;
+            break;
+        }
+        device->first_connection = tpm_context->num_connections;
+        device->num_connections = 0;
+        device->outstanding = 0;
+        device->failed_until = 0;
+        tpm_context_w->num_devices++;
+
+        while(device->num_connections < connections_per_device)
+        {
+            tpm_context_w->connections[tpm_context->num_connections].device = i;
+            ret = tpm_open_connection(
+                &tpm_context_w->connections[tpm_context->num_connections],
+                device->device_file);
+            if(ret != TSS2_RC_SUCCESS)
+            {
+                break;
+            }
+            tpm_context_w->free_mask |=
+                (uint64_t)1 << tpm_context->num_connections;
+            tpm_context_w->num_connections++;
+            device->num_connections++;
+        }
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            break;
+        }
+
+        /* A TPM without the properties gets responses of the largest size */
+        memset(&capabilities, 0, sizeof(capabilities));
+        (void)tpm_read_capabilities(
+            &tpm_context_w->connections[device->first_connection],
+            &capabilities);
+        max_random = sizeof(TPMU_HA);
+        if((capabilities.max_digest > 0) &&
+           (capabilities.max_digest < max_random))
+        {
+            max_random = (UINT16)capabilities.max_digest;
+        }
+        for(j = 0; j < device->num_connections; j++)
+        {
+            connection =
+                &tpm_context_w->connections[device->first_connection + j];
+            connection->max_random = max_random;
+#ifdef ENABLE_TCG_SAPI
+            connection->sapi.max_random = max_random;
+#endif
+        }
+        if(i == 0)
+        {
+            tpm_context_w->capabilities = capabilities;
+        }
+    }
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        /* Close the devices and connections opened so far */
+        tpm_close_devices(tpm_context);
+        return ret;
+    }
+
+    tpm_context_w->capabilities.len_key_max = UTA_LEN_KEY_MAX_V1;
+    tpm_context_w->capabilities.num_key_slots = USED_KEY_SLOTS;
+    tpm_context_w->capabilities.resource_manager =
+        (strstr(device_files[0], "tpmrm") != NULL) ? 1 : 0;
+    tpm_context_w->capabilities.num_devices = (uint32_t)num_devices;
+    tpm_context_w->capabilities.num_connections =
+        (uint32_t)tpm_context->num_connections;
+
+    /* The poll handle of the asynchronous connection does not change */
+    tpm_context_w->poll_fd = -1;
+    if(Esys_GetPollHandles(
+        tpm_context->connections[ASYNC_CONNECTION].esys_context,
+        &handles, &count) == TSS2_RC_SUCCESS)
+    {
+        if(count > 0)
+        {
+            tpm_context_w->poll_fd = handles[0].fd;
+        }
+        free(handles);
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+/**
+ * @brief Opens one connection to the TPM: TCTI, ESAPI context and a salted HMAC
+ *      session, or the session saved by a previous process. The ESYS_TR
+ *      handles of the key slots are resolved once. On failure, everything
+ *      opened so far is released again.
+ * @param[in,out] connection Pointer to the connection, its device must be
+ *      set.
+ * @param[in] device_file TPM device file of the connection.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_open_connection(tpm_connection_t *connection,
+        const char *device_file)
+{
+    TSS2_RC ret;
+    size_t size;
+    uint8_t key_slot;
+
+#ifdef ENABLE_TCG_SAPI
+    const TPM2_HANDLE key_handles[USED_KEY_SLOTS] = {
+        TPM_KEY0_HANDLE, TPM_KEY1_HANDLE
+    };
+
+    connection->sapi.sys_context = NULL;
+#endif
+
+    connection->esys_context = NULL;
+    connection->session = ESYS_TR_NONE;
+    connection->salt_handle = ESYS_TR_NONE;
+    connection->deadline = UTA_DEADLINE_NONE;
+    connection->pending = 0;
+    connection->max_random = sizeof(TPMU_HA);
+    for(key_slot = 0; key_slot < USED_KEY_SLOTS; key_slot++)
+    {
+        connection->key_handles[key_slot] = ESYS_TR_NONE;
+    }
+
+    ret = Tss2_Tcti_Device_Init(NULL, &size, 0);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+    connection->tcti_ctx = (TSS2_TCTI_CONTEXT *) calloc(1, size);
+    if(connection->tcti_ctx == NULL)
+    {
+        return TSS2_ESYS_RC_MEMORY;
+    }
+
+    ret = Tss2_Tcti_Device_Init(connection->tcti_ctx, &size, device_file);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        free(connection->tcti_ctx);
+        return ret;
+    }
+
+    ret = Esys_Initialize(&connection->esys_context,
+        connection->tcti_ctx,
+        NULL);
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        Tss2_Tcti_Finalize(connection->tcti_ctx);
+        free(connection->tcti_ctx);
+        return ret;
+    }
+
+#ifdef CONFIGURED_SESSION_CACHE_FILE
+    /* Resume the session, which a previous process saved on the first device */
+    if(connection->device == 0)
+    {
+        (void)tpm_load_session(connection);
+    }
+#endif
+
+    if(connection->session == ESYS_TR_NONE)
+    {
+        ret = tpm_start_session(connection);
+    }
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        tpm_close_connection(connection);
+        return ret;
+    }
+
+    /*
+     * Get the ESYS_TR handles of the key slots once. A key slot, which cannot
+     * be resolved here, is resolved again on its first use.
+     */
+    for(key_slot = 0; key_slot < USED_KEY_SLOTS; key_slot++)
+    {
+        (void)tpm_resolve_key_handle(connection, key_slot);
+    }
+
+#ifdef ENABLE_TCG_SAPI
+    /*
+     * Start the fast path on the same TCTI. Without it, e.g. for a salt key
+     * other than ECC NIST P-256, all commands use the ESAPI session.
+     */
+    (void)tpm_sapi_open(&connection->sapi, connection->tcti_ctx,
+        TPM_SALT_HANDLE, key_handles);
+#endif
+
+    return TSS2_RC_SUCCESS;
+}
+
+/**
+ * @brief Starts the salted HMAC session of a connection with the salt key.
+ * @param[in,out] connection Pointer to the connection without a session. The
+ *      salt key handle and the session are set on success.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_start_session(tpm_connection_t *connection)
+{
+    TSS2_RC ret;
+
+    TPM2_HANDLE TPMKeyHandle = TPM_SALT_HANDLE;
+
+    /* Starting HMAC session */
+    const TPMT_SYM_DEF symmetric = {
+        .algorithm = TPM2_ALG_AES,
+        .keyBits = {.aes = 128},
+        .mode = {.aes = TPM2_ALG_CFB}
+    };
+
+    /* get a ESYS_TR handle for tpmKey */
+    UTA_TRACE_TPM_ENTRY(TPM2_CC_ReadPublic);
+    ret = Esys_TR_FromTPMPublic(
+        connection->esys_context,
+        TPMKeyHandle, /* required */
+        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
+        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
+        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
+        &connection->salt_handle /* required (non-NULL) */
+    );
+    UTA_TRACE_TPM_RETURN(TPM2_CC_ReadPublic, ret);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        connection->salt_handle = ESYS_TR_NONE;
+        return ret;
+    }
+
+    UTA_TRACE_TPM_ENTRY(TPM2_CC_StartAuthSession);
+    ret = Esys_StartAuthSession(
+        connection->esys_context,
+        connection->salt_handle,
+        ESYS_TR_NONE,
+        ESYS_TR_NONE,
+        ESYS_TR_NONE,
+        ESYS_TR_NONE,
+        NULL,
+        TPM2_SE_HMAC,
+        &symmetric,
+        TPM2_ALG_SHA256,
+        &connection->session);
+    UTA_TRACE_TPM_RETURN(TPM2_CC_StartAuthSession, ret);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        connection->session = ESYS_TR_NONE;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Replaces the HMAC session of a connection, which the TPM no longer
+ *      accepts, e.g. after a TPM reset or an eviction by the resource
+ *      manager. The TCTI and the ESAPI context are kept, only the session,
+ *      the salt key and the key slot handles are set up again, and the SAPI
+ *      fast path is restarted, if it switched itself off. The caller must own
+ *      the connection.
+ * @param[in,out] connection Pointer to the connection. Without a session on
+ *      failure, so that the next call tries again.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_recover_session(tpm_connection_t *connection)
+{
+    TSS2_RC ret;
+    uint8_t key_slot;
+#ifdef ENABLE_TCG_SAPI
+    const TPM2_HANDLE key_handles[USED_KEY_SLOTS] = {
+        TPM_KEY0_HANDLE, TPM_KEY1_HANDLE
+    };
+#endif
+
+    /* The old session may still be loaded, if only its nonces are lost */
+    if(connection->session != ESYS_TR_NONE)
+    {
+        if(Esys_FlushContext(connection->esys_context,
+            connection->session) != TSS2_RC_SUCCESS)
+        {
+            (void)Esys_TR_Close(connection->esys_context,
+                &connection->session);
+        }
+        connection->session = ESYS_TR_NONE;
+    }
+
+    /* The handles are resolved again, a reset may have replaced the keys */
+    for(key_slot = 0; key_slot < USED_KEY_SLOTS; key_slot++)
+    {
+        if(connection->key_handles[key_slot] != ESYS_TR_NONE)
+        {
+            (void)Esys_TR_Close(connection->esys_context,
+                &connection->key_handles[key_slot]);
+        }
+    }
+    if(connection->salt_handle != ESYS_TR_NONE)
+    {
+        (void)Esys_TR_Close(connection->esys_context,
+            &connection->salt_handle);
+    }
+
+#ifdef ENABLE_TCG_SAPI
+    /* Reopened first, the ESAPI session is then fresh for the retry */
+    if(connection->sapi.sys_context == NULL)
+    {
+        (void)tpm_sapi_open(&connection->sapi, connection->tcti_ctx,
+            TPM_SALT_HANDLE, key_handles);
+    }
+#endif
+
+    ret = tpm_start_session(connection);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+
+    for(key_slot = 0; key_slot < USED_KEY_SLOTS; key_slot++)
+    {
+        (void)tpm_resolve_key_handle(connection, key_slot);
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+/**
+ * @brief Closes one connection to the TPM, which has been opened by
+ *      tpm_open_connection.
+ * @param[in,out] connection Pointer to the connection.
+ */
+static void tpm_close_connection(tpm_connection_t *connection)
+{
+    uint8_t key_slot;
+
+    /* A response left behind by an expired call is not waited for */
+    connection->deadline = DEADLINE_POLL;
+    (void)tpm_drain_connection(connection);
+
+#ifdef CONFIGURED_SESSION_CACHE_FILE
+    /* Keep the session of the first device for the next process */
+    if((connection->device == 0) && (connection->session != ESYS_TR_NONE))
+    {
+        tpm_save_session(connection);
+    }
+#endif
+
+    /* Close open HMAC-Session */
+    if(connection->session != ESYS_TR_NONE)
+    {
+        (void)Esys_FlushContext(connection->esys_context, connection->session);
+    }
+
+    /* Release the ESYS_TR handles of the key slots and the salt key */
+    for(key_slot = 0; key_slot < USED_KEY_SLOTS; key_slot++)
+    {
+        if(connection->key_handles[key_slot] != ESYS_TR_NONE)
+        {
+            (void)Esys_TR_Close(connection->esys_context,
+                &connection->key_handles[key_slot]);
+        }
+    }
+    if(connection->salt_handle != ESYS_TR_NONE)
+    {
+        (void)Esys_TR_Close(connection->esys_context,
+            &connection->salt_handle);
+    }
+
+#ifdef ENABLE_TCG_SAPI
+    /* Close the session of the fast path, while the TCTI is still open */
+    tpm_sapi_close(&connection->sapi);
+#endif
+
+    /* Remove the TSS context */
+    Esys_Finalize(&connection->esys_context);
+
+    /* Remove the TSS context */
+    Tss2_Tcti_Finalize(connection->tcti_ctx);
+    free(connection->tcti_ctx);
+}
+
+/**
+ * @brief Releases a connection, which the calling process inherited over fork,
+ *      without a TPM command. The session stays valid for the parent and
+ *      closing the inherited file descriptor does not close its connection.
+ * @param[in,out] connection Pointer to the connection.
+ */
+static void tpm_forget_connection(tpm_connection_t *connection)
+{
+    /* ESYS releases the ESYS_TR handles without flushing them */
+    Esys_Finalize(&connection->esys_context);
+#ifdef ENABLE_TCG_SAPI
+    tpm_sapi_forget(&connection->sapi);
+#endif
+
+    Tss2_Tcti_Finalize(connection->tcti_ctx);
+    free(connection->tcti_ctx);
+}
+
+#ifdef CONFIGURED_SESSION_CACHE_FILE
+/**
+ * @brief Loads the session saved by a previous process with ContextLoad. The
+ *      session cache file is removed in any case.
+ * @param[in,out] connection Pointer to the connection. The session is set on
+ *      success.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_load_session(tpm_connection_t *connection)
+{
+    uta_saved_session_t saved;
+    TPMS_CONTEXT context;
+    TSS2_RC ret = TSS2_ESYS_RC_GENERAL_FAILURE;
+
+    if(uta_session_cache_take(CONFIGURED_SESSION_CACHE_FILE, &saved) != 0)
+    {
+        return ret;
+    }
+
+    if(saved.len_blob <= sizeof(context.contextBlob.buffer))
+    {
+        memset(&context, 0, sizeof(context));
+        context.sequence = saved.sequence;
+        context.savedHandle = saved.saved_handle;
+        context.hierarchy = saved.hierarchy;
+        context.contextBlob.size = saved.len_blob;
+        memcpy(context.contextBlob.buffer, saved.blob, saved.len_blob);
+
+        UTA_TRACE_TPM_ENTRY(TPM2_CC_ContextLoad);
+        ret = Esys_ContextLoad(connection->esys_context, &context,
+            &connection->session);
+        UTA_TRACE_TPM_RETURN(TPM2_CC_ContextLoad, ret);
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            connection->session = ESYS_TR_NONE;
+        }
+
+        uta_key_cache_zeroize(&context, sizeof(context));
+    }
+
+    uta_key_cache_zeroize(&saved, sizeof(saved));
+
+    return ret;
+}
+
+/**
+ * @brief Saves the session with ContextSave to the session cache file, unless
+ *      another process has already saved one. If the session cannot be
+ *      stored, it is loaded again, so that it is flushed on close.
+ * @param[in,out] connection Pointer to the connection. The session is reset
+ *      to ESYS_TR_NONE, if it has been saved.
+ */
+static void tpm_save_session(tpm_connection_t *connection)
+{
+    uta_saved_session_t saved;
+    TPMS_CONTEXT *context = NULL;
+    TSS2_RC ret;
+    int stored = 1;
+
+    if(uta_session_cache_exists(CONFIGURED_SESSION_CACHE_FILE) != 0)
+    {
+        return;
+    }
+
+    UTA_TRACE_TPM_ENTRY(TPM2_CC_ContextSave);
+    ret = Esys_ContextSave(connection->esys_context, connection->session,
+        &context);
+    UTA_TRACE_TPM_RETURN(TPM2_CC_ContextSave, ret);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return;
+    }
+
+    /* ESYS releases the ESYS_TR of a saved session */
+    connection->session = ESYS_TR_NONE;
+
+    if(context->contextBlob.size <= sizeof(saved.blob))
+    {
+        saved.sequence = context->sequence;
+        saved.saved_handle = context->savedHandle;
+        saved.hierarchy = context->hierarchy;
+        saved.len_blob = context->contextBlob.size;
+        memcpy(saved.blob, context->contextBlob.buffer, saved.len_blob);
+        /* ESYS keeps the session state in the context blob */
+        saved.len_state = 0;
+        stored = uta_session_cache_put(CONFIGURED_SESSION_CACHE_FILE, &saved);
+        uta_key_cache_zeroize(&saved, sizeof(saved));
+    }
+
+    if(stored != 0)
+    {
+        UTA_TRACE_TPM_ENTRY(TPM2_CC_ContextLoad);
+        ret = Esys_ContextLoad(connection->esys_context, context,
+            &connection->session);
+        UTA_TRACE_TPM_RETURN(TPM2_CC_ContextLoad, ret);
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            connection->session = ESYS_TR_NONE;
+        }
+    }
+
+    uta_key_cache_zeroize(context, sizeof(*context));
+    free(context);
+}
+#endif
+
+/**
+ * @brief Closes all connections and releases all devices of the context, which
+ *      have been opened by tpm_open_devices.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ */
+static void tpm_close_devices(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    size_t i;
+
+    for(i = 0; i < tpm_context->num_connections; i++)
+    {
+        tpm_close_connection(&tpm_context_w->connections[i]);
+    }
+    tpm_context_w->num_connections = 0;
+
+    for(i = 0; i < tpm_context->num_devices; i++)
+    {
+        /* Destroy the scheduler of the device connections */
+        uta_sched_destroy(&tpm_context_w->devices[i].sched);
+        free(tpm_context_w->devices[i].device_file);
+    }
+    tpm_context_w->num_devices = 0;
+}
+
+/**
+ * @brief Reads the fixed TPM properties of the capabilities from the device
+ *      of a connection. Properties, which the TPM does not report, are left
+ *      unchanged.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[in,out] capabilities Pointer to the capabilities.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_read_capabilities(tpm_connection_t *connection,
+        uta_capabilities_v1_t *capabilities)
+{
+    TSS2_RC ret;
+    TPMI_YES_NO moreData;
+    TPMS_CAPABILITY_DATA *capabilityData;
+    const TPMS_TAGGED_PROPERTY *property;
+    UINT32 i;
+
+    /* All properties of interest are read with one command */
+    UTA_TRACE_TPM_ENTRY(TPM2_CC_GetCapability);
+    ret = Esys_GetCapability(
+        connection->esys_context,
+        ESYS_TR_NONE,
+        ESYS_TR_NONE,
+        ESYS_TR_NONE,
+        TPM2_CAP_TPM_PROPERTIES,
+        TPM2_PT_MANUFACTURER,
+        TPM2_PT_MAX_DIGEST - TPM2_PT_MANUFACTURER + 1,
+        &moreData,
+        &capabilityData);
+    UTA_TRACE_TPM_RETURN(TPM2_CC_GetCapability, ret);
+
+    /* capabilityData is only allocated on success */
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+
+    for(i = 0; i < capabilityData->data.tpmProperties.count; i++)
+    {
+        property = &capabilityData->data.tpmProperties.tpmProperty[i];
+        switch(property->property)
+        {
+        case TPM2_PT_MANUFACTURER:
+            capabilities->manufacturer = property->value;
+            break;
+        case TPM2_PT_FIRMWARE_VERSION_1:
+            capabilities->firmware_version_1 = property->value;
+            break;
+        case TPM2_PT_FIRMWARE_VERSION_2:
+            capabilities->firmware_version_2 = property->value;
+            break;
+        case TPM2_PT_INPUT_BUFFER:
+            capabilities->input_buffer = property->value;
+            break;
+        case TPM2_PT_MAX_DIGEST:
+            capabilities->max_digest = property->value;
+            break;
+        default:
+            break;
+        }
+    }
+    free(capabilityData);
+
+    return TSS2_RC_SUCCESS;
+}
+
+/**
+ * @brief Re-establishes a context, which the calling process inherited over
+ *      fork. The connections of the parent are dropped without a TPM command,
+ *      so that its sessions stay valid, and the locks, the pending
+ *      asynchronous operation, the key cache and the statistics are reset.
+ *      With reopen, the child opens its own connections to the same devices
+ *      and seeds a selected DRBG again or restarts the prefetch, so that it
+ *      does not repeat the random numbers of the parent. If the connections
+ *      cannot be opened, all calls fail until the context is closed.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] reopen 1 to open new connections, 0 if the context is closed.
+ * @return UTA return code.
+ */
+static uta_rc tpm_check_fork(const uta_context_v1_t *tpm_context, int reopen)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    char *device_files[CONFIGURED_TPM_POOL_MAX];
+    size_t connections_per_device;
+    size_t num_devices;
+    size_t prefetch_size;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    uta_rc rc = UTA_SUCCESS;
+    size_t i;
+
+    /* Fast path in the process, which opened the context */
+    if(uta_fork_detected(&tpm_context->fork_generation) == 0)
+    {
+        return UTA_SUCCESS;
+    }
+
+    uta_fork_lock();
+
+    /* Another thread of the child may have been faster */
+    if(uta_fork_detected(&tpm_context->fork_generation) == 0)
+    {
+        uta_fork_unlock();
+        return UTA_SUCCESS;
+    }
+
+    /* No device is left, if opening the connections failed before */
+    num_devices = tpm_context->num_devices;
+    if(num_devices == 0)
+    {
+        if(reopen == 0)
+        {
+            (void)uta_fork_init(&tpm_context_w->fork_generation);
+        }
+        uta_fork_unlock();
+        return (reopen == 0) ? UTA_SUCCESS : UTA_TA_ERROR;
+    }
+    connections_per_device = tpm_context->devices[0].num_connections;
+
+    for(i = 0; i < tpm_context->num_connections; i++)
+    {
+        tpm_forget_connection(&tpm_context_w->connections[i]);
+    }
+    tpm_context_w->num_connections = 0;
+    tpm_context_w->free_mask = 0;
+
+    for(i = 0; i < num_devices; i++)
+    {
+        /* The scheduler may be locked, it is initialized again on reopen */
+        device_files[i] = tpm_context->devices[i].device_file;
+    }
+    tpm_context_w->num_devices = 0;
+    tpm_context_w->poll_fd = -1;
+
+    /* Threads of the parent may have held the locks during the fork */
+    (void)pthread_mutex_init(&tpm_context_w->accesslock, NULL);
+    (void)pthread_mutex_init(&tpm_context_w->asynclock, NULL);
+#ifdef ENABLE_DRBG
+    (void)pthread_mutex_init(&tpm_context_w->drbglock, NULL);
+#endif
+    tpm_context_w->async_kind = ASYNC_NONE;
+
+    uta_key_cache_after_fork(&tpm_context_w->key_cache);
+    prefetch_size = uta_prefetch_after_fork(&tpm_context_w->prefetch);
+    uta_stats_reset(&tpm_context_w->stats);
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+    uta_latency_record_init(&tpm_context_w->latency_record);
+#endif
+
+    if(reopen != 0)
+    {
+        ret = tpm_open_connections(tpm_context,
+            (const char * const *)device_files, num_devices,
+            connections_per_device);
+    }
+
+    for(i = 0; i < num_devices; i++)
+    {
+        free(device_files[i]);
+    }
+
+#ifdef ENABLE_DRBG
+    /* Without new connections, the DRBG is cleared on close */
+    if((reopen != 0) && (tpm_context->drbg.seeded != 0))
+    {
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            rc = tpm_drbg_start(tpm_context, tpm_context->drbg.reseed_bytes,
+                tpm_context->drbg.reseed_interval, UTA_DEADLINE_NONE);
+        }
+        else
+        {
+            tpm_drbg_stop(tpm_context);
+        }
+    }
+#endif
+
+    /* The child fills its own ring, the bytes of the parent are wiped */
+    if((reopen != 0) && (ret == TSS2_RC_SUCCESS) && (prefetch_size != 0))
+    {
+        rc = uta_prefetch_start(&tpm_context_w->prefetch, tpm_prefetch_fill,
+            tpm_context_w, prefetch_size);
+    }
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        rc = UTA_TA_ERROR;
+    }
+    else
+    {
+        (void)uta_fork_init(&tpm_context_w->fork_generation);
+    }
+
+    uta_fork_unlock();
+
+    return rc;
+}
+
+/**
+ * @brief Takes a free connection from the pool. The device is selected by the
+ *      number of outstanding requests, where failed devices and the devices
+ *      in tried_devices are only used if no other device is left. Ties are
+ *      resolved round-robin.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] tried_devices Bit mask of the devices, which already failed for
+ *      the current request.
+ * @param[in] op Operation of the access for the latency recording,
+ *      UTA_STATS_NUM_OPS if it is not recorded.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return Pointer to the connection, NULL on error or timeout.
+ */
+static tpm_connection_t *tpm_acquire_connection(
+        const uta_context_v1_t *tpm_context, uint64_t tried_devices,
+        uta_stats_op_t op, uint64_t deadline)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    uint64_t score;
+    uint64_t best_score = 0;
+    size_t best = 0;
+    size_t start;
+    size_t device;
+    size_t i;
+    int64_t now;
+
+    /* A single device needs no selection */
+    if(tpm_context->num_devices == 1)
+    {
+        return tpm_acquire_device_connection(tpm_context, 0, op, deadline);
+    }
+
+    now = tpm_now();
+    start = __atomic_fetch_add(&tpm_context_w->next_device, 1,
+        __ATOMIC_RELAXED);
+
+    for(i = 0; i < tpm_context->num_devices; i++)
+    {
+        device = (start + i) % tpm_context->num_devices;
+
+        score = __atomic_load_n(&tpm_context->devices[device].outstanding,
+            __ATOMIC_RELAXED);
+        if(__atomic_load_n(&tpm_context->devices[device].failed_until,
+            __ATOMIC_RELAXED) > now)
+        {
+            score += DEVICE_SCORE_FAILED;
+        }
+        if((tried_devices & ((uint64_t)1 << device)) != 0)
+        {
+            score += DEVICE_SCORE_TRIED;
+        }
+
+        if((i == 0) || (score < best_score))
+        {
+            best = device;
+            best_score = score;
+        }
+    }
+
+    return tpm_acquire_device_connection(tpm_context, best, op, deadline);
+}
+
+/**
+ * @brief Takes a free connection of the given device. Blocks until a
+ *      connection of the device is returned by another thread, if all of them
+ *      are in use, but not beyond the deadline.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] device Index of the device.
+ * @param[in] op Operation of the access for the latency recording.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return Pointer to the connection, NULL on error or timeout.
+ */
+static tpm_connection_t *tpm_acquire_device_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op, uint64_t deadline)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_device_t *tpm_device = &tpm_context_w->devices[device];
+
+    (void)__atomic_add_fetch(&tpm_device->outstanding, 1, __ATOMIC_RELAXED);
+
+    /*
+     * Wait until a connection is granted to the priority class of the call,
+     * the scheduler counts the bits in free_mask
+     */
+    if(uta_sched_acquire(&tpm_device->sched, &tpm_context_w->stats,
+        uta_sched_class(op), deadline) != UTA_SUCCESS)
+    {
+        (void)__atomic_sub_fetch(&tpm_device->outstanding, 1,
+            __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    return tpm_claim_connection(tpm_context, device, op, deadline);
+}
+
+/**
+ * @brief Takes a free connection of the given device without blocking.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] device Index of the device.
+ * @param[in] op Operation of the access for the latency recording.
+ * @return Pointer to the connection, NULL if all connections are in use or
+ *      the response of an expired call is still pending.
+ */
+static tpm_connection_t *tpm_try_acquire_device_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_device_t *tpm_device = &tpm_context_w->devices[device];
+    tpm_connection_t *connection;
+
+    if(uta_sched_try_acquire(&tpm_device->sched, uta_sched_class(op)) != 0)
+    {
+        return NULL;
+    }
+
+    (void)__atomic_add_fetch(&tpm_device->outstanding, 1, __ATOMIC_RELAXED);
+
+    /* The response of an expired call is only polled, not waited for */
+    connection = tpm_claim_connection(tpm_context, device, op, DEADLINE_POLL);
+    if(connection != NULL)
+    {
+        connection->deadline = UTA_DEADLINE_NONE;
+    }
+
+    return connection;
+}
+
+/**
+ * @brief Claims a free connection of the given device, after the caller took
+ *      one unit of the scheduler of the device. The response of a command,
+ *      which an earlier call left behind at its deadline, is read first.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] device Index of the device.
+ * @param[in] op Operation of the access for the latency recording.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return Pointer to the connection, NULL if the pending response did not
+ *      arrive before the deadline.
+ */
+static tpm_connection_t *tpm_claim_connection(
+        const uta_context_v1_t *tpm_context, size_t device,
+        uta_stats_op_t op, uint64_t deadline)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_device_t *tpm_device = &tpm_context_w->devices[device];
+    uint64_t device_mask;
+    uint64_t mask;
+    int index;
+
+    device_mask = (tpm_device->num_connections == 64) ? ~(uint64_t)0 :
+        (((uint64_t)1 << tpm_device->num_connections) - 1);
+    device_mask <<= tpm_device->first_connection;
+
+    /*
+     * Claim the highest free bit of the device. The asynchronous connection
+     * has bit 0 and is therefore only used by synchronous calls if all other
+     * connections of the first device are busy.
+     */
+    mask = __atomic_load_n(&tpm_context_w->free_mask, __ATOMIC_ACQUIRE);
+    do
+    {
+        index = 63 - __builtin_clzll(mask & device_mask);
+    } while(!__atomic_compare_exchange_n(&tpm_context_w->free_mask, &mask,
+        mask & ~((uint64_t)1 << index), 0, __ATOMIC_ACQUIRE,
+        __ATOMIC_ACQUIRE));
+
+    /* The trust anchor access is timed until the release */
+    tpm_context_w->connections[index].acquired = uta_stats_now();
+    tpm_context_w->connections[index].op = op;
+    tpm_context_w->connections[index].deadline = deadline;
+
+    if(tpm_drain_connection(&tpm_context_w->connections[index]) !=
+       TSS2_RC_SUCCESS)
+    {
+        tpm_release_connection(tpm_context,
+            &tpm_context_w->connections[index]);
+        return NULL;
+    }
+
+    return &tpm_context_w->connections[index];
+}
+
+/**
+ * @brief Takes the asynchronous connection from the pool without blocking.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] op Operation of the submission, which selects the priority
+ *      class.
+ * @return Pointer to the connection, NULL if it is in use or the response of
+ *      an expired call is still pending.
+ */
+static tpm_connection_t *tpm_try_acquire_async_connection(
+        const uta_context_v1_t *tpm_context, uta_stats_op_t op)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_connection_t *connection =
+        &tpm_context_w->connections[ASYNC_CONNECTION];
+    tpm_device_t *tpm_device = &tpm_context_w->devices[connection->device];
+    const uint64_t bit = (uint64_t)1 << ASYNC_CONNECTION;
+
+    if(uta_sched_try_acquire(&tpm_device->sched, uta_sched_class(op)) != 0)
+    {
+        return NULL;
+    }
+
+    /* Another connection is free, but not the asynchronous one */
+    if((__atomic_fetch_and(&tpm_context_w->free_mask, ~bit,
+        __ATOMIC_ACQUIRE) & bit) == 0)
+    {
+        uta_sched_release(&tpm_device->sched);
+        return NULL;
+    }
+
+    (void)__atomic_add_fetch(&tpm_device->outstanding, 1, __ATOMIC_RELAXED);
+
+    /* The asynchronous connection is held between the calls, it is not timed */
+    connection->acquired = 0;
+
+    /* A synchronous call may have left a response behind on the connection */
+    connection->deadline = DEADLINE_POLL;
+    if(tpm_drain_connection(connection) != TSS2_RC_SUCCESS)
+    {
+        tpm_release_connection(tpm_context, connection);
+        return NULL;
+    }
+    connection->deadline = UTA_DEADLINE_NONE;
+
+    return connection;
+}
+
+/**
+ * @brief Returns a connection to the pool.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] connection Connection taken by tpm_acquire_connection,
+ *      tpm_acquire_device_connection or tpm_try_acquire_async_connection.
+ */
+static void tpm_release_connection(const uta_context_v1_t *tpm_context,
+        tpm_connection_t *connection)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_device_t *tpm_device = &tpm_context_w->devices[connection->device];
+    size_t index = connection - tpm_context_w->connections;
+
+    if(connection->acquired != 0)
+    {
+        uta_stats_ta_access(&tpm_context_w->stats, connection->acquired);
+#ifdef CONFIGURED_LATENCY_RECORD_FILE
+        uta_latency_record_add(&tpm_context_w->latency_record, connection->op,
+            uta_stats_now() - connection->acquired);
+#endif
+    }
+
+    (void)__atomic_fetch_or(&tpm_context_w->free_mask, (uint64_t)1 << index,
+        __ATOMIC_RELEASE);
+    uta_sched_release(&tpm_device->sched);
+    (void)__atomic_sub_fetch(&tpm_device->outstanding, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Marks the device of a connection as failed, so that other devices
+ *      are preferred for DEVICE_RETRY_INTERVAL seconds.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] connection Connection, on which a command failed.
+ */
+static void tpm_device_failed(const uta_context_v1_t *tpm_context,
+        const tpm_connection_t *connection)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    __atomic_store_n(&tpm_context_w->devices[connection->device].failed_until,
+        tpm_now() + DEVICE_RETRY_INTERVAL, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the seconds of the monotonic clock.
+ * @return Seconds since an unspecified starting point.
+ */
+static int64_t tpm_now(void)
+{
+    struct timespec now;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+    {
+        return 0;
+    }
+
+    return (int64_t)now.tv_sec;
+}
+
+/**
+ * @brief Checks the parameters of a key derivation.
+ * @param[in] len_key Requested number of key bytes.
+ * @param[in] len_dv Length in bytes of the derivation value.
+ * @param[in] key_slot Requested key slot.
+ * @return UTA return code.
+ */
+static uta_rc tpm_check_derive_args(size_t len_key, size_t len_dv,
+        uint8_t key_slot)
+{
+    if(key_slot > (USED_KEY_SLOTS-1))
+    {
+        return UTA_INVALID_KEY_SLOT;
+    }
+
+    if(len_dv != DERIV_STR_LEN)
+    {
+        return UTA_INVALID_DV_LENGTH;
+    }
+
+    if(len_key > 32)
+    {
+        return UTA_INVALID_KEY_LENGTH;
+    }
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Gets the ESYS_TR handle of a key slot and stores it in the connection.
+ *      A previously resolved handle of the key slot is closed. The caller must
+ *      own the connection.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[in] key_slot Key slot, which has already been checked.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_resolve_key_handle(tpm_connection_t *connection,
+        uint8_t key_slot)
+{
+    TPM2_HANDLE TPMhmacKeyHandle = (key_slot == 0x00) ? TPM_KEY0_HANDLE :
+        TPM_KEY1_HANDLE;
+    TSS2_RC ret;
+
+    if(connection->key_handles[key_slot] != ESYS_TR_NONE)
+    {
+        (void)Esys_TR_Close(connection->esys_context,
+            &connection->key_handles[key_slot]);
+    }
+    connection->key_handles[key_slot] = ESYS_TR_NONE;
+
+    UTA_TRACE_TPM_ENTRY(TPM2_CC_ReadPublic);
+    ret = Esys_TR_FromTPMPublic(
+        connection->esys_context,
+        TPMhmacKeyHandle, /* required */
+        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
+        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
+        ESYS_TR_NONE, /* optional (ESYS_TR_NONE) */
+        &connection->key_handles[key_slot] /* required (non-NULL) */
+    );
+    UTA_TRACE_TPM_RETURN(TPM2_CC_ReadPublic, ret);
+
+    return ret;
+}
+
+/**
+ * @brief Checks if a TSS return code reports an invalid or unknown handle.
+ * @param[in] ret TCG TSS return code.
+ * @return 1 in case of a handle error, 0 otherwise.
+ */
+static int tpm_is_handle_error(TSS2_RC ret)
+{
+    /* ESYS_TR unknown to the ESAPI */
+    if(ret == TSS2_ESYS_RC_BAD_TR)
+    {
+        return 1;
+    }
+
+    /* The remaining checks only apply to TPM response codes */
+    if(((ret & TSS2_RC_LAYER_MASK) != TSS2_TPM_RC_LAYER) &&
+       ((ret & TSS2_RC_LAYER_MASK) != TSS2_RESMGR_TPM_RC_LAYER))
+    {
+        return 0;
+    }
+    ret &= ~TSS2_RC_LAYER_MASK;
+
+    /* Format one TPM2_RC_HANDLE error for any of the handles */
+    if((ret & (TPM2_RC_FMT1 | 0x3F)) == TPM2_RC_HANDLE)
+    {
+        return 1;
+    }
+
+    /* Handle references a transient object that is not loaded */
+    if((ret >= TPM2_RC_REFERENCE_H0) && (ret <= TPM2_RC_REFERENCE_H6))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Checks if a TSS return code reports, that the HMAC session of a
+ *      connection cannot be used any more: the TPM does not know the session,
+ *      e.g. after a TPM reset or an eviction by the resource manager, or the
+ *      nonces of the session are out of sync. Authorization failures, which
+ *      count for the dictionary attack protection, are not included.
+ * @param[in] ret TCG TSS return code.
+ * @return 1 in case of a session error, 0 otherwise.
+ */
+static int tpm_is_session_error(TSS2_RC ret)
+{
+    /* The HMAC of the response does not match the nonces of the session */
+    if(ret == TSS2_ESYS_RC_RSP_AUTH_FAILED)
+    {
+        return 1;
+    }
+
+    /* The remaining checks only apply to TPM response codes */
+    if(((ret & TSS2_RC_LAYER_MASK) != TSS2_TPM_RC_LAYER) &&
+       ((ret & TSS2_RC_LAYER_MASK) != TSS2_RESMGR_TPM_RC_LAYER))
+    {
+        return 0;
+    }
+    ret &= ~TSS2_RC_LAYER_MASK;
+
+    /* Session, which is not loaded */
+    if((ret >= TPM2_RC_REFERENCE_S0) && (ret <= TPM2_RC_REFERENCE_S6))
+    {
+        return 1;
+    }
+
+    /* Format one error of a session, a parameter number may also set bit 11 */
+    if(((ret & TPM2_RC_FMT1) == 0) || ((ret & TPM2_RC_P) != 0) ||
+       ((ret & TPM2_RC_S) == 0))
+    {
+        return 0;
+    }
+    switch(ret & (TPM2_RC_FMT1 | 0x3F))
+    {
+    case TPM2_RC_HANDLE:
+    case TPM2_RC_NONCE:
+    case TPM2_RC_BAD_AUTH:
+    case TPM2_RC_EXPIRED:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Checks if a TSS return code reports, that a response has not arrived
+ *      in time.
+ * @param[in] ret TCG TSS return code.
+ * @return 1 in case of a timeout, 0 otherwise.
+ */
+static int tpm_is_timeout(TSS2_RC ret)
+{
+    return ((ret & ~TSS2_RC_LAYER_MASK) == TSS2_BASE_RC_TRY_AGAIN) ? 1 : 0;
+}
+
+/**
+ * @brief Returns the session attributes of a parameter encryption mode for a
+ *      command with a command and a response parameter.
+ * @param[in] mode Parameter encryption mode.
+ * @return Session attributes, which continue the session.
+ */
+static TPMA_SESSION tpm_session_attributes(uta_param_enc_t mode)
+{
+    switch(mode)
+    {
+    case UTA_PARAM_ENC_RESPONSE:
+        return TPMA_SESSION_CONTINUESESSION | TPMA_SESSION_ENCRYPT;
+    case UTA_PARAM_ENC_AUDIT:
+        /* A session without authorization needs one of the attributes */
+        return TPMA_SESSION_CONTINUESESSION | TPMA_SESSION_AUDIT;
+    default:
+        return TPMA_SESSION_CONTINUESESSION | TPMA_SESSION_ENCRYPT |
+            TPMA_SESSION_DECRYPT;
+    }
+}
+
+/**
+ * @brief Maps a TSS return code to the UTA return code of a call.
+ * @param[in] ret TCG TSS return code.
+ * @return UTA_SUCCESS, UTA_TIMEOUT or UTA_TA_ERROR.
+ */
+static uta_rc tpm_uta_rc(TSS2_RC ret)
+{
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        return UTA_SUCCESS;
+    }
+
+    return (tpm_is_timeout(ret) != 0) ? UTA_TIMEOUT : UTA_TA_ERROR;
+}
+
+/**
+ * @brief Derives the value of the device UUID with a primary key of the
+ *      endorsement hierarchy, which is created for the HMAC and flushed
+ *      afterwards.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[out] outHMAC Pointer to the HMAC, which has to be freed by the caller.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_derive_uuid(tpm_connection_t *connection,
+        TPM2B_DIGEST **outHMAC)
+{
+    TSS2_RC ret;
+
+    ESYS_TR primaryHandle = ESYS_TR_NONE;
+
+    TPM2B_AUTH authValuePrimary = {
+        .size = 0,
+        .buffer = {}
+    };
+
+    TPM2B_SENSITIVE_CREATE inSensitivePrimary = {
+        .size = 4,
+        .sensitive = {
+            .userAuth = {
+                 .size = 0,
+                 .buffer = {0 },
+             },
+            .data = {
+                 .size = 0,
+                 .buffer = {0},
+             },
+        },
+    };
+    inSensitivePrimary.sensitive.userAuth = authValuePrimary;
+    TPM2B_PUBLIC inPublic = { 0 };
+
+    TPM2B_DATA outsideInfo = {
+        .size = 0,
+        .buffer = {},
+    };
+    TPML_PCR_SELECTION creationPCR = {
+        .count = 0,
+    };
+
+    TPM2B_MAX_BUFFER dv_buffer = { .size = 8,
+                                   .buffer={0x44, 0x45, 0x56, 0x49,
+                                            0x43, 0x45, 0x49, 0x44}} ;
+
+    TPMA_SESSION sessionAttributes = TPMA_SESSION_CONTINUESESSION |
+        TPMA_SESSION_ENCRYPT | TPMA_SESSION_DECRYPT;
+
+    inPublic.publicArea.nameAlg = TPM2_ALG_SHA256;
+    inPublic.publicArea.type = TPM2_ALG_KEYEDHASH;
+    inPublic.publicArea.objectAttributes |= TPMA_OBJECT_SIGN_ENCRYPT;
+    inPublic.publicArea.objectAttributes |= TPMA_OBJECT_USERWITHAUTH;
+    inPublic.publicArea.objectAttributes |= TPMA_OBJECT_SENSITIVEDATAORIGIN;
+    inPublic.publicArea.parameters.keyedHashDetail.scheme.scheme =
+        TPM2_ALG_HMAC;
+    inPublic.publicArea.parameters.keyedHashDetail.scheme.details.hmac.hashAlg =
+        TPM2_ALG_SHA256;
+
+    UTA_TRACE_TPM_ENTRY(TPM2_CC_CreatePrimary);
+    ret = Esys_CreatePrimary(
+        connection->esys_context,
+        ESYS_TR_RH_ENDORSEMENT,
+        ESYS_TR_PASSWORD,
+        ESYS_TR_NONE,
+        ESYS_TR_NONE,
+        &inSensitivePrimary,
+        &inPublic,
+        &outsideInfo,
+        &creationPCR,
+        &primaryHandle,
+        NULL,
+        NULL,
+        NULL,
+        NULL);
+    UTA_TRACE_TPM_RETURN(TPM2_CC_CreatePrimary, ret);
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+
+    ret = Esys_TR_SetAuth(
+        connection->esys_context,
+        primaryHandle,
+        &authValuePrimary);
+
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        ret = Esys_TRSess_SetAttributes(
+            connection->esys_context,
+            connection->session,
+            sessionAttributes,
+            0xff);
+    }
+
+    if(ret == TSS2_RC_SUCCESS)
+    {
+#ifdef ENABLE_TEST_HOOKS
+        tpm_test_flush_session(connection);
+#endif
+
+        UTA_TRACE_TPM_ENTRY(TPM2_CC_HMAC);
+        ret = Esys_HMAC(
+            connection->esys_context,
+            primaryHandle,
+            ESYS_TR_PASSWORD,
+            connection->session,
+            ESYS_TR_NONE,
+            &dv_buffer,
+            TPM2_ALG_SHA256,
+            outHMAC);
+        UTA_TRACE_TPM_RETURN(TPM2_CC_HMAC, ret);
+    }
+
+    /* Flush endorsement key */
+    (void)Esys_FlushContext(connection->esys_context, primaryHandle);
+
+    return ret;
+}
+
+/**
+ * @brief Sends an HMAC command on the connection. Without a deadline the
+ *      synchronous ESAPI call is used, otherwise the response is awaited by
+ *      tpm_finish until the deadline of the connection.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[in] key_slot Key slot, whose handle has already been resolved.
+ * @param[in] dv_buffer Derivation value.
+ * @param[out] outHMAC HMAC allocated by the ESAPI, only set on success.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_hmac(tpm_connection_t *connection, uint8_t key_slot,
+        const TPM2B_MAX_BUFFER *dv_buffer, TPM2B_DIGEST **outHMAC)
+{
+    TSS2_RC ret;
+
+#ifdef ENABLE_TEST_HOOKS
+    tpm_test_flush_session(connection);
+#endif
+
+    UTA_TRACE_TPM_ENTRY(TPM2_CC_HMAC);
+    if(connection->deadline == UTA_DEADLINE_NONE)
+    {
+        ret = Esys_HMAC(
+            connection->esys_context,
+            connection->key_handles[key_slot],
+            ESYS_TR_PASSWORD,
+            connection->session,
+            ESYS_TR_NONE,
+            dv_buffer,
+            TPM2_ALG_SHA256,
+            outHMAC);
+        UTA_TRACE_TPM_RETURN(TPM2_CC_HMAC, ret);
+        return ret;
+    }
+
+    ret = Esys_HMAC_Async(
+        connection->esys_context,
+        connection->key_handles[key_slot],
+        ESYS_TR_PASSWORD,
+        connection->session,
+        ESYS_TR_NONE,
+        dv_buffer,
+        TPM2_ALG_SHA256);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        UTA_TRACE_TPM_RETURN(TPM2_CC_HMAC, ret);
+        return ret;
+    }
+
+    return tpm_finish(connection, TPM2_CC_HMAC, outHMAC);
+}
+
+/**
+ * @brief Sends a GetRandom command on the connection, like tpm_hmac.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[in] bytesRequested Number of random bytes.
+ * @param[out] randomBytes Random bytes allocated by the ESAPI, only set on
+ *      success.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_get_random_command(tpm_connection_t *connection,
+        UINT16 bytesRequested, TPM2B_DIGEST **randomBytes)
+{
+    TSS2_RC ret;
+
+    UTA_TRACE_TPM_ENTRY(TPM2_CC_GetRandom);
+    if(connection->deadline == UTA_DEADLINE_NONE)
+    {
+        ret = Esys_GetRandom(
+            connection->esys_context,
+            connection->session,
+            ESYS_TR_NONE,
+            ESYS_TR_NONE,
+            bytesRequested,
+            randomBytes);
+        UTA_TRACE_TPM_RETURN(TPM2_CC_GetRandom, ret);
+        return ret;
+    }
+
+    ret = Esys_GetRandom_Async(
+        connection->esys_context,
+        connection->session,
+        ESYS_TR_NONE,
+        ESYS_TR_NONE,
+        bytesRequested);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        UTA_TRACE_TPM_RETURN(TPM2_CC_GetRandom, ret);
+        return ret;
+    }
+
+    return tpm_finish(connection, TPM2_CC_GetRandom, randomBytes);
+}
+
+/**
+ * @brief Waits for the response of an HMAC or GetRandom command, which has
+ *      been sent with the asynchronous ESAPI call. The TCTI timeout is set to
+ *      the time left until the deadline of the connection. If the response
+ *      does not arrive in time, the command is recorded as pending, so that
+ *      the next owner of the connection reads and discards the response.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[in] command TPM2_CC_HMAC or TPM2_CC_GetRandom.
+ * @param[out] output Response allocated by the ESAPI, only set on success.
+ * @return TCG TSS return code, a TRY_AGAIN code on timeout.
+ */
+static TSS2_RC tpm_finish(tpm_connection_t *connection, TPM2_CC command,
+        TPM2B_DIGEST **output)
+{
+    TSS2_RC ret;
+    int32_t remaining_ms;
+
+    do
+    {
+        remaining_ms = uta_deadline_remaining_ms(connection->deadline);
+        (void)Esys_SetTimeout(connection->esys_context,
+            (remaining_ms < 0) ? TSS2_TCTI_TIMEOUT_BLOCK : remaining_ms);
+        if(command == TPM2_CC_HMAC)
+        {
+            ret = Esys_HMAC_Finish(connection->esys_context, output);
+        }
+        else
+        {
+            ret = Esys_GetRandom_Finish(connection->esys_context, output);
+        }
+    } while((tpm_is_timeout(ret) != 0) && (remaining_ms != 0));
+    (void)Esys_SetTimeout(connection->esys_context, TSS2_TCTI_TIMEOUT_BLOCK);
+
+    if(tpm_is_timeout(ret) != 0)
+    {
+        connection->pending = command;
+        return ret;
+    }
+
+    UTA_TRACE_TPM_RETURN(command, ret);
+    connection->pending = 0;
+
+    return ret;
+}
+
+/**
+ * @brief Reads the response of a command, which has been left pending by an
+ *      expired call, before the connection is used again. The response is
+ *      discarded.
+ * @param[in,out] connection Pointer to the connection.
+ * @return TSS2_RC_SUCCESS if the connection is ready, a TRY_AGAIN code if
+ *      the response did not arrive before the deadline of the connection.
+ */
+static TSS2_RC tpm_drain_connection(tpm_connection_t *connection)
+{
+    TSS2_RC ret;
+    TPM2B_DIGEST *output;
+
+    if(connection->pending == 0)
+    {
+        return TSS2_RC_SUCCESS;
+    }
+
+    ret = tpm_finish(connection, connection->pending, &output);
+    if(tpm_is_timeout(ret) != 0)
+    {
+        return ret;
+    }
+
+    /* A failed command leaves the connection ready as well */
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        uta_key_cache_zeroize(output, sizeof(*output));
+        free(output);
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+/**
+ * @brief Calculates an HMAC-SHA256 over the derivation value on the TPM. The
+ *      caller must own the connection. If the TPM reports a handle error, the
+ *      key slot handle is resolved again, if it reports a session error, the
+ *      session is started again, and the HMAC is retried once. An active SAPI
+ *      fast path is used instead of the ESAPI session.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[out] key Pointer to the buffer where the derived key is written to.
+ * @param[in] len_key Number of bytes, which should be written to key.
+ * @param[in] dv Pointer to the derivation value (DERIV_STR_LEN bytes).
+ * @param[in] key_slot Key slot, which has already been checked.
+ * @param[in] attributes Session attributes of the command.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_calc_hmac(tpm_connection_t *connection,
+        uint8_t *key, size_t len_key, const uint8_t *dv, uint8_t key_slot,
+        TPMA_SESSION attributes)
+{
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    int retry;
+
+    TPM2B_MAX_BUFFER dv_buffer = { .size = DERIV_STR_LEN,
+                                   .buffer={0}} ;
+    TPM2B_DIGEST *outHMAC;
+
+#ifdef ENABLE_TCG_SAPI
+    /* The SAPI fast path blocks, a deadline needs the asynchronous ESAPI */
+    if((connection->sapi.sys_context != NULL) &&
+       (connection->deadline == UTA_DEADLINE_NONE))
+    {
+        ret = tpm_calc_hmac_sapi(connection, key, len_key, dv, key_slot,
+            attributes);
+
+        /* Continue with the ESAPI, if the fast path switched itself off */
+        if((ret == TSS2_RC_SUCCESS) || (connection->sapi.sys_context != NULL))
+        {
+            return ret;
+        }
+    }
+#endif
+
+    memcpy(dv_buffer.buffer, dv, DERIV_STR_LEN);
+
+    /* Start the session again, if an earlier recovery has failed */
+    if(connection->session == ESYS_TR_NONE)
+    {
+        ret = tpm_recover_session(connection);
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    /* Resolve the key slot, if this has not been possible during open */
+    if(connection->key_handles[key_slot] == ESYS_TR_NONE)
+    {
+        ret = tpm_resolve_key_handle(connection, key_slot);
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    for(retry = 0; retry < 2; retry++)
+    {
+        ret = Esys_TRSess_SetAttributes(connection->esys_context,
+            connection->session,
+            attributes,
+            0xff);
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            return ret;
+        }
+
+        ret = tpm_hmac(connection, key_slot, &dv_buffer, &outHMAC);
+
+        if((ret == TSS2_RC_SUCCESS) || (retry > 0))
+        {
+            break;
+        }
+
+        /* A session error also reports the session handle as invalid */
+        if((tpm_is_session_error(ret) != 0) &&
+           (uta_deadline_expired(connection->deadline) == 0))
+        {
+            /* The TPM lost the session, start a new one */
+            ret = tpm_recover_session(connection);
+        }
+        else if(tpm_is_handle_error(ret) != 0)
+        {
+            /* The cached handle is no longer valid, get a new one */
+            ret = tpm_resolve_key_handle(connection, key_slot);
+        }
+        else
+        {
+            break;
+        }
+
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+
+    if(outHMAC->size < len_key)
+    {
+        free(outHMAC);
+        return TSS2_ESYS_RC_GENERAL_FAILURE;
+    }
+
+    memcpy(key, outHMAC->buffer, len_key);
+    free(outHMAC);
+
+    return TSS2_RC_SUCCESS;
+}
+
+/**
+ * @brief Reads the next len_random random bytes of a request from the TPM.
+ *      Each command requests as many of these bytes as fit into a response
+ *      and the response is scattered directly to the buffers at the cursor.
+ *      The response is encrypted with the salted session, if the attributes
+ *      select it. If the TPM reports a session error, the session is started
+ *      again and the failed command is retried once. The caller must own the
+ *      connection. An active SAPI fast path is used instead of the ESAPI
+ *      session.
+ * @param[in,out] connection Pointer to the connection.
+ * @param[in,out] cursor Position of the request in its buffers, which is
+ *      advanced by the bytes read.
+ * @param[in] len_random Number of bytes, at most the remaining bytes of the
+ *      request.
+ * @param[in] attributes Session attributes of the commands.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_read_random(tpm_connection_t *connection,
+        uta_random_cursor_t *cursor, size_t len_random,
+        TPMA_SESSION attributes)
+{
+    TSS2_RC ret;
+    TPM2B_DIGEST *randomBytes;
+    size_t bytesRequested;
+    size_t remaining = len_random;
+    uint8_t recovered = 0;
+#ifdef ENABLE_TCG_SAPI
+    size_t start = cursor->remaining;
+#endif
+
+#ifdef ENABLE_TCG_SAPI
+    /* The SAPI fast path blocks, a deadline needs the asynchronous ESAPI */
+    if((connection->sapi.sys_context != NULL) &&
+       (connection->deadline == UTA_DEADLINE_NONE))
+    {
+        ret = tpm_sapi_get_random(&connection->sapi, cursor, len_random,
+            attributes);
+
+        /* Continue with the ESAPI, if the fast path switched itself off */
+        if((ret == TSS2_RC_SUCCESS) || (connection->sapi.sys_context != NULL))
+        {
+            return ret;
+        }
+
+        /* Only the bytes, which the fast path has not read, are left */
+        remaining -= start - cursor->remaining;
+    }
+#endif
+
+    /* Start the session again, if an earlier recovery has failed */
+    if(connection->session == ESYS_TR_NONE)
+    {
+        ret = tpm_recover_session(connection);
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    ret = Esys_TRSess_SetAttributes(
+        connection->esys_context,
+        connection->session,
+        attributes,
+        0xff);
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+
+    while(remaining > 0)
+    {
+        /* Request whatever is left, up to the size of a response */
+        bytesRequested = remaining;
+        if(bytesRequested > connection->max_random)
+        {
+            bytesRequested = connection->max_random;
+        }
+
+        /* Get Random numbers from TPM */
+        ret = tpm_get_random_command(connection, (UINT16)bytesRequested,
+            &randomBytes);
+
+        /* The TPM lost the session, start a new one and repeat the command */
+        if((ret != TSS2_RC_SUCCESS) && (recovered == 0) &&
+           (tpm_is_session_error(ret) != 0) &&
+           (uta_deadline_expired(connection->deadline) == 0))
+        {
+            recovered = 1;
+            ret = tpm_recover_session(connection);
+            if(ret == TSS2_RC_SUCCESS)
+            {
+                ret = Esys_TRSess_SetAttributes(connection->esys_context,
+                    connection->session,
+                    attributes,
+                    0xff);
+            }
+            if(ret != TSS2_RC_SUCCESS)
+            {
+                return ret;
+            }
+            continue;
+        }
+
+        /* randomBytes is only allocated on success */
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            return ret;
+        }
+
+        /* An empty response would never complete the request */
+        if((randomBytes->size == 0) || (randomBytes->size > bytesRequested))
+        {
+            free(randomBytes);
+            return TSS2_ESYS_RC_MALFORMED_RESPONSE;
+        }
+
+        /* Scatter the response, empty buffers are skipped */
+        uta_random_cursor_scatter(cursor, randomBytes->buffer,
+            randomBytes->size);
+        remaining -= randomBytes->size;
+        free(randomBytes);
+
+        /* Each command of the request may be retried once */
+        recovered = 0;
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+#ifdef ENABLE_TCG_SAPI
+/**
+ * @brief Calculates an HMAC-SHA256 over the derivation value with the SAPI
+ *      fast path. The caller must own the connection. If the TPM reports a
+ *      handle error, the name of the key is read again and the HMAC is
+ *      retried once.
+ * @param[in,out] connection Pointer to the connection with an active fast
+ *      path.
+ * @param[out] key Pointer to the buffer where the derived key is written to.
+ * @param[in] len_key Number of bytes, which should be written to key.
+ * @param[in] dv Pointer to the derivation value (DERIV_STR_LEN bytes).
+ * @param[in] key_slot Key slot, which has already been checked.
+ * @param[in] attributes Session attributes of the command.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_calc_hmac_sapi(tpm_connection_t *connection,
+        uint8_t *key, size_t len_key, const uint8_t *dv, uint8_t key_slot,
+        TPMA_SESSION attributes)
+{
+    TSS2_RC ret;
+
+    ret = tpm_sapi_hmac(&connection->sapi, key_slot, dv, DERIV_STR_LEN, key,
+        len_key, attributes);
+    if((ret == TSS2_RC_SUCCESS) || (tpm_is_handle_error(ret) == 0) ||
+       (connection->sapi.sys_context == NULL))
+    {
+        return ret;
+    }
+
+    /* The key behind the persistent handle may have been replaced */
+    ret = tpm_sapi_read_name(&connection->sapi, key_slot);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+
+    return tpm_sapi_hmac(&connection->sapi, key_slot, dv, DERIV_STR_LEN, key,
+        len_key, attributes);
+}
+#endif
+
+/**
+ * @brief Reads random numbers from a connection of the pool. The request is
+ *      read in slices of UTA_SCHED_SLICE_LEN bytes. Between two slices, the
+ *      connection is given back to the pool, while a call of the high
+ *      priority class waits for the device, and the request continues on
+ *      the next connection granted to it. If the device fails, the rest of
+ *      the request is repeated on another device.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in,out] cursor Position in the buffers, where the random numbers are
+ *      written to. Nothing is read, if no bytes are remaining.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return TCG TSS return code, a TRY_AGAIN code on timeout.
+ */
+static TSS2_RC tpm_pool_read_random(const uta_context_v1_t *tpm_context,
+        uta_random_cursor_t *cursor, uint64_t deadline)
+{
+    tpm_connection_t *connection;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    uint64_t tried_devices = 0;
+    size_t attempt = 0;
+    TPMA_SESSION attributes =
+        __atomic_load_n(&tpm_context->attributes_random, __ATOMIC_RELAXED);
+
+    /* Continue on the next connection, each device is tried once on failure */
+    while(cursor->remaining > 0)
+    {
+        /* Take a free connection from the pool */
+        connection = tpm_acquire_connection(tpm_context, tried_devices,
+            UTA_STATS_GET_RANDOM, deadline);
+        if (connection == NULL)
+        {
+            return (uta_deadline_expired(deadline) != 0) ?
+                TSS2_ESYS_RC_TRY_AGAIN : TSS2_ESYS_RC_GENERAL_FAILURE;
+        }
+
+        do
+        {
+            ret = tpm_read_random(connection, cursor,
+                uta_random_cursor_slice(cursor), attributes);
+        } while((ret == TSS2_RC_SUCCESS) && (cursor->remaining > 0) &&
+            (uta_sched_preempted(
+            &tpm_context->devices[connection->device].sched) == 0));
+
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            tpm_device_failed(tpm_context, connection);
+            tried_devices |= (uint64_t)1 << connection->device;
+            attempt++;
+        }
+
+        /* Return the connection to the pool */
+        tpm_release_connection(tpm_context, connection);
+
+        /* No time is left for another device after a timeout */
+        if((ret != TSS2_RC_SUCCESS) && ((tpm_is_timeout(ret) != 0) ||
+            (attempt == tpm_context->num_devices)))
+        {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Sends the next command of the pending asynchronous operation to the
+ *      TPM. The caller must hold the asynclock and own the asynchronous
+ *      connection.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC tpm_async_start(const uta_context_v1_t *tpm_context)
+{
+    const tpm_connection_t *connection =
+        &tpm_context->connections[ASYNC_CONNECTION];
+    TSS2_RC ret;
+    TPMA_SESSION sessionAttributes;
+    TPM2B_MAX_BUFFER dv_buffer = { .size = DERIV_STR_LEN,
+                                   .buffer={0}} ;
+    size_t len;
+
+    if(tpm_context->async_kind == ASYNC_DERIVE_KEY)
+    {
+        sessionAttributes = __atomic_load_n(&tpm_context->attributes_hmac,
+            __ATOMIC_RELAXED);
+    }
+    else
+    {
+        sessionAttributes = __atomic_load_n(&tpm_context->attributes_random,
+            __ATOMIC_RELAXED);
+    }
+
+    ret = Esys_TRSess_SetAttributes(connection->esys_context,
+        connection->session,
+        sessionAttributes,
+        0xff);
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+
+    if(tpm_context->async_kind == ASYNC_DERIVE_KEY)
+    {
+        memcpy(dv_buffer.buffer, tpm_context->async_dv, DERIV_STR_LEN);
+
+        UTA_TRACE_TPM_ENTRY(TPM2_CC_HMAC);
+        return Esys_HMAC_Async(
+            connection->esys_context,
+            connection->key_handles[tpm_context->async_key_slot],
+            ESYS_TR_PASSWORD,
+            connection->session,
+            ESYS_TR_NONE,
+            &dv_buffer,
+            TPM2_ALG_SHA256);
+    }
+
+    /* A single response carries at most one digest */
+    len = tpm_context->async_len - tpm_context->async_done;
+    if(len > connection->max_random)
+    {
+        len = connection->max_random;
+    }
+
+    UTA_TRACE_TPM_ENTRY(TPM2_CC_GetRandom);
+    return Esys_GetRandom_Async(
+        connection->esys_context,
+        connection->session,
+        ESYS_TR_NONE,
+        ESYS_TR_NONE,
+        (UINT16)len);
+}
+
+/**
+ * @brief Sends the self test command to each device and marks the self test
+ *      as running. The TPM may test in the background, the result is polled
+ *      by tpm_poll_self_test.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] mode Mode of the self test.
+ * @return UTA return code.
+ */
+static uta_rc tpm_begin_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    /* Algorithms of the key derivation and of the salted sessions */
+    const TPML_ALG toTest = {
+        .count = 6,
+        .algorithms = {TPM2_ALG_SHA256, TPM2_ALG_HMAC, TPM2_ALG_AES,
+            TPM2_ALG_CFB, TPM2_ALG_ECC, TPM2_ALG_ECDH}
+    };
+    tpm_connection_t *connection;
+    TPML_ALG *toDoList;
+    TSS2_RC ret;
+    size_t device;
+
+    uta_self_test_started(&tpm_context_w->self_test, mode);
+
+    for(device = 0; device < tpm_context->num_devices; device++)
+    {
+        connection = tpm_acquire_device_connection(tpm_context, device,
+            UTA_STATS_SELF_TEST, UTA_DEADLINE_NONE);
+        if(connection == NULL)
+        {
+            return uta_self_test_finished(&tpm_context_w->self_test, mode,
+                UTA_TA_ERROR);
+        }
+
+        if(mode == UTA_SELF_TEST_INCREMENTAL)
+        {
+            UTA_TRACE_TPM_ENTRY(TPM2_CC_IncrementalSelfTest);
+            ret = Esys_IncrementalSelfTest(connection->esys_context,
+                ESYS_TR_NONE,
+                ESYS_TR_NONE,
+                ESYS_TR_NONE,
+                &toTest,
+                &toDoList);
+            UTA_TRACE_TPM_RETURN(TPM2_CC_IncrementalSelfTest, ret);
+
+            if(ret == TSS2_RC_SUCCESS)
+            {
+                free(toDoList);
+            }
+        }
+        else
+        {
+            UTA_TRACE_TPM_ENTRY(TPM2_CC_SelfTest);
+            ret = Esys_SelfTest(connection->esys_context,
+                ESYS_TR_NONE,
+                ESYS_TR_NONE,
+                ESYS_TR_NONE,
+                1);
+            UTA_TRACE_TPM_RETURN(TPM2_CC_SelfTest, ret);
+        }
+
+        /* The TPM is still testing since an earlier command, the response
+         * code may carry the layer of a resource manager */
+        if((((ret & TSS2_RC_LAYER_MASK) == TSS2_TPM_RC_LAYER) ||
+            ((ret & TSS2_RC_LAYER_MASK) == TSS2_RESMGR_TPM_RC_LAYER)) &&
+           ((ret & ~TSS2_RC_LAYER_MASK) == TPM2_RC_TESTING))
+        {
+            ret = TSS2_RC_SUCCESS;
+        }
+
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            tpm_device_failed(tpm_context, connection);
+        }
+
+        tpm_release_connection(tpm_context, connection);
+
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            return uta_self_test_finished(&tpm_context_w->self_test, mode,
+                UTA_TA_ERROR);
+        }
+    }
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Reads the test result of each device on a free connection. The
+ *      result is stored, as soon as one device failed or all devices finished
+ *      testing. Busy devices are asked again on the next call.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] mode Mode of the running self test.
+ */
+static void tpm_poll_self_test(const uta_context_v1_t *tpm_context,
+        uta_self_test_mode_t mode)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    tpm_connection_t *connection;
+    TPM2B_MAX_BUFFER *outData;
+    TPM2_RC testResult;
+    TSS2_RC ret;
+    size_t device;
+    uta_rc device_rc;
+    uta_rc rc = UTA_SUCCESS;
+
+    for(device = 0; device < tpm_context->num_devices; device++)
+    {
+        connection = tpm_try_acquire_device_connection(tpm_context, device,
+            UTA_STATS_SELF_TEST);
+        if(connection == NULL)
+        {
+            rc = UTA_TRY_AGAIN;
+            continue;
+        }
+
+        UTA_TRACE_TPM_ENTRY(TPM2_CC_GetTestResult);
+        ret = Esys_GetTestResult(
+            connection->esys_context,
+            ESYS_TR_NONE,
+            ESYS_TR_NONE,
+            ESYS_TR_NONE,
+            &outData,
+            &testResult);
+        UTA_TRACE_TPM_RETURN(TPM2_CC_GetTestResult, ret);
+
+        device_rc = UTA_TA_ERROR;
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            free(outData);
+            device_rc = tpm_test_result_rc(testResult);
+        }
+        else
+        {
+            tpm_device_failed(tpm_context, connection);
+        }
+
+        tpm_release_connection(tpm_context, connection);
+
+        if(device_rc == UTA_TA_ERROR)
+        {
+            rc = UTA_TA_ERROR;
+            break;
+        }
+        if(device_rc == UTA_TRY_AGAIN)
+        {
+            rc = UTA_TRY_AGAIN;
+        }
+    }
+
+    if(rc != UTA_TRY_AGAIN)
+    {
+        (void)uta_self_test_finished(&tpm_context_w->self_test, mode, rc);
+    }
+}
+
+/**
+ * @brief Maps the testResult of TPM2_GetTestResult to a uta_rc. Algorithms,
+ *      which have not been tested yet, do not fail an incremental self test.
+ * @param[in] testResult Test result of the TPM.
+ * @return UTA_SUCCESS, UTA_TRY_AGAIN while testing or UTA_TA_ERROR.
+ */
+static uta_rc tpm_test_result_rc(TPM2_RC testResult)
+{
+    if((testResult == TPM2_RC_SUCCESS) || (testResult == TPM2_RC_NEEDS_TEST))
+    {
+        return UTA_SUCCESS;
+    }
+
+    if(testResult == TPM2_RC_TESTING)
+    {
+        return UTA_TRY_AGAIN;
+    }
+
+    return UTA_TA_ERROR;
+}
+
+#ifdef ENABLE_TEST_HOOKS
+/**
+ * @brief Flushes the session of the connection from the TPM, if the test hook
+ *      tpm_flush_sessions asks for it. A second object of the session is
+ *      flushed, so that the ESAPI still uses the first one.
+ * @param[in,out] connection Pointer to the connection.
+ */
+static void tpm_test_flush_session(tpm_connection_t *connection)
+{
+    uint32_t count = __atomic_load_n(&test_flushed_sessions,
+        __ATOMIC_RELAXED);
+    TPM2_HANDLE handle;
+    ESYS_TR session;
+
+    /* Take one of the commands, if any are left */
+    do
+    {
+        if(count == 0)
+        {
+            return;
+        }
+    } while(__atomic_compare_exchange_n(&test_flushed_sessions, &count,
+        count - 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) == 0);
+
+    if((connection->session == ESYS_TR_NONE) ||
+       (Esys_TR_GetTpmHandle(connection->esys_context, connection->session,
+        &handle) != TSS2_RC_SUCCESS))
+    {
+        return;
+    }
+
+    if(Esys_TR_FromTPMPublic(connection->esys_context, handle, ESYS_TR_NONE,
+        ESYS_TR_NONE, ESYS_TR_NONE, &session) == TSS2_RC_SUCCESS)
+    {
+        (void)Esys_FlushContext(connection->esys_context, session);
+    }
+}
+#endif
+
+#ifdef ENABLE_DRBG
+/**
+ * @brief Seeds the DRBG from the TPM and selects it for the random requests.
+ *      The caller holds the accesslock or is the only thread of the context.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ * @param[in] reseed_bytes Output bytes until the next reseed.
+ * @param[in] reseed_interval Seconds until the next reseed.
+ * @param[in] deadline Deadline of the call, which seeds the DRBG.
+ * @return UTA return code.
+ */
+static uta_rc tpm_drbg_start(const uta_context_v1_t *tpm_context,
+        uint64_t reseed_bytes, uint32_t reseed_interval, uint64_t deadline)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    uta_rc rc;
+
+    /* Lock the DRBG state with the drbglock mutex */
+    rc = uta_stats_mutex_lock(&tpm_context_w->stats,
+        &tpm_context_w->drbglock, deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        return rc;
+    }
+
+    tpm_context_w->drbg_deadline = deadline;
+    rc = uta_drbg_seed(&tpm_context_w->drbg, tpm_drbg_entropy,
+        tpm_context_w, reseed_bytes, reseed_interval);
+    if(rc != UTA_SUCCESS)
+    {
+        rc = uta_deadline_rc(deadline);
+    }
+
+    /* A failed seed leaves the DRBG cleared */
+    __atomic_store_n(&tpm_context_w->drbg_active, tpm_context->drbg.seeded,
+        __ATOMIC_RELEASE);
+
+    /* Release the drbglock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&tpm_context_w->drbglock);
+
+    return rc;
+}
+
+/**
+ * @brief Clears the DRBG, the random requests are read from the TPM again.
+ *      The caller holds the accesslock or is the only thread of the context.
+ * @param[in,out] tpm_context Pointer to the internal context struct.
+ */
+static void tpm_drbg_stop(const uta_context_v1_t *tpm_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *tpm_context_w = (uta_context_v1_t*)tpm_context;
+
+    /* A running request finishes first (ignore return code) */
+    (void)pthread_mutex_lock(&tpm_context_w->drbglock);
+    __atomic_store_n(&tpm_context_w->drbg_active, 0, __ATOMIC_RELAXED);
+    uta_drbg_free(&tpm_context_w->drbg);
+    (void)pthread_mutex_unlock(&tpm_context_w->drbglock);
+}
+
+/**
+ * @brief Entropy callback of the DRBG, which reads from the TPM. It is called
+ *      while the drbglock is held.
+ * @param[in,out] p_entropy Pointer to the internal context struct.
+ * @param[out] output Buffer for the entropy.
+ * @param[in] len Number of entropy bytes.
+ * @return 0 on success, an mbedtls error code otherwise.
+ */
+static int tpm_drbg_entropy(void *p_entropy, unsigned char *output,
+        size_t len)
+{
+    const uta_context_v1_t *tpm_context = (const uta_context_v1_t *)p_entropy;
+    uta_random_buffer_v1_t buffer = { .random = output, .len_random = len };
+    uta_random_cursor_t cursor;
+
+    uta_random_cursor_init(&cursor, &buffer, 1);
+
+    /* The entropy is read within the deadline of the call, which reseeds */
+    if(tpm_pool_read_random(tpm_context, &cursor,
+       tpm_context->drbg_deadline) != TSS2_RC_SUCCESS)
+    {
+        return MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+    }
+
+    return 0;
+}
+#endif
+
+/**
+ * @brief Fill callback of the prefetch ring, which reads from the TPM on the
+ *      background thread. It waits for a connection without limit, but gives
+ *      it back between two slices like every bulk random request.
+ * @param[in,out] p_fill Pointer to the internal context struct.
+ * @param[out] output Buffer for the random numbers.
+ * @param[in] len Number of random bytes.
+ * @return 0 on success, -1 otherwise.
+ */
+static int tpm_prefetch_fill(void *p_fill, uint8_t *output, size_t len)
+{
+    const uta_context_v1_t *tpm_context = (const uta_context_v1_t *)p_fill;
+    uta_random_buffer_v1_t buffer = { .random = output, .len_random = len };
+    uta_random_cursor_t cursor;
+
+    uta_random_cursor_init(&cursor, &buffer, 1);
+
+    if(tpm_pool_read_random(tpm_context, &cursor, UTA_DEADLINE_NONE) !=
+       TSS2_RC_SUCCESS)
+    {
+        return -1;
+    }
+
+    return 0;
+}
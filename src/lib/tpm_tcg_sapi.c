@@ -0,0 +1,1019 @@
+/** @file tpm_tcg_sapi.c
+*
+* @brief Unified Trust Anchor (UTA) allocation free fast path of the TCG TSS
+* for HMAC and GetRandom on top of the system API (SAPI). The ESAPI allocates
+* each response and updates its own session metadata on every command. The
+* fast path keeps one SAPI context with its command and response buffer per
+* connection and a salted HMAC session of its own, whose secrets are computed
+* on the host (TPM 2.0 Part 1, sections 19 and 21):
+* - the salt is exchanged by ECDH with the salt key and KDFe,
+* - the session key and the AES-128-CFB parameter encryption keys are derived
+*   with KDFa,
+* - every command is authorized with an HMAC over the cpHash and the nonces
+*   and every response HMAC is verified before it is decrypted.
+* After open, a command neither allocates memory nor uses the ESAPI.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/random.h>
+
+#include <tpm_tcg_sapi.h>
+#include <uta_trace.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/aes.h>
+#include <mbedtls/ecdh.h>
+#include <mbedtls/platform_util.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Size of the command and response buffer of the SAPI context */
+#define SAPI_MAX_COMMAND_SIZE   4096
+/* Length of a coordinate of a NIST P-256 point */
+#define SAPI_ECC_LEN            32
+/* Key and block length of the AES-128-CFB parameter encryption */
+#define SAPI_AES_KEY_LEN        16
+#define SAPI_AES_BLOCK_LEN      16
+/* Block length of SHA256, all HMAC keys of the session are shorter */
+#define SAPI_HASH_BLOCK_LEN     64
+/* Largest first parameter, which is encrypted on the stack */
+#define SAPI_MAX_PARAM_LEN      TPM2_MAX_DIGEST_BUFFER
+
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief HMAC-SHA256 on the stack. mbedtls_md_setup would allocate the pads.
+ */
+typedef struct
+{
+    mbedtls_sha256_context inner;
+    mbedtls_sha256_context outer;
+} sapi_hmac_t;
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static TSS2_RC sapi_start_session(tpm_sapi_t *sapi, TPM2_HANDLE salt_handle);
+static TSS2_RC sapi_read_public(tpm_sapi_t *sapi, TPM2_HANDLE handle,
+        TPM2B_PUBLIC *out_public, TPM2B_NAME *name);
+static TSS2_RC sapi_ecdh_salt(const TPM2B_PUBLIC *salt_public,
+        TPM2B_ENCRYPTED_SECRET *encrypted_salt, uint8_t *salt);
+static TSS2_RC sapi_execute(tpm_sapi_t *sapi, TPM2_CC command_code,
+        const TPM2B_NAME *name, TPMA_SESSION attributes);
+static TSS2_RC sapi_crypt_param(const tpm_sapi_t *sapi,
+        const TPM2B_NONCE *nonce_newer, const TPM2B_NONCE *nonce_older,
+        uint8_t *param, size_t len_param, int mode);
+static void sapi_session_hmac(const tpm_sapi_t *sapi, const uint8_t *p_hash,
+        const TPM2B_NONCE *nonce_newer, const TPM2B_NONCE *nonce_older,
+        TPMA_SESSION attributes, uint8_t *hmac);
+static int sapi_keep_session(TSS2_RC ret);
+static int sapi_random(void *p_rng, unsigned char *output, size_t len);
+static void sapi_kdfa(const uint8_t *key, size_t len_key, const char *label,
+        const TPM2B_NONCE *context_u, const TPM2B_NONCE *context_v,
+        uint8_t *out, size_t len_out);
+static void sapi_kdfe(const uint8_t *z, size_t len_z, const char *label,
+        const uint8_t *party_u, size_t len_party_u, const uint8_t *party_v,
+        size_t len_party_v, uint8_t *out, size_t len_out);
+static void sapi_hmac_starts(sapi_hmac_t *hmac, const uint8_t *key,
+        size_t len_key);
+static void sapi_hmac_update(sapi_hmac_t *hmac, const uint8_t *data,
+        size_t len_data);
+static void sapi_hmac_finish(sapi_hmac_t *hmac, uint8_t *mac);
+static void sapi_put_uint16(uint8_t *buffer, uint16_t value);
+static void sapi_put_uint32(uint8_t *buffer, uint32_t value);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Initializes the SAPI context on the TCTI of a connection and starts
+ *      the salted session of the fast path. The names of the keys are read
+ *      once, a key slot, whose name cannot be read here, is read on its first
+ *      use. On failure, the fast path stays inactive.
+ * @param[out] sapi Pointer to the fast path state of the connection.
+ * @param[in] tcti_ctx TCTI of the connection, shared with its ESAPI context.
+ * @param[in] salt_handle Persistent handle of the ECC NIST P-256 salt key.
+ * @param[in] key_handles Persistent handles of the TPM_SAPI_KEY_SLOTS keys.
+ * @return TCG TSS return code.
+ */
+TSS2_RC tpm_sapi_open(tpm_sapi_t *sapi, TSS2_TCTI_CONTEXT *tcti_ctx,
+        TPM2_HANDLE salt_handle, const TPM2_HANDLE *key_handles)
+{
+    TSS2_RC ret;
+    size_t size;
+    uint8_t key_slot;
+
+    memset(sapi, 0, sizeof(*sapi));
+    sapi->max_random = sizeof(TPMU_HA);
+    for(key_slot = 0; key_slot < TPM_SAPI_KEY_SLOTS; key_slot++)
+    {
+        sapi->key_handles[key_slot] = key_handles[key_slot];
+    }
+
+    /* The only allocation of the fast path, it holds both message buffers */
+    size = Tss2_Sys_GetContextSize(SAPI_MAX_COMMAND_SIZE);
+    sapi->sys_context = (TSS2_SYS_CONTEXT *) calloc(1, size);
+    if(sapi->sys_context == NULL)
+    {
+        return TSS2_SYS_RC_GENERAL_FAILURE;
+    }
+
+    ret = Tss2_Sys_Initialize(sapi->sys_context, size, tcti_ctx, NULL);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        free(sapi->sys_context);
+        sapi->sys_context = NULL;
+        return ret;
+    }
+
+    ret = sapi_start_session(sapi, salt_handle);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        tpm_sapi_forget(sapi);
+        return ret;
+    }
+
+    for(key_slot = 0; key_slot < TPM_SAPI_KEY_SLOTS; key_slot++)
+    {
+        (void)tpm_sapi_read_name(sapi, key_slot);
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+/**
+ * @brief Flushes the session of the fast path and releases its SAPI context.
+ *      The TCTI is finalized by the caller.
+ * @param[in,out] sapi Pointer to the fast path state of the connection.
+ */
+void tpm_sapi_close(tpm_sapi_t *sapi)
+{
+    if(sapi->sys_context == NULL)
+    {
+        return;
+    }
+
+    (void)Tss2_Sys_FlushContext(sapi->sys_context, sapi->session);
+
+    tpm_sapi_forget(sapi);
+}
+
+/**
+ * @brief Releases the SAPI context without a TPM command, e.g. in a child,
+ *      which inherited the connection over fork. The secrets of the session
+ *      are cleared.
+ * @param[in,out] sapi Pointer to the fast path state of the connection.
+ */
+void tpm_sapi_forget(tpm_sapi_t *sapi)
+{
+    if(sapi->sys_context == NULL)
+    {
+        return;
+    }
+
+    Tss2_Sys_Finalize(sapi->sys_context);
+    free(sapi->sys_context);
+
+    /* Also sets sys_context to NULL, which deactivates the fast path */
+    mbedtls_platform_zeroize(sapi, sizeof(*sapi));
+}
+
+/**
+ * @brief Reads the name of a key, which is part of the cpHash of each HMAC
+ *      command. It is called again, if the TPM reports a handle error for the
+ *      key. The caller must own the connection.
+ * @param[in,out] sapi Pointer to the active fast path state.
+ * @param[in] key_slot Key slot, which has already been checked.
+ * @return TCG TSS return code.
+ */
+TSS2_RC tpm_sapi_read_name(tpm_sapi_t *sapi, uint8_t key_slot)
+{
+    TPM2B_PUBLIC out_public;
+
+    return sapi_read_public(sapi, sapi->key_handles[key_slot], &out_public,
+        &sapi->key_names[key_slot]);
+}
+
+/**
+ * @brief Calculates an HMAC-SHA256 over data with the key of a key slot. The
+ *      data and the HMAC are encrypted by the salted session as selected by
+ *      the attributes. If the session is no longer in sync with the TPM
+ *      afterwards, the fast path is switched off and sapi->sys_context is
+ *      NULL. The caller must own the connection.
+ * @param[in,out] sapi Pointer to the active fast path state.
+ * @param[in] key_slot Key slot, which has already been checked.
+ * @param[in] data Pointer to the data.
+ * @param[in] len_data Length of the data in bytes.
+ * @param[out] hmac Pointer to the buffer where the HMAC is written to.
+ * @param[in] len_hmac Number of bytes, which should be written to hmac.
+ * @param[in] attributes Session attributes of the command.
+ * @return TCG TSS return code.
+ */
+TSS2_RC tpm_sapi_hmac(tpm_sapi_t *sapi, uint8_t key_slot,
+        const uint8_t *data, size_t len_data, uint8_t *hmac, size_t len_hmac,
+        TPMA_SESSION attributes)
+{
+    TPM2B_MAX_BUFFER buffer;
+    TPM2B_DIGEST out_hmac;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+
+    if(len_data > sizeof(buffer.buffer))
+    {
+        return TSS2_SYS_RC_BAD_VALUE;
+    }
+
+    /* Read the name, if this has not been possible during open */
+    if(sapi->key_names[key_slot].size == 0)
+    {
+        ret = tpm_sapi_read_name(sapi, key_slot);
+    }
+
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        buffer.size = (UINT16)len_data;
+        memcpy(buffer.buffer, data, len_data);
+        ret = Tss2_Sys_HMAC_Prepare(sapi->sys_context,
+            sapi->key_handles[key_slot], &buffer, TPM2_ALG_SHA256);
+    }
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        ret = sapi_execute(sapi, TPM2_CC_HMAC, &sapi->key_names[key_slot],
+            attributes);
+    }
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        out_hmac.size = 0;
+        ret = Tss2_Sys_HMAC_Complete(sapi->sys_context, &out_hmac);
+    }
+    if((ret == TSS2_RC_SUCCESS) && (out_hmac.size < len_hmac))
+    {
+        ret = TSS2_SYS_RC_MALFORMED_RESPONSE;
+    }
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        memcpy(hmac, out_hmac.buffer, len_hmac);
+    }
+
+    mbedtls_platform_zeroize(&buffer, sizeof(buffer));
+    mbedtls_platform_zeroize(&out_hmac, sizeof(out_hmac));
+
+    if((ret != TSS2_RC_SUCCESS) && (sapi_keep_session(ret) == 0))
+    {
+        tpm_sapi_close(sapi);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Reads the next len_random random bytes of a request from the TPM.
+ *      Each command requests as many of these bytes as fit into a response
+ *      and the response is scattered directly to the buffers at the cursor.
+ *      The response is encrypted by the salted session, if the attributes
+ *      select it. If the session is no longer in sync with the TPM
+ *      afterwards, the fast path is switched off and sapi->sys_context is
+ *      NULL. The caller must own the connection.
+ * @param[in,out] sapi Pointer to the active fast path state.
+ * @param[in,out] cursor Position of the request in its buffers, which is
+ *      advanced by the bytes read.
+ * @param[in] len_random Number of bytes, at most the remaining bytes of the
+ *      request.
+ * @param[in] attributes Session attributes of the commands.
+ * @return TCG TSS return code.
+ */
+TSS2_RC tpm_sapi_get_random(tpm_sapi_t *sapi, uta_random_cursor_t *cursor,
+        size_t len_random, TPMA_SESSION attributes)
+{
+    TPM2B_DIGEST random_bytes;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    size_t remaining = len_random;
+    size_t requested;
+
+    while(remaining > 0)
+    {
+        requested = remaining;
+        if(requested > sapi->max_random)
+        {
+            requested = sapi->max_random;
+        }
+
+        ret = Tss2_Sys_GetRandom_Prepare(sapi->sys_context, (UINT16)requested);
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            ret = sapi_execute(sapi, TPM2_CC_GetRandom, NULL, attributes);
+        }
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            random_bytes.size = 0;
+            ret = Tss2_Sys_GetRandom_Complete(sapi->sys_context, &random_bytes);
+        }
+        /* An empty response would never complete the request */
+        if((ret == TSS2_RC_SUCCESS) &&
+           ((random_bytes.size == 0) || (random_bytes.size > requested)))
+        {
+            ret = TSS2_SYS_RC_MALFORMED_RESPONSE;
+        }
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            break;
+        }
+
+        /* Scatter the response, empty buffers are skipped */
+        uta_random_cursor_scatter(cursor, random_bytes.buffer,
+            random_bytes.size);
+        remaining -= random_bytes.size;
+    }
+
+    mbedtls_platform_zeroize(&random_bytes, sizeof(random_bytes));
+
+    if((ret != TSS2_RC_SUCCESS) && (sapi_keep_session(ret) == 0))
+    {
+        tpm_sapi_close(sapi);
+    }
+
+    return ret;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Starts the salted, unbound HMAC session of the fast path with
+ *      AES-128-CFB parameter encryption and computes its session key.
+ * @param[in,out] sapi Pointer to the fast path state with an initialized SAPI
+ *      context.
+ * @param[in] salt_handle Persistent handle of the salt key.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC sapi_start_session(tpm_sapi_t *sapi, TPM2_HANDLE salt_handle)
+{
+    const TPMT_SYM_DEF symmetric = {
+        .algorithm = TPM2_ALG_AES,
+        .keyBits = {.aes = 128},
+        .mode = {.aes = TPM2_ALG_CFB}
+    };
+    TPM2B_PUBLIC salt_public;
+    TPM2B_NAME salt_name;
+    TPM2B_ENCRYPTED_SECRET encrypted_salt;
+    TPM2B_NONCE nonce_caller;
+    uint8_t salt[TPM_SAPI_DIGEST_LEN];
+    TSS2_RC ret;
+
+    ret = sapi_read_public(sapi, salt_handle, &salt_public, &salt_name);
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        ret = sapi_ecdh_salt(&salt_public, &encrypted_salt, salt);
+    }
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        nonce_caller.size = TPM_SAPI_DIGEST_LEN;
+        if(sapi_random(NULL, nonce_caller.buffer, nonce_caller.size) != 0)
+        {
+            ret = TSS2_SYS_RC_GENERAL_FAILURE;
+        }
+    }
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        sapi->nonce_tpm.size = 0;
+        UTA_TRACE_TPM_ENTRY(TPM2_CC_StartAuthSession);
+        ret = Tss2_Sys_StartAuthSession(sapi->sys_context, salt_handle,
+            TPM2_RH_NULL, NULL, &nonce_caller, &encrypted_salt, TPM2_SE_HMAC,
+            &symmetric, TPM2_ALG_SHA256, &sapi->session, &sapi->nonce_tpm,
+            NULL);
+        UTA_TRACE_TPM_RETURN(TPM2_CC_StartAuthSession, ret);
+    }
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        /* The session is not bound, so the salt is the only HMAC key */
+        sapi_kdfa(salt, sizeof(salt), "ATH", &sapi->nonce_tpm, &nonce_caller,
+            sapi->session_key, sizeof(sapi->session_key));
+    }
+
+    mbedtls_platform_zeroize(salt, sizeof(salt));
+
+    return ret;
+}
+
+/**
+ * @brief Reads the public area and the name of a persistent object.
+ * @param[in,out] sapi Pointer to the fast path state with an initialized SAPI
+ *      context.
+ * @param[in] handle Persistent handle of the object.
+ * @param[out] out_public Public area of the object.
+ * @param[out] name Name of the object, its size is 0 on failure.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC sapi_read_public(tpm_sapi_t *sapi, TPM2_HANDLE handle,
+        TPM2B_PUBLIC *out_public, TPM2B_NAME *name)
+{
+    TPM2B_NAME qualified_name;
+    TSS2_RC ret;
+
+    memset(out_public, 0, sizeof(*out_public));
+    name->size = 0;
+    qualified_name.size = 0;
+
+    UTA_TRACE_TPM_ENTRY(TPM2_CC_ReadPublic);
+    ret = Tss2_Sys_ReadPublic(sapi->sys_context, handle, NULL, out_public,
+        name, &qualified_name, NULL);
+    UTA_TRACE_TPM_RETURN(TPM2_CC_ReadPublic, ret);
+
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        name->size = 0;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Computes the salt with an ephemeral ECDH key pair of the host and
+ *      the salt key, salt = KDFe(Z, "SECRET", QeU.x, QsB.x). The ephemeral
+ *      public point QeU is returned as encrypted salt.
+ * @param[in] salt_public Public area of the salt key.
+ * @param[out] encrypted_salt Marshalled TPMS_ECC_POINT QeU.
+ * @param[out] salt Pointer to the buffer of TPM_SAPI_DIGEST_LEN bytes, where
+ *      the salt is written to.
+ * @return TCG TSS return code, TSS2_SYS_RC_BAD_VALUE if the salt key is not
+ *      an ECC NIST P-256 key with SHA256 names.
+ */
+static TSS2_RC sapi_ecdh_salt(const TPM2B_PUBLIC *salt_public,
+        TPM2B_ENCRYPTED_SECRET *encrypted_salt, uint8_t *salt)
+{
+    const TPMT_PUBLIC *area = &salt_public->publicArea;
+    mbedtls_ecp_group grp;
+    mbedtls_ecp_point q_tpm;
+    mbedtls_ecp_point q_host;
+    mbedtls_mpi d;
+    mbedtls_mpi z;
+    uint8_t z_x[SAPI_ECC_LEN];
+    uint8_t *point = encrypted_salt->secret;
+    int ret;
+
+    if((area->type != TPM2_ALG_ECC) || (area->nameAlg != TPM2_ALG_SHA256) ||
+       (area->parameters.eccDetail.curveID != TPM2_ECC_NIST_P256) ||
+       (area->unique.ecc.x.size > SAPI_ECC_LEN) ||
+       (area->unique.ecc.y.size > SAPI_ECC_LEN))
+    {
+        return TSS2_SYS_RC_BAD_VALUE;
+    }
+
+    mbedtls_ecp_group_init(&grp);
+    mbedtls_ecp_point_init(&q_tpm);
+    mbedtls_ecp_point_init(&q_host);
+    mbedtls_mpi_init(&d);
+    mbedtls_mpi_init(&z);
+
+    ret = mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_SECP256R1);
+    if(ret == 0)
+    {
+        ret = mbedtls_mpi_read_binary(&q_tpm.X, area->unique.ecc.x.buffer,
+            area->unique.ecc.x.size);
+    }
+    if(ret == 0)
+    {
+        ret = mbedtls_mpi_read_binary(&q_tpm.Y, area->unique.ecc.y.buffer,
+            area->unique.ecc.y.size);
+    }
+    if(ret == 0)
+    {
+        ret = mbedtls_mpi_lset(&q_tpm.Z, 1);
+    }
+    if(ret == 0)
+    {
+        ret = mbedtls_ecp_check_pubkey(&grp, &q_tpm);
+    }
+    if(ret == 0)
+    {
+        ret = mbedtls_ecdh_gen_public(&grp, &d, &q_host, sapi_random, NULL);
+    }
+    if(ret == 0)
+    {
+        ret = mbedtls_ecdh_compute_shared(&grp, &z, &q_tpm, &d, sapi_random,
+            NULL);
+    }
+    if(ret == 0)
+    {
+        ret = mbedtls_mpi_write_binary(&z, z_x, sizeof(z_x));
+    }
+    /* TPMS_ECC_POINT with two TPM2B_ECC_PARAMETER of fixed length */
+    if(ret == 0)
+    {
+        sapi_put_uint16(point, SAPI_ECC_LEN);
+        ret = mbedtls_mpi_write_binary(&q_host.X, &point[2], SAPI_ECC_LEN);
+    }
+    if(ret == 0)
+    {
+        sapi_put_uint16(&point[2 + SAPI_ECC_LEN], SAPI_ECC_LEN);
+        ret = mbedtls_mpi_write_binary(&q_host.Y, &point[4 + SAPI_ECC_LEN],
+            SAPI_ECC_LEN);
+    }
+    if(ret == 0)
+    {
+        encrypted_salt->size = 2 * (2 + SAPI_ECC_LEN);
+        sapi_kdfe(z_x, sizeof(z_x), "SECRET", &point[2], SAPI_ECC_LEN,
+            area->unique.ecc.x.buffer, area->unique.ecc.x.size, salt,
+            TPM_SAPI_DIGEST_LEN);
+    }
+
+    mbedtls_platform_zeroize(z_x, sizeof(z_x));
+    mbedtls_mpi_free(&z);
+    mbedtls_mpi_free(&d);
+    mbedtls_ecp_point_free(&q_host);
+    mbedtls_ecp_point_free(&q_tpm);
+    mbedtls_ecp_group_free(&grp);
+
+    return (ret == 0) ? TSS2_RC_SUCCESS : TSS2_SYS_RC_GENERAL_FAILURE;
+}
+
+/**
+ * @brief Executes a prepared command with the salted session. A password
+ *      session precedes it, if the command has an authorized handle. With
+ *      TPMA_SESSION_DECRYPT, the first command parameter is encrypted before
+ *      the command HMAC is computed over it. The response HMAC is verified
+ *      before the first response parameter is decrypted with
+ *      TPMA_SESSION_ENCRYPT.
+ * @param[in,out] sapi Pointer to the active fast path state.
+ * @param[in] command_code Command code of the prepared command.
+ * @param[in] name Name of the handle, which is authorized with the password
+ *      session, or NULL if the command has no handle.
+ * @param[in] attributes Attributes of the salted session.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC sapi_execute(tpm_sapi_t *sapi, TPM2_CC command_code,
+        const TPM2B_NAME *name, TPMA_SESSION attributes)
+{
+    TSS2L_SYS_AUTH_COMMAND cmd_auths;
+    TSS2L_SYS_AUTH_RESPONSE rsp_auths;
+    const TPMS_AUTH_RESPONSE *rsp_auth;
+    TPM2B_NONCE nonce_caller;
+    mbedtls_sha256_context sha256;
+    uint8_t p_hash[TPM_SAPI_DIGEST_LEN];
+    uint8_t expected[TPM_SAPI_DIGEST_LEN];
+    uint8_t code[4];
+    uint8_t param[SAPI_MAX_PARAM_LEN];
+    const uint8_t *buffer;
+    size_t len_buffer;
+    size_t index = (name != NULL) ? 1 : 0;
+    uint8_t diff = 0;
+    size_t i;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+
+    /* The nonceCaller is fresh for each command */
+    nonce_caller.size = TPM_SAPI_DIGEST_LEN;
+    if(sapi_random(NULL, nonce_caller.buffer, nonce_caller.size) != 0)
+    {
+        return TSS2_SYS_RC_GENERAL_FAILURE;
+    }
+
+    if((attributes & TPMA_SESSION_DECRYPT) != 0)
+    {
+        ret = Tss2_Sys_GetDecryptParam(sapi->sys_context, &len_buffer,
+            &buffer);
+        if((ret == TSS2_RC_SUCCESS) && (len_buffer > sizeof(param)))
+        {
+            ret = TSS2_SYS_RC_BAD_VALUE;
+        }
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            memcpy(param, buffer, len_buffer);
+            ret = sapi_crypt_param(sapi, &nonce_caller, &sapi->nonce_tpm,
+                param, len_buffer, MBEDTLS_AES_ENCRYPT);
+        }
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            ret = Tss2_Sys_SetDecryptParam(sapi->sys_context, len_buffer,
+                param);
+        }
+        mbedtls_platform_zeroize(param, sizeof(param));
+        if(ret != TSS2_RC_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    /* cpHash = SHA256(commandCode || name || parameters) */
+    ret = Tss2_Sys_GetCpBuffer(sapi->sys_context, &len_buffer, &buffer);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+    sapi_put_uint32(code, command_code);
+    mbedtls_sha256_init(&sha256);
+    (void)mbedtls_sha256_starts_ret(&sha256, 0);
+    (void)mbedtls_sha256_update_ret(&sha256, code, sizeof(code));
+    if(name != NULL)
+    {
+        (void)mbedtls_sha256_update_ret(&sha256, name->name, name->size);
+    }
+    (void)mbedtls_sha256_update_ret(&sha256, buffer, len_buffer);
+    (void)mbedtls_sha256_finish_ret(&sha256, p_hash);
+    mbedtls_sha256_free(&sha256);
+
+    memset(&cmd_auths, 0, sizeof(cmd_auths));
+    cmd_auths.count = (UINT16)(index + 1);
+    cmd_auths.auths[0].sessionHandle = TPM2_RS_PW;
+    cmd_auths.auths[index].sessionHandle = sapi->session;
+    cmd_auths.auths[index].nonce = nonce_caller;
+    cmd_auths.auths[index].sessionAttributes = attributes;
+    cmd_auths.auths[index].hmac.size = TPM_SAPI_DIGEST_LEN;
+    sapi_session_hmac(sapi, p_hash, &nonce_caller, &sapi->nonce_tpm,
+        attributes, cmd_auths.auths[index].hmac.buffer);
+
+    ret = Tss2_Sys_SetCmdAuths(sapi->sys_context, &cmd_auths);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+
+    UTA_TRACE_TPM_ENTRY(command_code);
+    ret = Tss2_Sys_Execute(sapi->sys_context);
+    UTA_TRACE_TPM_RETURN(command_code, ret);
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+
+    memset(&rsp_auths, 0, sizeof(rsp_auths));
+    ret = Tss2_Sys_GetRspAuths(sapi->sys_context, &rsp_auths);
+    if((ret == TSS2_RC_SUCCESS) && (rsp_auths.count != cmd_auths.count))
+    {
+        ret = TSS2_SYS_RC_MALFORMED_RESPONSE;
+    }
+    if(ret == TSS2_RC_SUCCESS)
+    {
+        ret = Tss2_Sys_GetRpBuffer(sapi->sys_context, &len_buffer, &buffer);
+    }
+    if(ret != TSS2_RC_SUCCESS)
+    {
+        return ret;
+    }
+    rsp_auth = &rsp_auths.auths[index];
+
+    /* rpHash = SHA256(responseCode || commandCode || parameters) */
+    memset(code, 0, sizeof(code));
+    mbedtls_sha256_init(&sha256);
+    (void)mbedtls_sha256_starts_ret(&sha256, 0);
+    (void)mbedtls_sha256_update_ret(&sha256, code, sizeof(code));
+    sapi_put_uint32(code, command_code);
+    (void)mbedtls_sha256_update_ret(&sha256, code, sizeof(code));
+    (void)mbedtls_sha256_update_ret(&sha256, buffer, len_buffer);
+    (void)mbedtls_sha256_finish_ret(&sha256, p_hash);
+    mbedtls_sha256_free(&sha256);
+
+    sapi_session_hmac(sapi, p_hash, &rsp_auth->nonce, &nonce_caller,
+        rsp_auth->sessionAttributes, expected);
+    if(rsp_auth->hmac.size != TPM_SAPI_DIGEST_LEN)
+    {
+        return TSS2_SYS_RC_MALFORMED_RESPONSE;
+    }
+    for(i = 0; i < TPM_SAPI_DIGEST_LEN; i++)
+    {
+        diff |= (uint8_t)(expected[i] ^ rsp_auth->hmac.buffer[i]);
+    }
+    if(diff != 0)
+    {
+        return TSS2_SYS_RC_MALFORMED_RESPONSE;
+    }
+
+    /* The nonceTPM of the response is the nonceOlder of the next command */
+    sapi->nonce_tpm = rsp_auth->nonce;
+
+    if((attributes & TPMA_SESSION_ENCRYPT) != 0)
+    {
+        ret = Tss2_Sys_GetEncryptParam(sapi->sys_context, &len_buffer,
+            &buffer);
+        if((ret == TSS2_RC_SUCCESS) && (len_buffer > sizeof(param)))
+        {
+            ret = TSS2_SYS_RC_MALFORMED_RESPONSE;
+        }
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            memcpy(param, buffer, len_buffer);
+            ret = sapi_crypt_param(sapi, &sapi->nonce_tpm, &nonce_caller,
+                param, len_buffer, MBEDTLS_AES_DECRYPT);
+        }
+        if(ret == TSS2_RC_SUCCESS)
+        {
+            ret = Tss2_Sys_SetEncryptParam(sapi->sys_context, len_buffer,
+                param);
+        }
+        mbedtls_platform_zeroize(param, sizeof(param));
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Encrypts or decrypts a parameter in place with AES-128-CFB. Key and
+ *      IV are KDFa(sessionKey, "CFB", nonceNewer, nonceOlder).
+ * @param[in] sapi Pointer to the active fast path state.
+ * @param[in] nonce_newer nonceCaller of a command, nonceTPM of a response.
+ * @param[in] nonce_older nonceTPM of a command, nonceCaller of a response.
+ * @param[in,out] param Pointer to the parameter without its size field.
+ * @param[in] len_param Length of the parameter in bytes.
+ * @param[in] mode MBEDTLS_AES_ENCRYPT or MBEDTLS_AES_DECRYPT.
+ * @return TCG TSS return code.
+ */
+static TSS2_RC sapi_crypt_param(const tpm_sapi_t *sapi,
+        const TPM2B_NONCE *nonce_newer, const TPM2B_NONCE *nonce_older,
+        uint8_t *param, size_t len_param, int mode)
+{
+    mbedtls_aes_context aes;
+    uint8_t key_iv[SAPI_AES_KEY_LEN + SAPI_AES_BLOCK_LEN];
+    size_t iv_offset = 0;
+    int ret;
+
+    sapi_kdfa(sapi->session_key, sizeof(sapi->session_key), "CFB",
+        nonce_newer, nonce_older, key_iv, sizeof(key_iv));
+
+    /* CFB uses the encryption key schedule in both directions */
+    mbedtls_aes_init(&aes);
+    ret = mbedtls_aes_setkey_enc(&aes, key_iv, SAPI_AES_KEY_LEN * 8);
+    if(ret == 0)
+    {
+        ret = mbedtls_aes_crypt_cfb128(&aes, mode, len_param, &iv_offset,
+            &key_iv[SAPI_AES_KEY_LEN], param, param);
+    }
+    mbedtls_aes_free(&aes);
+
+    mbedtls_platform_zeroize(key_iv, sizeof(key_iv));
+
+    return (ret == 0) ? TSS2_RC_SUCCESS : TSS2_SYS_RC_GENERAL_FAILURE;
+}
+
+/**
+ * @brief Computes the HMAC of the salted session, HMAC(sessionKey, pHash ||
+ *      nonceNewer || nonceOlder || sessionAttributes). The session is not
+ *      used for an authorization, so no authValue is appended to the key and
+ *      no further nonces are included.
+ * @param[in] sapi Pointer to the active fast path state.
+ * @param[in] p_hash cpHash of a command or rpHash of a response.
+ * @param[in] nonce_newer nonceCaller of a command, nonceTPM of a response.
+ * @param[in] nonce_older nonceTPM of a command, nonceCaller of a response.
+ * @param[in] attributes Session attributes of the command or response.
+ * @param[out] hmac Pointer to the buffer of TPM_SAPI_DIGEST_LEN bytes.
+ */
+static void sapi_session_hmac(const tpm_sapi_t *sapi, const uint8_t *p_hash,
+        const TPM2B_NONCE *nonce_newer, const TPM2B_NONCE *nonce_older,
+        TPMA_SESSION attributes, uint8_t *hmac)
+{
+    sapi_hmac_t ctx;
+
+    sapi_hmac_starts(&ctx, sapi->session_key, sizeof(sapi->session_key));
+    sapi_hmac_update(&ctx, p_hash, TPM_SAPI_DIGEST_LEN);
+    sapi_hmac_update(&ctx, nonce_newer->buffer, nonce_newer->size);
+    sapi_hmac_update(&ctx, nonce_older->buffer, nonce_older->size);
+    sapi_hmac_update(&ctx, &attributes, 1);
+    sapi_hmac_finish(&ctx, hmac);
+}
+
+/**
+ * @brief Checks, whether the session is still in sync with the TPM after a
+ *      failed command. This is only the case, if the TPM rejected the command
+ *      for a reason, which does not concern the session. Otherwise, e.g.
+ *      after a TCTI error, the nonces of the TPM are unknown.
+ * @param[in] ret TCG TSS return code of the failed command.
+ * @return 1 if the session can be used further, 0 otherwise.
+ */
+static int sapi_keep_session(TSS2_RC ret)
+{
+    if(((ret & TSS2_RC_LAYER_MASK) != TSS2_TPM_RC_LAYER) &&
+       ((ret & TSS2_RC_LAYER_MASK) != TSS2_RESMGR_TPM_RC_LAYER))
+    {
+        return 0;
+    }
+    ret &= ~TSS2_RC_LAYER_MASK;
+
+    /* Format one error of a session, a parameter number may also set bit 11 */
+    if((ret & TPM2_RC_FMT1) != 0)
+    {
+        return (((ret & TPM2_RC_P) == 0) && ((ret & TPM2_RC_S) != 0)) ? 0 : 1;
+    }
+
+    /* Session, which is not loaded */
+    if((ret >= TPM2_RC_REFERENCE_S0) && (ret <= TPM2_RC_REFERENCE_S6))
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Random source of the ephemeral ECDH key and the nonceCaller, in the
+ *      form of an mbedtls f_rng callback.
+ * @param[in] p_rng Not used.
+ * @param[out] output Pointer to the buffer where the random bytes are written
+ *      to.
+ * @param[in] len Number of random bytes, at most 256.
+ * @return 0 on success, MBEDTLS_ERR_ECP_RANDOM_FAILED otherwise.
+ */
+static int sapi_random(void *p_rng, unsigned char *output, size_t len)
+{
+    /* Requests of up to 256 bytes are not interrupted */
+    if(getrandom(output, len, 0) != (ssize_t)len)
+    {
+        return MBEDTLS_ERR_ECP_RANDOM_FAILED;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief KDFa with SHA256, K(i) = HMAC(key, [i] || label || 0x00 ||
+ *      contextU || contextV || [bits]).
+ * @param[in] key Pointer to the key, at most SAPI_HASH_BLOCK_LEN bytes.
+ * @param[in] len_key Length of the key in bytes.
+ * @param[in] label Label without its terminating zero, which is included.
+ * @param[in] context_u Nonce used as contextU.
+ * @param[in] context_v Nonce used as contextV.
+ * @param[out] out Pointer to the buffer where the key stream is written to.
+ * @param[in] len_out Number of bytes to derive.
+ */
+static void sapi_kdfa(const uint8_t *key, size_t len_key, const char *label,
+        const TPM2B_NONCE *context_u, const TPM2B_NONCE *context_v,
+        uint8_t *out, size_t len_out)
+{
+    sapi_hmac_t ctx;
+    uint8_t block[TPM_SAPI_DIGEST_LEN];
+    uint8_t counter[4];
+    uint8_t bits[4];
+    size_t offset;
+    size_t len_copy;
+    uint32_t i = 1;
+
+    sapi_put_uint32(bits, (uint32_t)(len_out * 8));
+
+    for(offset = 0; offset < len_out; offset += len_copy)
+    {
+        sapi_put_uint32(counter, i++);
+        sapi_hmac_starts(&ctx, key, len_key);
+        sapi_hmac_update(&ctx, counter, sizeof(counter));
+        sapi_hmac_update(&ctx, (const uint8_t *)label, strlen(label) + 1);
+        sapi_hmac_update(&ctx, context_u->buffer, context_u->size);
+        sapi_hmac_update(&ctx, context_v->buffer, context_v->size);
+        sapi_hmac_update(&ctx, bits, sizeof(bits));
+        sapi_hmac_finish(&ctx, block);
+
+        len_copy = len_out - offset;
+        if(len_copy > sizeof(block))
+        {
+            len_copy = sizeof(block);
+        }
+        memcpy(&out[offset], block, len_copy);
+    }
+
+    mbedtls_platform_zeroize(block, sizeof(block));
+}
+
+/**
+ * @brief KDFe with SHA256, K(i) = SHA256([i] || Z || label || 0x00 ||
+ *      partyUInfo || partyVInfo).
+ * @param[in] z Pointer to the x coordinate of the shared point.
+ * @param[in] len_z Length of z in bytes.
+ * @param[in] label Label without its terminating zero, which is included.
+ * @param[in] party_u Pointer to the x coordinate of the ephemeral key.
+ * @param[in] len_party_u Length of party_u in bytes.
+ * @param[in] party_v Pointer to the x coordinate of the salt key.
+ * @param[in] len_party_v Length of party_v in bytes.
+ * @param[out] out Pointer to the buffer where the key stream is written to.
+ * @param[in] len_out Number of bytes to derive.
+ */
+static void sapi_kdfe(const uint8_t *z, size_t len_z, const char *label,
+        const uint8_t *party_u, size_t len_party_u, const uint8_t *party_v,
+        size_t len_party_v, uint8_t *out, size_t len_out)
+{
+    mbedtls_sha256_context sha256;
+    uint8_t block[TPM_SAPI_DIGEST_LEN];
+    uint8_t counter[4];
+    size_t offset;
+    size_t len_copy;
+    uint32_t i = 1;
+
+    for(offset = 0; offset < len_out; offset += len_copy)
+    {
+        sapi_put_uint32(counter, i++);
+        mbedtls_sha256_init(&sha256);
+        (void)mbedtls_sha256_starts_ret(&sha256, 0);
+        (void)mbedtls_sha256_update_ret(&sha256, counter, sizeof(counter));
+        (void)mbedtls_sha256_update_ret(&sha256, z, len_z);
+        (void)mbedtls_sha256_update_ret(&sha256, (const uint8_t *)label,
+            strlen(label) + 1);
+        (void)mbedtls_sha256_update_ret(&sha256, party_u, len_party_u);
+        (void)mbedtls_sha256_update_ret(&sha256, party_v, len_party_v);
+        (void)mbedtls_sha256_finish_ret(&sha256, block);
+        mbedtls_sha256_free(&sha256);
+
+        len_copy = len_out - offset;
+        if(len_copy > sizeof(block))
+        {
+            len_copy = sizeof(block);
+        }
+        memcpy(&out[offset], block, len_copy);
+    }
+
+    mbedtls_platform_zeroize(block, sizeof(block));
+}
+
+/**
+ * @brief Starts an HMAC-SHA256 with a key of at most SAPI_HASH_BLOCK_LEN
+ *      bytes.
+ * @param[out] hmac HMAC context.
+ * @param[in] key Pointer to the key.
+ * @param[in] len_key Length of the key in bytes.
+ */
+static void sapi_hmac_starts(sapi_hmac_t *hmac, const uint8_t *key,
+        size_t len_key)
+{
+    uint8_t pad[SAPI_HASH_BLOCK_LEN];
+    size_t i;
+
+    memset(pad, 0x36, sizeof(pad));
+    for(i = 0; i < len_key; i++)
+    {
+        pad[i] ^= key[i];
+    }
+    mbedtls_sha256_init(&hmac->inner);
+    (void)mbedtls_sha256_starts_ret(&hmac->inner, 0);
+    (void)mbedtls_sha256_update_ret(&hmac->inner, pad, sizeof(pad));
+
+    memset(pad, 0x5C, sizeof(pad));
+    for(i = 0; i < len_key; i++)
+    {
+        pad[i] ^= key[i];
+    }
+    mbedtls_sha256_init(&hmac->outer);
+    (void)mbedtls_sha256_starts_ret(&hmac->outer, 0);
+    (void)mbedtls_sha256_update_ret(&hmac->outer, pad, sizeof(pad));
+
+    mbedtls_platform_zeroize(pad, sizeof(pad));
+}
+
+/**
+ * @brief Adds data to an HMAC-SHA256.
+ * @param[in,out] hmac HMAC context.
+ * @param[in] data Pointer to the data.
+ * @param[in] len_data Length of the data in bytes.
+ */
+static void sapi_hmac_update(sapi_hmac_t *hmac, const uint8_t *data,
+        size_t len_data)
+{
+    (void)mbedtls_sha256_update_ret(&hmac->inner, data, len_data);
+}
+
+/**
+ * @brief Finishes an HMAC-SHA256 and clears its context.
+ * @param[in,out] hmac HMAC context.
+ * @param[out] mac Pointer to the buffer of TPM_SAPI_DIGEST_LEN bytes.
+ */
+static void sapi_hmac_finish(sapi_hmac_t *hmac, uint8_t *mac)
+{
+    uint8_t digest[TPM_SAPI_DIGEST_LEN];
+
+    (void)mbedtls_sha256_finish_ret(&hmac->inner, digest);
+    (void)mbedtls_sha256_update_ret(&hmac->outer, digest, sizeof(digest));
+    (void)mbedtls_sha256_finish_ret(&hmac->outer, mac);
+
+    mbedtls_sha256_free(&hmac->inner);
+    mbedtls_sha256_free(&hmac->outer);
+    mbedtls_platform_zeroize(digest, sizeof(digest));
+}
+
+/**
+ * @brief Writes a 16 bit value in big endian byte order.
+ * @param[out] buffer Pointer to two bytes.
+ * @param[in] value Value to write.
+ */
+static void sapi_put_uint16(uint8_t *buffer, uint16_t value)
+{
+    buffer[0] = (uint8_t)(value >> 8);
+    buffer[1] = (uint8_t)value;
+}
+
+/**
+ * @brief Writes a 32 bit value in big endian byte order.
+ * @param[out] buffer Pointer to four bytes.
+ * @param[in] value Value to write.
+ */
+static void sapi_put_uint32(uint8_t *buffer, uint32_t value)
+{
+    buffer[0] = (uint8_t)(value >> 24);
+    buffer[1] = (uint8_t)(value >> 16);
+    buffer[2] = (uint8_t)(value >> 8);
+    buffer[3] = (uint8_t)value;
+}
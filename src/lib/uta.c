@@ -17,12 +17,12 @@
  * Includes
  ******************************************************************************/
 #include <config.h>
-#include <stdio.h>
 #include <stdint.h>
 #include <uta.h>
 #include <tpm_ibm.h>
 #include <uta_sim.h>
 #include <tpm_tcg.h>
+#include <uta_client.h>
 
 /*******************************************************************************
  * Public function bodies
@@ -48,8 +48,14 @@ uta_rc uta_get_version(const uta_context_v1_t *uta_context,
     version->uta_type=TPM_TCG;
     #endif
 
-    (void)sscanf(VERSION,"%u.%u.%u",&(version->major), &(version->minor),
-        &(version->patch));
+    #ifdef HW_BACKEND_UTA_CLIENT
+    version->uta_type=UTA_CLIENT;
+    #endif
+
+    /* The version numbers are defined by configure */
+    version->major = UTA_VERSION_MAJOR;
+    version->minor = UTA_VERSION_MINOR;
+    version->patch = UTA_VERSION_PATCH;
 
     return UTA_SUCCESS;
 }
@@ -61,7 +67,7 @@ uta_rc uta_get_version(const uta_context_v1_t *uta_context,
  */
 size_t uta_len_key_max(void)
 {
-    return 32;
+    return UTA_LEN_KEY_MAX_V1;
 }
 
 /**
@@ -100,7 +106,17 @@ uta_rc uta_init_v1(uta_api_v1_t *uta)
 	uta->get_random=&tpm_get_random;
 	uta->self_test= &tpm_self_test;
 	uta->get_device_uuid= &tpm_get_device_uuid;
-    
+
+// Pointer to the UTA_CLIENT functions
+#elif HW_BACKEND_UTA_CLIENT
+    uta->context_v1_size=&client_context_v1_size;
+    uta->open=&client_open;
+    uta->close=&client_close;
+    uta->derive_key=&client_derive_key;
+    uta->get_random=&client_get_random;
+    uta->self_test=&client_self_test;
+    uta->get_device_uuid=&client_get_device_uuid;
+
 #else
 #error "No valid HARDWARE defined!"
 #endif
@@ -110,3 +126,106 @@ uta_rc uta_init_v1(uta_api_v1_t *uta)
     
     return UTA_SUCCESS;
 }
+
+/**
+ * @brief Returns a struct containing the function pointers of the UTA v1
+ *      extensions.
+ * @param[out] uta_ext Struct with the v1 extension function pointers.
+ * @return UTA return code.
+ */
+uta_rc uta_init_v1_ext(uta_api_v1_ext_t *uta_ext)
+{
+// Pointer to the TPM_IBM functions
+#if HW_BACKEND_TPM_IBM
+    uta_ext->derive_key_batch=&tpm_derive_key_batch;
+    uta_ext->set_random_mode=&tpm_set_random_mode;
+    uta_ext->get_poll_fd=&tpm_get_poll_fd;
+    uta_ext->derive_key_submit=&tpm_derive_key_submit;
+    uta_ext->get_random_submit=&tpm_get_random_submit;
+    uta_ext->complete=&tpm_async_complete;
+    uta_ext->open_pool=&tpm_open_pool;
+    uta_ext->open_devices=&tpm_open_devices;
+    uta_ext->get_stats=&tpm_get_stats;
+    uta_ext->reset_stats=&tpm_reset_stats;
+    uta_ext->derive_key_expand=&tpm_derive_key_expand;
+    uta_ext->set_key_cache=&tpm_set_key_cache;
+    uta_ext->flush_key_cache=&tpm_flush_key_cache;
+    uta_ext->start_self_test=&tpm_start_self_test;
+    uta_ext->get_self_test_result=&tpm_get_self_test_result;
+    uta_ext->get_random_v=&tpm_get_random_v;
+    uta_ext->set_timeout=&tpm_set_timeout;
+    uta_ext->get_capabilities=&tpm_get_capabilities;
+    uta_ext->set_param_encryption=&tpm_set_param_encryption;
+
+// Pointer to the UTA_SIM functions
+#elif HW_BACKEND_UTA_SIM
+    uta_ext->derive_key_batch=&sim_derive_key_batch;
+    uta_ext->set_random_mode=&sim_set_random_mode;
+    uta_ext->get_poll_fd=&sim_get_poll_fd;
+    uta_ext->derive_key_submit=&sim_derive_key_submit;
+    uta_ext->get_random_submit=&sim_get_random_submit;
+    uta_ext->complete=&sim_async_complete;
+    uta_ext->open_pool=&sim_open_pool;
+    uta_ext->open_devices=&sim_open_devices;
+    uta_ext->get_stats=&sim_get_stats;
+    uta_ext->reset_stats=&sim_reset_stats;
+    uta_ext->derive_key_expand=&sim_derive_key_expand;
+    uta_ext->set_key_cache=&sim_set_key_cache;
+    uta_ext->flush_key_cache=&sim_flush_key_cache;
+    uta_ext->start_self_test=&sim_start_self_test;
+    uta_ext->get_self_test_result=&sim_get_self_test_result;
+    uta_ext->get_random_v=&sim_get_random_v;
+    uta_ext->set_timeout=&sim_set_timeout;
+    uta_ext->get_capabilities=&sim_get_capabilities;
+    uta_ext->set_param_encryption=&sim_set_param_encryption;
+
+// Pointer to the TPM_TCG functions
+#elif HW_BACKEND_TPM_TCG
+    uta_ext->derive_key_batch=&tpm_derive_key_batch;
+    uta_ext->set_random_mode=&tpm_set_random_mode;
+    uta_ext->get_poll_fd=&tpm_get_poll_fd;
+    uta_ext->derive_key_submit=&tpm_derive_key_submit;
+    uta_ext->get_random_submit=&tpm_get_random_submit;
+    uta_ext->complete=&tpm_async_complete;
+    uta_ext->open_pool=&tpm_open_pool;
+    uta_ext->open_devices=&tpm_open_devices;
+    uta_ext->get_stats=&tpm_get_stats;
+    uta_ext->reset_stats=&tpm_reset_stats;
+    uta_ext->derive_key_expand=&tpm_derive_key_expand;
+    uta_ext->set_key_cache=&tpm_set_key_cache;
+    uta_ext->flush_key_cache=&tpm_flush_key_cache;
+    uta_ext->start_self_test=&tpm_start_self_test;
+    uta_ext->get_self_test_result=&tpm_get_self_test_result;
+    uta_ext->get_random_v=&tpm_get_random_v;
+    uta_ext->set_timeout=&tpm_set_timeout;
+    uta_ext->get_capabilities=&tpm_get_capabilities;
+    uta_ext->set_param_encryption=&tpm_set_param_encryption;
+
+// Pointer to the UTA_CLIENT functions
+#elif HW_BACKEND_UTA_CLIENT
+    uta_ext->derive_key_batch=&client_derive_key_batch;
+    uta_ext->set_random_mode=&client_set_random_mode;
+    uta_ext->get_poll_fd=&client_get_poll_fd;
+    uta_ext->derive_key_submit=&client_derive_key_submit;
+    uta_ext->get_random_submit=&client_get_random_submit;
+    uta_ext->complete=&client_async_complete;
+    uta_ext->open_pool=&client_open_pool;
+    uta_ext->open_devices=&client_open_devices;
+    uta_ext->get_stats=&client_get_stats;
+    uta_ext->reset_stats=&client_reset_stats;
+    uta_ext->derive_key_expand=&client_derive_key_expand;
+    uta_ext->set_key_cache=&client_set_key_cache;
+    uta_ext->flush_key_cache=&client_flush_key_cache;
+    uta_ext->start_self_test=&client_start_self_test;
+    uta_ext->get_self_test_result=&client_get_self_test_result;
+    uta_ext->get_random_v=&client_get_random_v;
+    uta_ext->set_timeout=&client_set_timeout;
+    uta_ext->get_capabilities=&client_get_capabilities;
+    uta_ext->set_param_encryption=&client_set_param_encryption;
+
+#else
+#error "No valid HARDWARE defined!"
+#endif
+
+    return UTA_SUCCESS;
+}
@@ -0,0 +1,152 @@
+/** @file uta_async.c
+* 
+* @brief Unified Trust Anchor (UTA) emulation of the asynchronous API for
+* backends without native asynchronous commands. The operation is executed
+* synchronously on submission and its completion is signalled through a pipe,
+* so that the same event loop code can be used with all backends. The caller
+* has to serialize the access to a uta_async_t, e.g. with the accesslock of
+* the context.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License 
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#define _GNU_SOURCE /* pipe2 */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <uta_async.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* States of the emulated operation */
+#define ASYNC_IDLE      0
+#define ASYNC_CLAIMED   1
+#define ASYNC_POSTED    2
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Creates the non-blocking pipe used for the completion signal.
+ * @param[out] async Pointer to the emulation state.
+ * @return UTA return code.
+ */
+uta_rc uta_async_init(uta_async_t *async)
+{
+    async->pending = ASYNC_IDLE;
+    async->result = UTA_SUCCESS;
+
+    if(pipe2(async->fds, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        async->fds[0] = -1;
+        async->fds[1] = -1;
+        return UTA_TA_ERROR;
+    }
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Closes the pipe. A pending result is discarded.
+ * @param[in,out] async Pointer to the emulation state.
+ */
+void uta_async_free(uta_async_t *async)
+{
+    if(async->fds[0] >= 0)
+    {
+        (void)close(async->fds[0]);
+        (void)close(async->fds[1]);
+    }
+    async->fds[0] = -1;
+    async->fds[1] = -1;
+    async->pending = ASYNC_IDLE;
+}
+
+/**
+ * @brief Returns the file descriptor, which becomes readable on completion.
+ * @param[in] async Pointer to the emulation state.
+ * @return Read end of the pipe.
+ */
+int uta_async_fd(const uta_async_t *async)
+{
+    return async->fds[0];
+}
+
+/**
+ * @brief Marks an operation as pending, before it is executed.
+ * @param[in,out] async Pointer to the emulation state.
+ * @return UTA_TRY_AGAIN if another operation is pending, UTA_SUCCESS
+ *      otherwise.
+ */
+uta_rc uta_async_claim(uta_async_t *async)
+{
+    if(async->pending != ASYNC_IDLE)
+    {
+        return UTA_TRY_AGAIN;
+    }
+
+    async->pending = ASYNC_CLAIMED;
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Stores the result of the claimed operation and signals the
+ *      completion.
+ * @param[in,out] async Pointer to the emulation state.
+ * @param[in] result Return code of the operation.
+ */
+void uta_async_post(uta_async_t *async, uta_rc result)
+{
+    char signal = 1;
+    ssize_t ret;
+
+    async->result = result;
+    async->pending = ASYNC_POSTED;
+
+    /*
+     * The pipe is empty, because only one operation can be pending. Without
+     * the signal, the result is still returned by uta_async_collect.
+     */
+    ret = write(async->fds[1], &signal, 1);
+    (void)ret;
+}
+
+/**
+ * @brief Returns the result of the pending operation and clears the signal.
+ * @param[in,out] async Pointer to the emulation state.
+ * @return Result of the operation, UTA_TRY_AGAIN if it has not been posted
+ *      yet or UTA_TA_ERROR if no operation is pending.
+ */
+uta_rc uta_async_collect(uta_async_t *async)
+{
+    char signal;
+    ssize_t ret;
+
+    if(async->pending == ASYNC_IDLE)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    if(async->pending == ASYNC_CLAIMED)
+    {
+        return UTA_TRY_AGAIN;
+    }
+
+    async->pending = ASYNC_IDLE;
+
+    /* Clear the completion signal */
+    ret = read(async->fds[0], &signal, 1);
+    (void)ret;
+
+    return async->result;
+}
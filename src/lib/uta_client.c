@@ -0,0 +1,1669 @@
+/** @file uta_client.c
+*
+* @brief Unified Trust Anchor (UTA) client backend. The trust anchor is not
+* accessed by the process itself, every call is forwarded over a Unix domain
+* socket to the utad daemon, which holds the open contexts of the trust anchor
+* for all processes of the host. Each connection carries one request at a
+* time; a pooled context opens several connections, so that its threads are
+* served in parallel. Parameters are checked before a request is sent and
+* broken connections are opened again once per request, e.g. after a restart
+* of the daemon.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <config.h>
+#include <uta_config.h>
+#include <uta_client.h>
+#include <utad_protocol.h>
+#include <uta_async.h>
+#include <uta_stats.h>
+#include <uta_deadline.h>
+#include <uta_fork.h>
+#include <uta_key_cache.h>
+#include <uta_trace.h>
+#ifdef ENABLE_DRBG
+#include <uta_drbg.h>
+#endif
+#ifdef ENABLE_HKDF
+#include <uta_hkdf.h>
+#endif
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define KEY_LEN           32
+#define DERIV_VAL_LEN     8
+#define USED_KEY_SLOTS    2
+#define UUID_LEN          16
+
+/* Each request is sent again once on a new connection, if the old one broke */
+#define CLIENT_ATTEMPTS   2
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+struct _uta_context_v1_t
+{
+    /* Connections to utad, free_mask has one bit per free connection */
+    int fds[CONFIGURED_TPM_POOL_MAX];
+    size_t num_connections;
+    uint64_t free_mask;
+    sem_t free_count;
+    /* Fork generation of the process, which owns the connections */
+    uint32_t fork_generation;
+    /* Statistics, updated with atomic operations */
+    uta_stats_v1_t stats;
+    /* Timeout of the calls in ms, 0 for none, accessed atomically */
+    uint32_t timeout_ms;
+    /* Cache of derived keys, read without a lock */
+    uta_key_cache_t key_cache;
+    /* Context wide state, protected by the accesslock */
+    uint8_t uuid[UUID_LEN];
+    uint8_t uuid_cached;
+#ifdef ENABLE_DRBG
+    /* DRBG of the DRBG mode, protected by the drbglock, which is taken after
+     * the accesslock. drbg_active is set while the DRBG is seeded and read
+     * atomically, so that random requests of the other mode take no lock */
+    uta_drbg_t drbg;
+    /* Deadline of the call, which (re)seeds the DRBG */
+    uint64_t drbg_deadline;
+    uint8_t drbg_active;
+    pthread_mutex_t drbglock;
+#endif
+    uta_async_t async;
+    pthread_mutex_t accesslock;
+};
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static int client_connect(void);
+static void client_close_connections(const uta_context_v1_t *client_context);
+static uta_rc client_check_fork(const uta_context_v1_t *client_context,
+        int reopen);
+static int client_acquire_connection(const uta_context_v1_t *client_context,
+        uint64_t deadline);
+static void client_release_connection(const uta_context_v1_t *client_context,
+        int index, uint64_t start);
+static int client_transfer(int fd, const utad_request_t *request,
+        uint8_t *output, uta_rc *rc, uint64_t deadline);
+static uta_rc client_request(const uta_context_v1_t *client_context,
+        utad_request_t *request, uint8_t *output, uint64_t deadline);
+static uta_rc client_read_random(const uta_context_v1_t *client_context,
+        uint8_t *random, size_t len_random, uint64_t deadline);
+static int client_wait(int fd, short events, uint64_t deadline);
+static int send_all(int fd, const void *buf, size_t len, uint64_t deadline);
+static int recv_all(int fd, void *buf, size_t len, uint64_t deadline);
+#ifdef ENABLE_DRBG
+static uta_rc client_drbg_start(const uta_context_v1_t *client_context,
+        uint64_t reseed_bytes, uint32_t reseed_interval, uint64_t deadline);
+static void client_drbg_stop(const uta_context_v1_t *client_context);
+static int client_drbg_entropy(void *p_entropy, unsigned char *output,
+        size_t len);
+#endif
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Return the size of the opaque struct uta_context_v1_t.
+ * The bound UTA_CONTEXT_V1_STORAGE of configure.ac is 512 bytes for the
+ * context without connections (about 400 bytes on x86_64), plus 8 bytes per
+ * connection of the pool (one socket, 4 bytes) and 256 bytes for the DRBG
+ * (168 bytes).
+ * @return Size of the opaque struct uta_context_v1_t.
+ */
+size_t client_context_v1_size(void)
+{
+    /* Applications may store the context in UTA_CONTEXT_V1_STORAGE bytes,
+     * see above */
+    _Static_assert(sizeof(uta_context_v1_t) <= UTA_CONTEXT_V1_STORAGE,
+        "UTA_CONTEXT_V1_STORAGE of configure is too small");
+    return(sizeof(uta_context_v1_t));
+}
+
+/**
+ * @brief Opens one connection to the daemon.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc client_open(const uta_context_v1_t *client_context)
+{
+    return client_open_pool(client_context, 1);
+}
+
+/**
+ * @brief Opens a pool of connections to the daemon, so that up to
+ *      num_connections threads are served in parallel.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] num_connections Number of connections between 1 and
+ *      CONFIGURED_TPM_POOL_MAX.
+ * @return UTA return code.
+ */
+uta_rc client_open_pool(const uta_context_v1_t *client_context,
+        size_t num_connections)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    size_t i;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_OPEN, 0, num_connections);
+
+    /* Each open starts with cleared statistics */
+    uta_stats_reset(&client_context_w->stats);
+
+    if((num_connections < 1) || (num_connections > CONFIGURED_TPM_POOL_MAX))
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_OPEN,
+            UTA_NOT_SUPPORTED);
+    }
+
+    /* A child process re-establishes the context on its first call */
+    if(uta_fork_init(&client_context_w->fork_generation) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+
+    /* Initialization of the accesslock mutex */
+    if(pthread_mutex_init(&client_context_w->accesslock, NULL) != 0)
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+
+#ifdef ENABLE_DRBG
+    /* Initialization of the drbglock mutex */
+    if(pthread_mutex_init(&client_context_w->drbglock, NULL) != 0)
+    {
+        (void)pthread_mutex_destroy(&client_context_w->accesslock);
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+#endif
+
+    /* Initialization of the free connection counter */
+    if(sem_init(&client_context_w->free_count, 0, num_connections) != 0)
+    {
+#ifdef ENABLE_DRBG
+        (void)pthread_mutex_destroy(&client_context_w->drbglock);
+#endif
+        (void)pthread_mutex_destroy(&client_context_w->accesslock);
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+
+    client_context_w->num_connections = 0;
+    client_context_w->free_mask = 0;
+    for(i = 0; i < num_connections; i++)
+    {
+        client_context_w->fds[i] = client_connect();
+        if(client_context->fds[i] < 0)
+        {
+            break;
+        }
+        client_context_w->free_mask |= (uint64_t)1 << i;
+        client_context_w->num_connections++;
+    }
+
+    /* Completion signal of the emulated asynchronous operations */
+    if((client_context->num_connections != num_connections) ||
+       (uta_async_init(&client_context_w->async) != UTA_SUCCESS))
+    {
+        client_close_connections(client_context);
+        (void)sem_destroy(&client_context_w->free_count);
+#ifdef ENABLE_DRBG
+        (void)pthread_mutex_destroy(&client_context_w->drbglock);
+#endif
+        (void)pthread_mutex_destroy(&client_context_w->accesslock);
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+
+    /* The device UUID is requested on the first call */
+    client_context_w->uuid_cached = 0;
+
+    /* The calls wait without limit until set_timeout is called */
+    uta_deadline_set_timeout(&client_context_w->timeout_ms, 0);
+
+#ifdef ENABLE_DRBG
+    /* Random numbers are read from the daemon until a DRBG mode is selected */
+    uta_drbg_init(&client_context_w->drbg);
+    client_context_w->drbg_active = 0;
+#endif
+
+    /* Keys are not cached until set_key_cache is called */
+    uta_key_cache_init(&client_context_w->key_cache);
+
+    return uta_stats_call(&client_context_w->stats, UTA_STATS_OPEN,
+        UTA_SUCCESS);
+}
+
+/**
+ * @brief Opens connections_per_device connections for each device. The
+ *      devices are selected by the daemon, so the device files are ignored
+ *      and the context is opened like with client_open_pool.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] device_files Paths of the devices.
+ * @param[in] num_devices Number of devices, at least 1.
+ * @param[in] connections_per_device Connections per device, at least 1. The
+ *      total must not exceed CONFIGURED_TPM_POOL_MAX.
+ * @return UTA return code.
+ */
+uta_rc client_open_devices(const uta_context_v1_t *client_context,
+        const char * const *device_files, size_t num_devices,
+        size_t connections_per_device)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    (void)device_files;
+
+    if((num_devices < 1) || (connections_per_device < 1) ||
+       (connections_per_device > (CONFIGURED_TPM_POOL_MAX / num_devices)))
+    {
+        UTA_TRACE_OP_ENTRY(UTA_STATS_OPEN, 0, num_devices);
+        uta_stats_reset(&client_context_w->stats);
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_OPEN,
+            UTA_NOT_SUPPORTED);
+    }
+
+    return client_open_pool(client_context,
+        num_devices * connections_per_device);
+}
+
+/**
+ * @brief Closes the connections to the daemon.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc client_close(const uta_context_v1_t *client_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_CLOSE, 0, 0);
+
+    /* A child only drops the connections of the parent */
+    (void)client_check_fork(client_context, 0);
+
+    /* Lock the context with the accesslock mutex, close always waits */
+    if(uta_stats_mutex_lock(&client_context_w->stats,
+        &client_context_w->accesslock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_CLOSE,
+            UTA_TA_ERROR);
+    }
+
+    client_close_connections(client_context);
+
+#ifdef ENABLE_DRBG
+    /* Clear the DRBG state */
+    client_drbg_stop(client_context);
+#endif
+
+    uta_async_free(&client_context_w->async);
+
+    /* Clear and release the key cache */
+    uta_key_cache_free(&client_context_w->key_cache);
+
+    /* Release the accesslock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&client_context_w->accesslock);
+
+    /* Destroy the semaphore and the mutexes (ignore return codes) */
+    (void)sem_destroy(&client_context_w->free_count);
+#ifdef ENABLE_DRBG
+    (void)pthread_mutex_destroy(&client_context_w->drbglock);
+#endif
+    (void)pthread_mutex_destroy(&client_context_w->accesslock);
+
+    return uta_stats_call(&client_context_w->stats, UTA_STATS_CLOSE,
+        UTA_SUCCESS);
+}
+
+/**
+ * @brief Derives a key by the trust anchor of the daemon.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[out] key Pointer to the buffer where the derived key is written to.
+ * @param[in] len_key Defines the number of bytes, which should be written to
+ *      the key buffer.
+ * @param[in] dv Pointer to the buffer in which the derivation value is handed
+ *      over.
+ * @param[in] len_dv Specifies the length in bytes of the derivation value.
+ * @param[in] key_slot Defines which master key is used for the HMAC function.
+ * @return UTA return code.
+ */
+uta_rc client_derive_key(const uta_context_v1_t *client_context, uint8_t *key,
+        size_t len_key, const uint8_t *dv, size_t len_dv, uint8_t key_slot)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    utad_request_t request;
+    uint8_t key_buffer[KEY_LEN];
+    uint64_t deadline;
+    uta_rc rc;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_DERIVE_KEY, key_slot, len_key);
+
+    deadline = uta_deadline_start(&client_context->timeout_ms);
+
+    if(key_slot > (USED_KEY_SLOTS-1))
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_DERIVE_KEY,
+            UTA_INVALID_KEY_SLOT);
+    }
+
+    if(len_dv != DERIV_VAL_LEN)
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_DERIVE_KEY,
+            UTA_INVALID_DV_LENGTH);
+    }
+
+    if(len_key > KEY_LEN)
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_DERIVE_KEY,
+            UTA_INVALID_KEY_LENGTH);
+    }
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_DERIVE_KEY,
+            UTA_TA_ERROR);
+    }
+
+    /* Serve repeated derivations from the key cache without a request */
+    if(uta_key_cache_enabled(&client_context_w->key_cache) != 0)
+    {
+        if(uta_key_cache_lookup(&client_context_w->key_cache, key_slot, dv,
+            key, len_key) != 0)
+        {
+            uta_stats_key_cache(&client_context_w->stats, 1);
+            return uta_stats_call(&client_context_w->stats,
+                UTA_STATS_DERIVE_KEY, UTA_SUCCESS);
+        }
+        uta_stats_key_cache(&client_context_w->stats, 0);
+    }
+
+    /* The cache keeps the full HMAC, which is truncated afterwards */
+    memset(&request, 0, sizeof(request));
+    request.op = UTAD_OP_DERIVE_KEY;
+    request.len = (uta_key_cache_enabled(&client_context_w->key_cache) != 0) ?
+        KEY_LEN : len_key;
+    request.key_slot = key_slot;
+    memcpy(request.dv, dv, DERIV_VAL_LEN);
+
+    rc = client_request(client_context, &request, key_buffer, deadline);
+    if(rc == UTA_SUCCESS)
+    {
+        if(request.len == KEY_LEN)
+        {
+            uta_key_cache_store(&client_context_w->key_cache, key_slot, dv,
+                key_buffer);
+        }
+        memcpy(key, key_buffer, len_key);
+    }
+    uta_key_cache_zeroize(key_buffer, sizeof(key_buffer));
+
+    return uta_stats_call(&client_context_w->stats, UTA_STATS_DERIVE_KEY, rc);
+}
+
+/**
+ * @brief Derives multiple keys. The daemon combines the requests of all its
+ *      clients, so the entries are simply sent one after the other.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in,out] requests Array of derivation requests. The result of each
+ *      request is written to its rc member.
+ * @param[in] num_requests Number of entries in requests.
+ * @return UTA return code of the first failed request, UTA_SUCCESS otherwise.
+ */
+uta_rc client_derive_key_batch(const uta_context_v1_t *client_context,
+        uta_derive_request_v1_t *requests, size_t num_requests)
+{
+    uta_rc rc = UTA_SUCCESS;
+    size_t i;
+
+    for(i = 0; i < num_requests; i++)
+    {
+        requests[i].rc = client_derive_key(client_context, requests[i].key,
+            requests[i].len_key, requests[i].dv, requests[i].len_dv,
+            requests[i].key_slot);
+        if((requests[i].rc != UTA_SUCCESS) && (rc == UTA_SUCCESS))
+        {
+            rc = requests[i].rc;
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Gets random numbers from the trust anchor of the daemon.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[out] random Pointer to the buffer where the random numbers are written
+ *      to.
+ * @param[in] len_random Defines the desired number of random bytes.
+ * @return UTA return code.
+ */
+uta_rc client_get_random(const uta_context_v1_t *client_context,
+        uint8_t *random, size_t len_random)
+{
+    uta_random_buffer_v1_t buffer = { .random = random,
+                                      .len_random = len_random };
+
+    return client_get_random_v(client_context, &buffer, 1);
+}
+
+/**
+ * @brief Gets random numbers from the trust anchor of the daemon for several
+ *      buffers. Each buffer is requested from the daemon on its own, which
+ *      coalesces concurrent random requests anyway. In the DRBG mode, all
+ *      buffers are generated under one hold of the drbglock mutex, the
+ *      requests to the daemon take no lock of the context.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] buffers Buffers, where the random numbers are written to.
+ * @param[in] num_buffers Number of entries in buffers.
+ * @return UTA return code.
+ */
+uta_rc client_get_random_v(const uta_context_v1_t *client_context,
+        const uta_random_buffer_v1_t *buffers, size_t num_buffers)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uta_rc rc = UTA_SUCCESS;
+    size_t len_random = 0;
+    uint64_t deadline;
+    size_t i;
+
+    for(i = 0; i < num_buffers; i++)
+    {
+        len_random += buffers[i].len_random;
+    }
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_GET_RANDOM, 0, len_random);
+
+    deadline = uta_deadline_start(&client_context->timeout_ms);
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_GET_RANDOM,
+            UTA_TA_ERROR);
+    }
+
+#ifdef ENABLE_DRBG
+    /* Serve the request from the DRBG, if it has been selected */
+    if(__atomic_load_n(&client_context->drbg_active, __ATOMIC_ACQUIRE) != 0)
+    {
+        /* Lock the DRBG state with the drbglock mutex */
+        rc = uta_stats_mutex_lock(&client_context_w->stats,
+            &client_context_w->drbglock, deadline);
+        if(rc != UTA_SUCCESS)
+        {
+            return uta_stats_call(&client_context_w->stats,
+                UTA_STATS_GET_RANDOM, rc);
+        }
+
+        /* The DRBG mode may have been left meanwhile */
+        if(client_context->drbg.seeded != 0)
+        {
+            /* A reseed reads the entropy before the deadline of this call */
+            client_context_w->drbg_deadline = deadline;
+
+            for(i = 0; (rc == UTA_SUCCESS) && (i < num_buffers); i++)
+            {
+                rc = uta_drbg_generate(&client_context_w->drbg,
+                    buffers[i].random, buffers[i].len_random);
+            }
+            if(rc != UTA_SUCCESS)
+            {
+                rc = uta_deadline_rc(deadline);
+            }
+
+            /* Release the drbglock mutex (ignore return code) */
+            (void)pthread_mutex_unlock(&client_context_w->drbglock);
+            if(rc == UTA_SUCCESS)
+            {
+                uta_stats_random(&client_context_w->stats, len_random);
+            }
+            return uta_stats_call(&client_context_w->stats,
+                UTA_STATS_GET_RANDOM, rc);
+        }
+
+        /* Release the drbglock mutex (ignore return code) */
+        (void)pthread_mutex_unlock(&client_context_w->drbglock);
+    }
+#endif
+
+    for(i = 0; (rc == UTA_SUCCESS) && (i < num_buffers); i++)
+    {
+        rc = client_read_random(client_context, buffers[i].random,
+            buffers[i].len_random, deadline);
+    }
+    if(rc == UTA_SUCCESS)
+    {
+        uta_stats_random(&client_context_w->stats, len_random);
+    }
+
+    return uta_stats_call(&client_context_w->stats, UTA_STATS_GET_RANDOM, rc);
+}
+
+/**
+ * @brief Selects the random mode of the context. In the DRBG mode, the DRBG
+ *      runs in the client process and is seeded from the daemon immediately.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] config Random mode and reseed limits.
+ * @return UTA return code.
+ */
+uta_rc client_set_random_mode(const uta_context_v1_t *client_context,
+        const uta_random_config_v1_t *config)
+{
+#ifdef ENABLE_DRBG
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uint64_t deadline;
+    uta_rc rc;
+
+    if((config->mode != UTA_RANDOM_TA) && (config->mode != UTA_RANDOM_DRBG))
+    {
+        return UTA_NOT_SUPPORTED;
+    }
+
+    deadline = uta_deadline_start(&client_context->timeout_ms);
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    /* Serialize the mode changes with the accesslock mutex */
+    rc = uta_stats_mutex_lock(&client_context_w->stats,
+        &client_context_w->accesslock, deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        return rc;
+    }
+
+    if(config->mode == UTA_RANDOM_DRBG)
+    {
+        rc = client_drbg_start(client_context, config->reseed_bytes,
+            config->reseed_interval, deadline);
+    }
+    else
+    {
+        client_drbg_stop(client_context);
+    }
+
+    /* Release the accesslock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&client_context_w->accesslock);
+
+    return rc;
+#else
+    /* Without DRBG support, only the daemon is available as source */
+    if(config->mode != UTA_RANDOM_TA)
+    {
+        return UTA_NOT_SUPPORTED;
+    }
+
+    return UTA_SUCCESS;
+#endif
+}
+
+/**
+ * @brief Sets the timeout of the calls of the context. The deadline of a call
+ *      bounds the wait for the accesslock mutex, for a free connection and
+ *      for the response of the daemon. A connection, whose response did not
+ *      arrive in time, is closed and opened again by a later request.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] timeout_ms Timeout of each call in ms, 0 for no limit.
+ * @return UTA return code.
+ */
+uta_rc client_set_timeout(const uta_context_v1_t *client_context,
+        uint32_t timeout_ms)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uta_deadline_set_timeout(&client_context_w->timeout_ms, timeout_ms);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Reads the capabilities of the trust anchor from the daemon. The
+ *      number of connections is that of this context to the daemon.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[out] capabilities Pointer to the capabilities.
+ * @return UTA return code.
+ */
+uta_rc client_get_capabilities(const uta_context_v1_t *client_context,
+        uta_capabilities_v1_t *capabilities)
+{
+    utad_request_t request;
+    uta_rc rc;
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.op = UTAD_OP_GET_CAPABILITIES;
+    request.len = UTAD_LEN_CAPABILITIES;
+
+    rc = client_request(client_context, &request, (uint8_t *)capabilities,
+        uta_deadline_start(&client_context->timeout_ms));
+    if(rc == UTA_SUCCESS)
+    {
+        capabilities->num_connections =
+            (uint32_t)client_context->num_connections;
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Checks the parameter encryption policy. The sessions to the trust
+ *      anchor belong to the daemon, which keeps all parameters encrypted, so
+ *      only this default is accepted.
+ * @param[in] client_context Pointer to the internal context struct.
+ * @param[in] policy Parameter encryption of the operations.
+ * @return UTA return code.
+ */
+uta_rc client_set_param_encryption(const uta_context_v1_t *client_context,
+        const uta_param_enc_policy_v1_t *policy)
+{
+    (void)client_context;
+
+    if((policy->derive_key != UTA_PARAM_ENC_FULL) ||
+       (policy->get_random != UTA_PARAM_ENC_FULL))
+    {
+        return UTA_NOT_SUPPORTED;
+    }
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Returns the file descriptor of the emulated asynchronous operations.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[out] fd File descriptor for poll, select or epoll.
+ * @return UTA return code.
+ */
+uta_rc client_get_poll_fd(const uta_context_v1_t *client_context, int *fd)
+{
+    /* The child gets its own pipe */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    *fd = uta_async_fd(&client_context->async);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Emulates an asynchronous key derivation. The key is derived
+ *      immediately and the completion is signalled on the poll fd.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[out] key Pointer to the buffer where the derived key is written to.
+ * @param[in] len_key Number of bytes, which should be written to key.
+ * @param[in] dv Pointer to the derivation value.
+ * @param[in] len_dv Length of the derivation value.
+ * @param[in] key_slot Key slot used for the HMAC function.
+ * @return UTA return code.
+ */
+uta_rc client_derive_key_submit(const uta_context_v1_t *client_context,
+        uint8_t *key, size_t len_key, const uint8_t *dv, size_t len_dv,
+        uint8_t key_slot)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uta_rc rc;
+
+    /* Invalid parameters are reported immediately, like on a TPM */
+    if((key_slot > (USED_KEY_SLOTS-1)) || (len_dv != DERIV_VAL_LEN) ||
+       (len_key > KEY_LEN))
+    {
+        return client_derive_key(client_context, key, len_key, dv, len_dv,
+            key_slot);
+    }
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    if(uta_stats_mutex_lock(&client_context_w->stats,
+        &client_context_w->accesslock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    rc = uta_async_claim(&client_context_w->async);
+    if(rc == UTA_SUCCESS)
+    {
+        uta_async_post(&client_context_w->async, client_derive_key(
+            client_context, key, len_key, dv, len_dv, key_slot));
+    }
+
+    (void)pthread_mutex_unlock(&client_context_w->accesslock);
+
+    return rc;
+}
+
+/**
+ * @brief Emulates an asynchronous random request. The random numbers are
+ *      requested from the daemon immediately and the completion is signalled
+ *      on the poll fd.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[out] random Pointer to the buffer where the random numbers are written
+ *      to.
+ * @param[in] len_random Defines the desired number of random bytes.
+ * @return UTA return code.
+ */
+uta_rc client_get_random_submit(const uta_context_v1_t *client_context,
+        uint8_t *random, size_t len_random)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uta_rc rc;
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    if(uta_stats_mutex_lock(&client_context_w->stats,
+        &client_context_w->accesslock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    rc = uta_async_claim(&client_context_w->async);
+    if(rc == UTA_SUCCESS)
+    {
+        UTA_TRACE_OP_ENTRY(UTA_STATS_GET_RANDOM, 0, len_random);
+        rc = client_read_random(client_context, random, len_random,
+            UTA_DEADLINE_NONE);
+        if(rc == UTA_SUCCESS)
+        {
+            uta_stats_random(&client_context_w->stats, len_random);
+        }
+        uta_async_post(&client_context_w->async,
+            uta_stats_call(&client_context_w->stats, UTA_STATS_GET_RANDOM,
+            rc));
+        rc = UTA_SUCCESS;
+    }
+
+    (void)pthread_mutex_unlock(&client_context_w->accesslock);
+
+    return rc;
+}
+
+/**
+ * @brief Returns the result of the emulated asynchronous operation.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @return UTA return code of the operation.
+ */
+uta_rc client_async_complete(const uta_context_v1_t *client_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uta_rc rc;
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    if(uta_stats_mutex_lock(&client_context_w->stats,
+        &client_context_w->accesslock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    rc = uta_async_collect(&client_context_w->async);
+
+    (void)pthread_mutex_unlock(&client_context_w->accesslock);
+
+    return rc;
+}
+
+/**
+ * @brief Enables, replaces or disables the key cache of the context. The
+ *      cache is kept in the client process.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] config Size and TTL of the cache.
+ * @return UTA return code.
+ */
+uta_rc client_set_key_cache(const uta_context_v1_t *client_context,
+        const uta_key_cache_config_v1_t *config)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    return uta_key_cache_configure(&client_context_w->key_cache,
+        config->max_entries, config->ttl);
+}
+
+/**
+ * @brief Clears all entries of the key cache.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc client_flush_key_cache(const uta_context_v1_t *client_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uta_key_cache_flush(&client_context_w->key_cache);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Copies the statistics of the context. A trust anchor access is the
+ *      round trip of one request to the daemon.
+ * @param[in] client_context Pointer to the internal context struct.
+ * @param[out] stats Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc client_get_stats(const uta_context_v1_t *client_context,
+        uta_stats_v1_t *stats)
+{
+    uta_stats_read(&client_context->stats, stats);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Clears the statistics of the context.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc client_reset_stats(const uta_context_v1_t *client_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uta_stats_reset(&client_context_w->stats);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Derives a key like client_derive_key and expands it with
+ *      HKDF-Expand into the subkeys of all requests.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in,out] requests Array of expand requests.
+ * @param[in] num_requests Number of entries in requests.
+ * @param[in] dv Pointer to the buffer in which the derivation value is handed
+ *      over.
+ * @param[in] len_dv Specifies the length in bytes of the derivation value.
+ * @param[in] key_slot Defines which master key is used for the HMAC function.
+ * @return UTA return code.
+ */
+uta_rc client_derive_key_expand(const uta_context_v1_t *client_context,
+        uta_expand_request_v1_t *requests, size_t num_requests,
+        const uint8_t *dv, size_t len_dv, uint8_t key_slot)
+{
+#ifdef ENABLE_HKDF
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    return uta_hkdf_derive_key_expand(client_derive_key, client_context,
+        &client_context_w->stats, requests, num_requests, dv, len_dv,
+        key_slot);
+#else
+    /* Without HKDF support, the subkeys cannot be expanded */
+    return UTA_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * @brief Gets the device UUID from the daemon. It is requested once per
+ *      context.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[out] uuid Pointer to the buffer where the UUID should be written to.
+ * @return UTA return code.
+ */
+uta_rc client_get_device_uuid(const uta_context_v1_t *client_context,
+        uint8_t *uuid)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    utad_request_t request;
+    uint64_t deadline;
+    uta_rc rc;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_GET_DEVICE_UUID, 0, UUID_LEN);
+
+    deadline = uta_deadline_start(&client_context->timeout_ms);
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&client_context_w->stats,
+            UTA_STATS_GET_DEVICE_UUID, UTA_TA_ERROR);
+    }
+
+    rc = uta_stats_mutex_lock(&client_context_w->stats,
+        &client_context_w->accesslock, deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        return uta_stats_call(&client_context_w->stats,
+            UTA_STATS_GET_DEVICE_UUID, rc);
+    }
+
+    /* Request the UUID only once */
+    if(client_context->uuid_cached == 0)
+    {
+        memset(&request, 0, sizeof(request));
+        request.op = UTAD_OP_GET_DEVICE_UUID;
+        request.len = UUID_LEN;
+        rc = client_request(client_context, &request, client_context_w->uuid,
+            deadline);
+        if(rc == UTA_SUCCESS)
+        {
+            client_context_w->uuid_cached = 1;
+        }
+    }
+
+    if(rc == UTA_SUCCESS)
+    {
+        memcpy(uuid, client_context->uuid, UUID_LEN);
+    }
+
+    (void)pthread_mutex_unlock(&client_context_w->accesslock);
+
+    return uta_stats_call(&client_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+        rc);
+}
+
+/**
+ * @brief Runs the self test of the trust anchor of the daemon.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc client_self_test(const uta_context_v1_t *client_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    utad_request_t request;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_SELF_TEST, 0, 0);
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_SELF_TEST,
+            UTA_TA_ERROR);
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.op = UTAD_OP_SELF_TEST;
+
+    return uta_stats_call(&client_context_w->stats, UTA_STATS_SELF_TEST,
+        client_request(client_context, &request, NULL,
+        uta_deadline_start(&client_context->timeout_ms)));
+}
+
+/**
+ * @brief Starts the self test of the trust anchor of the daemon without
+ *      waiting for its result.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] mode Mode of the self test.
+ * @return UTA return code.
+ */
+uta_rc client_start_self_test(const uta_context_v1_t *client_context,
+        uta_self_test_mode_t mode)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    utad_request_t request;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_SELF_TEST, 0, 0);
+
+    if((mode != UTA_SELF_TEST_FULL) && (mode != UTA_SELF_TEST_INCREMENTAL))
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_SELF_TEST,
+            UTA_NOT_SUPPORTED);
+    }
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&client_context_w->stats, UTA_STATS_SELF_TEST,
+            UTA_TA_ERROR);
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.op = UTAD_OP_START_SELF_TEST;
+    request.key_slot = (uint8_t)mode;
+
+    return uta_stats_call(&client_context_w->stats, UTA_STATS_SELF_TEST,
+        client_request(client_context, &request, NULL,
+        uta_deadline_start(&client_context->timeout_ms)));
+}
+
+/**
+ * @brief Gets the result of the last self test of the trust anchor of the
+ *      daemon, which is shared by all clients.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[out] result Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc client_get_self_test_result(const uta_context_v1_t *client_context,
+        uta_self_test_result_v1_t *result)
+{
+    utad_request_t request;
+    utad_self_test_result_t response;
+    uta_rc rc;
+
+    /* A context inherited over fork is re-established first */
+    if(client_check_fork(client_context, 1) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.op = UTAD_OP_GET_SELF_TEST_RESULT;
+    request.len = UTAD_LEN_SELF_TEST_RESULT;
+
+    rc = client_request(client_context, &request, (uint8_t *)&response,
+        uta_deadline_start(&client_context->timeout_ms));
+    if(rc == UTA_SUCCESS)
+    {
+        result->rc = response.rc;
+        result->mode = (uta_self_test_mode_t)response.mode;
+        result->age = response.age;
+    }
+
+    return rc;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Connects to the socket of the daemon.
+ * @return Socket descriptor, -1 on error.
+ */
+static int client_connect(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if(strlen(CONFIGURED_UTAD_SOCKET) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, CONFIGURED_UTAD_SOCKET);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+
+    if(connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        (void)close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Closes all connections of the context.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ */
+static void client_close_connections(const uta_context_v1_t *client_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    size_t i;
+
+    for(i = 0; i < client_context->num_connections; i++)
+    {
+        if(client_context->fds[i] >= 0)
+        {
+            (void)close(client_context->fds[i]);
+        }
+        client_context_w->fds[i] = -1;
+    }
+    client_context_w->num_connections = 0;
+    client_context_w->free_mask = 0;
+}
+
+/**
+ * @brief Re-establishes a context, which the calling process inherited over
+ *      fork. The sockets of the parent are closed in the child, which then
+ *      connects again on its first request on each connection, so that the
+ *      requests of both processes do not interleave on one socket. The
+ *      locks, the semaphore, the pending asynchronous operation, the key
+ *      cache and the statistics are reset. With reopen, a selected DRBG is
+ *      seeded again, so that the child does not repeat the random numbers of
+ *      the parent. If the context cannot be re-established, all calls fail
+ *      until the context is closed.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] reopen 1 to seed the DRBG again, 0 if the context is closed.
+ * @return UTA return code.
+ */
+static uta_rc client_check_fork(const uta_context_v1_t *client_context,
+        int reopen)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    size_t num_connections;
+    uta_rc rc = UTA_SUCCESS;
+    int ret = 0;
+    size_t i;
+
+    /* Fast path in the process, which opened the context */
+    if(uta_fork_detected(&client_context->fork_generation) == 0)
+    {
+        return UTA_SUCCESS;
+    }
+
+    uta_fork_lock();
+
+    /* Another thread of the child may have been faster */
+    if(uta_fork_detected(&client_context->fork_generation) == 0)
+    {
+        uta_fork_unlock();
+        return UTA_SUCCESS;
+    }
+
+    /* No connection is left, if the re-establishment failed before */
+    num_connections = client_context->num_connections;
+    if(num_connections == 0)
+    {
+        if(reopen == 0)
+        {
+            (void)uta_fork_init(&client_context_w->fork_generation);
+        }
+        uta_fork_unlock();
+        return (reopen == 0) ? UTA_SUCCESS : UTA_TA_ERROR;
+    }
+
+    /* Threads of the parent may have used the connections during the fork */
+    client_close_connections(client_context);
+    for(i = 0; i < num_connections; i++)
+    {
+        client_context_w->free_mask |= (uint64_t)1 << i;
+    }
+
+    /* Threads of the parent may have held the locks during the fork */
+    (void)pthread_mutex_init(&client_context_w->accesslock, NULL);
+#ifdef ENABLE_DRBG
+    (void)pthread_mutex_init(&client_context_w->drbglock, NULL);
+#endif
+
+    /* The pipe is shared with the parent */
+    uta_async_free(&client_context_w->async);
+    if((sem_init(&client_context_w->free_count, 0, num_connections) != 0) ||
+       (uta_async_init(&client_context_w->async) != UTA_SUCCESS))
+    {
+        ret = 1;
+    }
+
+    uta_key_cache_after_fork(&client_context_w->key_cache);
+    uta_stats_reset(&client_context_w->stats);
+
+#ifdef ENABLE_DRBG
+    /* Without a usable context, the DRBG is cleared on close */
+    if((reopen != 0) && (client_context->drbg.seeded != 0))
+    {
+        if(ret == 0)
+        {
+            rc = client_drbg_start(client_context,
+                client_context->drbg.reseed_bytes,
+                client_context->drbg.reseed_interval, UTA_DEADLINE_NONE);
+        }
+        else
+        {
+            client_drbg_stop(client_context);
+        }
+    }
+#endif
+
+    if(ret != 0)
+    {
+        client_context_w->free_mask = 0;
+        rc = UTA_TA_ERROR;
+    }
+    else
+    {
+        client_context_w->num_connections = num_connections;
+        (void)uta_fork_init(&client_context_w->fork_generation);
+    }
+
+    uta_fork_unlock();
+
+    return rc;
+}
+
+/**
+ * @brief Takes a free connection. Blocks until another thread returns a
+ *      connection, if all of them are in use, but not beyond the deadline.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return Index of the connection, -1 on error or timeout.
+ */
+static int client_acquire_connection(const uta_context_v1_t *client_context,
+        uint64_t deadline)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uint64_t mask;
+    int index;
+
+    /* Wait for a free connection, the semaphore counts the bits in free_mask */
+    if(uta_stats_sem_wait(&client_context_w->stats,
+        &client_context_w->free_count, deadline) != UTA_SUCCESS)
+    {
+        return -1;
+    }
+
+    mask = __atomic_load_n(&client_context_w->free_mask, __ATOMIC_ACQUIRE);
+    do
+    {
+        index = __builtin_ctzll(mask);
+    } while(!__atomic_compare_exchange_n(&client_context_w->free_mask, &mask,
+        mask & ~((uint64_t)1 << index), 0, __ATOMIC_ACQUIRE,
+        __ATOMIC_ACQUIRE));
+
+    return index;
+}
+
+/**
+ * @brief Returns a connection to the pool and counts the round trip.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] index Index of the connection.
+ * @param[in] start Time of uta_stats_now after the connection was taken.
+ */
+static void client_release_connection(const uta_context_v1_t *client_context,
+        int index, uint64_t start)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uta_stats_ta_access(&client_context_w->stats, start);
+
+    (void)__atomic_fetch_or(&client_context_w->free_mask,
+        (uint64_t)1 << index, __ATOMIC_RELEASE);
+    (void)sem_post(&client_context_w->free_count);
+}
+
+/**
+ * @brief Sends one request and receives its response.
+ * @param[in] fd Connection to the daemon.
+ * @param[in] request Request, its len is the expected payload length.
+ * @param[out] output Buffer for the payload of a successful response.
+ * @param[out] rc Return code of the operation.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return 0 on success, 1 if the connection is broken or out of sync, which
+ *      includes a response that did not arrive before the deadline.
+ */
+static int client_transfer(int fd, const utad_request_t *request,
+        uint8_t *output, uta_rc *rc, uint64_t deadline)
+{
+    utad_response_t response;
+
+    if((send_all(fd, request, sizeof(*request), deadline) != 0) ||
+       (recv_all(fd, &response, sizeof(response), deadline) != 0) ||
+       (response.magic != UTAD_MAGIC))
+    {
+        return 1;
+    }
+
+    *rc = response.rc;
+    if(response.rc != UTA_SUCCESS)
+    {
+        return 0;
+    }
+
+    if((response.len != request->len) ||
+       (recv_all(fd, output, response.len, deadline) != 0))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Sends a request to the daemon on a free connection. A broken
+ *      connection is opened again and the request is repeated once.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in,out] request Request without magic, which is set here.
+ * @param[out] output Buffer for request->len payload bytes.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return UTA return code of the operation, UTA_TA_ERROR if the daemon cannot
+ *      be reached, UTA_TIMEOUT if it did not answer before the deadline.
+ */
+static uta_rc client_request(const uta_context_v1_t *client_context,
+        utad_request_t *request, uint8_t *output, uint64_t deadline)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uta_rc rc = UTA_TA_ERROR;
+    uint64_t start;
+    int attempt;
+    int index;
+
+    request->magic = UTAD_MAGIC;
+
+    index = client_acquire_connection(client_context, deadline);
+    if(index < 0)
+    {
+        return uta_deadline_rc(deadline);
+    }
+    start = uta_stats_now();
+
+    for(attempt = 0; attempt < CLIENT_ATTEMPTS; attempt++)
+    {
+        if(client_context->fds[index] < 0)
+        {
+            client_context_w->fds[index] = client_connect();
+            if(client_context->fds[index] < 0)
+            {
+                break;
+            }
+        }
+
+        if(client_transfer(client_context->fds[index], request, output,
+            &rc, deadline) == 0)
+        {
+            break;
+        }
+
+        /* Drop the broken connection, a later request connects again */
+        (void)close(client_context->fds[index]);
+        client_context_w->fds[index] = -1;
+
+        /* The late response would be out of sync, it is not retried */
+        rc = uta_deadline_rc(deadline);
+        if(rc == UTA_TIMEOUT)
+        {
+            break;
+        }
+    }
+
+    client_release_connection(client_context, index, start);
+
+    return rc;
+}
+
+/**
+ * @brief Reads random numbers from the daemon in requests of at most
+ *      UTAD_LEN_RANDOM_MAX bytes.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[out] random Pointer to the buffer for the random numbers.
+ * @param[in] len_random Number of random bytes.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return UTA return code.
+ */
+static uta_rc client_read_random(const uta_context_v1_t *client_context,
+        uint8_t *random, size_t len_random, uint64_t deadline)
+{
+    utad_request_t request;
+    size_t done;
+    uta_rc rc = UTA_SUCCESS;
+
+    memset(&request, 0, sizeof(request));
+    request.op = UTAD_OP_GET_RANDOM;
+
+    for(done = 0; (rc == UTA_SUCCESS) && (done < len_random);
+        done += request.len)
+    {
+        request.len = ((len_random - done) > UTAD_LEN_RANDOM_MAX) ?
+            UTAD_LEN_RANDOM_MAX : (uint32_t)(len_random - done);
+        rc = client_request(client_context, &request, &random[done],
+            deadline);
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Waits until the socket is ready or the deadline expired.
+ * @param[in] fd Socket descriptor.
+ * @param[in] events POLLIN or POLLOUT.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to return
+ *      immediately.
+ * @return 0 if the socket can be read or written, 1 on error or timeout.
+ */
+static int client_wait(int fd, short events, uint64_t deadline)
+{
+    struct pollfd pfd;
+    int ret;
+
+    if(deadline == UTA_DEADLINE_NONE)
+    {
+        return 0;
+    }
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do
+    {
+        ret = poll(&pfd, 1, uta_deadline_remaining_ms(deadline));
+    } while((ret < 0) && (errno == EINTR));
+
+    return (ret > 0) ? 0 : 1;
+}
+
+/**
+ * @brief Sends the whole buffer. SIGPIPE is suppressed, so that a stopped
+ *      daemon does not terminate the calling process.
+ * @param[in] fd Socket descriptor.
+ * @param[in] buf Buffer.
+ * @param[in] len Number of bytes.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return 0 on success, 1 otherwise.
+ */
+static int send_all(int fd, const void *buf, size_t len, uint64_t deadline)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    ssize_t n;
+
+    while(len > 0)
+    {
+        if(client_wait(fd, POLLOUT, deadline) != 0)
+        {
+            return 1;
+        }
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return 1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Receives exactly len bytes.
+ * @param[in] fd Socket descriptor.
+ * @param[out] buf Buffer.
+ * @param[in] len Number of bytes.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return 0 on success, 1 on error, on timeout or if the daemon closed the
+ *      connection.
+ */
+static int recv_all(int fd, void *buf, size_t len, uint64_t deadline)
+{
+    uint8_t *p = (uint8_t *)buf;
+    ssize_t n;
+
+    while(len > 0)
+    {
+        if(client_wait(fd, POLLIN, deadline) != 0)
+        {
+            return 1;
+        }
+        n = recv(fd, p, len, 0);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return 1;
+        }
+        if(n == 0)
+        {
+            return 1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+#ifdef ENABLE_DRBG
+/**
+ * @brief Seeds the DRBG from the daemon and selects it for the random requests.
+ *      The caller holds the accesslock or is the only thread of the context.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ * @param[in] reseed_bytes Output bytes until the next reseed.
+ * @param[in] reseed_interval Seconds until the next reseed.
+ * @param[in] deadline Deadline of the call, which seeds the DRBG.
+ * @return UTA return code.
+ */
+static uta_rc client_drbg_start(const uta_context_v1_t *client_context,
+        uint64_t reseed_bytes, uint32_t reseed_interval, uint64_t deadline)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    uta_rc rc;
+
+    /* Lock the DRBG state with the drbglock mutex */
+    rc = uta_stats_mutex_lock(&client_context_w->stats,
+        &client_context_w->drbglock, deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        return rc;
+    }
+
+    client_context_w->drbg_deadline = deadline;
+    rc = uta_drbg_seed(&client_context_w->drbg, client_drbg_entropy,
+        client_context_w, reseed_bytes, reseed_interval);
+    if(rc != UTA_SUCCESS)
+    {
+        rc = uta_deadline_rc(deadline);
+    }
+
+    /* A failed seed leaves the DRBG cleared */
+    __atomic_store_n(&client_context_w->drbg_active,
+        client_context->drbg.seeded, __ATOMIC_RELEASE);
+
+    /* Release the drbglock mutex (ignore return code) */
+    (void)pthread_mutex_unlock(&client_context_w->drbglock);
+
+    return rc;
+}
+
+/**
+ * @brief Clears the DRBG, the random numbers are requested from the daemon
+ *      again. The caller holds the accesslock or is the only thread of the
+ *      context.
+ * @param[in,out] client_context Pointer to the internal context struct.
+ */
+static void client_drbg_stop(const uta_context_v1_t *client_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *client_context_w = (uta_context_v1_t*)client_context;
+
+    /* A running request finishes first (ignore return code) */
+    (void)pthread_mutex_lock(&client_context_w->drbglock);
+    __atomic_store_n(&client_context_w->drbg_active, 0, __ATOMIC_RELAXED);
+    uta_drbg_free(&client_context_w->drbg);
+    (void)pthread_mutex_unlock(&client_context_w->drbglock);
+}
+
+/**
+ * @brief Entropy callback of the DRBG, which reads from the daemon. It is
+ *      called while the drbglock is held.
+ * @param[in,out] p_entropy Pointer to the internal context struct.
+ * @param[out] output Buffer for the entropy.
+ * @param[in] len Number of entropy bytes.
+ * @return 0 on success, an mbedtls error code otherwise.
+ */
+static int client_drbg_entropy(void *p_entropy, unsigned char *output,
+        size_t len)
+{
+    const uta_context_v1_t *client_context =
+        (const uta_context_v1_t *)p_entropy;
+
+    /* The entropy is read within the deadline of the call, which reseeds */
+    if(client_read_random(client_context, output, len,
+       client_context->drbg_deadline) != UTA_SUCCESS)
+    {
+        return MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+    }
+
+    return 0;
+}
+#endif
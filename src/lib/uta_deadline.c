@@ -0,0 +1,129 @@
+/** @file uta_deadline.c
+*
+* @brief Unified Trust Anchor (UTA) deadlines of the calls on a context with a
+* timeout. The timeout of the context is read once at the start of a call and
+* turned into an absolute deadline on the monotonic clock of the statistics,
+* so that all waits of the call together stay within the timeout. A deadline
+* of UTA_DEADLINE_NONE never expires.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <uta_deadline.h>
+#include <uta_stats.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define NS_PER_MS   1000000u
+#define NS_PER_S    1000000000u
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Stores the timeout of a context. Calls, which are already running,
+ *      keep their deadline.
+ * @param[out] timeout_ms Pointer to the timeout of the context.
+ * @param[in] value Timeout in ms, 0 for no timeout.
+ */
+void uta_deadline_set_timeout(uint32_t *timeout_ms, uint32_t value)
+{
+    __atomic_store_n(timeout_ms, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the deadline of a call, which starts now.
+ * @param[in] timeout_ms Pointer to the timeout of the context.
+ * @return Deadline in ns of uta_stats_now, UTA_DEADLINE_NONE without timeout.
+ */
+uint64_t uta_deadline_start(const uint32_t *timeout_ms)
+{
+    uint32_t timeout = __atomic_load_n(timeout_ms, __ATOMIC_RELAXED);
+
+    if(timeout == 0)
+    {
+        return UTA_DEADLINE_NONE;
+    }
+
+    return uta_stats_now() + ((uint64_t)timeout * NS_PER_MS);
+}
+
+/**
+ * @brief Checks, whether a deadline has passed.
+ * @param[in] deadline Deadline of the call.
+ * @return 1 if the deadline has passed, 0 otherwise.
+ */
+int uta_deadline_expired(uint64_t deadline)
+{
+    return ((deadline != UTA_DEADLINE_NONE) &&
+            (uta_stats_now() >= deadline)) ? 1 : 0;
+}
+
+/**
+ * @brief Returns the time left until the deadline in the format of the TSS
+ *      timeouts, rounded up to full ms.
+ * @param[in] deadline Deadline of the call.
+ * @return Remaining ms, 0 if the deadline has passed and -1 without deadline.
+ */
+int32_t uta_deadline_remaining_ms(uint64_t deadline)
+{
+    uint64_t now;
+    uint64_t remaining;
+
+    if(deadline == UTA_DEADLINE_NONE)
+    {
+        return -1;
+    }
+
+    now = uta_stats_now();
+    if(now >= deadline)
+    {
+        return 0;
+    }
+
+    remaining = (deadline - now + NS_PER_MS - 1) / NS_PER_MS;
+
+    return (remaining > INT32_MAX) ? INT32_MAX : (int32_t)remaining;
+}
+
+/**
+ * @brief Converts a deadline to the absolute CLOCK_REALTIME time expected by
+ *      pthread_mutex_timedlock and sem_timedwait.
+ * @param[in] deadline Deadline of the call, not UTA_DEADLINE_NONE.
+ * @param[out] abstime Absolute time of the deadline.
+ */
+void uta_deadline_abstime(uint64_t deadline, struct timespec *abstime)
+{
+    uint64_t now = uta_stats_now();
+    uint64_t remaining = (deadline > now) ? (deadline - now) : 0;
+
+    if(clock_gettime(CLOCK_REALTIME, abstime) != 0)
+    {
+        abstime->tv_sec = 0;
+        abstime->tv_nsec = 0;
+        return;
+    }
+
+    remaining += (uint64_t)abstime->tv_nsec;
+    abstime->tv_sec += (time_t)(remaining / NS_PER_S);
+    abstime->tv_nsec = (long)(remaining % NS_PER_S);
+}
+
+/**
+ * @brief Returns the UTA return code of a failed wait or trust anchor access.
+ * @param[in] deadline Deadline of the call.
+ * @return UTA_TIMEOUT if the deadline has passed, UTA_TA_ERROR otherwise.
+ */
+uta_rc uta_deadline_rc(uint64_t deadline)
+{
+    return (uta_deadline_expired(deadline) != 0) ? UTA_TIMEOUT : UTA_TA_ERROR;
+}
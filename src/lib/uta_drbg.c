@@ -0,0 +1,197 @@
+/** @file uta_drbg.c
+* 
+* @brief Unified Trust Anchor (UTA) host CTR_DRBG seeded by the trust anchor.
+* The DRBG serves small random requests at memory speed, while the trust
+* anchor stays the only entropy source. The caller has to serialize the access
+* to a uta_drbg_t, e.g. with the accesslock of the context.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License 
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <uta_drbg.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Personalization string of the CTR_DRBG instances */
+#define DRBG_PERSONALIZATION    "UTA CTR_DRBG"
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static uint8_t drbg_reseed_required(const uta_drbg_t *drbg);
+static void drbg_mark_reseeded(uta_drbg_t *drbg);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Initializes an unseeded DRBG.
+ * @param[out] drbg Pointer to the DRBG state.
+ */
+void uta_drbg_init(uta_drbg_t *drbg)
+{
+    memset(drbg, 0, sizeof(uta_drbg_t));
+    mbedtls_ctr_drbg_init(&drbg->ctr_drbg);
+}
+
+/**
+ * @brief Seeds the DRBG from the given entropy source. An already seeded DRBG
+ *      is instantiated again.
+ * @param[in,out] drbg Pointer to the DRBG state.
+ * @param[in] f_entropy Entropy callback, which reads from the trust anchor.
+ * @param[in] p_entropy Parameter handed over to f_entropy.
+ * @param[in] reseed_bytes Number of output bytes after which the DRBG is
+ *      reseeded. 0 selects UTA_DRBG_RESEED_BYTES.
+ * @param[in] reseed_interval Time in seconds after which the DRBG is
+ *      reseeded. 0 selects UTA_DRBG_RESEED_INTERVAL.
+ * @return UTA return code.
+ */
+uta_rc uta_drbg_seed(uta_drbg_t *drbg, uta_drbg_entropy_t f_entropy,
+        void *p_entropy, uint64_t reseed_bytes, uint32_t reseed_interval)
+{
+    int ret;
+
+    uta_drbg_free(drbg);
+    uta_drbg_init(drbg);
+
+    drbg->reseed_bytes = (reseed_bytes != 0) ? reseed_bytes :
+        UTA_DRBG_RESEED_BYTES;
+    drbg->reseed_interval = (reseed_interval != 0) ? reseed_interval :
+        UTA_DRBG_RESEED_INTERVAL;
+
+    ret = mbedtls_ctr_drbg_seed(&drbg->ctr_drbg, f_entropy, p_entropy,
+        (const unsigned char *)DRBG_PERSONALIZATION,
+        strlen(DRBG_PERSONALIZATION));
+    if(ret != 0)
+    {
+        uta_drbg_free(drbg);
+        return UTA_TA_ERROR;
+    }
+
+    drbg_mark_reseeded(drbg);
+    drbg->seeded = 1;
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Writes len random bytes from the DRBG to output. The DRBG is reseeded
+ *      from the trust anchor first, if the byte or time limit is reached. If
+ *      the reseed fails, no output is generated.
+ * @param[in,out] drbg Pointer to the seeded DRBG state.
+ * @param[out] output Buffer for the random bytes.
+ * @param[in] len Number of random bytes.
+ * @return UTA return code.
+ */
+uta_rc uta_drbg_generate(uta_drbg_t *drbg, uint8_t *output, size_t len)
+{
+    size_t chunk;
+    int ret;
+
+    if(drbg->seeded == 0)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    while(len > 0)
+    {
+        if(drbg_reseed_required(drbg) != 0)
+        {
+            ret = mbedtls_ctr_drbg_reseed(&drbg->ctr_drbg, NULL, 0);
+            if(ret != 0)
+            {
+                return UTA_TA_ERROR;
+            }
+            drbg_mark_reseeded(drbg);
+        }
+
+        /*
+         * mbedtls limits the output of a single request, the byte limit of
+         * the current seed must not be exceeded either
+         */
+        chunk = (len > MBEDTLS_CTR_DRBG_MAX_REQUEST) ?
+            MBEDTLS_CTR_DRBG_MAX_REQUEST : len;
+        if(chunk > (drbg->reseed_bytes - drbg->bytes_since_reseed))
+        {
+            chunk = (size_t)(drbg->reseed_bytes - drbg->bytes_since_reseed);
+        }
+
+        ret = mbedtls_ctr_drbg_random(&drbg->ctr_drbg, output, chunk);
+        if(ret != 0)
+        {
+            return UTA_TA_ERROR;
+        }
+
+        drbg->bytes_since_reseed += chunk;
+        output += chunk;
+        len -= chunk;
+    }
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Clears the DRBG state. The DRBG has to be seeded again before use.
+ * @param[in,out] drbg Pointer to the DRBG state.
+ */
+void uta_drbg_free(uta_drbg_t *drbg)
+{
+    mbedtls_ctr_drbg_free(&drbg->ctr_drbg);
+    drbg->bytes_since_reseed = 0;
+    drbg->seeded = 0;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Checks the byte and time limits of the current seed.
+ * @param[in] drbg Pointer to the DRBG state.
+ * @return 1 if the DRBG has to be reseeded, 0 otherwise.
+ */
+static uint8_t drbg_reseed_required(const uta_drbg_t *drbg)
+{
+    struct timespec now;
+
+    if(drbg->bytes_since_reseed >= drbg->reseed_bytes)
+    {
+        return 1;
+    }
+
+    /* Reseed if the clock can not be read */
+    if(clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+    {
+        return 1;
+    }
+
+    if((now.tv_sec - drbg->last_reseed.tv_sec) >=
+       (time_t)drbg->reseed_interval)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Resets the byte counter and the time of the last reseed.
+ * @param[in,out] drbg Pointer to the DRBG state.
+ */
+static void drbg_mark_reseeded(uta_drbg_t *drbg)
+{
+    drbg->bytes_since_reseed = 0;
+    (void)clock_gettime(CLOCK_MONOTONIC, &drbg->last_reseed);
+}
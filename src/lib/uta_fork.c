@@ -0,0 +1,135 @@
+/** @file uta_fork.c
+*
+* @brief Unified Trust Anchor (UTA) detection of contexts, which a child
+* process inherited over fork. A pthread_atfork handler counts the forks in
+* the child. Each context stores the count of its process, so that a single
+* atomic compare on every call detects, that the connections, sessions and
+* locks of the context belong to the parent. The backend then re-establishes
+* the context under the fork lock, which is held across fork, so that a child
+* never inherits it in the locked state.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <pthread.h>
+
+#include <uta_fork.h>
+
+/*******************************************************************************
+ * Static data declaration
+ ******************************************************************************/
+/* Number of forks between the first process and the current process */
+static uint32_t fork_generation = 0;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+static int fork_registered = 0;
+static pthread_mutex_t fork_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static void fork_register(void);
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Registers the fork handlers on the first call and assigns the
+ *      current process to a context. It is called on open and after the
+ *      context has been re-established in a child.
+ * @param[out] generation Fork generation stored in the context.
+ * @return UTA return code.
+ */
+uta_rc uta_fork_init(uint32_t *generation)
+{
+    if((pthread_once(&fork_once, fork_register) != 0) ||
+       (fork_registered == 0))
+    {
+        return UTA_TA_ERROR;
+    }
+
+    __atomic_store_n(generation,
+        __atomic_load_n(&fork_generation, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Checks, whether the context has been opened by a parent process.
+ *      This is the fast path of every call and does not take a lock.
+ * @param[in] generation Fork generation stored in the context.
+ * @return 1 if the calling process is a child of the process, which opened
+ *      the context, 0 otherwise.
+ */
+int uta_fork_detected(const uint32_t *generation)
+{
+    return (__atomic_load_n(generation, __ATOMIC_ACQUIRE) !=
+        __atomic_load_n(&fork_generation, __ATOMIC_ACQUIRE)) ? 1 : 0;
+}
+
+/**
+ * @brief Serializes the re-establishment of the contexts in a child. The
+ *      caller checks uta_fork_detected again after taking the lock.
+ */
+void uta_fork_lock(void)
+{
+    (void)pthread_mutex_lock(&fork_mutex);
+}
+
+/**
+ * @brief Releases the lock taken by uta_fork_lock.
+ */
+void uta_fork_unlock(void)
+{
+    (void)pthread_mutex_unlock(&fork_mutex);
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Registers the fork handlers once per process image.
+ */
+static void fork_register(void)
+{
+    if(pthread_atfork(fork_prepare, fork_parent, fork_child) == 0)
+    {
+        fork_registered = 1;
+    }
+}
+
+/**
+ * @brief Waits for a context being re-established before the fork.
+ */
+static void fork_prepare(void)
+{
+    (void)pthread_mutex_lock(&fork_mutex);
+}
+
+/**
+ * @brief Releases the fork lock in the parent.
+ */
+static void fork_parent(void)
+{
+    (void)pthread_mutex_unlock(&fork_mutex);
+}
+
+/**
+ * @brief Marks all inherited contexts as foreign and releases the fork lock
+ *      in the child.
+ */
+static void fork_child(void)
+{
+    (void)__atomic_add_fetch(&fork_generation, 1, __ATOMIC_RELEASE);
+    (void)pthread_mutex_unlock(&fork_mutex);
+}
@@ -0,0 +1,212 @@
+/** @file uta_hkdf.c
+* 
+* @brief Unified Trust Anchor (UTA) host HKDF-Expand (RFC 5869) with
+* HMAC-SHA256. The output of one trust anchor HMAC is used as pseudorandom
+* key (PRK) and expanded into any number of labeled subkeys on the host. The
+* extract step is omitted, because the trust anchor output already is a
+* uniformly distributed key (RFC 5869, section 3.3).
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License 
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <string.h>
+#include <stdint.h>
+
+#include <uta_hkdf.h>
+#include <uta_trace.h>
+#include <mbedtls/md.h>
+#include <mbedtls/platform_util.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Output length of SHA256 */
+#define HKDF_HASH_LEN   32
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static uta_rc hkdf_expand_one(mbedtls_md_context_t *md_ctx,
+        const uint8_t *prk, size_t len_prk, uta_expand_request_v1_t *request);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Checks the output lengths of all requests. It is called before the
+ *      trust anchor is accessed.
+ * @param[in] requests Array of expand requests.
+ * @param[in] num_requests Number of entries in requests.
+ * @return UTA return code.
+ */
+uta_rc uta_hkdf_check(const uta_expand_request_v1_t *requests,
+        size_t num_requests)
+{
+    size_t i;
+
+    if((requests == NULL) || (num_requests == 0))
+    {
+        return UTA_INVALID_KEY_LENGTH;
+    }
+
+    for(i = 0; i < num_requests; i++)
+    {
+        if((requests[i].len_key == 0) ||
+            (requests[i].len_key > UTA_HKDF_LEN_KEY_MAX))
+        {
+            return UTA_INVALID_KEY_LENGTH;
+        }
+    }
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Derives the PRK with the derive_key function of the backend and
+ *      expands it into the key buffer of each request. The PRK is cleared
+ *      afterwards.
+ * @param[in] derive_key derive_key function of the backend.
+ * @param[in,out] uta_context Pointer to the internal context struct.
+ * @param[in,out] stats Statistics of the context, which count a failed
+ *      length check. All other results are counted by derive_key.
+ * @param[in,out] requests Array of expand requests.
+ * @param[in] num_requests Number of entries in requests.
+ * @param[in] dv Pointer to the buffer in which the derivation value is handed
+ *      over.
+ * @param[in] len_dv Specifies the length in bytes of the derivation value.
+ * @param[in] key_slot Defines which master key is used for the HMAC function.
+ * @return UTA return code.
+ */
+uta_rc uta_hkdf_derive_key_expand(uta_hkdf_derive_t derive_key,
+        const uta_context_v1_t *uta_context, uta_stats_v1_t *stats,
+        uta_expand_request_v1_t *requests, size_t num_requests,
+        const uint8_t *dv, size_t len_dv, uint8_t key_slot)
+{
+    uint8_t prk[UTA_HKDF_LEN_PRK];
+    uta_rc rc;
+
+    /* Check the output lengths before the trust anchor is accessed */
+    rc = uta_hkdf_check(requests, num_requests);
+    if(rc != UTA_SUCCESS)
+    {
+        UTA_TRACE_OP_ENTRY(UTA_STATS_DERIVE_KEY, key_slot, 0);
+        return uta_stats_call(stats, UTA_STATS_DERIVE_KEY, rc);
+    }
+
+    rc = derive_key(uta_context, prk, sizeof(prk), dv, len_dv, key_slot);
+    if(rc == UTA_SUCCESS)
+    {
+        rc = uta_hkdf_expand(prk, sizeof(prk), requests, num_requests);
+    }
+
+    mbedtls_platform_zeroize(prk, sizeof(prk));
+
+    return rc;
+}
+
+/**
+ * @brief Expands the PRK into the key buffer of each request, using the info
+ *      string of the request.
+ * @param[in] prk Pointer to the pseudorandom key.
+ * @param[in] len_prk Length of the pseudorandom key.
+ * @param[in,out] requests Array of expand requests.
+ * @param[in] num_requests Number of entries in requests.
+ * @return UTA return code.
+ */
+uta_rc uta_hkdf_expand(const uint8_t *prk, size_t len_prk,
+        uta_expand_request_v1_t *requests, size_t num_requests)
+{
+    mbedtls_md_context_t md_ctx;
+    uta_rc rc = UTA_SUCCESS;
+    size_t i;
+
+    mbedtls_md_init(&md_ctx);
+    if(mbedtls_md_setup(&md_ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+        1) != 0)
+    {
+        mbedtls_md_free(&md_ctx);
+        return UTA_TA_ERROR;
+    }
+
+    for(i = 0; (i < num_requests) && (rc == UTA_SUCCESS); i++)
+    {
+        rc = hkdf_expand_one(&md_ctx, prk, len_prk, &requests[i]);
+    }
+
+    /* mbedtls_md_free also clears the HMAC pads, which depend on the PRK */
+    mbedtls_md_free(&md_ctx);
+
+    return rc;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Computes T(1) | T(2) | ... with T(n) = HMAC(PRK, T(n-1) | info | n)
+ *      and writes the first len_key bytes to the key buffer.
+ * @param[in,out] md_ctx HMAC-SHA256 context.
+ * @param[in] prk Pointer to the pseudorandom key.
+ * @param[in] len_prk Length of the pseudorandom key.
+ * @param[in,out] request Expand request.
+ * @return UTA return code.
+ */
+static uta_rc hkdf_expand_one(mbedtls_md_context_t *md_ctx,
+        const uint8_t *prk, size_t len_prk, uta_expand_request_v1_t *request)
+{
+    uint8_t t[HKDF_HASH_LEN];
+    size_t len_t = 0;
+    size_t offset = 0;
+    size_t len_copy;
+    uint8_t counter = 1;
+    int ret;
+
+    while(offset < request->len_key)
+    {
+        ret = mbedtls_md_hmac_starts(md_ctx, prk, len_prk);
+        if(ret == 0)
+        {
+            ret = mbedtls_md_hmac_update(md_ctx, t, len_t);
+        }
+        if((ret == 0) && (request->len_info > 0))
+        {
+            ret = mbedtls_md_hmac_update(md_ctx, request->info,
+                request->len_info);
+        }
+        if(ret == 0)
+        {
+            ret = mbedtls_md_hmac_update(md_ctx, &counter, 1);
+        }
+        if(ret == 0)
+        {
+            ret = mbedtls_md_hmac_finish(md_ctx, t);
+        }
+        if(ret != 0)
+        {
+            mbedtls_platform_zeroize(t, sizeof(t));
+            return UTA_TA_ERROR;
+        }
+        len_t = HKDF_HASH_LEN;
+
+        len_copy = request->len_key - offset;
+        if(len_copy > HKDF_HASH_LEN)
+        {
+            len_copy = HKDF_HASH_LEN;
+        }
+        memcpy(request->key + offset, t, len_copy);
+        offset += len_copy;
+        counter++;
+    }
+
+    mbedtls_platform_zeroize(t, sizeof(t));
+
+    return UTA_SUCCESS;
+}
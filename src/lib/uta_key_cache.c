@@ -0,0 +1,441 @@
+/** @file uta_key_cache.c
+*
+* @brief Unified Trust Anchor (UTA) cache of derived keys. The entries are
+* kept in an anonymous mapping, which is locked into RAM and excluded from
+* core dumps. The table is an open addressing hash table with a short probe
+* window. Each entry is protected by a sequence counter, so that lookups read
+* it without a lock and writers claim it with a compare and swap. Flushed,
+* replaced and expired entries are cleared.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <uta_key_cache.h>
+#include <uta_stats.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Number of entries searched for a key slot and dv */
+#define KEY_CACHE_PROBES    8
+#define KEY_CACHE_WORDS     (UTA_KEY_CACHE_LEN_KEY / sizeof(uint64_t))
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static uint64_t key_cache_hash(uint64_t tag, uint64_t dv);
+static size_t key_cache_probes(const uta_key_cache_t *cache);
+static uint8_t key_cache_claim(uta_key_cache_entry_t *entry, uint64_t *seq);
+static void key_cache_clear(uta_key_cache_entry_t *entry, uint64_t seq);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Initializes a disabled cache.
+ * @param[out] cache Pointer to the cache.
+ */
+void uta_key_cache_init(uta_key_cache_t *cache)
+{
+    memset(cache, 0, sizeof(uta_key_cache_t));
+}
+
+/**
+ * @brief Enables the cache with a new, empty table or disables it. The
+ *      entries of the previous table are cleared. The function must not be
+ *      called while other threads use the cache.
+ * @param[in,out] cache Pointer to the cache.
+ * @param[in] max_entries Number of entries, rounded up to a power of two. 0
+ *      disables the cache.
+ * @param[in] ttl Time in seconds after which an entry expires. 0 selects
+ *      UTA_KEY_CACHE_TTL.
+ * @return UTA return code.
+ */
+uta_rc uta_key_cache_configure(uta_key_cache_t *cache, size_t max_entries,
+        uint32_t ttl)
+{
+    size_t num_entries = 1;
+    size_t len_map;
+    void *map;
+
+    if(max_entries > UTA_KEY_CACHE_MAX_ENTRIES)
+    {
+        return UTA_NOT_SUPPORTED;
+    }
+
+    uta_key_cache_free(cache);
+    if(max_entries == 0)
+    {
+        return UTA_SUCCESS;
+    }
+
+    while(num_entries < max_entries)
+    {
+        num_entries <<= 1;
+    }
+    len_map = num_entries * sizeof(uta_key_cache_entry_t);
+
+    /* The mapping is zero filled, i.e. all entries are empty */
+    map = mmap(NULL, len_map, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    /* The keys must not be written to the swap space */
+    if(mlock(map, len_map) != 0)
+    {
+        (void)munmap(map, len_map);
+        return UTA_TA_ERROR;
+    }
+
+#ifdef MADV_DONTDUMP
+    /* Keep the keys out of core dumps (ignore return code) */
+    (void)madvise(map, len_map, MADV_DONTDUMP);
+#endif
+#ifdef MADV_WIPEONFORK
+    /* A forked child starts with an empty cache (ignore return code) */
+    (void)madvise(map, len_map, MADV_WIPEONFORK);
+#endif
+
+    cache->entries = (uta_key_cache_entry_t *)map;
+    cache->num_entries = num_entries;
+    cache->len_map = len_map;
+    cache->ttl = (uint64_t)((ttl == 0) ? UTA_KEY_CACHE_TTL : ttl) *
+        1000000000u;
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Checks, whether the cache is enabled.
+ * @param[in] cache Pointer to the cache.
+ * @return 1 if the cache is enabled, 0 otherwise.
+ */
+uint8_t uta_key_cache_enabled(const uta_key_cache_t *cache)
+{
+    return (cache->entries != NULL) ? 1 : 0;
+}
+
+/**
+ * @brief Searches the cache without a lock. An expired entry is cleared.
+ * @param[in,out] cache Pointer to the cache.
+ * @param[in] key_slot Key slot of the derivation.
+ * @param[in] dv Derivation value with UTA_KEY_CACHE_LEN_DV bytes.
+ * @param[out] key Buffer for the first len_key bytes of the cached key.
+ * @param[in] len_key Number of bytes to write to key.
+ * @return 1 if the key has been found, 0 otherwise.
+ */
+uint8_t uta_key_cache_lookup(uta_key_cache_t *cache, uint8_t key_slot,
+        const uint8_t *dv, uint8_t *key, size_t len_key)
+{
+    uta_key_cache_entry_t *entry;
+    uint64_t words[KEY_CACHE_WORDS];
+    uint64_t tag = (uint64_t)key_slot + 1;
+    uint64_t dv_word;
+    uint64_t hash;
+    uint64_t seq;
+    uint64_t expiry;
+    uint8_t found = 0;
+    size_t i;
+    size_t j;
+
+    if(cache->entries == NULL)
+    {
+        return 0;
+    }
+
+    memcpy(&dv_word, dv, sizeof(dv_word));
+    hash = key_cache_hash(tag, dv_word);
+
+    for(i = 0; i < key_cache_probes(cache); i++)
+    {
+        entry = &cache->entries[(hash + i) & (cache->num_entries - 1)];
+
+        /* Read a consistent copy of the entry, skip it during a write */
+        seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        if((seq & 1) != 0)
+        {
+            continue;
+        }
+        if((__atomic_load_n(&entry->tag, __ATOMIC_RELAXED) != tag) ||
+            (__atomic_load_n(&entry->dv, __ATOMIC_RELAXED) != dv_word))
+        {
+            continue;
+        }
+        expiry = __atomic_load_n(&entry->expiry, __ATOMIC_RELAXED);
+        for(j = 0; j < KEY_CACHE_WORDS; j++)
+        {
+            words[j] = __atomic_load_n(&entry->key[j], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+        {
+            continue;
+        }
+
+        if(expiry > uta_stats_now())
+        {
+            memcpy(key, words, len_key);
+            found = 1;
+        }
+        else if(key_cache_claim(entry, &seq) != 0)
+        {
+            key_cache_clear(entry, seq);
+        }
+        break;
+    }
+
+    uta_key_cache_zeroize(words, sizeof(words));
+
+    return found;
+}
+
+/**
+ * @brief Stores a derived key. An entry of the same derivation, an empty or
+ *      expired entry or else the oldest entry of the probe window is
+ *      replaced. The key is not stored, if that entry is being written by
+ *      another thread.
+ * @param[in,out] cache Pointer to the cache.
+ * @param[in] key_slot Key slot of the derivation.
+ * @param[in] dv Derivation value with UTA_KEY_CACHE_LEN_DV bytes.
+ * @param[in] key Derived key with UTA_KEY_CACHE_LEN_KEY bytes.
+ */
+void uta_key_cache_store(uta_key_cache_t *cache, uint8_t key_slot,
+        const uint8_t *dv, const uint8_t *key)
+{
+    uta_key_cache_entry_t *entry;
+    uta_key_cache_entry_t *victim = NULL;
+    uint64_t words[KEY_CACHE_WORDS];
+    uint64_t tag = (uint64_t)key_slot + 1;
+    uint64_t victim_expiry = UINT64_MAX;
+    uint64_t now = uta_stats_now();
+    uint64_t dv_word;
+    uint64_t hash;
+    uint64_t expiry;
+    uint64_t seq;
+    size_t i;
+
+    if(cache->entries == NULL)
+    {
+        return;
+    }
+
+    memcpy(&dv_word, dv, sizeof(dv_word));
+    hash = key_cache_hash(tag, dv_word);
+
+    for(i = 0; i < key_cache_probes(cache); i++)
+    {
+        entry = &cache->entries[(hash + i) & (cache->num_entries - 1)];
+
+        if((__atomic_load_n(&entry->tag, __ATOMIC_RELAXED) == tag) &&
+            (__atomic_load_n(&entry->dv, __ATOMIC_RELAXED) == dv_word))
+        {
+            victim = entry;
+            break;
+        }
+
+        /* Empty entries have the expiry 0 */
+        expiry = __atomic_load_n(&entry->expiry, __ATOMIC_RELAXED);
+        if(expiry <= now)
+        {
+            expiry = 0;
+        }
+        if((victim == NULL) || (expiry < victim_expiry))
+        {
+            victim = entry;
+            victim_expiry = expiry;
+        }
+    }
+
+    if(key_cache_claim(victim, &seq) == 0)
+    {
+        return;
+    }
+
+    memcpy(words, key, sizeof(words));
+    __atomic_store_n(&victim->tag, tag, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->dv, dv_word, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->expiry, now + cache->ttl, __ATOMIC_RELAXED);
+    for(i = 0; i < KEY_CACHE_WORDS; i++)
+    {
+        __atomic_store_n(&victim->key[i], words[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+
+    uta_key_cache_zeroize(words, sizeof(words));
+}
+
+/**
+ * @brief Clears all entries. Entries, which are being written by another
+ *      thread, are cleared after the write.
+ * @param[in,out] cache Pointer to the cache.
+ */
+void uta_key_cache_flush(uta_key_cache_t *cache)
+{
+    uint64_t seq;
+    size_t i;
+
+    for(i = 0; (cache->entries != NULL) && (i < cache->num_entries); i++)
+    {
+        while(key_cache_claim(&cache->entries[i], &seq) == 0)
+        {
+        }
+        key_cache_clear(&cache->entries[i], seq);
+    }
+}
+
+/**
+ * @brief Clears all entries and releases the table. The cache is disabled
+ *      afterwards.
+ * @param[in,out] cache Pointer to the cache.
+ */
+void uta_key_cache_free(uta_key_cache_t *cache)
+{
+    if(cache->entries == NULL)
+    {
+        return;
+    }
+
+    uta_key_cache_flush(cache);
+
+    /* Unlock and release the mapping (ignore return codes) */
+    (void)munlock(cache->entries, cache->len_map);
+    (void)munmap(cache->entries, cache->len_map);
+
+    uta_key_cache_init(cache);
+}
+
+/**
+ * @brief Prepares the cache of a context, which a child inherited over fork.
+ *      The entries are cleared, also those a thread of the parent was
+ *      writing during the fork, and the table is locked into RAM again,
+ *      because memory locks are not inherited. The cache is disabled, if the
+ *      table cannot be locked. No other thread may use the cache.
+ * @param[in,out] cache Pointer to the cache.
+ */
+void uta_key_cache_after_fork(uta_key_cache_t *cache)
+{
+    if(cache->entries == NULL)
+    {
+        return;
+    }
+
+    uta_key_cache_zeroize(cache->entries, cache->len_map);
+
+    if(mlock(cache->entries, cache->len_map) != 0)
+    {
+        (void)munmap(cache->entries, cache->len_map);
+        uta_key_cache_init(cache);
+    }
+}
+
+/**
+ * @brief Clears a buffer with key material. The volatile access prevents the
+ *      compiler from removing the stores.
+ * @param[out] buf Pointer to the buffer.
+ * @param[in] len Length of the buffer.
+ */
+void uta_key_cache_zeroize(void *buf, size_t len)
+{
+    volatile uint8_t *p = (volatile uint8_t *)buf;
+
+    while(len-- > 0)
+    {
+        *p++ = 0;
+    }
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Mixes the key slot and the dv into the start index of the probe
+ *      window (finalizer of MurmurHash3).
+ * @param[in] tag Key slot + 1.
+ * @param[in] dv Derivation value.
+ * @return Hash value.
+ */
+static uint64_t key_cache_hash(uint64_t tag, uint64_t dv)
+{
+    uint64_t hash = dv ^ (tag * 0x9e3779b97f4a7c15u);
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdu;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53u;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/**
+ * @brief Returns the size of the probe window.
+ * @param[in] cache Pointer to the cache.
+ * @return Number of entries searched.
+ */
+static size_t key_cache_probes(const uta_key_cache_t *cache)
+{
+    return (cache->num_entries < KEY_CACHE_PROBES) ? cache->num_entries :
+        KEY_CACHE_PROBES;
+}
+
+/**
+ * @brief Claims an entry for writing by making its sequence counter odd. The
+ *      release fence after the claim pairs with the acquire fence of the
+ *      readers, so that a reader, which sees a store to the entry, also sees
+ *      the odd counter and discards the entry.
+ * @param[in,out] entry Pointer to the entry.
+ * @param[out] seq Even sequence counter before the claim.
+ * @return 1 if the entry has been claimed, 0 if another thread writes it.
+ */
+static uint8_t key_cache_claim(uta_key_cache_entry_t *entry, uint64_t *seq)
+{
+    *seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    if((*seq & 1) != 0)
+    {
+        return 0;
+    }
+
+    if(__atomic_compare_exchange_n(&entry->seq, seq, *seq + 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) == 0)
+    {
+        return 0;
+    }
+
+    /* Orders the odd counter before the stores to the entry */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * @brief Clears a claimed entry and releases it.
+ * @param[in,out] entry Pointer to the entry.
+ * @param[in] seq Sequence counter returned by key_cache_claim.
+ */
+static void key_cache_clear(uta_key_cache_entry_t *entry, uint64_t seq)
+{
+    size_t i;
+
+    __atomic_store_n(&entry->tag, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->dv, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->expiry, 0, __ATOMIC_RELAXED);
+    for(i = 0; i < KEY_CACHE_WORDS; i++)
+    {
+        __atomic_store_n(&entry->key[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,638 @@
+/** @file uta_latency.c
+*
+* @brief Unified Trust Anchor (UTA) latency profiles of the simulator and
+* latency recording of the TPM backends. A profile is a text file with one
+* line per operation:
+*
+*     <op> fixed <us>
+*     <op> uniform <min us> <max us>
+*     <op> normal <mean us> <standard deviation us>
+*     <op> histogram <us>:<count> [<us>:<count> ...]
+*
+* <op> is one of open, close, derive_key, get_random, get_device_uuid and
+* self_test, everything after a '#' is a comment. The TPM backends record the
+* trust anchor accesses in histogram lines, so that a recorded file can be
+* used as profile of the simulator.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <sys/types.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <uta_latency.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define LATENCY_FILE_MAX    65536
+/* Longest latency of a profile, 60 s in us */
+#define LATENCY_US_MAX      60000000ull
+
+/*******************************************************************************
+ * Constants
+ ******************************************************************************/
+/* Names of the operations, in the order of uta_stats_op_t */
+static const char * const LATENCY_OP_NAMES[UTA_STATS_NUM_OPS] =
+{
+    "open", "close", "derive_key", "get_random", "get_device_uuid",
+    "self_test"
+};
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static uta_rc latency_parse(uta_latency_profile_t *profile, char *text);
+static uta_rc latency_parse_line(uta_latency_op_t *entry, char **save);
+static int latency_parse_us(const char *token, char delimiter, uint64_t *us,
+        const char **end);
+static size_t latency_bucket(uint64_t us);
+static uint64_t latency_bucket_us(size_t bucket);
+static uint64_t latency_get_u64(const uint8_t *random);
+static ssize_t latency_read_fd(int fd, char *text, size_t len);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Reads a latency profile. A missing file is an empty profile, so that
+ *      the latency emulation can be switched off by removing the file.
+ * @param[out] profile Latency profile.
+ * @param[in] path Path of the profile.
+ * @return UTA_SUCCESS if the file is missing or valid, UTA_TA_ERROR otherwise.
+ */
+uta_rc uta_latency_load(uta_latency_profile_t *profile, const char *path)
+{
+    char *text;
+    ssize_t len;
+    uta_rc rc;
+    int fd;
+
+    memset(profile, 0, sizeof(*profile));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return (errno == ENOENT) ? UTA_SUCCESS : UTA_TA_ERROR;
+    }
+
+    text = malloc(LATENCY_FILE_MAX + 1);
+    if(text == NULL)
+    {
+        (void)close(fd);
+        return UTA_TA_ERROR;
+    }
+
+    len = latency_read_fd(fd, text, LATENCY_FILE_MAX + 1);
+    (void)close(fd);
+    if((len < 0) || (len > LATENCY_FILE_MAX))
+    {
+        free(text);
+        return UTA_TA_ERROR;
+    }
+    text[len] = '\0';
+
+    rc = latency_parse(profile, text);
+    free(text);
+    if(rc != UTA_SUCCESS)
+    {
+        memset(profile, 0, sizeof(*profile));
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Checks, whether the profile emulates a latency for an operation.
+ * @param[in] profile Latency profile.
+ * @param[in] op Operation.
+ * @return 1 if a latency is emulated, 0 otherwise.
+ */
+int uta_latency_enabled(const uta_latency_profile_t *profile,
+        uta_stats_op_t op)
+{
+    return (profile->ops[op].model != UTA_LATENCY_NONE) ? 1 : 0;
+}
+
+/**
+ * @brief Draws a latency of an operation from the profile.
+ * @param[in] profile Latency profile.
+ * @param[in] op Operation.
+ * @param[in] random UTA_LATENCY_RANDOM_LEN random bytes.
+ * @return Latency in ns.
+ */
+uint64_t uta_latency_sample(const uta_latency_profile_t *profile,
+        uta_stats_op_t op, const uint8_t *random)
+{
+    const uta_latency_op_t *entry = &profile->ops[op];
+    int64_t deviation;
+    int64_t sum;
+    uint64_t r;
+    size_t i;
+
+    switch(entry->model)
+    {
+        case UTA_LATENCY_FIXED:
+            return entry->value_a;
+
+        case UTA_LATENCY_UNIFORM:
+            r = latency_get_u64(random);
+            return entry->value_a + (r % (entry->value_b - entry->value_a + 1));
+
+        case UTA_LATENCY_NORMAL:
+            /* Sum of 12 uniform values, which has the variance 1 */
+            sum = 0;
+            for(i = 0; i < 12; i++)
+            {
+                sum += ((int64_t)random[2 * i] << 8) | random[(2 * i) + 1];
+            }
+            deviation = ((int64_t)entry->value_b * (sum - (6 * 65536))) /
+                65536;
+            if((deviation < 0) && ((uint64_t)(-deviation) > entry->value_a))
+            {
+                return 0;
+            }
+            return (uint64_t)((int64_t)entry->value_a + deviation);
+
+        case UTA_LATENCY_HISTOGRAM:
+            r = latency_get_u64(random) %
+                entry->bin_cumulative[entry->num_bins - 1];
+            for(i = 0; i < (entry->num_bins - 1); i++)
+            {
+                if(r < entry->bin_cumulative[i])
+                {
+                    break;
+                }
+            }
+            return entry->bin_value[i];
+
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Sleeps for the given time, interrupted sleeps are continued.
+ * @param[in] duration Time in ns.
+ */
+void uta_latency_sleep(uint64_t duration)
+{
+    struct timespec deadline;
+
+    if((duration == 0) || (clock_gettime(CLOCK_MONOTONIC, &deadline) != 0))
+    {
+        return;
+    }
+
+    duration += (uint64_t)deadline.tv_nsec;
+    deadline.tv_sec += (time_t)(duration / 1000000000u);
+    deadline.tv_nsec = (long)(duration % 1000000000u);
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+        EINTR)
+    {
+    }
+}
+
+/**
+ * @brief Clears all recorded histograms.
+ * @param[out] record Recorded histograms.
+ */
+void uta_latency_record_init(uta_latency_record_t *record)
+{
+    memset(record, 0, sizeof(*record));
+}
+
+/**
+ * @brief Counts a trust anchor access in the histogram of an operation.
+ * @param[in,out] record Recorded histograms.
+ * @param[in] op Operation, accesses of UTA_STATS_NUM_OPS are not recorded.
+ * @param[in] duration Duration of the access in ns.
+ */
+void uta_latency_record_add(uta_latency_record_t *record, uta_stats_op_t op,
+        uint64_t duration)
+{
+    if(op >= UTA_STATS_NUM_OPS)
+    {
+        return;
+    }
+
+    (void)__atomic_fetch_add(
+        &record->counts[op][latency_bucket(duration / 1000u)], 1,
+        __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Adds the recorded histograms to the histograms of the file. The file
+ *      is locked, so that concurrent processes can record into the same file.
+ * @param[in] record Recorded histograms.
+ * @param[in] path Path of the file.
+ * @return 0 on success, 1 otherwise.
+ */
+int uta_latency_record_save(const uta_latency_record_t *record,
+        const char *path)
+{
+    uint64_t counts[UTA_STATS_NUM_OPS][UTA_LATENCY_NUM_BUCKETS];
+    uta_latency_profile_t *saved;
+    const uta_latency_op_t *entry;
+    uint64_t previous;
+    size_t written;
+    size_t offset;
+    size_t op;
+    size_t i;
+    ssize_t len;
+    char *text;
+    int ret = 1;
+    int fd;
+
+    saved = malloc(sizeof(*saved));
+    text = malloc(LATENCY_FILE_MAX + 1);
+    if((saved == NULL) || (text == NULL))
+    {
+        free(saved);
+        free(text);
+        return 1;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if((fd < 0) || (flock(fd, LOCK_EX) != 0))
+    {
+        goto cleanup;
+    }
+
+    for(op = 0; op < UTA_STATS_NUM_OPS; op++)
+    {
+        for(i = 0; i < UTA_LATENCY_NUM_BUCKETS; i++)
+        {
+            counts[op][i] = __atomic_load_n(&record->counts[op][i],
+                __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Merge the histograms of the file, an unreadable file is replaced */
+    len = latency_read_fd(fd, text, LATENCY_FILE_MAX + 1);
+    memset(saved, 0, sizeof(*saved));
+    if((len >= 0) && (len <= LATENCY_FILE_MAX))
+    {
+        text[len] = '\0';
+        if(latency_parse(saved, text) != UTA_SUCCESS)
+        {
+            memset(saved, 0, sizeof(*saved));
+        }
+    }
+    for(op = 0; op < UTA_STATS_NUM_OPS; op++)
+    {
+        entry = &saved->ops[op];
+        if(entry->model != UTA_LATENCY_HISTOGRAM)
+        {
+            continue;
+        }
+        previous = 0;
+        for(i = 0; i < entry->num_bins; i++)
+        {
+            counts[op][latency_bucket(entry->bin_value[i] / 1000u)] +=
+                entry->bin_cumulative[i] - previous;
+            previous = entry->bin_cumulative[i];
+        }
+    }
+
+    /* Write one histogram line per recorded operation */
+    offset = (size_t)snprintf(text, LATENCY_FILE_MAX + 1,
+        "# Trust anchor accesses recorded by libuta: <op> histogram "
+        "<us>:<count>\n");
+    for(op = 0; op < UTA_STATS_NUM_OPS; op++)
+    {
+        written = 0;
+        for(i = 0; i < UTA_LATENCY_NUM_BUCKETS; i++)
+        {
+            if(counts[op][i] == 0)
+            {
+                continue;
+            }
+            if(written == 0)
+            {
+                offset += (size_t)snprintf(&text[offset],
+                    LATENCY_FILE_MAX + 1 - offset, "%s histogram",
+                    LATENCY_OP_NAMES[op]);
+            }
+            offset += (size_t)snprintf(&text[offset],
+                LATENCY_FILE_MAX + 1 - offset, " %llu:%llu",
+                (unsigned long long)latency_bucket_us(i),
+                (unsigned long long)counts[op][i]);
+            written++;
+        }
+        if(written != 0)
+        {
+            offset += (size_t)snprintf(&text[offset],
+                LATENCY_FILE_MAX + 1 - offset, "\n");
+        }
+    }
+
+    if(ftruncate(fd, 0) != 0)
+    {
+        goto cleanup;
+    }
+    for(written = 0; written < offset; written += (size_t)len)
+    {
+        len = pwrite(fd, &text[written], offset - written, (off_t)written);
+        if((len < 0) && (errno == EINTR))
+        {
+            len = 0;
+        }
+        else if(len <= 0)
+        {
+            goto cleanup;
+        }
+    }
+    ret = 0;
+
+cleanup:
+    if(fd >= 0)
+    {
+        (void)close(fd);
+    }
+    free(saved);
+    free(text);
+
+    return ret;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Parses the text of a profile, see the description of the file.
+ * @param[out] profile Latency profile, cleared by the caller.
+ * @param[in,out] text Text of the profile, which is modified.
+ * @return UTA return code.
+ */
+static uta_rc latency_parse(uta_latency_profile_t *profile, char *text)
+{
+    char *save_line;
+    char *save;
+    char *line;
+    char *comment;
+    char *token;
+    size_t op;
+
+    for(line = strtok_r(text, "\n", &save_line); line != NULL;
+        line = strtok_r(NULL, "\n", &save_line))
+    {
+        comment = strchr(line, '#');
+        if(comment != NULL)
+        {
+            *comment = '\0';
+        }
+
+        token = strtok_r(line, " \t\r", &save);
+        if(token == NULL)
+        {
+            continue;
+        }
+
+        for(op = 0; op < UTA_STATS_NUM_OPS; op++)
+        {
+            if(strcmp(token, LATENCY_OP_NAMES[op]) == 0)
+            {
+                break;
+            }
+        }
+        if(op == UTA_STATS_NUM_OPS)
+        {
+            return UTA_TA_ERROR;
+        }
+
+        if(latency_parse_line(&profile->ops[op], &save) != UTA_SUCCESS)
+        {
+            return UTA_TA_ERROR;
+        }
+    }
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Parses the model and the values of one line.
+ * @param[out] entry Latency of the operation.
+ * @param[in,out] save strtok_r state of the line after the operation.
+ * @return UTA return code.
+ */
+static uta_rc latency_parse_line(uta_latency_op_t *entry, char **save)
+{
+    const char *model = strtok_r(NULL, " \t\r", save);
+    const char *token;
+    const char *end;
+    uint64_t total = 0;
+    uint64_t count;
+    uint64_t us;
+
+    if(model == NULL)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    if(strcmp(model, "histogram") == 0)
+    {
+        entry->model = UTA_LATENCY_HISTOGRAM;
+        while((token = strtok_r(NULL, " \t\r", save)) != NULL)
+        {
+            if((entry->num_bins == UTA_LATENCY_MAX_BINS) ||
+               (latency_parse_us(token, ':', &us, &end) != 0))
+            {
+                return UTA_TA_ERROR;
+            }
+            errno = 0;
+            count = strtoull(end + 1, (char **)&end, 10);
+            if((errno != 0) || (*end != '\0') || (count > UINT32_MAX))
+            {
+                return UTA_TA_ERROR;
+            }
+            total += count;
+            entry->bin_value[entry->num_bins] = us * 1000u;
+            entry->bin_cumulative[entry->num_bins] = total;
+            entry->num_bins++;
+        }
+        return (total != 0) ? UTA_SUCCESS : UTA_TA_ERROR;
+    }
+
+    if(strcmp(model, "fixed") == 0)
+    {
+        entry->model = UTA_LATENCY_FIXED;
+    }
+    else if(strcmp(model, "uniform") == 0)
+    {
+        entry->model = UTA_LATENCY_UNIFORM;
+    }
+    else if(strcmp(model, "normal") == 0)
+    {
+        entry->model = UTA_LATENCY_NORMAL;
+    }
+    else
+    {
+        return UTA_TA_ERROR;
+    }
+
+    token = strtok_r(NULL, " \t\r", save);
+    if((token == NULL) || (latency_parse_us(token, '\0', &us, &end) != 0))
+    {
+        return UTA_TA_ERROR;
+    }
+    entry->value_a = us * 1000u;
+
+    if(entry->model != UTA_LATENCY_FIXED)
+    {
+        token = strtok_r(NULL, " \t\r", save);
+        if((token == NULL) || (latency_parse_us(token, '\0', &us, &end) != 0))
+        {
+            return UTA_TA_ERROR;
+        }
+        entry->value_b = us * 1000u;
+
+        if((entry->model == UTA_LATENCY_UNIFORM) &&
+           (entry->value_b < entry->value_a))
+        {
+            return UTA_TA_ERROR;
+        }
+    }
+
+    /* No further values are allowed */
+    return (strtok_r(NULL, " \t\r", save) == NULL) ? UTA_SUCCESS :
+        UTA_TA_ERROR;
+}
+
+/**
+ * @brief Parses a latency in us up to LATENCY_US_MAX.
+ * @param[in] token Text of the value.
+ * @param[in] delimiter Character expected after the value.
+ * @param[out] us Latency in us.
+ * @param[out] end Position of the delimiter.
+ * @return 0 on success, 1 otherwise.
+ */
+static int latency_parse_us(const char *token, char delimiter, uint64_t *us,
+        const char **end)
+{
+    if((*token < '0') || (*token > '9'))
+    {
+        return 1;
+    }
+
+    errno = 0;
+    *us = strtoull(token, (char **)end, 10);
+    if((errno != 0) || (**end != delimiter) || (*us > LATENCY_US_MAX))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Returns the histogram bucket of a latency. Below 4 us each us has its
+ *      own bucket, above each power of two is split into four buckets.
+ * @param[in] us Latency in us.
+ * @return Index of the bucket.
+ */
+static size_t latency_bucket(uint64_t us)
+{
+    size_t bucket;
+    int msb;
+
+    if(us < 4)
+    {
+        return (size_t)us;
+    }
+
+    msb = 63 - __builtin_clzll(us);
+    bucket = (4 * (size_t)(msb - 1)) + (size_t)((us >> (msb - 2)) & 3);
+
+    return (bucket < UTA_LATENCY_NUM_BUCKETS) ? bucket :
+        (UTA_LATENCY_NUM_BUCKETS - 1);
+}
+
+/**
+ * @brief Returns the latency, which represents a bucket in the file.
+ * @param[in] bucket Index of the bucket.
+ * @return Middle of the bucket in us.
+ */
+static uint64_t latency_bucket_us(size_t bucket)
+{
+    uint64_t lower;
+    int shift;
+
+    if(bucket < 4)
+    {
+        return (uint64_t)bucket;
+    }
+
+    shift = (int)(bucket / 4) - 1;
+    lower = (uint64_t)(4 | (bucket % 4)) << shift;
+
+    return lower + (((uint64_t)1 << shift) / 2);
+}
+
+/**
+ * @brief Reads 8 random bytes as integer.
+ * @param[in] random Random bytes.
+ * @return 64 bit value.
+ */
+static uint64_t latency_get_u64(const uint8_t *random)
+{
+    uint64_t value = 0;
+    size_t i;
+
+    for(i = 0; i < 8; i++)
+    {
+        value = (value << 8) | random[i];
+    }
+
+    return value;
+}
+
+/**
+ * @brief Reads a file from the beginning.
+ * @param[in] fd File descriptor.
+ * @param[out] text Buffer.
+ * @param[in] len Size of the buffer.
+ * @return Number of bytes read, -1 on error.
+ */
+static ssize_t latency_read_fd(int fd, char *text, size_t len)
+{
+    size_t total = 0;
+    ssize_t ret;
+
+    while(total < len)
+    {
+        ret = pread(fd, &text[total], len - total, (off_t)total);
+        if((ret < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        if(ret < 0)
+        {
+            return -1;
+        }
+        if(ret == 0)
+        {
+            break;
+        }
+        total += (size_t)ret;
+    }
+
+    return (ssize_t)total;
+}
@@ -0,0 +1,319 @@
+/** @file uta_prefetch.c
+*
+* @brief Unified Trust Anchor (UTA) ring of random bytes, which a background
+* thread prefetches from the trust anchor. The thread sleeps, while at least
+* half of the ring is filled, and then reads UTA_PREFETCH_CHUNK bytes at a
+* time, until the ring is full again. get_random takes the bytes from the ring
+* and wipes them, so that every byte is handed out once. The ring is locked in
+* memory, if the limits of the process allow it.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <uta_prefetch.h>
+#include <uta_key_cache.h>
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static void *uta_prefetch_thread(void *arg);
+static void uta_prefetch_release_ring(uta_prefetch_t *prefetch);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Initializes a stopped prefetch ring. It is called on open.
+ * @param[out] prefetch Pointer to the prefetch ring.
+ * @return UTA return code.
+ */
+uta_rc uta_prefetch_init(uta_prefetch_t *prefetch)
+{
+    memset(prefetch, 0, sizeof(*prefetch));
+
+    if(pthread_mutex_init(&prefetch->mutex, NULL) != 0)
+    {
+        return UTA_TA_ERROR;
+    }
+    if(pthread_cond_init(&prefetch->cond, NULL) != 0)
+    {
+        (void)pthread_mutex_destroy(&prefetch->mutex);
+        return UTA_TA_ERROR;
+    }
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Allocates the ring and starts the background thread, which fills it.
+ *      A running prefetch is stopped first, its bytes are discarded.
+ * @param[in,out] prefetch Pointer to the prefetch ring.
+ * @param[in] f_fill Source of the random bytes, called by the thread.
+ * @param[in] p_fill Parameter of f_fill.
+ * @param[in] size Size of the ring in bytes, at least UTA_PREFETCH_CHUNK.
+ * @return UTA return code.
+ */
+uta_rc uta_prefetch_start(uta_prefetch_t *prefetch, uta_prefetch_fill_t f_fill,
+        void *p_fill, size_t size)
+{
+    uint8_t *ring;
+
+    uta_prefetch_stop(prefetch);
+
+    if(size < UTA_PREFETCH_CHUNK)
+    {
+        return UTA_NOT_SUPPORTED;
+    }
+
+    ring = calloc(1, size);
+    if(ring == NULL)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    /* The bytes should not be swapped out, but the limit may be too low */
+    (void)mlock(ring, size);
+
+    (void)pthread_mutex_lock(&prefetch->mutex);
+    prefetch->f_fill = f_fill;
+    prefetch->p_fill = p_fill;
+    prefetch->ring = ring;
+    prefetch->size = size;
+    prefetch->head = 0;
+    prefetch->count = 0;
+    prefetch->stop = 0;
+    if(pthread_create(&prefetch->thread, NULL, uta_prefetch_thread,
+       prefetch) != 0)
+    {
+        uta_prefetch_release_ring(prefetch);
+        (void)pthread_mutex_unlock(&prefetch->mutex);
+        return UTA_TA_ERROR;
+    }
+    prefetch->running = 1;
+    (void)pthread_mutex_unlock(&prefetch->mutex);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Stops the background thread and wipes and releases the ring. A
+ *      refill step, which the thread has already started, is finished first.
+ * @param[in,out] prefetch Pointer to the prefetch ring.
+ */
+void uta_prefetch_stop(uta_prefetch_t *prefetch)
+{
+    (void)pthread_mutex_lock(&prefetch->mutex);
+    if(prefetch->running == 0)
+    {
+        (void)pthread_mutex_unlock(&prefetch->mutex);
+        return;
+    }
+    prefetch->stop = 1;
+    (void)pthread_cond_signal(&prefetch->cond);
+    (void)pthread_mutex_unlock(&prefetch->mutex);
+
+    (void)pthread_join(prefetch->thread, NULL);
+
+    (void)pthread_mutex_lock(&prefetch->mutex);
+    prefetch->running = 0;
+    uta_prefetch_release_ring(prefetch);
+    (void)pthread_mutex_unlock(&prefetch->mutex);
+}
+
+/**
+ * @brief Scatters prefetched bytes to the buffers at the cursor and wipes them
+ *      in the ring. The thread is woken, if less than half of the ring is
+ *      left afterwards.
+ * @param[in,out] prefetch Pointer to the prefetch ring.
+ * @param[in,out] cursor Position of the request in its buffers, which is
+ *      advanced by the bytes taken.
+ * @return Number of bytes taken, 0 if the ring is empty or stopped.
+ */
+size_t uta_prefetch_take(uta_prefetch_t *prefetch,
+        uta_random_cursor_t *cursor)
+{
+    size_t len;
+    size_t first;
+
+    (void)pthread_mutex_lock(&prefetch->mutex);
+
+    len = (prefetch->running != 0) ? prefetch->count : 0;
+    if(len > cursor->remaining)
+    {
+        len = cursor->remaining;
+    }
+
+    if(len > 0)
+    {
+        /* The bytes may wrap around the end of the ring */
+        first = prefetch->size - prefetch->head;
+        if(first > len)
+        {
+            first = len;
+        }
+        uta_random_cursor_scatter(cursor, &prefetch->ring[prefetch->head],
+            first);
+        uta_key_cache_zeroize(&prefetch->ring[prefetch->head], first);
+        if(len > first)
+        {
+            uta_random_cursor_scatter(cursor, prefetch->ring, len - first);
+            uta_key_cache_zeroize(prefetch->ring, len - first);
+        }
+
+        prefetch->head = (prefetch->head + len) % prefetch->size;
+        prefetch->count -= len;
+        if(prefetch->count < (prefetch->size / 2))
+        {
+            (void)pthread_cond_signal(&prefetch->cond);
+        }
+    }
+
+    (void)pthread_mutex_unlock(&prefetch->mutex);
+
+    return len;
+}
+
+/**
+ * @brief Resets the prefetch ring in a child process, which has no copy of
+ *      the background thread. The bytes of the parent are wiped, so that the
+ *      child never hands out the same bytes as the parent.
+ * @param[in,out] prefetch Pointer to the prefetch ring.
+ * @return Size of the ring, which has been running in the parent, so that the
+ *      caller can start it again, 0 if it was stopped.
+ */
+size_t uta_prefetch_after_fork(uta_prefetch_t *prefetch)
+{
+    size_t size = (prefetch->running != 0) ? prefetch->size : 0;
+
+    /* Threads of the parent may have held the mutex during the fork */
+    (void)pthread_mutex_init(&prefetch->mutex, NULL);
+    (void)pthread_cond_init(&prefetch->cond, NULL);
+
+    prefetch->running = 0;
+    uta_prefetch_release_ring(prefetch);
+
+    return size;
+}
+
+/**
+ * @brief Stops the prefetch and destroys the ring. It is called on close.
+ * @param[in,out] prefetch Pointer to the prefetch ring.
+ */
+void uta_prefetch_free(uta_prefetch_t *prefetch)
+{
+    uta_prefetch_stop(prefetch);
+
+    (void)pthread_cond_destroy(&prefetch->cond);
+    (void)pthread_mutex_destroy(&prefetch->mutex);
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Background thread, which refills the ring. The mutex is released
+ *      while the random bytes are read from the trust anchor.
+ * @param[in,out] arg Pointer to the prefetch ring.
+ * @return NULL.
+ */
+static void *uta_prefetch_thread(void *arg)
+{
+    uta_prefetch_t *prefetch = (uta_prefetch_t *)arg;
+    uint8_t chunk[UTA_PREFETCH_CHUNK];
+    struct timespec retry;
+    uint8_t filling = 1;
+    size_t tail;
+    size_t first;
+    size_t len;
+    int ret;
+
+    (void)pthread_mutex_lock(&prefetch->mutex);
+
+    while(prefetch->stop == 0)
+    {
+        /* Refill from below the watermark until the ring is full */
+        if(prefetch->count == prefetch->size)
+        {
+            filling = 0;
+        }
+        else if(prefetch->count < (prefetch->size / 2))
+        {
+            filling = 1;
+        }
+        if(filling == 0)
+        {
+            (void)pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+            continue;
+        }
+
+        len = prefetch->size - prefetch->count;
+        if(len > sizeof(chunk))
+        {
+            len = sizeof(chunk);
+        }
+
+        /* Only this thread adds bytes, so the space is still free later */
+        (void)pthread_mutex_unlock(&prefetch->mutex);
+        ret = prefetch->f_fill(prefetch->p_fill, chunk, len);
+        (void)pthread_mutex_lock(&prefetch->mutex);
+
+        if(ret == 0)
+        {
+            tail = (prefetch->head + prefetch->count) % prefetch->size;
+            first = prefetch->size - tail;
+            if(first > len)
+            {
+                first = len;
+            }
+            memcpy(&prefetch->ring[tail], chunk, first);
+            memcpy(prefetch->ring, &chunk[first], len - first);
+            prefetch->count += len;
+        }
+        uta_key_cache_zeroize(chunk, len);
+
+        /* A failing trust anchor is not asked again immediately */
+        if((ret != 0) && (prefetch->stop == 0))
+        {
+            (void)clock_gettime(CLOCK_REALTIME, &retry);
+            retry.tv_sec += UTA_PREFETCH_RETRY_INTERVAL;
+            (void)pthread_cond_timedwait(&prefetch->cond, &prefetch->mutex,
+                &retry);
+        }
+    }
+
+    (void)pthread_mutex_unlock(&prefetch->mutex);
+
+    return NULL;
+}
+
+/**
+ * @brief Wipes and releases the ring. The caller must hold the mutex or be
+ *      the only thread using the prefetch ring.
+ * @param[in,out] prefetch Pointer to the prefetch ring.
+ */
+static void uta_prefetch_release_ring(uta_prefetch_t *prefetch)
+{
+    if(prefetch->ring != NULL)
+    {
+        uta_key_cache_zeroize(prefetch->ring, prefetch->size);
+        (void)munlock(prefetch->ring, prefetch->size);
+        free(prefetch->ring);
+    }
+    prefetch->ring = NULL;
+    prefetch->size = 0;
+    prefetch->head = 0;
+    prefetch->count = 0;
+}
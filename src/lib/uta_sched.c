@@ -0,0 +1,351 @@
+/** @file uta_sched.c
+*
+* @brief Unified Trust Anchor (UTA) priority scheduling of the connections of
+* a TPM device. The connections of a device are handed out by a counting
+* semaphore with one wait queue per priority class, so that a key derivation
+* is not queued behind bulk random requests. A bulk random request is read in
+* slices of UTA_SCHED_SLICE_LEN bytes and gives its connection back between
+* two slices, while a call of the high class waits. The random cursor keeps
+* the position of such a request in its buffers.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <errno.h>
+#include <string.h>
+
+#include <uta_sched.h>
+#include <uta_stats.h>
+#include <uta_deadline.h>
+#include <uta_trace.h>
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static int uta_sched_next(const uta_sched_t *sched);
+static void uta_sched_grant(uta_sched_t *sched, int prio);
+static void uta_sched_wake(uta_sched_t *sched);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Initializes the scheduler of a device.
+ * @param[out] sched Pointer to the scheduler.
+ * @param[in] slots Number of connections of the device.
+ * @return 0 on success, -1 otherwise.
+ */
+int uta_sched_init(uta_sched_t *sched, uint32_t slots)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->free = slots;
+
+    if(pthread_mutex_init(&sched->mutex, NULL) != 0)
+    {
+        return -1;
+    }
+    if(pthread_cond_init(&sched->cond[UTA_SCHED_HIGH], NULL) != 0)
+    {
+        (void)pthread_mutex_destroy(&sched->mutex);
+        return -1;
+    }
+    if(pthread_cond_init(&sched->cond[UTA_SCHED_BULK], NULL) != 0)
+    {
+        (void)pthread_cond_destroy(&sched->cond[UTA_SCHED_HIGH]);
+        (void)pthread_mutex_destroy(&sched->mutex);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Destroys the scheduler of a device. No call may wait on it.
+ * @param[in,out] sched Pointer to the scheduler.
+ */
+void uta_sched_destroy(uta_sched_t *sched)
+{
+    (void)pthread_cond_destroy(&sched->cond[UTA_SCHED_BULK]);
+    (void)pthread_cond_destroy(&sched->cond[UTA_SCHED_HIGH]);
+    (void)pthread_mutex_destroy(&sched->mutex);
+}
+
+/**
+ * @brief Returns the priority class of an operation. Random requests may
+ *      cover many TPM commands and are served after the other calls.
+ * @param[in] op Operation of the access.
+ * @return UTA_SCHED_BULK for get_random, UTA_SCHED_HIGH otherwise.
+ */
+int uta_sched_class(uta_stats_op_t op)
+{
+    return (op == UTA_STATS_GET_RANDOM) ? UTA_SCHED_BULK : UTA_SCHED_HIGH;
+}
+
+/**
+ * @brief Takes a connection of the device. Blocks until the connection is
+ *      granted to the priority class of the caller, but not beyond the
+ *      deadline. The waiting time is counted in the statistics.
+ * @param[in,out] sched Pointer to the scheduler.
+ * @param[in,out] stats Pointer to the statistics.
+ * @param[in] prio Priority class of the caller.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return UTA_SUCCESS, UTA_TIMEOUT if the deadline passed or UTA_TA_ERROR.
+ */
+uta_rc uta_sched_acquire(uta_sched_t *sched, uta_stats_v1_t *stats,
+        int prio, uint64_t deadline)
+{
+    struct timespec abstime;
+    uint64_t start;
+    int ready;
+    int ret = 0;
+
+    UTA_TRACE_LOCK_ENTRY(sched);
+
+    if(pthread_mutex_lock(&sched->mutex) != 0)
+    {
+        UTA_TRACE_LOCK_RETURN(sched, -1);
+        return UTA_TA_ERROR;
+    }
+
+    (void)__atomic_add_fetch(&sched->waiting[prio], 1, __ATOMIC_RELAXED);
+    ready = ((sched->free > 0) && (uta_sched_next(sched) == prio)) ? 1 : 0;
+
+    if(ready == 0)
+    {
+        start = uta_stats_now();
+        if(deadline != UTA_DEADLINE_NONE)
+        {
+            uta_deadline_abstime(deadline, &abstime);
+        }
+
+        while((ready == 0) && (ret == 0))
+        {
+            if(deadline == UTA_DEADLINE_NONE)
+            {
+                ret = pthread_cond_wait(&sched->cond[prio], &sched->mutex);
+            }
+            else
+            {
+                ret = pthread_cond_timedwait(&sched->cond[prio],
+                    &sched->mutex, &abstime);
+            }
+            ready = ((sched->free > 0) && (uta_sched_next(sched) == prio)) ?
+                1 : 0;
+        }
+        uta_stats_lock_wait(stats, start);
+    }
+
+    (void)__atomic_sub_fetch(&sched->waiting[prio], 1, __ATOMIC_RELAXED);
+    if(ready != 0)
+    {
+        uta_sched_grant(sched, prio);
+        ret = 0;
+    }
+
+    /* Pass a remaining connection on, also after a timeout */
+    uta_sched_wake(sched);
+    (void)pthread_mutex_unlock(&sched->mutex);
+
+    UTA_TRACE_LOCK_RETURN(sched, ret);
+    if(ret == ETIMEDOUT)
+    {
+        return UTA_TIMEOUT;
+    }
+    return (ret == 0) ? UTA_SUCCESS : UTA_TA_ERROR;
+}
+
+/**
+ * @brief Takes a connection of the device without blocking. A connection,
+ *      which is due to a waiting call of another class, is not taken.
+ * @param[in,out] sched Pointer to the scheduler.
+ * @param[in] prio Priority class of the caller.
+ * @return 0 on success, -1 otherwise.
+ */
+int uta_sched_try_acquire(uta_sched_t *sched, int prio)
+{
+    int ret = -1;
+
+    if(pthread_mutex_lock(&sched->mutex) != 0)
+    {
+        return -1;
+    }
+
+    (void)__atomic_add_fetch(&sched->waiting[prio], 1, __ATOMIC_RELAXED);
+    if((sched->free > 0) && (uta_sched_next(sched) == prio))
+    {
+        uta_sched_grant(sched, prio);
+        ret = 0;
+    }
+    (void)__atomic_sub_fetch(&sched->waiting[prio], 1, __ATOMIC_RELAXED);
+
+    (void)pthread_mutex_unlock(&sched->mutex);
+
+    return ret;
+}
+
+/**
+ * @brief Returns a connection to the device and wakes the call, which is
+ *      served next.
+ * @param[in,out] sched Pointer to the scheduler.
+ */
+void uta_sched_release(uta_sched_t *sched)
+{
+    (void)pthread_mutex_lock(&sched->mutex);
+    sched->free++;
+    uta_sched_wake(sched);
+    (void)pthread_mutex_unlock(&sched->mutex);
+}
+
+/**
+ * @brief Checks without a lock, whether a bulk call should give its
+ *      connection back, because a call of the high class waits.
+ * @param[in] sched Pointer to the scheduler.
+ * @return 1 if a call of the high class waits, 0 otherwise.
+ */
+int uta_sched_preempted(const uta_sched_t *sched)
+{
+    return (__atomic_load_n(&sched->waiting[UTA_SCHED_HIGH],
+        __ATOMIC_RELAXED) > 0) ? 1 : 0;
+}
+
+/**
+ * @brief Starts a random request at the first byte of its buffers.
+ * @param[out] cursor Pointer to the cursor.
+ * @param[in] buffers Buffers, where the random numbers are written to.
+ * @param[in] num_buffers Number of entries in buffers.
+ */
+void uta_random_cursor_init(uta_random_cursor_t *cursor,
+        const uta_random_buffer_v1_t *buffers, size_t num_buffers)
+{
+    size_t i;
+
+    cursor->buffers = buffers;
+    cursor->index = 0;
+    cursor->offset = 0;
+    cursor->remaining = 0;
+
+    for(i = 0; i < num_buffers; i++)
+    {
+        cursor->remaining += buffers[i].len_random;
+    }
+}
+
+/**
+ * @brief Returns the number of bytes, which are read before the next check
+ *      for waiting calls of the high class.
+ * @param[in] cursor Pointer to the cursor.
+ * @return Length of the next slice, 0 if the request is complete.
+ */
+size_t uta_random_cursor_slice(const uta_random_cursor_t *cursor)
+{
+    return (cursor->remaining > UTA_SCHED_SLICE_LEN) ? UTA_SCHED_SLICE_LEN :
+        cursor->remaining;
+}
+
+/**
+ * @brief Scatters random bytes to the buffers at the cursor and advances it.
+ *      Empty buffers are skipped.
+ * @param[in,out] cursor Pointer to the cursor.
+ * @param[in] random Random bytes.
+ * @param[in] len_random Number of random bytes, at most the remaining bytes
+ *      of the request.
+ */
+void uta_random_cursor_scatter(uta_random_cursor_t *cursor,
+        const uint8_t *random, size_t len_random)
+{
+    const uta_random_buffer_v1_t *buffer;
+    size_t done;
+    size_t n;
+
+    for(done = 0; done < len_random; done += n)
+    {
+        while(cursor->offset == cursor->buffers[cursor->index].len_random)
+        {
+            cursor->index++;
+            cursor->offset = 0;
+        }
+
+        buffer = &cursor->buffers[cursor->index];
+        n = buffer->len_random - cursor->offset;
+        if(n > (len_random - done))
+        {
+            n = len_random - done;
+        }
+        memcpy(&buffer->random[cursor->offset], &random[done], n);
+        cursor->offset += n;
+    }
+    cursor->remaining -= len_random;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Returns the class, which is served next. The caller must hold the
+ *      mutex.
+ * @param[in] sched Pointer to the scheduler.
+ * @return Priority class, -1 if no call waits.
+ */
+static int uta_sched_next(const uta_sched_t *sched)
+{
+    if((sched->waiting[UTA_SCHED_BULK] > 0) &&
+       ((sched->waiting[UTA_SCHED_HIGH] == 0) ||
+        (sched->high_grants >= UTA_SCHED_BULK_SHARE)))
+    {
+        return UTA_SCHED_BULK;
+    }
+    if(sched->waiting[UTA_SCHED_HIGH] > 0)
+    {
+        return UTA_SCHED_HIGH;
+    }
+    return -1;
+}
+
+/**
+ * @brief Grants a connection to a call. The caller must hold the mutex.
+ * @param[in,out] sched Pointer to the scheduler.
+ * @param[in] prio Priority class of the call.
+ */
+static void uta_sched_grant(uta_sched_t *sched, int prio)
+{
+    sched->free--;
+
+    if(prio == UTA_SCHED_BULK)
+    {
+        sched->high_grants = 0;
+    }
+    else if(sched->waiting[UTA_SCHED_BULK] > 0)
+    {
+        sched->high_grants++;
+    }
+}
+
+/**
+ * @brief Wakes a call of the class, which is served next, if a connection is
+ *      free. The caller must hold the mutex.
+ * @param[in,out] sched Pointer to the scheduler.
+ */
+static void uta_sched_wake(uta_sched_t *sched)
+{
+    int next;
+
+    if(sched->free == 0)
+    {
+        return;
+    }
+
+    next = uta_sched_next(sched);
+    if(next >= 0)
+    {
+        (void)pthread_cond_signal(&sched->cond[next]);
+    }
+}
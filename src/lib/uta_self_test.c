@@ -0,0 +1,115 @@
+/** @file uta_self_test.c
+*
+* @brief Unified Trust Anchor (UTA) cached result of the last self test. The
+* result is kept in one atomic word, so that health checks read it without a
+* lock. A self test, which is still running, is finished with a compare and
+* swap, so that the result of an older self test never overwrites a newer
+* one.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <uta_self_test.h>
+#include <uta_stats.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define SELF_TEST_STATE(mode, rc)   ((((uint32_t)(mode)) << 16) | \
+                                        ((uint32_t)(rc) & 0xFFFF))
+#define SELF_TEST_RC(state)         ((uta_rc)((state) & 0xFFFF))
+#define SELF_TEST_MODE(state)       ((uta_self_test_mode_t)((state) >> 16))
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Initializes the result, no self test has been run.
+ * @param[out] self_test Pointer to the result.
+ */
+void uta_self_test_init(uta_self_test_t *self_test)
+{
+    __atomic_store_n(&self_test->finished, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&self_test->state,
+        SELF_TEST_STATE(UTA_SELF_TEST_FULL, UTA_NOT_SUPPORTED),
+        __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Marks a self test of the given mode as running.
+ * @param[in,out] self_test Pointer to the result.
+ * @param[in] mode Mode of the started self test.
+ */
+void uta_self_test_started(uta_self_test_t *self_test,
+        uta_self_test_mode_t mode)
+{
+    __atomic_store_n(&self_test->state, SELF_TEST_STATE(mode, UTA_TRY_AGAIN),
+        __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Stores the result of a running self test. The result is dropped,
+ *      if a self test of another mode has been started meanwhile.
+ * @param[in,out] self_test Pointer to the result.
+ * @param[in] mode Mode of the finished self test.
+ * @param[in] rc Result, UTA_SUCCESS or UTA_TA_ERROR.
+ * @return rc.
+ */
+uta_rc uta_self_test_finished(uta_self_test_t *self_test,
+        uta_self_test_mode_t mode, uta_rc rc)
+{
+    uint32_t running = SELF_TEST_STATE(mode, UTA_TRY_AGAIN);
+
+    if(__atomic_load_n(&self_test->state, __ATOMIC_ACQUIRE) != running)
+    {
+        return rc;
+    }
+
+    __atomic_store_n(&self_test->finished, uta_stats_now(), __ATOMIC_RELAXED);
+    (void)__atomic_compare_exchange_n(&self_test->state, &running,
+        SELF_TEST_STATE(mode, rc), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+    return rc;
+}
+
+/**
+ * @brief Checks, whether the last self test is still running.
+ * @param[in] self_test Pointer to the result.
+ * @return 1 if the self test is running, 0 otherwise.
+ */
+int uta_self_test_running(const uta_self_test_t *self_test)
+{
+    return (SELF_TEST_RC(__atomic_load_n(&self_test->state,
+        __ATOMIC_ACQUIRE)) == UTA_TRY_AGAIN) ? 1 : 0;
+}
+
+/**
+ * @brief Copies the result of the last self test.
+ * @param[in] self_test Pointer to the result.
+ * @param[out] result Pointer to the copy.
+ */
+void uta_self_test_read(const uta_self_test_t *self_test,
+        uta_self_test_result_v1_t *result)
+{
+    uint32_t state = __atomic_load_n(&self_test->state, __ATOMIC_ACQUIRE);
+    uint64_t finished = __atomic_load_n(&self_test->finished,
+        __ATOMIC_RELAXED);
+    uint64_t now = uta_stats_now();
+
+    result->rc = SELF_TEST_RC(state);
+    result->mode = SELF_TEST_MODE(state);
+    result->age = 0;
+    if((result->rc != UTA_TRY_AGAIN) && (result->rc != UTA_NOT_SUPPORTED) &&
+       (now > finished))
+    {
+        result->age = now - finished;
+    }
+}
@@ -0,0 +1,254 @@
+/** @file uta_session_cache.c
+* 
+* @brief Unified Trust Anchor (UTA) persisted TPM session context. A process
+* saves its HMAC session with TPM2_ContextSave on close, so that the next
+* process loads it with TPM2_ContextLoad instead of starting a new salted
+* session. The file holds at most one session, which is taken by exactly one
+* process. The saved context contains the session secrets of the TSS, so the
+* file is only accessible by its owner.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License 
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <uta_session_cache.h>
+#include <uta_key_cache.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/*
+ * File layout: magic (4 Bytes) | sequence (8 Bytes) | saved handle (4 Bytes) |
+ * hierarchy (4 Bytes) | blob length (2 Bytes) | state length (2 Bytes) |
+ * blob | state, big endian
+ */
+#define CACHE_MAGIC         "UTS2"
+#define CACHE_MAGIC_LEN     4
+#define CACHE_HEADER_LEN    (CACHE_MAGIC_LEN + 8 + 4 + 4 + 2 + 2)
+#define CACHE_FILE_MAX      (CACHE_HEADER_LEN + UTA_SESSION_CACHE_LEN_BLOB + \
+                             UTA_SESSION_CACHE_LEN_STATE)
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static uint64_t cache_get_be(const uint8_t *buffer, size_t len);
+static void cache_put_be(uint8_t *buffer, uint64_t value, size_t len);
+static int cache_temp_path(char *tmp_path, size_t len, const char *path);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Checks, whether a saved session is available.
+ * @param[in] path Path of the cache file.
+ * @return 1 if the cache file exists, 0 otherwise.
+ */
+int uta_session_cache_exists(const char *path)
+{
+    struct stat st;
+
+    return (lstat(path, &st) == 0) ? 1 : 0;
+}
+
+/**
+ * @brief Takes the saved session from the cache file. The file is renamed
+ *      before it is read, so that a session is never loaded twice, and it is
+ *      always removed. It is only accepted if it is a regular file of the
+ *      effective user, which is not accessible by group or others.
+ * @param[in] path Path of the cache file.
+ * @param[out] session Saved session.
+ * @return 0 if the session has been read, 1 otherwise.
+ */
+int uta_session_cache_take(const char *path, uta_saved_session_t *session)
+{
+    uint8_t buffer[CACHE_FILE_MAX + 1];
+    char tmp_path[4096];
+    struct stat st;
+    ssize_t len;
+    int ret = 1;
+    int fd;
+
+    if(cache_temp_path(tmp_path, sizeof(tmp_path), path) != 0)
+    {
+        return 1;
+    }
+
+    if(rename(path, tmp_path) != 0)
+    {
+        return 1;
+    }
+
+    fd = open(tmp_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    (void)unlink(tmp_path);
+    if(fd < 0)
+    {
+        return 1;
+    }
+
+    if((fstat(fd, &st) != 0) || (!S_ISREG(st.st_mode)) ||
+       (st.st_uid != geteuid()) ||
+       ((st.st_mode & (S_IRWXG | S_IRWXO)) != 0))
+    {
+        (void)close(fd);
+        return 1;
+    }
+
+    /* Read one byte more than possible to detect oversized files */
+    len = read(fd, buffer, sizeof(buffer));
+    (void)close(fd);
+
+    if((len >= CACHE_HEADER_LEN) && (len <= CACHE_FILE_MAX) &&
+       (memcmp(buffer, CACHE_MAGIC, CACHE_MAGIC_LEN) == 0))
+    {
+        session->sequence = cache_get_be(&buffer[CACHE_MAGIC_LEN], 8);
+        session->saved_handle = (uint32_t)cache_get_be(
+            &buffer[CACHE_MAGIC_LEN + 8], 4);
+        session->hierarchy = (uint32_t)cache_get_be(
+            &buffer[CACHE_MAGIC_LEN + 12], 4);
+        session->len_blob = (uint16_t)cache_get_be(
+            &buffer[CACHE_MAGIC_LEN + 16], 2);
+        session->len_state = (uint16_t)cache_get_be(
+            &buffer[CACHE_MAGIC_LEN + 18], 2);
+        if((session->len_blob <= UTA_SESSION_CACHE_LEN_BLOB) &&
+           (session->len_state <= UTA_SESSION_CACHE_LEN_STATE) &&
+           ((size_t)len == (CACHE_HEADER_LEN + (size_t)session->len_blob +
+            (size_t)session->len_state)))
+        {
+            memcpy(session->blob, &buffer[CACHE_HEADER_LEN],
+                session->len_blob);
+            memcpy(session->state,
+                &buffer[CACHE_HEADER_LEN + session->len_blob],
+                session->len_state);
+            ret = 0;
+        }
+    }
+
+    uta_key_cache_zeroize(buffer, sizeof(buffer));
+
+    return ret;
+}
+
+/**
+ * @brief Writes a saved session to the cache file, if no other process has
+ *      written one meanwhile. The file is created next to the final path and
+ *      linked afterwards, so that readers never see a partially written file
+ *      and an existing file is not replaced.
+ * @param[in] path Path of the cache file.
+ * @param[in] session Saved session.
+ * @return 0 if the cache file has been written, 1 otherwise.
+ */
+int uta_session_cache_put(const char *path,
+        const uta_saved_session_t *session)
+{
+    uint8_t buffer[CACHE_FILE_MAX];
+    char tmp_path[4096];
+    size_t len;
+    int ret = 1;
+    int fd;
+
+    if((session->len_blob > UTA_SESSION_CACHE_LEN_BLOB) ||
+       (session->len_state > UTA_SESSION_CACHE_LEN_STATE) ||
+       (cache_temp_path(tmp_path, sizeof(tmp_path), path) != 0))
+    {
+        return 1;
+    }
+
+    memcpy(buffer, CACHE_MAGIC, CACHE_MAGIC_LEN);
+    cache_put_be(&buffer[CACHE_MAGIC_LEN], session->sequence, 8);
+    cache_put_be(&buffer[CACHE_MAGIC_LEN + 8], session->saved_handle, 4);
+    cache_put_be(&buffer[CACHE_MAGIC_LEN + 12], session->hierarchy, 4);
+    cache_put_be(&buffer[CACHE_MAGIC_LEN + 16], session->len_blob, 2);
+    cache_put_be(&buffer[CACHE_MAGIC_LEN + 18], session->len_state, 2);
+    memcpy(&buffer[CACHE_HEADER_LEN], session->blob, session->len_blob);
+    memcpy(&buffer[CACHE_HEADER_LEN + session->len_blob], session->state,
+        session->len_state);
+    len = CACHE_HEADER_LEN + session->len_blob + session->len_state;
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+        S_IRUSR | S_IWUSR);
+    if(fd >= 0)
+    {
+        if(write(fd, buffer, len) == (ssize_t)len)
+        {
+            /* link fails, if another process has saved its session first */
+            ret = (link(tmp_path, path) == 0) ? 0 : 1;
+        }
+        (void)close(fd);
+        (void)unlink(tmp_path);
+    }
+
+    uta_key_cache_zeroize(buffer, sizeof(buffer));
+
+    return ret;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Reads a big endian number.
+ * @param[in] buffer Pointer to the number.
+ * @param[in] len Length of the number in bytes.
+ * @return Number.
+ */
+static uint64_t cache_get_be(const uint8_t *buffer, size_t len)
+{
+    uint64_t value = 0;
+    size_t i;
+
+    for(i = 0; i < len; i++)
+    {
+        value = (value << 8) | buffer[i];
+    }
+
+    return value;
+}
+
+/**
+ * @brief Writes a big endian number.
+ * @param[out] buffer Pointer to the output buffer.
+ * @param[in] value Number.
+ * @param[in] len Length of the number in bytes.
+ */
+static void cache_put_be(uint8_t *buffer, uint64_t value, size_t len)
+{
+    while(len-- > 0)
+    {
+        buffer[len] = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+/**
+ * @brief Builds a temporary path, which is unique for each call in this
+ *      process.
+ * @param[out] tmp_path Buffer for the temporary path.
+ * @param[in] len Size of tmp_path.
+ * @param[in] path Path of the cache file.
+ * @return 0 on success, 1 if the path is too long.
+ */
+static int cache_temp_path(char *tmp_path, size_t len, const char *path)
+{
+    static uint32_t counter = 0;
+    int ret;
+
+    ret = snprintf(tmp_path, len, "%s.%ld.%u", path, (long)getpid(),
+        (unsigned int)__atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+
+    return ((ret < 0) || ((size_t)ret >= len)) ? 1 : 0;
+}
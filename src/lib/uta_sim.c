@@ -17,46 +17,120 @@
  ******************************************************************************/
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/random.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <pthread.h>
 
 #include <config.h>
+#include <uta_config.h>
 #include <uta_sim.h>
-#include <mbedtls/md.h>
+#include <uta_async.h>
+#include <uta_stats.h>
+#include <uta_deadline.h>
+#include <uta_key_cache.h>
+#include <uta_self_test.h>
+#include <uta_trace.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/chacha20.h>
+#ifdef ENABLE_DRBG
+#include <uta_drbg.h>
+#endif
+#ifdef ENABLE_HKDF
+#include <uta_hkdf.h>
+#endif
+#ifdef CONFIGURED_SIM_LATENCY_PROFILE
+#include <semaphore.h>
+#include <uta_latency.h>
+#endif
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define KEY_LEN           32
+#define DERIV_VAL_LEN     8
+#define USED_KEY_SLOTS    2
+#define UUID_LEN          16
+#define HMAC_BLOCK_LEN    64
+#define RANDOM_KEY_LEN    32
+#define RANDOM_NONCE_LEN  12
+#define RANDOM_BLOCK_LEN  64
 
 /*******************************************************************************
  * Data types
  ******************************************************************************/
 struct _uta_context_v1_t
 {
-    
+    /* SHA-256 states after the inner and outer HMAC pad of each key slot */
+    mbedtls_sha256_context hmac_inner[USED_KEY_SLOTS];
+    mbedtls_sha256_context hmac_outer[USED_KEY_SLOTS];
+    /* ChaCha20 key stream of the context, each request reserves its blocks
+     * by an atomic increment of random_blocks */
+    uint8_t random_key[RANDOM_KEY_LEN];
+    uint8_t random_nonce[RANDOM_NONCE_LEN];
+    uint64_t random_blocks;
+    uint8_t uuid[UUID_LEN];
+    uint8_t uuid_cached;
+#ifdef ENABLE_DRBG
+    uta_drbg_t drbg;
+#endif
+    uta_async_t async;
+    uta_stats_v1_t stats;
+    /* Timeout of the calls in ms, 0 for none, accessed atomically */
+    uint32_t timeout_ms;
+    uta_key_cache_t key_cache;
+    uta_self_test_t self_test;
+    /* Simulated limits, filled on open */
+    uta_capabilities_v1_t capabilities;
+#ifdef CONFIGURED_SIM_LATENCY_PROFILE
+    /* Emulated latency, each simulated device serves one access at a time */
+    uta_latency_profile_t latency;
+    sem_t device_free;
+#endif
+    pthread_mutex_t accesslock;
 };
 
 /*******************************************************************************
- * Defines
+ * Constants
  ******************************************************************************/
-#define KEY_LEN           32
-#define DERIV_VAL_LEN     8
-#define USED_KEY_SLOTS    2
+const uint8_t KEY_SLOTS[USED_KEY_SLOTS][KEY_LEN]={KEY_SLOT_0,KEY_SLOT_1};
 
 /*******************************************************************************
- * Constants
+ * Private function prototypes
  ******************************************************************************/
-const uint8_t KEY_SLOTS[USED_KEY_SLOTS][KEY_LEN]={KEY_SLOT_0,KEY_SLOT_1};
+static uta_rc sim_open_simulation(uta_context_v1_t *sim_context_w,
+        size_t num_devices, size_t num_connections);
+static uta_rc sim_emulate_access(uta_context_v1_t *sim_context,
+        uta_stats_op_t op, uint64_t deadline);
+static uta_rc sim_hmac_init(uta_context_v1_t *sim_context);
+static void sim_hmac(const uta_context_v1_t *sim_context, uint8_t key_slot,
+        const uint8_t *dv, size_t len_dv, uint8_t *key);
+static void sim_read_random(uta_context_v1_t *sim_context, uint8_t *random,
+        size_t len_random);
+#ifdef ENABLE_DRBG
+static int sim_drbg_entropy(void *p_entropy, unsigned char *output,
+        size_t len);
+#endif
 
 /*******************************************************************************
  * Public function bodies
  ******************************************************************************/
 /**
  * @brief Return the size of the opaque struct uta_context_v1_t.
+ * The bound UTA_CONTEXT_V1_STORAGE of configure.ac is 1280 bytes (about 900
+ * bytes on x86_64), 11520 bytes with the latency profile (about 10340 bytes),
+ * plus 256 bytes for the DRBG (112 bytes).
  * @return Size of the opaque struct uta_context_v1_t .
  */
 size_t sim_context_v1_size(void)
 {
+   /* Applications may store the context in UTA_CONTEXT_V1_STORAGE bytes,
+    * see above */
+   _Static_assert(sizeof(uta_context_v1_t) <= UTA_CONTEXT_V1_STORAGE,
+       "UTA_CONTEXT_V1_STORAGE of configure is too small");
    return(sizeof(uta_context_v1_t));
 }
  
@@ -67,11 +141,65 @@ size_t sim_context_v1_size(void)
  */
 uta_rc sim_open(const uta_context_v1_t *sim_context)
 {
-    /* Initialize the PRNG */
-    time_t t;
-    srand((unsigned) time(&t));
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
 
-    return UTA_SUCCESS;
+    return sim_open_simulation(sim_context_w, 1, 1);
+}
+
+/**
+ * @brief Opens a simulation session for a pool of connections. The simulation
+ *      has no connections, so the context is opened like with sim_open, only
+ *      the capabilities report the pool.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[in] num_connections Number of connections, at least 1.
+ * @return UTA return code.
+ */
+uta_rc sim_open_pool(const uta_context_v1_t *sim_context,
+    size_t num_connections)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    if(num_connections < 1)
+    {
+        UTA_TRACE_OP_ENTRY(UTA_STATS_OPEN, 0, 1);
+        uta_stats_reset(&sim_context_w->stats);
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_OPEN,
+            UTA_NOT_SUPPORTED);
+    }
+
+    return sim_open_simulation(sim_context_w, 1, num_connections);
+}
+
+/**
+ * @brief Opens a simulation session for several devices. The simulation has
+ *      no devices, the device files are ignored.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[in] device_files Paths of the devices.
+ * @param[in] num_devices Number of devices, at least 1.
+ * @param[in] connections_per_device Connections per device, at least 1.
+ * @return UTA return code.
+ */
+uta_rc sim_open_devices(const uta_context_v1_t *sim_context,
+    const char * const *device_files, size_t num_devices,
+    size_t connections_per_device)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    (void)device_files;
+
+    if((num_devices < 1) || (connections_per_device < 1))
+    {
+        UTA_TRACE_OP_ENTRY(UTA_STATS_OPEN, 0, num_devices);
+        uta_stats_reset(&sim_context_w->stats);
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_OPEN,
+            UTA_NOT_SUPPORTED);
+    }
+
+    return sim_open_simulation(sim_context_w, num_devices,
+        num_devices * connections_per_device);
 }
 
 /**
@@ -81,11 +209,46 @@ uta_rc sim_open(const uta_context_v1_t *sim_context)
  */
 uta_rc sim_close(const uta_context_v1_t *sim_context)
 {
-    return UTA_SUCCESS;
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    size_t i;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_CLOSE, 0, 0);
+
+    (void)sim_emulate_access(sim_context_w, UTA_STATS_CLOSE, UTA_DEADLINE_NONE);
+
+    /* Clear the key stream and the HMAC states of the key slots */
+    uta_key_cache_zeroize(sim_context_w->random_key, RANDOM_KEY_LEN);
+    for(i = 0; i < USED_KEY_SLOTS; i++)
+    {
+        mbedtls_sha256_free(&sim_context_w->hmac_inner[i]);
+        mbedtls_sha256_free(&sim_context_w->hmac_outer[i]);
+    }
+
+#ifdef ENABLE_DRBG
+    /* Clear the DRBG state */
+    uta_drbg_free(&sim_context_w->drbg);
+#endif
+
+    uta_async_free(&sim_context_w->async);
+
+    /* Clear and release the key cache */
+    uta_key_cache_free(&sim_context_w->key_cache);
+
+#ifdef CONFIGURED_SIM_LATENCY_PROFILE
+    (void)sem_destroy(&sim_context_w->device_free);
+#endif
+
+    /* Destroy the accesslock mutex (ignore return code) */
+    (void)pthread_mutex_destroy(&sim_context_w->accesslock);
+
+    return uta_stats_call(&sim_context_w->stats, UTA_STATS_CLOSE, UTA_SUCCESS);
 }
 
 /**
- * @brief Derives a key using the mbedtls HMAC function.
+ * @brief Derives a key with HMAC-SHA256 from the precomputed states of the key
+ *      slot, without a lock.
  * @param[in,out] sim_context Pointer to the internal context struct.
  * @param[out] key Pointer to the buffer where the derived key is written to.
  * @param[in] len_key Defines the number of bytes, which should be written to
@@ -99,34 +262,96 @@ uta_rc sim_close(const uta_context_v1_t *sim_context)
 uta_rc sim_derive_key(const uta_context_v1_t *sim_context, uint8_t *key,
     size_t len_key, const uint8_t *dv,size_t len_dv, uint8_t key_slot)
 {
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
     uint8_t key_buffer[KEY_LEN];
-    const mbedtls_md_info_t *sha256_hmac =
-        mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    uint64_t start;
+    uint64_t deadline;
+    uta_rc rc;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_DERIVE_KEY, key_slot, len_key);
+
+    deadline = uta_deadline_start(&sim_context->timeout_ms);
 
     if(key_slot > (USED_KEY_SLOTS-1))
     {
-        return UTA_INVALID_KEY_SLOT;
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_DERIVE_KEY,
+            UTA_INVALID_KEY_SLOT);
     }
 
     if(len_dv != DERIV_VAL_LEN)
     {
-        return UTA_INVALID_DV_LENGTH;
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_DERIVE_KEY,
+            UTA_INVALID_DV_LENGTH);
     }
 
     if(len_key > KEY_LEN)
     {
-        return UTA_INVALID_KEY_LENGTH;
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_DERIVE_KEY,
+            UTA_INVALID_KEY_LENGTH);
     }
 
-    mbedtls_md_hmac(sha256_hmac, KEY_SLOTS[key_slot], KEY_LEN,
-        dv, len_dv, key_buffer);
+    /* Serve repeated derivations from the key cache without a lock */
+    if(uta_key_cache_enabled(&sim_context_w->key_cache) != 0)
+    {
+        if(uta_key_cache_lookup(&sim_context_w->key_cache, key_slot, dv, key,
+            len_key) != 0)
+        {
+            uta_stats_key_cache(&sim_context_w->stats, 1);
+            return uta_stats_call(&sim_context_w->stats, UTA_STATS_DERIVE_KEY,
+                UTA_SUCCESS);
+        }
+        uta_stats_key_cache(&sim_context_w->stats, 0);
+    }
+
+    /* The HMAC is the access to the simulated trust anchor */
+    start = uta_stats_now();
+    rc = sim_emulate_access(sim_context_w, UTA_STATS_DERIVE_KEY, deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_DERIVE_KEY, rc);
+    }
+    sim_hmac(sim_context, key_slot, dv, len_dv, key_buffer);
+    uta_stats_ta_access(&sim_context_w->stats, start);
+    uta_key_cache_store(&sim_context_w->key_cache, key_slot, dv, key_buffer);
     memcpy(key,key_buffer,len_key);
+    uta_key_cache_zeroize(key_buffer, KEY_LEN);
 
-    return UTA_SUCCESS;
+    return uta_stats_call(&sim_context_w->stats, UTA_STATS_DERIVE_KEY,
+        UTA_SUCCESS);
+}
+
+/**
+ * @brief Derives multiple keys using the mbedtls HMAC function.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[in,out] requests Array of derivation requests. The result of each
+ *      request is written to its rc member.
+ * @param[in] num_requests Number of entries in requests.
+ * @return UTA return code of the first failed request, UTA_SUCCESS otherwise.
+ */
+uta_rc sim_derive_key_batch(const uta_context_v1_t *sim_context,
+    uta_derive_request_v1_t *requests, size_t num_requests)
+{
+    uta_rc rc = UTA_SUCCESS;
+    size_t i;
+
+    for(i=0; i<num_requests; i++)
+    {
+        requests[i].rc = sim_derive_key(sim_context, requests[i].key,
+            requests[i].len_key, requests[i].dv, requests[i].len_dv,
+            requests[i].key_slot);
+        if((requests[i].rc != UTA_SUCCESS) && (rc == UTA_SUCCESS))
+        {
+            rc = requests[i].rc;
+        }
+    }
+
+    return rc;
 }
 
 /**
- * @brief Gets random numbers using the rand() function.
+ * @brief Gets random numbers from the ChaCha20 key stream of the context.
  * @param[in,out] sim_context Pointer to the internal context struct.
  * @param[out] random Pointer to the buffer where the random numbers are written
  *      to.
@@ -136,14 +361,416 @@ uta_rc sim_derive_key(const uta_context_v1_t *sim_context, uint8_t *key,
 uta_rc sim_get_random(const uta_context_v1_t *sim_context, uint8_t *random,
     size_t len_random)
 {
-    for(int i=0; i<len_random; i++)
+    uta_random_buffer_v1_t buffer = { .random = random,
+                                      .len_random = len_random };
+
+    return sim_get_random_v(sim_context, &buffer, 1);
+}
+
+/**
+ * @brief Gets random numbers for several buffers. The simulated trust anchor
+ *      is accessed once for all buffers. In the DRBG mode, all buffers are
+ *      generated under one hold of the accesslock mutex.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[in] buffers Buffers, where the random numbers are written to.
+ * @param[in] num_buffers Number of entries in buffers.
+ * @return UTA return code.
+ */
+uta_rc sim_get_random_v(const uta_context_v1_t *sim_context,
+    const uta_random_buffer_v1_t *buffers, size_t num_buffers)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    size_t len_random = 0;
+    uint64_t deadline;
+    uta_rc rc;
+    size_t i;
+
+    for(i = 0; i < num_buffers; i++)
+    {
+        len_random += buffers[i].len_random;
+    }
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_GET_RANDOM, 0, len_random);
+
+    deadline = uta_deadline_start(&sim_context->timeout_ms);
+
+#ifdef ENABLE_DRBG
+    rc = uta_stats_mutex_lock(&sim_context_w->stats,
+        &sim_context_w->accesslock, deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_RANDOM, rc);
+    }
+
+    /* Serve the request from the DRBG, if it has been selected. Only the
+     * DRBG needs the lock, the key stream is read without it. */
+    if(sim_context->drbg.seeded != 0)
+    {
+        for(i = 0; (rc == UTA_SUCCESS) && (i < num_buffers); i++)
+        {
+            rc = uta_drbg_generate(&sim_context_w->drbg, buffers[i].random,
+                buffers[i].len_random);
+        }
+        (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+    }
+    else
+    {
+        (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+        rc = sim_emulate_access(sim_context_w, UTA_STATS_GET_RANDOM,
+            deadline);
+        for(i = 0; (rc == UTA_SUCCESS) && (i < num_buffers); i++)
+        {
+            sim_read_random(sim_context_w, buffers[i].random,
+                buffers[i].len_random);
+        }
+    }
+
+    if(rc == UTA_SUCCESS)
+    {
+        uta_stats_random(&sim_context_w->stats, len_random);
+    }
+    return uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_RANDOM, rc);
+#else
+    rc = sim_emulate_access(sim_context_w, UTA_STATS_GET_RANDOM, deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_RANDOM, rc);
+    }
+    for(i = 0; i < num_buffers; i++)
+    {
+        sim_read_random(sim_context_w, buffers[i].random,
+            buffers[i].len_random);
+    }
+
+    uta_stats_random(&sim_context_w->stats, len_random);
+    return uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_RANDOM,
+        UTA_SUCCESS);
+#endif
+}
+
+/**
+ * @brief Selects the random mode of the context. In the DRBG mode, the DRBG is
+ *      seeded from the key stream immediately.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[in] config Random mode and reseed limits.
+ * @return UTA return code.
+ */
+uta_rc sim_set_random_mode(const uta_context_v1_t *sim_context,
+    const uta_random_config_v1_t *config)
+{
+#ifdef ENABLE_DRBG
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    uta_rc rc;
+
+    if((config->mode != UTA_RANDOM_TA) && (config->mode != UTA_RANDOM_DRBG))
+    {
+        return UTA_NOT_SUPPORTED;
+    }
+
+    rc = uta_stats_mutex_lock(&sim_context_w->stats,
+        &sim_context_w->accesslock,
+        uta_deadline_start(&sim_context->timeout_ms));
+    if(rc != UTA_SUCCESS)
+    {
+        return rc;
+    }
+
+    if(config->mode == UTA_RANDOM_DRBG)
+    {
+        rc = uta_drbg_seed(&sim_context_w->drbg, sim_drbg_entropy,
+            sim_context_w, config->reseed_bytes, config->reseed_interval);
+    }
+    else
+    {
+        uta_drbg_free(&sim_context_w->drbg);
+    }
+
+    (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+
+    return rc;
+#else
+    /* Without DRBG support, only the key stream is available as source */
+    if(config->mode != UTA_RANDOM_TA)
+    {
+        return UTA_NOT_SUPPORTED;
+    }
+
+    return UTA_SUCCESS;
+#endif
+}
+
+/**
+ * @brief Sets the timeout of the calls of the context. It bounds the wait for
+ *      the accesslock mutex and the emulated trust anchor access.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[in] timeout_ms Timeout of each call in ms, 0 for no limit.
+ * @return UTA return code.
+ */
+uta_rc sim_set_timeout(const uta_context_v1_t *sim_context,
+    uint32_t timeout_ms)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    uta_deadline_set_timeout(&sim_context_w->timeout_ms, timeout_ms);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Copies the simulated limits. The simulation has no TPM properties,
+ *      they are reported as 0.
+ * @param[in] sim_context Pointer to the internal context struct.
+ * @param[out] capabilities Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc sim_get_capabilities(const uta_context_v1_t *sim_context,
+    uta_capabilities_v1_t *capabilities)
+{
+    *capabilities = sim_context->capabilities;
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Checks the parameter encryption policy. The simulation has no
+ *      session, all valid policies are accepted and have no effect.
+ * @param[in] sim_context Pointer to the internal context struct.
+ * @param[in] policy Parameter encryption of the operations.
+ * @return UTA return code.
+ */
+uta_rc sim_set_param_encryption(const uta_context_v1_t *sim_context,
+    const uta_param_enc_policy_v1_t *policy)
+{
+    (void)sim_context;
+
+    if((policy->derive_key > UTA_PARAM_ENC_AUDIT) ||
+       (policy->get_random > UTA_PARAM_ENC_AUDIT))
     {
-        random[i]=rand() % 256;
+        return UTA_NOT_SUPPORTED;
     }
 
     return UTA_SUCCESS;
 }
 
+/**
+ * @brief Returns the file descriptor of the emulated asynchronous operations.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[out] fd File descriptor for poll, select or epoll.
+ * @return UTA return code.
+ */
+uta_rc sim_get_poll_fd(const uta_context_v1_t *sim_context, int *fd)
+{
+    *fd = uta_async_fd(&sim_context->async);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Emulates an asynchronous key derivation. The key is derived
+ *      immediately and the completion is signalled on the poll fd.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[out] key Pointer to the buffer where the derived key is written to.
+ * @param[in] len_key Number of bytes, which should be written to key.
+ * @param[in] dv Pointer to the derivation value.
+ * @param[in] len_dv Length of the derivation value.
+ * @param[in] key_slot Key slot used for the HMAC function.
+ * @return UTA return code.
+ */
+uta_rc sim_derive_key_submit(const uta_context_v1_t *sim_context,
+    uint8_t *key, size_t len_key, const uint8_t *dv, size_t len_dv,
+    uint8_t key_slot)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    uta_rc rc;
+
+    /* Invalid parameters are reported immediately, like on a TPM */
+    if((key_slot > (USED_KEY_SLOTS-1)) || (len_dv != DERIV_VAL_LEN) ||
+       (len_key > KEY_LEN))
+    {
+        return sim_derive_key(sim_context, key, len_key, dv, len_dv,
+            key_slot);
+    }
+
+    if(uta_stats_mutex_lock(&sim_context_w->stats,
+        &sim_context_w->accesslock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    rc = uta_async_claim(&sim_context_w->async);
+    if(rc == UTA_SUCCESS)
+    {
+        uta_async_post(&sim_context_w->async, sim_derive_key(sim_context,
+            key, len_key, dv, len_dv, key_slot));
+    }
+
+    (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+
+    return rc;
+}
+
+/**
+ * @brief Emulates an asynchronous random request. The random numbers are read
+ *      from the key stream immediately and the completion is signalled on the
+ *      poll fd.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[out] random Pointer to the buffer where the random numbers are written
+ *      to.
+ * @param[in] len_random Defines the desired number of random bytes.
+ * @return UTA return code.
+ */
+uta_rc sim_get_random_submit(const uta_context_v1_t *sim_context,
+    uint8_t *random, size_t len_random)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    uta_rc rc;
+
+    if(uta_stats_mutex_lock(&sim_context_w->stats,
+        &sim_context_w->accesslock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    rc = uta_async_claim(&sim_context_w->async);
+    if(rc == UTA_SUCCESS)
+    {
+        UTA_TRACE_OP_ENTRY(UTA_STATS_GET_RANDOM, 0, len_random);
+        (void)sim_emulate_access(sim_context_w, UTA_STATS_GET_RANDOM,
+            UTA_DEADLINE_NONE);
+        sim_read_random(sim_context_w, random, len_random);
+        uta_stats_random(&sim_context_w->stats, len_random);
+        uta_async_post(&sim_context_w->async,
+            uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_RANDOM,
+            UTA_SUCCESS));
+    }
+
+    (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+
+    return rc;
+}
+
+/**
+ * @brief Returns the result of the emulated asynchronous operation.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @return UTA return code of the operation.
+ */
+uta_rc sim_async_complete(const uta_context_v1_t *sim_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    uta_rc rc;
+
+    if(uta_stats_mutex_lock(&sim_context_w->stats,
+        &sim_context_w->accesslock, UTA_DEADLINE_NONE) != UTA_SUCCESS)
+    {
+        return UTA_TA_ERROR;
+    }
+
+    rc = uta_async_collect(&sim_context_w->async);
+
+    (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+
+    return rc;
+}
+
+/**
+ * @brief Enables, replaces or disables the key cache of the context.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[in] config Size and TTL of the cache.
+ * @return UTA return code.
+ */
+uta_rc sim_set_key_cache(const uta_context_v1_t *sim_context,
+        const uta_key_cache_config_v1_t *config)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    return uta_key_cache_configure(&sim_context_w->key_cache,
+        config->max_entries, config->ttl);
+}
+
+/**
+ * @brief Clears all entries of the key cache.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc sim_flush_key_cache(const uta_context_v1_t *sim_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    uta_key_cache_flush(&sim_context_w->key_cache);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Copies the statistics of the context.
+ * @param[in] sim_context Pointer to the internal context struct.
+ * @param[out] stats Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc sim_get_stats(const uta_context_v1_t *sim_context,
+    uta_stats_v1_t *stats)
+{
+    uta_stats_read(&sim_context->stats, stats);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Clears the statistics of the context.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+uta_rc sim_reset_stats(const uta_context_v1_t *sim_context)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    uta_stats_reset(&sim_context_w->stats);
+
+    return UTA_SUCCESS;
+}
+
+/**
+ * @brief Derives a key like sim_derive_key and expands it with HKDF-Expand
+ *      into the subkeys of all requests.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[in,out] requests Array of expand requests.
+ * @param[in] num_requests Number of entries in requests.
+ * @param[in] dv Pointer to the buffer in which the derivation value is handed
+ *      over.
+ * @param[in] len_dv Specifies the length in bytes of the derivation value.
+ * @param[in] key_slot Defines which master key is used for the HMAC function.
+ * @return UTA return code.
+ */
+uta_rc sim_derive_key_expand(const uta_context_v1_t *sim_context,
+        uta_expand_request_v1_t *requests, size_t num_requests,
+        const uint8_t *dv, size_t len_dv, uint8_t key_slot)
+{
+#ifdef ENABLE_HKDF
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    return uta_hkdf_derive_key_expand(sim_derive_key, sim_context,
+        &sim_context_w->stats, requests, num_requests, dv, len_dv, key_slot);
+#else
+    /* Without HKDF support, the subkeys cannot be expanded */
+    return UTA_NOT_SUPPORTED;
+#endif
+}
+
 /**
  * @brief Gets the UUID of the Linux machine by reading /etc/machine-id.
  * @param[in,out] sim_context Pointer to the internal context struct.
@@ -152,16 +779,53 @@ uta_rc sim_get_random(const uta_context_v1_t *sim_context, uint8_t *random,
  */
 uta_rc sim_get_device_uuid(const uta_context_v1_t *sim_context, uint8_t *uuid)
 {
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
     FILE *fileptr;
     char machine_id[32];
-    uint8_t tmp_uuid[16];
+    uint8_t tmp_uuid[UUID_LEN];
+    uint64_t deadline;
+    uta_rc rc;
     int ret;
     int i;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_GET_DEVICE_UUID, 0, UUID_LEN);
+
+    deadline = uta_deadline_start(&sim_context->timeout_ms);
+
+    rc = uta_stats_mutex_lock(&sim_context_w->stats,
+        &sim_context_w->accesslock, deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            rc);
+    }
+
+    /* Use the UUID of a previous call */
+    if(sim_context->uuid_cached != 0)
+    {
+        memcpy(uuid, sim_context->uuid, UUID_LEN);
+        (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_SUCCESS);
+    }
     
+    rc = sim_emulate_access(sim_context_w, UTA_STATS_GET_DEVICE_UUID,
+        deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            rc);
+    }
+
     fileptr = fopen("/etc/machine-id", "rb");  // Open the file in binary mode
     if(fileptr == NULL)
     {
-        return UTA_TA_ERROR;
+        (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_TA_ERROR);
     }
     
     /* Read the UUID from file */
@@ -169,24 +833,33 @@ uta_rc sim_get_device_uuid(const uta_context_v1_t *sim_context, uint8_t *uuid)
     if(ret != 32)
     {
         (void)fclose(fileptr); // Close the file
-        return UTA_TA_ERROR;
+        (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+            UTA_TA_ERROR);
     }
     (void)fclose(fileptr); // Close the file
 
     /* Convert the ASCII UUID to hex */
-    for(i=0;i<16;i++)
+    for(i=0;i<UUID_LEN;i++)
     {
         ret = sscanf(&machine_id[i*2],"%02hhX", &tmp_uuid[i]);
         if(ret != 1)
         {
-            return UTA_TA_ERROR;
+            (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+            return uta_stats_call(&sim_context_w->stats,
+                UTA_STATS_GET_DEVICE_UUID, UTA_TA_ERROR);
         }
     }
     
-    /* Copy tmp_uuid to uuid */
-    memcpy(uuid, tmp_uuid, 16);
+    /* Copy tmp_uuid to the context and to uuid */
+    memcpy(sim_context_w->uuid, tmp_uuid, UUID_LEN);
+    sim_context_w->uuid_cached = 1;
+    memcpy(uuid, tmp_uuid, UUID_LEN);
 
-    return UTA_SUCCESS;
+    (void)pthread_mutex_unlock(&sim_context_w->accesslock);
+
+    return uta_stats_call(&sim_context_w->stats, UTA_STATS_GET_DEVICE_UUID,
+        UTA_SUCCESS);
 }
 
 /**
@@ -196,5 +869,366 @@ uta_rc sim_get_device_uuid(const uta_context_v1_t *sim_context, uint8_t *uuid)
  */
 uta_rc sim_self_test(const uta_context_v1_t *sim_context)
 {
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_SELF_TEST, 0, 0);
+
+    uta_self_test_started(&sim_context_w->self_test, UTA_SELF_TEST_FULL);
+
+    (void)sim_emulate_access(sim_context_w, UTA_STATS_SELF_TEST,
+        UTA_DEADLINE_NONE);
+
+    return uta_stats_call(&sim_context_w->stats, UTA_STATS_SELF_TEST,
+        uta_self_test_finished(&sim_context_w->self_test, UTA_SELF_TEST_FULL,
+        UTA_SUCCESS));
+}
+
+/**
+ * @brief Starts a simulated self test, which passes after the emulated
+ *      latency of self_test.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[in] mode Mode of the self test.
+ * @return UTA return code.
+ */
+uta_rc sim_start_self_test(const uta_context_v1_t *sim_context,
+        uta_self_test_mode_t mode)
+{
+    /* This function needs writing access to the context */
+    uta_context_v1_t *sim_context_w = (uta_context_v1_t*)sim_context;
+
+    UTA_TRACE_OP_ENTRY(UTA_STATS_SELF_TEST, 0, 0);
+
+    if((mode != UTA_SELF_TEST_FULL) && (mode != UTA_SELF_TEST_INCREMENTAL))
+    {
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_SELF_TEST,
+            UTA_NOT_SUPPORTED);
+    }
+
+    uta_self_test_started(&sim_context_w->self_test, mode);
+
+    (void)sim_emulate_access(sim_context_w, UTA_STATS_SELF_TEST,
+        UTA_DEADLINE_NONE);
+
+    return uta_stats_call(&sim_context_w->stats, UTA_STATS_SELF_TEST,
+        uta_self_test_finished(&sim_context_w->self_test, mode, UTA_SUCCESS));
+}
+
+/**
+ * @brief Copies the result of the last simulated self test.
+ * @param[in] sim_context Pointer to the internal context struct.
+ * @param[out] result Pointer to the copy.
+ * @return UTA return code.
+ */
+uta_rc sim_get_self_test_result(const uta_context_v1_t *sim_context,
+        uta_self_test_result_v1_t *result)
+{
+    uta_self_test_read(&sim_context->self_test, result);
+
     return UTA_SUCCESS;
 }
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Opens a simulation session with the given number of simulated
+ *      devices, which only matters for the emulated latency.
+ * @param[in,out] sim_context_w Pointer to the internal context struct.
+ * @param[in] num_devices Number of simulated devices, at least 1.
+ * @param[in] num_connections Number of connections reported in the
+ *      capabilities, at least 1.
+ * @return UTA return code.
+ */
+static uta_rc sim_open_simulation(uta_context_v1_t *sim_context_w,
+        size_t num_devices, size_t num_connections)
+{
+    UTA_TRACE_OP_ENTRY(UTA_STATS_OPEN, 0, 1);
+
+    /* Each open starts with cleared statistics */
+    uta_stats_reset(&sim_context_w->stats);
+
+    /* Each context has its own random key stream, seeded by the kernel */
+    if(getrandom(sim_context_w->random_key, RANDOM_KEY_LEN, 0) !=
+        RANDOM_KEY_LEN)
+    {
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+    if(getrandom(sim_context_w->random_nonce, RANDOM_NONCE_LEN, 0) !=
+        RANDOM_NONCE_LEN)
+    {
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+    sim_context_w->random_blocks = 0;
+
+    /* The HMAC pads of the key slots are hashed once per context */
+    if(sim_hmac_init(sim_context_w) != UTA_SUCCESS)
+    {
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+
+    /* Initialization of the accesslock mutex */
+    if(pthread_mutex_init(&sim_context_w->accesslock, NULL) != 0)
+    {
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+
+    /* Completion signal of the emulated asynchronous operations */
+    if(uta_async_init(&sim_context_w->async) != UTA_SUCCESS)
+    {
+        (void)pthread_mutex_destroy(&sim_context_w->accesslock);
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+
+#ifdef CONFIGURED_SIM_LATENCY_PROFILE
+    /* The profile is read on each open, so that it can be replaced between
+     * runs without rebuilding the library */
+    if((uta_latency_load(&sim_context_w->latency,
+        CONFIGURED_SIM_LATENCY_PROFILE) != UTA_SUCCESS) ||
+       (sem_init(&sim_context_w->device_free, 0, (unsigned int)num_devices)
+        != 0))
+    {
+        uta_async_free(&sim_context_w->async);
+        (void)pthread_mutex_destroy(&sim_context_w->accesslock);
+        return uta_stats_call(&sim_context_w->stats, UTA_STATS_OPEN,
+            UTA_TA_ERROR);
+    }
+#endif
+
+    /* The device UUID is read on the first request */
+    sim_context_w->uuid_cached = 0;
+
+    /* The simulated key slots derive HMAC-SHA256 keys */
+    memset(&sim_context_w->capabilities, 0,
+        sizeof(sim_context_w->capabilities));
+    sim_context_w->capabilities.max_digest = KEY_LEN;
+    sim_context_w->capabilities.len_key_max = UTA_LEN_KEY_MAX_V1;
+    sim_context_w->capabilities.num_key_slots = USED_KEY_SLOTS;
+    sim_context_w->capabilities.num_devices = (uint32_t)num_devices;
+    sim_context_w->capabilities.num_connections = (uint32_t)num_connections;
+
+    /* The calls wait without limit until set_timeout is called */
+    uta_deadline_set_timeout(&sim_context_w->timeout_ms, 0);
+
+#ifdef ENABLE_DRBG
+    /* Random numbers are read from the key stream until a DRBG mode is
+     * selected */
+    uta_drbg_init(&sim_context_w->drbg);
+#endif
+
+    /* Keys are not cached until set_key_cache is called */
+    uta_key_cache_init(&sim_context_w->key_cache);
+
+    uta_self_test_init(&sim_context_w->self_test);
+#ifdef ENABLE_SELF_TEST_ON_OPEN
+    /* The simulated incremental self test passes immediately */
+    uta_self_test_started(&sim_context_w->self_test,
+        UTA_SELF_TEST_INCREMENTAL);
+    (void)uta_self_test_finished(&sim_context_w->self_test,
+        UTA_SELF_TEST_INCREMENTAL, UTA_SUCCESS);
+#endif
+
+    (void)sim_emulate_access(sim_context_w, UTA_STATS_OPEN, UTA_DEADLINE_NONE);
+
+    return uta_stats_call(&sim_context_w->stats, UTA_STATS_OPEN, UTA_SUCCESS);
+}
+
+/**
+ * @brief Emulates the latency of a trust anchor access, if the latency profile
+ *      contains the operation. Like a TPM, each simulated device executes one
+ *      access at a time, so that concurrent threads queue up. An access,
+ *      which would not complete before the deadline, ends at the deadline.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[in] op Operation of the access.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return UTA_SUCCESS, UTA_TIMEOUT if the deadline expired.
+ */
+static uta_rc sim_emulate_access(uta_context_v1_t *sim_context,
+        uta_stats_op_t op, uint64_t deadline)
+{
+#ifdef CONFIGURED_SIM_LATENCY_PROFILE
+    uint8_t random[UTA_LATENCY_RANDOM_LEN];
+    uint64_t duration;
+    uint64_t now;
+    uta_rc rc;
+
+    if(uta_latency_enabled(&sim_context->latency, op) == 0)
+    {
+        return UTA_SUCCESS;
+    }
+
+    sim_read_random(sim_context, random, sizeof(random));
+
+    rc = uta_stats_sem_wait(&sim_context->stats, &sim_context->device_free,
+        deadline);
+    if(rc != UTA_SUCCESS)
+    {
+        /* The access is not emulated, if the semaphore fails */
+        return (rc == UTA_TIMEOUT) ? UTA_TIMEOUT : UTA_SUCCESS;
+    }
+
+    duration = uta_latency_sample(&sim_context->latency, op, random);
+    if(deadline != UTA_DEADLINE_NONE)
+    {
+        now = uta_stats_now();
+        if(now + duration > deadline)
+        {
+            duration = (deadline > now) ? (deadline - now) : 0;
+            rc = UTA_TIMEOUT;
+        }
+    }
+    uta_latency_sleep(duration);
+    (void)sem_post(&sim_context->device_free);
+
+    return rc;
+#else
+    return UTA_SUCCESS;
+#endif
+}
+
+/**
+ * @brief Hashes the inner and outer HMAC pad of each key slot, so that a
+ *      derivation only hashes the derivation value and the inner hash.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @return UTA return code.
+ */
+static uta_rc sim_hmac_init(uta_context_v1_t *sim_context)
+{
+    uint8_t ipad[HMAC_BLOCK_LEN];
+    uint8_t opad[HMAC_BLOCK_LEN];
+    uta_rc rc = UTA_SUCCESS;
+    size_t i;
+    size_t j;
+
+    for(i = 0; i < USED_KEY_SLOTS; i++)
+    {
+        /* The keys are shorter than the block, so they are padded with 0 */
+        memset(ipad, 0x36, HMAC_BLOCK_LEN);
+        memset(opad, 0x5c, HMAC_BLOCK_LEN);
+        for(j = 0; j < KEY_LEN; j++)
+        {
+            ipad[j] ^= KEY_SLOTS[i][j];
+            opad[j] ^= KEY_SLOTS[i][j];
+        }
+
+        mbedtls_sha256_init(&sim_context->hmac_inner[i]);
+        mbedtls_sha256_init(&sim_context->hmac_outer[i]);
+        if((mbedtls_sha256_starts_ret(&sim_context->hmac_inner[i], 0) != 0) ||
+           (mbedtls_sha256_update_ret(&sim_context->hmac_inner[i], ipad,
+            HMAC_BLOCK_LEN) != 0) ||
+           (mbedtls_sha256_starts_ret(&sim_context->hmac_outer[i], 0) != 0) ||
+           (mbedtls_sha256_update_ret(&sim_context->hmac_outer[i], opad,
+            HMAC_BLOCK_LEN) != 0))
+        {
+            rc = UTA_TA_ERROR;
+        }
+    }
+
+    uta_key_cache_zeroize(ipad, HMAC_BLOCK_LEN);
+    uta_key_cache_zeroize(opad, HMAC_BLOCK_LEN);
+
+    return rc;
+}
+
+/**
+ * @brief Computes HMAC-SHA256 of the derivation value from copies of the
+ *      precomputed states, so that threads can derive concurrently.
+ * @param[in] sim_context Pointer to the internal context struct.
+ * @param[in] key_slot Key slot, already checked by the caller.
+ * @param[in] dv Pointer to the derivation value.
+ * @param[in] len_dv Length of the derivation value.
+ * @param[out] key Buffer of KEY_LEN bytes for the HMAC.
+ */
+static void sim_hmac(const uta_context_v1_t *sim_context, uint8_t key_slot,
+        const uint8_t *dv, size_t len_dv, uint8_t *key)
+{
+    mbedtls_sha256_context sha256;
+
+    /* SHA-256 cannot fail on a valid state, so the return codes are
+     * ignored */
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_clone(&sha256, &sim_context->hmac_inner[key_slot]);
+    (void)mbedtls_sha256_update_ret(&sha256, dv, len_dv);
+    (void)mbedtls_sha256_finish_ret(&sha256, key);
+
+    mbedtls_sha256_clone(&sha256, &sim_context->hmac_outer[key_slot]);
+    (void)mbedtls_sha256_update_ret(&sha256, key, KEY_LEN);
+    (void)mbedtls_sha256_finish_ret(&sha256, key);
+    mbedtls_sha256_free(&sha256);
+}
+
+/**
+ * @brief Gets random numbers from the ChaCha20 key stream of the context. The
+ *      blocks are reserved atomically, so concurrent requests get disjoint
+ *      parts of the stream without a lock.
+ * @param[in,out] sim_context Pointer to the internal context struct.
+ * @param[out] random Pointer to the buffer where the random numbers are written
+ *      to.
+ * @param[in] len_random Defines the desired number of random bytes.
+ */
+static void sim_read_random(uta_context_v1_t *sim_context, uint8_t *random,
+        size_t len_random)
+{
+    uint8_t nonce[RANDOM_NONCE_LEN];
+    uint64_t blocks = (len_random + RANDOM_BLOCK_LEN - 1) / RANDOM_BLOCK_LEN;
+    uint64_t block;
+    uint64_t chunk_blocks;
+    size_t chunk_len;
+    uint32_t high;
+
+    block = __atomic_fetch_add(&sim_context->random_blocks, blocks,
+        __ATOMIC_RELAXED);
+
+    /* The key stream is XORed into zeros */
+    memset(random, 0, len_random);
+    while(len_random > 0)
+    {
+        /* ChaCha20 counts 32 bit blocks, the upper half of the block number
+         * is mixed into the nonce */
+        high = (uint32_t)(block >> 32);
+        memcpy(nonce, sim_context->random_nonce, RANDOM_NONCE_LEN);
+        nonce[0] ^= (uint8_t)high;
+        nonce[1] ^= (uint8_t)(high >> 8);
+        nonce[2] ^= (uint8_t)(high >> 16);
+        nonce[3] ^= (uint8_t)(high >> 24);
+
+        chunk_blocks = 0x100000000ull - (block & 0xffffffffull);
+        chunk_len = len_random;
+        if((chunk_blocks * RANDOM_BLOCK_LEN) < chunk_len)
+        {
+            chunk_len = (size_t)(chunk_blocks * RANDOM_BLOCK_LEN);
+        }
+
+        (void)mbedtls_chacha20_crypt(sim_context->random_key, nonce,
+            (uint32_t)block, chunk_len, random, random);
+
+        random += chunk_len;
+        len_random -= chunk_len;
+        block += chunk_blocks;
+    }
+}
+
+#ifdef ENABLE_DRBG
+/**
+ * @brief Entropy callback of the DRBG, which reads from the key stream.
+ * @param[in] p_entropy Pointer to the internal context struct.
+ * @param[out] output Buffer for the entropy.
+ * @param[in] len Number of entropy bytes.
+ * @return Always 0.
+ */
+static int sim_drbg_entropy(void *p_entropy, unsigned char *output,
+        size_t len)
+{
+    (void)sim_emulate_access((uta_context_v1_t *)p_entropy,
+        UTA_STATS_GET_RANDOM, UTA_DEADLINE_NONE);
+    sim_read_random((uta_context_v1_t *)p_entropy, output, len);
+
+    return 0;
+}
+#endif
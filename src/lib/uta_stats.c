@@ -0,0 +1,280 @@
+/** @file uta_stats.c
+*
+* @brief Unified Trust Anchor (UTA) statistics of a context. All counters are
+* updated with relaxed atomic operations, so that the threads sharing a
+* context need no additional lock. Locks are first tried without blocking and
+* only a contended wait is timed. A contended wait ends at the deadline of the
+* call, if the context has a timeout. The return of each counted call and every
+* lock are also traced here, see uta_trace.h.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <errno.h>
+#include <time.h>
+
+#include <uta_stats.h>
+#include <uta_deadline.h>
+#include <uta_trace.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* Number of 64 bit counters in uta_stats_v1_t */
+#define STATS_NUM_COUNTERS  (sizeof(uta_stats_v1_t) / sizeof(uint64_t))
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static void uta_stats_max(uint64_t *max, uint64_t value);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Clears all counters.
+ * @param[out] stats Pointer to the statistics.
+ */
+void uta_stats_reset(uta_stats_v1_t *stats)
+{
+    uint64_t *counters = (uint64_t *)stats;
+    size_t i;
+
+    for(i = 0; i < STATS_NUM_COUNTERS; i++)
+    {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Copies all counters. Each counter is read atomically, but the copy
+ *      is no consistent snapshot of all counters.
+ * @param[in] stats Pointer to the statistics.
+ * @param[out] copy Pointer to the copy.
+ */
+void uta_stats_read(const uta_stats_v1_t *stats, uta_stats_v1_t *copy)
+{
+    const uint64_t *counters = (const uint64_t *)stats;
+    uint64_t *copies = (uint64_t *)copy;
+    size_t i;
+
+    for(i = 0; i < STATS_NUM_COUNTERS; i++)
+    {
+        copies[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Counts a finished call of an operation.
+ * @param[in,out] stats Pointer to the statistics.
+ * @param[in] op Operation.
+ * @param[in] rc Return code of the call.
+ * @return rc, so that the function can be used in the return statement.
+ */
+uta_rc uta_stats_call(uta_stats_v1_t *stats, uta_stats_op_t op, uta_rc rc)
+{
+    size_t index = (rc < (UTA_STATS_NUM_RC - 1)) ? rc : (UTA_STATS_NUM_RC - 1);
+
+    UTA_TRACE_OP_RETURN(op, rc);
+
+    (void)__atomic_fetch_add(&stats->ops[op].calls, 1, __ATOMIC_RELAXED);
+    if(rc != UTA_SUCCESS)
+    {
+        (void)__atomic_fetch_add(&stats->ops[op].errors, 1, __ATOMIC_RELAXED);
+    }
+    (void)__atomic_fetch_add(&stats->rc[index], 1, __ATOMIC_RELAXED);
+
+    return rc;
+}
+
+/**
+ * @brief Counts the random bytes returned to the caller.
+ * @param[in,out] stats Pointer to the statistics.
+ * @param[in] len_random Number of random bytes.
+ */
+void uta_stats_random(uta_stats_v1_t *stats, size_t len_random)
+{
+    (void)__atomic_fetch_add(&stats->random_bytes, len_random,
+        __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Counts a lookup in the key cache.
+ * @param[in,out] stats Pointer to the statistics.
+ * @param[in] hit 1 if the key has been found, 0 otherwise.
+ */
+void uta_stats_key_cache(uta_stats_v1_t *stats, uint8_t hit)
+{
+    (void)__atomic_fetch_add((hit != 0) ? &stats->key_cache_hits :
+        &stats->key_cache_misses, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the time of the monotonic clock, which is read through the
+ *      vDSO without a system call on common platforms.
+ * @return Nanoseconds since an unspecified starting point.
+ */
+uint64_t uta_stats_now(void)
+{
+    struct timespec now;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+    {
+        return 0;
+    }
+
+    return ((uint64_t)now.tv_sec * 1000000000u) + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Counts a finished trust anchor access.
+ * @param[in,out] stats Pointer to the statistics.
+ * @param[in] start Time of uta_stats_now at the begin of the access.
+ */
+void uta_stats_ta_access(uta_stats_v1_t *stats, uint64_t start)
+{
+    uint64_t duration = uta_stats_now() - start;
+
+    (void)__atomic_fetch_add(&stats->ta_accesses, 1, __ATOMIC_RELAXED);
+    (void)__atomic_fetch_add(&stats->ta_time, duration, __ATOMIC_RELAXED);
+    uta_stats_max(&stats->ta_time_max, duration);
+}
+
+/**
+ * @brief Counts a finished wait for a lock or a free connection.
+ * @param[in,out] stats Pointer to the statistics.
+ * @param[in] start Time of uta_stats_now at the begin of the wait.
+ */
+void uta_stats_lock_wait(uta_stats_v1_t *stats, uint64_t start)
+{
+    uint64_t duration = uta_stats_now() - start;
+
+    (void)__atomic_fetch_add(&stats->lock_waits, 1, __ATOMIC_RELAXED);
+    (void)__atomic_fetch_add(&stats->lock_wait_time, duration,
+        __ATOMIC_RELAXED);
+    uta_stats_max(&stats->lock_wait_max, duration);
+}
+
+/**
+ * @brief Locks a mutex and counts the waiting time, if it is locked by
+ *      another thread.
+ * @param[in,out] stats Pointer to the statistics.
+ * @param[in,out] mutex Mutex to lock.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return UTA_SUCCESS, UTA_TIMEOUT if the deadline passed or UTA_TA_ERROR.
+ */
+uta_rc uta_stats_mutex_lock(uta_stats_v1_t *stats, pthread_mutex_t *mutex,
+        uint64_t deadline)
+{
+    struct timespec abstime;
+    uint64_t start;
+    int ret;
+
+    UTA_TRACE_LOCK_ENTRY(mutex);
+
+    ret = pthread_mutex_trylock(mutex);
+    if(ret != EBUSY)
+    {
+        UTA_TRACE_LOCK_RETURN(mutex, ret);
+        return (ret == 0) ? UTA_SUCCESS : UTA_TA_ERROR;
+    }
+
+    start = uta_stats_now();
+    if(deadline == UTA_DEADLINE_NONE)
+    {
+        ret = pthread_mutex_lock(mutex);
+    }
+    else
+    {
+        uta_deadline_abstime(deadline, &abstime);
+        ret = pthread_mutex_timedlock(mutex, &abstime);
+    }
+    uta_stats_lock_wait(stats, start);
+
+    UTA_TRACE_LOCK_RETURN(mutex, ret);
+    if(ret == ETIMEDOUT)
+    {
+        return UTA_TIMEOUT;
+    }
+    return (ret == 0) ? UTA_SUCCESS : UTA_TA_ERROR;
+}
+
+/**
+ * @brief Decrements a semaphore and counts the waiting time, if its value is
+ *      0. Interrupted waits are repeated.
+ * @param[in,out] stats Pointer to the statistics.
+ * @param[in,out] sem Semaphore to decrement.
+ * @param[in] deadline Deadline of the call, UTA_DEADLINE_NONE to wait
+ *      without limit.
+ * @return UTA_SUCCESS, UTA_TIMEOUT if the deadline passed or UTA_TA_ERROR.
+ */
+uta_rc uta_stats_sem_wait(uta_stats_v1_t *stats, sem_t *sem,
+        uint64_t deadline)
+{
+    struct timespec abstime;
+    uint64_t start;
+    uta_rc rc;
+    int ret;
+
+    UTA_TRACE_LOCK_ENTRY(sem);
+
+    if(sem_trywait(sem) == 0)
+    {
+        UTA_TRACE_LOCK_RETURN(sem, 0);
+        return UTA_SUCCESS;
+    }
+
+    start = uta_stats_now();
+    if(deadline == UTA_DEADLINE_NONE)
+    {
+        while(((ret = sem_wait(sem)) != 0) && (errno == EINTR))
+        {
+        }
+    }
+    else
+    {
+        uta_deadline_abstime(deadline, &abstime);
+        while(((ret = sem_timedwait(sem, &abstime)) != 0) && (errno == EINTR))
+        {
+        }
+    }
+    if(ret == 0)
+    {
+        rc = UTA_SUCCESS;
+    }
+    else
+    {
+        rc = (errno == ETIMEDOUT) ? UTA_TIMEOUT : UTA_TA_ERROR;
+    }
+    uta_stats_lock_wait(stats, start);
+
+    UTA_TRACE_LOCK_RETURN(sem, ret);
+    return rc;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Raises a maximum counter to value.
+ * @param[in,out] max Pointer to the counter.
+ * @param[in] value New value.
+ */
+static void uta_stats_max(uint64_t *max, uint64_t value)
+{
+    uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while((value > current) && !__atomic_compare_exchange_n(max, &current,
+        value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
@@ -0,0 +1,193 @@
+/** @file uta_uuid_cache.c
+* 
+* @brief Unified Trust Anchor (UTA) persisted device UUID cache. The cache file
+* allows short-lived processes to skip the creation of the primary key, which
+* is needed to calculate the device UUID on a TPM.
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License 
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <uta_uuid_cache.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+/* File layout: magic (4 Bytes) | UUID (16 Bytes) | CRC-32 (4 Bytes) */
+#define CACHE_MAGIC         "UTA1"
+#define CACHE_MAGIC_LEN     4
+#define CACHE_CRC_LEN       4
+#define CACHE_FILE_LEN      (CACHE_MAGIC_LEN + UTA_UUID_LEN + CACHE_CRC_LEN)
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static uint32_t cache_crc32(const uint8_t *data, size_t len);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Reads the device UUID from the cache file. The file is only accepted
+ *      if it is a regular file owned by root, which is not writable by group
+ *      or others, and if its checksum and the RFC 4122 format bits are valid.
+ * @param[in] path Path of the cache file.
+ * @param[out] uuid Buffer for the 16 Byte UUID.
+ * @return 0 if the UUID has been read, 1 otherwise.
+ */
+int uta_uuid_cache_read(const char *path, uint8_t *uuid)
+{
+    uint8_t buffer[CACHE_FILE_LEN + 1];
+    uint32_t crc;
+    struct stat st;
+    ssize_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return 1;
+    }
+
+    if((fstat(fd, &st) != 0) || (!S_ISREG(st.st_mode)) || (st.st_uid != 0) ||
+       ((st.st_mode & (S_IWGRP | S_IWOTH)) != 0))
+    {
+        (void)close(fd);
+        return 1;
+    }
+
+    /* Read one byte more than expected to detect oversized files */
+    len = read(fd, buffer, sizeof(buffer));
+    (void)close(fd);
+    if(len != CACHE_FILE_LEN)
+    {
+        return 1;
+    }
+
+    if(memcmp(buffer, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0)
+    {
+        return 1;
+    }
+
+    crc = ((uint32_t)buffer[CACHE_FILE_LEN-4] << 24) |
+          ((uint32_t)buffer[CACHE_FILE_LEN-3] << 16) |
+          ((uint32_t)buffer[CACHE_FILE_LEN-2] << 8) |
+          ((uint32_t)buffer[CACHE_FILE_LEN-1]);
+    if(crc != cache_crc32(buffer, CACHE_MAGIC_LEN + UTA_UUID_LEN))
+    {
+        return 1;
+    }
+
+    /* Version 4 UUID as described in RFC 4122 */
+    if(((buffer[CACHE_MAGIC_LEN+6] & 0xF0) != 0x40) ||
+       ((buffer[CACHE_MAGIC_LEN+8] & 0xC0) != 0x80))
+    {
+        return 1;
+    }
+
+    memcpy(uuid, &buffer[CACHE_MAGIC_LEN], UTA_UUID_LEN);
+
+    return 0;
+}
+
+/**
+ * @brief Writes the device UUID to the cache file. The file is only written by
+ *      root. It is created next to the final path and renamed afterwards, so
+ *      that readers never see a partially written file.
+ * @param[in] path Path of the cache file.
+ * @param[in] uuid 16 Byte UUID.
+ * @return 0 if the cache file has been written, 1 otherwise.
+ */
+int uta_uuid_cache_write(const char *path, const uint8_t *uuid)
+{
+    uint8_t buffer[CACHE_FILE_LEN];
+    char tmp_path[4096];
+    uint32_t crc;
+    int ret;
+    int fd;
+
+    if(geteuid() != 0)
+    {
+        return 1;
+    }
+
+    ret = snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long)getpid());
+    if((ret < 0) || (ret >= (int)sizeof(tmp_path)))
+    {
+        return 1;
+    }
+
+    memcpy(buffer, CACHE_MAGIC, CACHE_MAGIC_LEN);
+    memcpy(&buffer[CACHE_MAGIC_LEN], uuid, UTA_UUID_LEN);
+    crc = cache_crc32(buffer, CACHE_MAGIC_LEN + UTA_UUID_LEN);
+    buffer[CACHE_FILE_LEN-4] = (uint8_t)(crc >> 24);
+    buffer[CACHE_FILE_LEN-3] = (uint8_t)(crc >> 16);
+    buffer[CACHE_FILE_LEN-2] = (uint8_t)(crc >> 8);
+    buffer[CACHE_FILE_LEN-1] = (uint8_t)(crc);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(fd < 0)
+    {
+        return 1;
+    }
+
+    if((write(fd, buffer, CACHE_FILE_LEN) != CACHE_FILE_LEN) ||
+       (fsync(fd) != 0))
+    {
+        (void)close(fd);
+        (void)unlink(tmp_path);
+        return 1;
+    }
+    (void)close(fd);
+
+    if(rename(tmp_path, path) != 0)
+    {
+        (void)unlink(tmp_path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Calculates the CRC-32 (IEEE 802.3) checksum of a buffer.
+ * @param[in] data Pointer to the input buffer.
+ * @param[in] len Length of the input buffer.
+ * @return CRC-32 checksum.
+ */
+static uint32_t cache_crc32(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    size_t i;
+    int j;
+
+    for(i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for(j = 0; j < 8; j++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,967 @@
+/** @file uta_bench_main.c
+*
+* @brief Measures the throughput and latency of the UTA API calls
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <config.h>
+
+#include <uta.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define BENCH_MAX_LIST       16       // Entries of a comma separated list
+#define BENCH_MAX_THREADS    256
+#define BENCH_MAX_PROCESSES  64
+#define BENCH_KEY_LEN        32
+#define BENCH_UUID_LEN       16
+#define BENCH_DV             "uta_bnch"
+
+/*
+ * Latency histogram: 16 sub-buckets for each power of two of the latency in
+ * ns, which gives a resolution of about 6 % over the whole range
+ */
+#define BENCH_SUB_BITS       4
+#define BENCH_SUB_BUCKETS    (1 << BENCH_SUB_BITS)
+#define BENCH_BUCKETS        (64 * BENCH_SUB_BUCKETS)
+
+/*******************************************************************************
+ * Enums
+ ******************************************************************************/
+typedef enum {OP_OPEN, OP_DERIVE_KEY, OP_GET_RANDOM, OP_GET_DEVICE_UUID,
+    OP_SELF_TEST, OP_COUNT} bench_op_t;
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief Latency histogram of one benchmark case. It is sent from the worker
+ *      processes to the parent as it is, so it contains no pointers.
+ */
+typedef struct
+{
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t elapsed_ns;
+    uint64_t buckets[BENCH_BUCKETS];
+} bench_hist_t;
+
+/**
+ * @brief State of one benchmark thread.
+ */
+typedef struct
+{
+    bench_op_t op;
+    size_t size;
+    uta_context_v1_t *uta_context;
+    uint64_t start_ns;
+    uint64_t deadline_ns;
+    bench_hist_t hist;
+} bench_thread_t;
+
+/*******************************************************************************
+ * Static data declaration
+ ******************************************************************************/
+static uta_api_v1_t uta;
+static uta_api_v1_ext_t uta_ext;
+
+static const char *op_names[OP_COUNT] = {"open", "derive_key", "get_random",
+    "get_device_uuid", "self_test"};
+
+/* Command line options */
+static double duration = 1.0;
+static size_t processes = 1;
+static size_t connections = 0;
+static uint8_t key_slot = 0;
+static int json = 0;
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static void print_usage(void);
+static int parse_list(const char *str, size_t *values, size_t max_values);
+static int parse_ops(const char *str, int *ops);
+static uint64_t bench_now_ns(void);
+static size_t bench_bucket(uint64_t ns);
+static double bench_percentile_us(const bench_hist_t *hist, double quantile);
+static void bench_record(bench_hist_t *hist, uint64_t ns, uta_rc rc);
+static void bench_merge(bench_hist_t *total, const bench_hist_t *hist);
+static uta_rc bench_open(uta_context_v1_t *uta_context);
+static void *bench_thread(void *arg);
+static int bench_process(bench_op_t op, size_t size, size_t threads,
+        bench_hist_t *hist);
+static int bench_case(bench_op_t op, size_t size, size_t threads,
+        bench_hist_t *hist);
+static int write_all(int fd, const void *buf, size_t len);
+static int read_all(int fd, void *buf, size_t len);
+static void print_result(bench_op_t op, size_t size, size_t threads,
+        const bench_hist_t *hist, int first);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Runs each selected operation for each thread count and reports the
+ *      throughput and the latency percentiles.
+ * @param[in] argc Number of parameters.
+ * @param[in] argv List of parameters, see print_usage.
+ * @return Linux return code.
+ */
+int main(int argc, char **argv)
+{
+    int ops[OP_COUNT] = {1, 1, 1, 1, 1};
+    size_t sizes[BENCH_MAX_LIST] = {32, 256, 1024};
+    size_t num_sizes = 3;
+    size_t threads[BENCH_MAX_LIST] = {1};
+    size_t num_threads = 1;
+    const char *backends[] = {"UTA_SIM", "TPM_IBM", "TPM_TCG", "UTA_CLIENT"};
+    uta_context_v1_t *uta_context;
+    uta_version_t version;
+    bench_hist_t *hist;
+    int first = 1;
+    int success = 1;
+    int op;
+    size_t s;
+    size_t t;
+    size_t n;
+    char *end;
+    int ret;
+    int c;
+
+    while ((c = getopt(argc, argv, "o:s:t:p:d:c:k:jh")) != -1)
+    {
+        switch(c)
+        {
+        case 'o':
+            if (parse_ops(optarg, ops) != 0)
+            {
+                fprintf(stderr, "ERROR: Unknown operation in '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            ret = parse_list(optarg, sizes, BENCH_MAX_LIST);
+            if (ret < 1)
+            {
+                fprintf(stderr, "ERROR: Invalid list of sizes '%s'\n", optarg);
+                return 1;
+            }
+            num_sizes = ret;
+            break;
+        case 't':
+            ret = parse_list(optarg, threads, BENCH_MAX_LIST);
+            if (ret < 1)
+            {
+                fprintf(stderr, "ERROR: Invalid list of threads '%s'\n", optarg);
+                return 1;
+            }
+            num_threads = ret;
+            for (t = 0; t < num_threads; t++)
+            {
+                if (threads[t] > BENCH_MAX_THREADS)
+                {
+                    fprintf(stderr, "ERROR: At most %d threads are supported\n",
+                        BENCH_MAX_THREADS);
+                    return 1;
+                }
+            }
+            break;
+        case 'p':
+            if ((parse_list(optarg, &processes, 1) != 1) ||
+                (processes > BENCH_MAX_PROCESSES))
+            {
+                fprintf(stderr, "ERROR: Specify 1 to %d processes\n",
+                    BENCH_MAX_PROCESSES);
+                return 1;
+            }
+            break;
+        case 'd':
+            duration = strtod(optarg, &end);
+            if ((*end != '\0') || !(duration > 0.0))
+            {
+                fprintf(stderr, "ERROR: Invalid duration '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (parse_list(optarg, &connections, 1) != 1)
+            {
+                fprintf(stderr, "ERROR: Invalid number of connections '%s'\n",
+                    optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            if (0 == strcmp(optarg, "0"))
+            {
+                key_slot = 0;
+            }
+            else if (0 == strcmp(optarg, "1"))
+            {
+                key_slot = 1;
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: Wrong key_slot, specify either 0 or 1\n");
+                return 1;
+            }
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case '?':
+        case 'h':
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+
+    if ((uta_init_v1(&uta) != UTA_SUCCESS) ||
+        (uta_init_v1_ext(&uta_ext) != UTA_SUCCESS))
+    {
+        fprintf(stderr, "ERROR during uta_init_v1!\n");
+        return 1;
+    }
+
+    /* Read the version once, which also checks that the trust anchor works */
+    uta_context = malloc(uta.context_v1_size());
+    if (uta_context == NULL)
+    {
+        return 1;
+    }
+    if (bench_open(uta_context) != UTA_SUCCESS)
+    {
+        fprintf(stderr, "ERROR: The trust anchor could not be opened\n");
+        free(uta_context);
+        return 1;
+    }
+    if (uta.get_version(uta_context, &version) != UTA_SUCCESS)
+    {
+        fprintf(stderr, "ERROR during uta.get_version!\n");
+        (void)uta.close(uta_context);
+        free(uta_context);
+        return 1;
+    }
+    (void)uta.close(uta_context);
+    free(uta_context);
+
+    hist = malloc(sizeof(bench_hist_t));
+    if (hist == NULL)
+    {
+        return 1;
+    }
+
+    if (json)
+    {
+        printf("{\n");
+        printf("  \"backend\": \"%s\",\n",
+            (version.uta_type <= UTA_CLIENT) ? backends[version.uta_type] :
+            "unknown");
+        printf("  \"version\": \"%u.%u.%u\",\n", version.major, version.minor,
+            version.patch);
+        printf("  \"duration_s\": %g,\n", duration);
+        printf("  \"processes\": %zu,\n", processes);
+        printf("  \"connections\": %zu,\n", connections);
+        printf("  \"key_slot\": %u,\n", key_slot);
+        printf("  \"results\": [\n");
+    }
+    else
+    {
+        printf("Backend %s, library %u.%u.%u, %zu process(es), %s\n",
+            (version.uta_type <= UTA_CLIENT) ? backends[version.uta_type] :
+            "unknown", version.major, version.minor, version.patch, processes,
+            (connections == 0) ? "open" : "open_pool");
+        printf("%-16s %6s %7s %10s %10s %10s %10s %10s %8s\n", "operation",
+            "size", "threads", "ops/s", "mean[us]", "p50[us]", "p99[us]",
+            "p999[us]", "errors");
+    }
+
+    for (op = 0; op < OP_COUNT; op++)
+    {
+        if (!ops[op])
+        {
+            continue;
+        }
+
+        /* Only get_random is measured for several sizes */
+        n = (op == OP_GET_RANDOM) ? num_sizes : 1;
+        for (s = 0; s < n; s++)
+        {
+            for (t = 0; t < num_threads; t++)
+            {
+                if (bench_case(op, (op == OP_GET_RANDOM) ? sizes[s] :
+                    ((op == OP_DERIVE_KEY) ? BENCH_KEY_LEN : 0), threads[t],
+                    hist) != 0)
+                {
+                    fprintf(stderr, "ERROR: %s with %zu thread(s) failed to "
+                        "run\n", op_names[op], threads[t]);
+                    success = 0;
+                    continue;
+                }
+                print_result(op, (op == OP_GET_RANDOM) ? sizes[s] :
+                    ((op == OP_DERIVE_KEY) ? BENCH_KEY_LEN : 0), threads[t],
+                    hist, first);
+                first = 0;
+
+                if (hist->errors != 0)
+                {
+                    success = 0;
+                }
+            }
+        }
+    }
+
+    if (json)
+    {
+        printf("\n  ]\n}\n");
+    }
+
+    free(hist);
+
+    return (success == 1) ? 0 : 1;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Prints the usage of the tool.
+ */
+static void print_usage(void)
+{
+    fprintf(stderr, "### Measure throughput and latency of the UTA trust anchor ###\n\n");
+    fprintf(stderr, "Usage: uta_bench [-o <ops>] [-s <sizes>] [-t <threads>] [-p <processes>]\n");
+    fprintf(stderr, "                 [-d <seconds>] [-c <connections>] [-k <key_slot>] [-j] [-h]\n\n");
+    fprintf(stderr, "-o <ops>: comma separated list of operations from open, derive_key,\n");
+    fprintf(stderr, "   get_random, get_device_uuid and self_test; (default: all)\n");
+    fprintf(stderr, "-s <sizes>: comma separated list of get_random sizes in bytes;\n");
+    fprintf(stderr, "   (default: 32,256,1024)\n");
+    fprintf(stderr, "-t <threads>: comma separated list of thread counts, each operation\n");
+    fprintf(stderr, "   is measured for each of them; (default: 1)\n");
+    fprintf(stderr, "-p <processes>: number of processes running the threads; (default: 1)\n");
+    fprintf(stderr, "-d <seconds>: duration of each measurement; (default: 1)\n");
+    fprintf(stderr, "-c <connections>: open the context of each process with open_pool\n");
+    fprintf(stderr, "   instead of open; (default: open)\n");
+    fprintf(stderr, "-k <key_slot>: key slot used by derive_key; (default: 0)\n");
+    fprintf(stderr, "-j Print the results as JSON\n");
+    fprintf(stderr, "-h This help message\n");
+}
+
+/**
+ * @brief Parses a comma separated list of positive numbers.
+ * @param[in] str String with the list.
+ * @param[out] values Parsed numbers.
+ * @param[in] max_values Maximum number of entries.
+ * @return Number of entries, -1 on error.
+ */
+static int parse_list(const char *str, size_t *values, size_t max_values)
+{
+    unsigned long value;
+    size_t num = 0;
+    char *end;
+
+    while (*str != '\0')
+    {
+        if ((num == max_values) || (*str < '0') || (*str > '9'))
+        {
+            return -1;
+        }
+        errno = 0;
+        value = strtoul(str, &end, 10);
+        if ((errno != 0) || (value == 0) || ((*end != ',') && (*end != '\0')))
+        {
+            return -1;
+        }
+        values[num++] = value;
+        str = (*end == ',') ? end + 1 : end;
+    }
+
+    return (int)num;
+}
+
+/**
+ * @brief Parses a comma separated list of operation names.
+ * @param[in] str String with the list.
+ * @param[out] ops Flag for each operation, whether it is selected.
+ * @return 0 on success, 1 on an unknown operation.
+ */
+static int parse_ops(const char *str, int *ops)
+{
+    size_t len;
+    int found;
+    int op;
+
+    memset(ops, 0, OP_COUNT * sizeof(int));
+
+    while (*str != '\0')
+    {
+        len = strcspn(str, ",");
+        found = 0;
+        for (op = 0; op < OP_COUNT; op++)
+        {
+            if ((strlen(op_names[op]) == len) &&
+                (strncmp(str, op_names[op], len) == 0))
+            {
+                ops[op] = 1;
+                found = 1;
+            }
+        }
+        if (!found)
+        {
+            return 1;
+        }
+        str += len;
+        if (*str == ',')
+        {
+            str++;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Returns the time of the monotonic clock.
+ * @return Nanoseconds since an unspecified starting point.
+ */
+static uint64_t bench_now_ns(void)
+{
+    struct timespec now;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * 1000000000u) + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Returns the histogram bucket of a latency.
+ * @param[in] ns Latency in ns.
+ * @return Index of the bucket.
+ */
+static size_t bench_bucket(uint64_t ns)
+{
+    int exponent;
+
+    if (ns < BENCH_SUB_BUCKETS)
+    {
+        return (size_t)ns;
+    }
+
+    exponent = 63 - __builtin_clzll(ns);
+
+    return ((size_t)(exponent - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS) +
+        ((ns >> (exponent - BENCH_SUB_BITS)) & (BENCH_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief Calculates a percentile of the histogram. The center of the bucket
+ *      is returned, limited to the measured minimum and maximum.
+ * @param[in] hist Histogram.
+ * @param[in] quantile Quantile between 0 and 1.
+ * @return Latency in us.
+ */
+static double bench_percentile_us(const bench_hist_t *hist, double quantile)
+{
+    uint64_t target;
+    uint64_t count = 0;
+    uint64_t value = 0;
+    size_t group;
+    size_t i;
+
+    if (hist->ops == 0)
+    {
+        return 0.0;
+    }
+
+    /* Rank of the percentile, rounded up */
+    target = (uint64_t)(quantile * (double)hist->ops);
+    if (((double)target < (quantile * (double)hist->ops)) || (target < 1))
+    {
+        target++;
+    }
+
+    for (i = 0; i < BENCH_BUCKETS; i++)
+    {
+        count += hist->buckets[i];
+        if (count >= target)
+        {
+            break;
+        }
+    }
+
+    if (i < BENCH_SUB_BUCKETS)
+    {
+        value = i;
+    }
+    else if (i < BENCH_BUCKETS)
+    {
+        group = i >> BENCH_SUB_BITS;
+        value = ((uint64_t)(BENCH_SUB_BUCKETS + (i & (BENCH_SUB_BUCKETS - 1)))
+            << (group - 1)) + (((uint64_t)1 << (group - 1)) >> 1);
+    }
+
+    if (value < hist->min_ns)
+    {
+        value = hist->min_ns;
+    }
+    if ((value > hist->max_ns) || (i == BENCH_BUCKETS))
+    {
+        value = hist->max_ns;
+    }
+
+    return (double)value / 1000.0;
+}
+
+/**
+ * @brief Adds one call to the histogram.
+ * @param[in,out] hist Histogram.
+ * @param[in] ns Latency of the call in ns.
+ * @param[in] rc Return code of the call.
+ */
+static void bench_record(bench_hist_t *hist, uint64_t ns, uta_rc rc)
+{
+    if (rc != UTA_SUCCESS)
+    {
+        hist->errors++;
+        return;
+    }
+
+    if ((hist->ops == 0) || (ns < hist->min_ns))
+    {
+        hist->min_ns = ns;
+    }
+    if (ns > hist->max_ns)
+    {
+        hist->max_ns = ns;
+    }
+    hist->ops++;
+    hist->sum_ns += ns;
+    hist->buckets[bench_bucket(ns)]++;
+}
+
+/**
+ * @brief Adds a histogram to the total of a benchmark case.
+ * @param[in,out] total Histogram of all threads and processes.
+ * @param[in] hist Histogram of one thread or process.
+ */
+static void bench_merge(bench_hist_t *total, const bench_hist_t *hist)
+{
+    size_t i;
+
+    if ((hist->ops != 0) && ((total->ops == 0) ||
+        (hist->min_ns < total->min_ns)))
+    {
+        total->min_ns = hist->min_ns;
+    }
+    if (hist->max_ns > total->max_ns)
+    {
+        total->max_ns = hist->max_ns;
+    }
+    if (hist->elapsed_ns > total->elapsed_ns)
+    {
+        total->elapsed_ns = hist->elapsed_ns;
+    }
+    total->ops += hist->ops;
+    total->errors += hist->errors;
+    total->sum_ns += hist->sum_ns;
+    for (i = 0; i < BENCH_BUCKETS; i++)
+    {
+        total->buckets[i] += hist->buckets[i];
+    }
+}
+
+/**
+ * @brief Opens a context with open or with open_pool, if -c is given.
+ * @param[out] uta_context Context to open.
+ * @return UTA return code.
+ */
+static uta_rc bench_open(uta_context_v1_t *uta_context)
+{
+    if (connections == 0)
+    {
+        return uta.open(uta_context);
+    }
+
+    return uta_ext.open_pool(uta_context, connections);
+}
+
+/**
+ * @brief Calls the operation of the thread until the deadline has passed.
+ *      The open operation is measured as open and close of a context of the
+ *      thread, all other operations use the context of the process.
+ * @param[in,out] arg Pointer to the bench_thread_t of the thread.
+ * @return Always NULL.
+ */
+static void *bench_thread(void *arg)
+{
+    bench_thread_t *thread = (bench_thread_t *)arg;
+    uta_context_v1_t *uta_context = thread->uta_context;
+    uint8_t key[BENCH_KEY_LEN];
+    uint8_t uuid[BENCH_UUID_LEN];
+    uint8_t *random = NULL;
+    uint64_t start;
+    uint64_t end;
+    uta_rc rc;
+
+    if (thread->op == OP_GET_RANDOM)
+    {
+        random = malloc(thread->size);
+        if (random == NULL)
+        {
+            thread->hist.errors++;
+            return NULL;
+        }
+    }
+    else if (thread->op == OP_OPEN)
+    {
+        uta_context = malloc(uta.context_v1_size());
+        if (uta_context == NULL)
+        {
+            thread->hist.errors++;
+            return NULL;
+        }
+    }
+
+    do
+    {
+        start = bench_now_ns();
+        switch (thread->op)
+        {
+        case OP_OPEN:
+            rc = bench_open(uta_context);
+            if (rc == UTA_SUCCESS)
+            {
+                rc = uta.close(uta_context);
+            }
+            break;
+        case OP_DERIVE_KEY:
+            rc = uta.derive_key(uta_context, key, BENCH_KEY_LEN,
+                (const uint8_t *)BENCH_DV, UTA_LEN_DV_V1, key_slot);
+            break;
+        case OP_GET_RANDOM:
+            rc = uta.get_random(uta_context, random, thread->size);
+            break;
+        case OP_GET_DEVICE_UUID:
+            rc = uta.get_device_uuid(uta_context, uuid);
+            break;
+        default:
+            rc = uta.self_test(uta_context);
+            break;
+        }
+        end = bench_now_ns();
+
+        bench_record(&thread->hist, end - start, rc);
+    } while (end < thread->deadline_ns);
+
+    thread->hist.elapsed_ns = end - thread->start_ns;
+
+    if (thread->op == OP_OPEN)
+    {
+        free(uta_context);
+    }
+    free(random);
+
+    return NULL;
+}
+
+/**
+ * @brief Runs one benchmark case in the calling process. The context is opened
+ *      here, because it must not be shared between processes.
+ * @param[in] op Operation.
+ * @param[in] size Number of random bytes of get_random.
+ * @param[in] threads Number of threads.
+ * @param[out] hist Histogram of all threads.
+ * @return 0 on success, 1 on error.
+ */
+static int bench_process(bench_op_t op, size_t size, size_t threads,
+        bench_hist_t *hist)
+{
+    uta_context_v1_t *uta_context = NULL;
+    bench_thread_t *thread;
+    pthread_t *tids;
+    uint64_t start;
+    size_t started;
+    size_t i;
+    int ret = 0;
+
+    memset(hist, 0, sizeof(bench_hist_t));
+
+    thread = calloc(threads, sizeof(bench_thread_t));
+    tids = calloc(threads, sizeof(pthread_t));
+    if ((thread == NULL) || (tids == NULL))
+    {
+        free(thread);
+        free(tids);
+        return 1;
+    }
+
+    if (op != OP_OPEN)
+    {
+        uta_context = malloc(uta.context_v1_size());
+        if ((uta_context == NULL) || (bench_open(uta_context) != UTA_SUCCESS))
+        {
+            free(uta_context);
+            free(thread);
+            free(tids);
+            return 1;
+        }
+    }
+
+    start = bench_now_ns();
+    for (started = 0; started < threads; started++)
+    {
+        thread[started].op = op;
+        thread[started].size = size;
+        thread[started].uta_context = uta_context;
+        thread[started].start_ns = start;
+        thread[started].deadline_ns = start + (uint64_t)(duration * 1e9);
+        if (pthread_create(&tids[started], NULL, bench_thread,
+            &thread[started]) != 0)
+        {
+            ret = 1;
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        (void)pthread_join(tids[i], NULL);
+        bench_merge(hist, &thread[i].hist);
+    }
+
+    if (uta_context != NULL)
+    {
+        (void)uta.close(uta_context);
+        free(uta_context);
+    }
+    free(thread);
+    free(tids);
+
+    return ret;
+}
+
+/**
+ * @brief Runs one benchmark case in the configured number of processes. The
+ *      worker processes send their histograms to the parent through a pipe.
+ * @param[in] op Operation.
+ * @param[in] size Number of random bytes of get_random.
+ * @param[in] threads Number of threads per process.
+ * @param[out] hist Histogram of all processes.
+ * @return 0 on success, 1 on error.
+ */
+static int bench_case(bench_op_t op, size_t size, size_t threads,
+        bench_hist_t *hist)
+{
+    bench_hist_t *child_hist;
+    pid_t pids[BENCH_MAX_PROCESSES];
+    int fds[BENCH_MAX_PROCESSES];
+    int pipefd[2];
+    size_t forked;
+    size_t i;
+    int stat;
+    int ret = 0;
+
+    if (processes == 1)
+    {
+        return bench_process(op, size, threads, hist);
+    }
+
+    child_hist = malloc(sizeof(bench_hist_t));
+    if (child_hist == NULL)
+    {
+        return 1;
+    }
+
+    /* Do not duplicate buffered output in the children */
+    (void)fflush(stdout);
+
+    for (forked = 0; forked < processes; forked++)
+    {
+        if (pipe(pipefd) != 0)
+        {
+            ret = 1;
+            break;
+        }
+
+        pids[forked] = fork();
+        if (pids[forked] < 0)
+        {
+            (void)close(pipefd[0]);
+            (void)close(pipefd[1]);
+            ret = 1;
+            break;
+        }
+
+        if (pids[forked] == 0)
+        {
+            /* Worker process */
+            (void)close(pipefd[0]);
+            if ((bench_process(op, size, threads, child_hist) != 0) ||
+                (write_all(pipefd[1], child_hist, sizeof(bench_hist_t)) != 0))
+            {
+                _exit(1);
+            }
+            _exit(0);
+        }
+
+        (void)close(pipefd[1]);
+        fds[forked] = pipefd[0];
+    }
+
+    memset(hist, 0, sizeof(bench_hist_t));
+    for (i = 0; i < forked; i++)
+    {
+        if (read_all(fds[i], child_hist, sizeof(bench_hist_t)) == 0)
+        {
+            bench_merge(hist, child_hist);
+        }
+        else
+        {
+            ret = 1;
+        }
+        (void)close(fds[i]);
+
+        if ((waitpid(pids[i], &stat, 0) < 0) || !WIFEXITED(stat) ||
+            (WEXITSTATUS(stat) != 0))
+        {
+            ret = 1;
+        }
+    }
+
+    free(child_hist);
+
+    return ret;
+}
+
+/**
+ * @brief Writes the whole buffer to a file descriptor.
+ * @param[in] fd File descriptor.
+ * @param[in] buf Buffer.
+ * @param[in] len Number of bytes.
+ * @return 0 on success, 1 on error.
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Reads exactly len bytes from a file descriptor.
+ * @param[in] fd File descriptor.
+ * @param[out] buf Buffer.
+ * @param[in] len Number of bytes.
+ * @return 0 on success, 1 on error or end of file.
+ */
+static int read_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = (uint8_t *)buf;
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = read(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 1;
+        }
+        if (n == 0)
+        {
+            return 1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Prints the result of one benchmark case as table row or JSON object.
+ * @param[in] op Operation.
+ * @param[in] size Number of bytes of the operation.
+ * @param[in] threads Number of threads per process.
+ * @param[in] hist Histogram of the case.
+ * @param[in] first Set for the first result, which needs no separator.
+ */
+static void print_result(bench_op_t op, size_t size, size_t threads,
+        const bench_hist_t *hist, int first)
+{
+    double ops_per_s = 0.0;
+    double mean_us = 0.0;
+
+    if (hist->elapsed_ns != 0)
+    {
+        ops_per_s = (double)hist->ops * 1e9 / (double)hist->elapsed_ns;
+    }
+    if (hist->ops != 0)
+    {
+        mean_us = (double)hist->sum_ns / (double)hist->ops / 1000.0;
+    }
+
+    if (json)
+    {
+        printf("%s    {\"operation\": \"%s\", \"size\": %zu, \"threads\": %zu, "
+            "\"ops\": %llu, \"errors\": %llu, \"ops_per_s\": %.1f, "
+            "\"latency_us\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, "
+            "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}",
+            first ? "" : ",\n", op_names[op], size, threads,
+            (unsigned long long)hist->ops, (unsigned long long)hist->errors,
+            ops_per_s, (double)hist->min_ns / 1000.0, mean_us,
+            bench_percentile_us(hist, 0.5), bench_percentile_us(hist, 0.99),
+            bench_percentile_us(hist, 0.999), (double)hist->max_ns / 1000.0);
+    }
+    else
+    {
+        printf("%-16s %6zu %7zu %10.1f %10.1f %10.1f %10.1f %10.1f %8llu\n",
+            op_names[op], size, threads, ops_per_s, mean_us,
+            bench_percentile_us(hist, 0.5), bench_percentile_us(hist, 0.99),
+            bench_percentile_us(hist, 0.999), (unsigned long long)hist->errors);
+    }
+    (void)fflush(stdout);
+}
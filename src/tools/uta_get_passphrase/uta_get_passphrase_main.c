@@ -21,6 +21,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
 
 #include <uta.h>
 
@@ -28,6 +30,13 @@
  * Defines
  ******************************************************************************/
 #define TA_KEY_BYTES 32
+/* Maximum number of derivation strings of the batch mode, which are derived
+ * with one derive_key_batch call */
+#define BATCH_MAX 64
+/* Size of the input buffer of the batch mode */
+#define READ_BUFFER_LEN 4096
+/* Length of the longest encoding of a passphrase (hex) */
+#define PASSPHRASE_LEN_MAX (TA_KEY_BYTES * 2 + 1)
 
 /*******************************************************************************
  * Enums
@@ -38,6 +47,7 @@ typedef enum {BASE64_ENCODING, HEX_ENCODING} string_encoding_t;
  * Static data declaration
  ******************************************************************************/
 static uta_api_v1_t uta;
+static uta_api_v1_ext_t uta_ext;
 static uta_context_v1_t *uta_context;
 
 /*******************************************************************************
@@ -47,9 +57,20 @@ static int bytes2hexstr(const char *bin_in, size_t input_length,
                         char *hex_out, size_t output_length);
 static int bytes2base64(const char *input_data, size_t input_length,
                         char *base64_data, size_t output_length);
+static int encode_passphrase(const char *key, string_encoding_t string_encoding,
+                             char *passphrase, size_t output_length);
+static void pad_derivation_string(const char *derivation_string,
+                                  char *dv_padded);
+static int open_ta(void);
+static int close_ta(void);
+static void wipe(void *buf, size_t len);
 static int get_passphrase_from_ta(char **passphrase,
            const char *derivation_string, uint8_t key_slot,
            string_encoding_t string_encoding);
+static int derive_batch(char (*dvs)[UTA_LEN_DV_V1], size_t num,
+                        uint8_t key_slot, string_encoding_t string_encoding);
+static int get_passphrases_from_stream(int fd, uint8_t key_slot,
+                                       string_encoding_t string_encoding);
 
 /*******************************************************************************
  * Private function bodies
@@ -136,21 +157,39 @@ static int bytes2base64(const char *input_data, size_t input_length,
 }
 
 /**
- * @brief Get passphrase from trust anchor.
- * @param[out] passphrase Buffer containing the derived passphrase.
- * @param[in]  derivation_string Buffer containing the derivation value
+ * @brief Encodes a derived key as passphrase.
+ * @param[in] key Buffer with TA_KEY_BYTES key bytes.
+ * @param[in] string_encoding Encoding of the passphrase.
+ * @param[out] passphrase Buffer for the passphrase string.
+ * @param[in] output_length Size of the passphrase buffer.
  * @return returns 0 on success,
  *         returns 1 in case of an error
  */
-static int get_passphrase_from_ta(char **passphrase,
-                                  const char *derivation_string,
-                                  uint8_t key_slot,
-                                  string_encoding_t string_encoding)
+static int encode_passphrase(const char *key, string_encoding_t string_encoding,
+                             char *passphrase, size_t output_length)
 {
-    uta_rc rc;
-    char key[TA_KEY_BYTES] = {0};
-    char dv_padded[UTA_LEN_DV_V1];
+    if (BASE64_ENCODING == string_encoding)
+    {
+        return bytes2base64(key, TA_KEY_BYTES, passphrase, output_length);
+    }
+    else if (HEX_ENCODING == string_encoding)
+    {
+        return bytes2hexstr(key, TA_KEY_BYTES, passphrase, output_length);
+    }
 
+    return 1;
+}
+
+/**
+ * @brief Converts a derivation string to a derivation value.
+ * @param[in] derivation_string C-string with at most UTA_LEN_DV_V1
+ *            characters.
+ * @param[out] dv_padded Buffer for the UTA_LEN_DV_V1 bytes of the derivation
+ *             value.
+ */
+static void pad_derivation_string(const char *derivation_string,
+                                  char *dv_padded)
+{
     /* The 'derivation_string' is a variable length C-string while the
      * UTA-library requires a fixed length (UTA_LEN_DV_V1) byte string. This
      * loop copies the first UTA_LEN_DV_V1 bytes and pads the resulting byte
@@ -164,6 +203,16 @@ static int get_passphrase_from_ta(char **passphrase,
         }
         dv_padded[i] = padding==1 ? '=' : derivation_string[i];
     }
+}
+
+/**
+ * @brief Allocates and opens the context of the trust anchor.
+ * @return returns 0 on success,
+ *         returns 1 in case of an error
+ */
+static int open_ta(void)
+{
+    uta_rc rc;
 
     rc = uta_init_v1(&uta);
     if (UTA_SUCCESS != rc)
@@ -171,6 +220,12 @@ static int get_passphrase_from_ta(char **passphrase,
         return 1;
     }
 
+    rc = uta_init_v1_ext(&uta_ext);
+    if (UTA_SUCCESS != rc)
+    {
+        return 1;
+    }
+
     /* Allocate memory for the context */
     uta_context = malloc(uta.context_v1_size());
     if (NULL == uta_context)
@@ -182,6 +237,66 @@ static int get_passphrase_from_ta(char **passphrase,
     if (UTA_SUCCESS != rc)
     {
         free(uta_context);
+        uta_context=NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Closes and frees the context of the trust anchor.
+ * @return returns 0 on success,
+ *         returns 1 in case of an error
+ */
+static int close_ta(void)
+{
+    uta_rc rc;
+
+    rc = uta.close(uta_context);
+    free(uta_context);
+    uta_context=NULL;
+
+    return (UTA_SUCCESS == rc) ? 0 : 1;
+}
+
+/**
+ * @brief Clears a buffer with key material. The volatile access prevents the
+ *        compiler from removing the stores.
+ * @param[out] buf Pointer to the buffer.
+ * @param[in]  len Length of the buffer.
+ */
+static void wipe(void *buf, size_t len)
+{
+    volatile char *p = (volatile char *)buf;
+
+    while (len-- > 0)
+    {
+        *p++ = 0;
+    }
+}
+
+/**
+ * @brief Get passphrase from trust anchor.
+ * @param[out] passphrase Buffer containing the derived passphrase.
+ * @param[in]  derivation_string Buffer containing the derivation value
+ * @return returns 0 on success,
+ *         returns 1 in case of an error
+ */
+static int get_passphrase_from_ta(char **passphrase,
+                                  const char *derivation_string,
+                                  uint8_t key_slot,
+                                  string_encoding_t string_encoding)
+{
+    uta_rc rc;
+    char key[TA_KEY_BYTES] = {0};
+    char dv_padded[UTA_LEN_DV_V1];
+    int ret;
+
+    pad_derivation_string(derivation_string, dv_padded);
+
+    if (0 != open_ta())
+    {
         return 1;
     }
 
@@ -192,64 +307,210 @@ static int get_passphrase_from_ta(char **passphrase,
                         (unsigned char *) dv_padded,
                         UTA_LEN_DV_V1,
                         key_slot);
-    if (UTA_SUCCESS != rc)
+    if ((0 != close_ta()) || (UTA_SUCCESS != rc))
     {
-        free(uta_context);
+        wipe(key, sizeof(key));
         return 1;
-
     }
 
-    rc = uta.close(uta_context);
-    if (UTA_SUCCESS != rc)
+    // convert binary key data into a printable string (passphrase)
+    *passphrase = malloc(PASSPHRASE_LEN_MAX);
+    if (NULL == *passphrase)
     {
-        free(uta_context);
+        wipe(key, sizeof(key));
         return 1;
     }
 
-    free(uta_context);
-    uta_context=NULL;
+    ret = encode_passphrase(key, string_encoding, *passphrase,
+                            PASSPHRASE_LEN_MAX);
+    wipe(key, sizeof(key));
 
-    // convert binary key data into a printable string (passphrase)
-    if (BASE64_ENCODING == string_encoding)
+    return ret;
+}
+
+/**
+ * @brief Derives the passphrases of a batch with one derive_key_batch call
+ *        and prints them to stdout in the order of the derivation strings.
+ * @param[in] dvs Padded derivation values.
+ * @param[in] num Number of derivation values.
+ * @param[in] key_slot Key slot used for all derivations.
+ * @param[in] string_encoding Encoding of the passphrases.
+ * @return returns 0 on success,
+ *         returns 1 in case of an error
+ */
+static int derive_batch(char (*dvs)[UTA_LEN_DV_V1], size_t num,
+                        uint8_t key_slot, string_encoding_t string_encoding)
+{
+    static uta_derive_request_v1_t requests[BATCH_MAX];
+    static char keys[BATCH_MAX][TA_KEY_BYTES];
+    char passphrase[PASSPHRASE_LEN_MAX];
+    int ret = 0;
+    size_t i;
+
+    for (i = 0; i < num; i++)
     {
-        *passphrase = malloc((4 * ((TA_KEY_BYTES + 2) / 3)) + 1 );
-        if (NULL != *passphrase)
-        {
-            if(0 != bytes2base64(key, TA_KEY_BYTES, *passphrase, (4 * ((TA_KEY_BYTES + 2) / 3)) + 1 ))
-            {
-                return 1;
-            }
-        }
-        else
+        requests[i].key = (uint8_t *) keys[i];
+        requests[i].len_key = TA_KEY_BYTES;
+        requests[i].dv = (const uint8_t *) dvs[i];
+        requests[i].len_dv = UTA_LEN_DV_V1;
+        requests[i].key_slot = key_slot;
+    }
+
+    if (UTA_SUCCESS != uta_ext.derive_key_batch(uta_context, requests, num))
+    {
+        fprintf(stderr, "ERROR: Deriving the passphrases failed\n");
+        ret = 1;
+    }
+
+    for (i = 0; (0 == ret) && (i < num); i++)
+    {
+        if (0 != encode_passphrase(keys[i], string_encoding, passphrase,
+                                   sizeof(passphrase)))
         {
-           return 1;
+            ret = 1;
+            break;
         }
+        printf("%s\n", passphrase);
     }
-    else if (HEX_ENCODING == string_encoding)
+
+    /* Pass the batch to the consumer, before the next one is read */
+    if (0 != fflush(stdout))
     {
-        *passphrase = malloc(TA_KEY_BYTES * 2 + 1);
-        if (NULL != *passphrase)
+        ret = 1;
+    }
+
+    wipe(keys, num * TA_KEY_BYTES);
+    wipe(passphrase, sizeof(passphrase));
+
+    return ret;
+}
+
+/**
+ * @brief Prints the passphrase of each line of the input. The context is
+ *        opened once. Lines, which are already available, are collected into
+ *        batches of up to BATCH_MAX derivation strings, so that a file is
+ *        derived with few derive_key_batch calls, while the passphrase of a
+ *        line written to a pipe is printed before the next line arrives.
+ * @param[in] fd File descriptor of the input with one derivation string per
+ *            line.
+ * @param[in] key_slot Key slot used for all derivations.
+ * @param[in] string_encoding Encoding of the passphrases.
+ * @return returns 0 on success,
+ *         returns 1 in case of an error
+ */
+static int get_passphrases_from_stream(int fd, uint8_t key_slot,
+                                       string_encoding_t string_encoding)
+{
+    static char dvs[BATCH_MAX][UTA_LEN_DV_V1];
+    char buffer[READ_BUFFER_LEN];
+    char line[UTA_LEN_DV_V1 + 1];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+    unsigned long line_number = 0;
+    size_t len = 0;
+    size_t num = 0;
+    size_t line_len;
+    size_t consumed;
+    char *newline;
+    int eof = 0;
+    int ret = 0;
+    ssize_t n;
+
+    if (0 != open_ta())
+    {
+        fprintf(stderr, "ERROR: Opening the trust anchor failed\n");
+        return 1;
+    }
+
+    while ((0 == ret) && ((0 == eof) || (len > 0)))
+    {
+        newline = memchr(buffer, '\n', len);
+        if ((NULL == newline) && (0 == eof) && (len < sizeof(buffer)))
         {
-            if(0 != bytes2hexstr(key, TA_KEY_BYTES, *passphrase, TA_KEY_BYTES * 2 + 1))
+            /* Derive the collected lines, before waiting for more input */
+            if ((num > 0) && (0 == poll(&pfd, 1, 0)))
+            {
+                ret = derive_batch(dvs, num, key_slot, string_encoding);
+                num = 0;
+                continue;
+            }
+
+            n = read(fd, &buffer[len], sizeof(buffer) - len);
+            if (n < 0)
             {
-                return 1;
+                if (EINTR != errno)
+                {
+                    fprintf(stderr, "ERROR: Reading the input failed\n");
+                    ret = 1;
+                }
             }
+            else if (0 == n)
+            {
+                eof = 1;
+            }
+            else
+            {
+                len += n;
+            }
+            continue;
+        }
+
+        line_number++;
+        if (NULL != newline)
+        {
+            line_len = newline - buffer;
+            consumed = line_len + 1;
         }
         else
         {
-            return 1;
+            line_len = len;
+            consumed = len;
+        }
+        if ((line_len > 0) && ('\r' == buffer[line_len - 1]))
+        {
+            line_len--;
+        }
+
+        /* A full buffer without a line end is too long as well */
+        if ((UTA_LEN_DV_V1 < line_len) || ((NULL == newline) && (0 == eof)))
+        {
+            fprintf(stderr, "ERROR: Derivation string in line %lu must be %d or less characters long\n",
+                    line_number, UTA_LEN_DV_V1);
+            ret = 1;
+            break;
+        }
+
+        memcpy(line, buffer, line_len);
+        line[line_len] = '\0';
+        pad_derivation_string(line, dvs[num]);
+        num++;
+
+        memmove(buffer, &buffer[consumed], len - consumed);
+        len -= consumed;
+
+        if (BATCH_MAX == num)
+        {
+            ret = derive_batch(dvs, num, key_slot, string_encoding);
+            num = 0;
         }
     }
-    else
+
+    if ((0 == ret) && (num > 0))
     {
-       return 1;
+        ret = derive_batch(dvs, num, key_slot, string_encoding);
     }
-    return 0;
+
+    if (0 != close_ta())
+    {
+        ret = 1;
+    }
+
+    return ret;
 }
 
 /**
  * @brief Basic command line interface to retrieve a passphrase from the
- *         HW trust anchor.
+ *         HW trust anchor. With -f, a passphrase is printed for each line of
+ *         the given file or of stdin.
  * @param[in] derivation_string: character string used in passphrase
  *         derivation. Only the first eight characters are considered.
  * @return exit status 0 on success,
@@ -261,14 +522,18 @@ int main(int argc, char *argv[])
    int dflag = 0;
    int eflag = 0;
    int kflag = 0;
+   int fflag = 0;
    char *dval = NULL;
    char *eval = NULL;
    char *kval = NULL;
+   char *fval = NULL;
+   int fd;
+   int ret;
    int key_slot = 0;
    string_encoding_t encoding = BASE64_ENCODING;
    int c;
 
-   while ((c = getopt (argc, argv, "d:e:k:h")) != -1)
+   while ((c = getopt (argc, argv, "d:e:k:f:h")) != -1)
    {
        switch(c)
        {
@@ -284,21 +549,33 @@ int main(int argc, char *argv[])
           kflag = 1;
           kval = optarg;
           break;
+       case 'f':
+          fflag = 1;
+          fval = optarg;
+          break;
        case '?':
        case 'h':
           fprintf(stderr, "### Retrieve passphrase from the UTA trust anchor ### \n\n");
-          fprintf(stderr, "Usage: uta_get_passphrase [-d <derivation_string>] [-e <encoding>] [-k <key_slot>] [-h]\n\n");
+          fprintf(stderr, "Usage: uta_get_passphrase [-d <derivation_string> | -f <file>] [-e <encoding>] [-k <key_slot>] [-h]\n\n");
           fprintf(stderr, "-d <derivation_string>: string used in the computation of passphrase,\n");
           fprintf(stderr, "   maximum length is %d characters; (default value: 'default!')\n", UTA_LEN_DV_V1);
           fprintf(stderr, "-e <encoding>: select encoding of the passphrase from\n");
           fprintf(stderr, "   'base64' and 'hex'; (default: 'base64')\n");
           fprintf(stderr, "-k <key_slot>: select key_slot from 0 and 1;\n");
           fprintf(stderr, "   (default: 1, key_slot containing device specific key)\n");
+          fprintf(stderr, "-f <file>: print a passphrase for each line of the file, which\n");
+          fprintf(stderr, "   contains one derivation string per line; '-' reads from stdin\n");
           fprintf(stderr, "-h This help message\n");
           return 1;
        }
    }
 
+   if((1 == dflag) && (1 == fflag))
+   {
+      fprintf(stderr, "ERROR: Specify either a derivation string or a file\n");
+      return 1;
+   }
+
    if(1 == dflag)
    {
       if (UTA_LEN_DV_V1 < strnlen(dval, UTA_LEN_DV_V1+1))
@@ -307,7 +584,7 @@ int main(int argc, char *argv[])
          return 1;
       }
    }
-   else
+   else if(0 == fflag)
    {
       dval = malloc(9);
       if (NULL == dval)
@@ -359,6 +636,30 @@ int main(int argc, char *argv[])
       key_slot = 1;
    }
 
+   if(1 == fflag)
+   {
+      if (0 == strcmp(fval, "-"))
+      {
+         fd = STDIN_FILENO;
+      }
+      else
+      {
+         fd = open(fval, O_RDONLY);
+         if (fd < 0)
+         {
+            fprintf(stderr, "ERROR: Cannot open the file %s\n", fval);
+            return 1;
+         }
+      }
+
+      ret = get_passphrases_from_stream(fd, key_slot, encoding);
+      if (STDIN_FILENO != fd)
+      {
+         (void)close(fd);
+      }
+      return ret;
+   }
+
    if (0 != get_passphrase_from_ta(&passphrase, dval, key_slot, encoding))
    {
        return 1;
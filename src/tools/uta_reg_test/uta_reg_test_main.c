@@ -18,14 +18,19 @@
  * Includes
  ******************************************************************************/
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <string.h>
 #include <config.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <poll.h>
 
 #include <uta.h>
+#ifdef ENABLE_TEST_HOOKS
+#include <tpm_tcg.h>
+#endif
 #include <mbedtls/md.h>
 
 /*******************************************************************************
@@ -33,12 +38,46 @@
  ******************************************************************************/
 typedef int(*test_case_t)(uta_context_v1_t *uta_context);
 
+/* Result of the scaling test workers of one thread, process or level */
+typedef struct
+{
+    uint64_t ops;
+    uint64_t errors;
+    /* Worst case latency of a single derive_key call */
+    uint64_t max_ns;
+    /* Time from the start of all workers until the last one has finished */
+    uint64_t elapsed_ns;
+} scale_result_t;
+
+/* Arguments of a scaling test thread */
+typedef struct
+{
+    /* Shared context, NULL if the thread opens its own context */
+    uta_context_v1_t *uta_context;
+    pthread_barrier_t *barrier;
+    int index;
+    scale_result_t result;
+} scale_thread_t;
+
+/* Arguments of a bulk random thread of the priority test */
+typedef struct
+{
+    uta_context_v1_t *uta_context;
+    /* Length of the first buffer, the others are derived from it */
+    size_t len_bulk;
+    /* Set, when the request is issued, accessed atomically */
+    int issued;
+    /* Completion time of the request */
+    uint64_t done_ns;
+} priority_thread_t;
+
 /*******************************************************************************
  * Defines
  ******************************************************************************/
 /* Parameters for the derive_key regression test */
 #define KEYLEN           32
 #define DVLEN            8
+#define UUIDLEN          16
 #define NR_VEC           10
 #define USED_KEY_SLOTS   2
 
@@ -53,6 +92,81 @@ typedef int(*test_case_t)(uta_context_v1_t *uta_context);
 #define CHI2_UPPER       25.0295
 #define CHI2_NUM_REPEATS 5
 #define CHI2_N_SAMPLES   128      // Samplesize is 4 bit
+
+/* Parameters for the DRBG random mode regression test */
+#define DRBG_RESEED_BYTES 256      // Force reseeds during the test
+#define DRBG_LEN_BULK     3000     // More than one mbedtls request
+
+/* Parameters for the prefetch random mode regression test */
+#define PREFETCH_LEN_BULK  5000    // More than the default ring
+#define PREFETCH_LEN_PAIR  32
+
+/* Parameters for the vectored random regression test */
+#define RANDOM_V_BUFFERS   7
+#define RANDOM_V_LEN_TOTAL 208     // More than one TPM command
+#define RANDOM_V_GUARD     0xA5
+
+/* Parameters for the HKDF key expansion regression test */
+#define EXPAND_LEN_KEY    40       // More than one HMAC block
+#define EXPAND_LABEL_ENC  "enc"
+#define EXPAND_LABEL_MAC  "mac"
+#define EXPAND_LEN_LABEL  3
+
+/* Parameters for the key cache regression test */
+#define KEY_CACHE_ENTRIES 16
+
+/* Parameters for the fork regression test */
+#define FORK_LEN_RANDOM   32
+
+/* Parameters for the self test result regression test */
+#define SELF_TEST_TIMEOUT_MS 5000
+#define SELF_TEST_POLL_MS    10
+
+/* Parameters for the asynchronous API regression test */
+#define ASYNC_LEN_RANDOM  100      // More than one TPM command
+#define ASYNC_TIMEOUT_MS  5000
+
+/* Parameters for the timeout regression test */
+#define TIMEOUT_LONG_MS   1000     // Never reached by a healthy trust anchor
+#define TIMEOUT_SHORT_MS  20
+
+/* Parameters for the priority scheduling regression test */
+#define PRIORITY_THREADS   3        // One running and two queued requests
+#define PRIORITY_BUFFERS   3
+#define PRIORITY_LEN_BULK  4099     // Many slices, odd buffer sizes
+#define PRIORITY_ZERO_RUN  16       // Never produced by a working RNG
+#define PRIORITY_ROUNDS    10       // Doubles the length until saturated
+#define PRIORITY_SETTLE_US 1000     // Lets the bulk requests enter the queue
+
+/*
+ * Parameters for the pooled context regression test. Several connections
+ * need a resource manager, which may be missing without multiprocessing.
+ * The device list repeats the configured device POOL_DEVICES times.
+ */
+#ifdef MULTIPROCESSING
+#define POOL_CONNECTIONS  4
+#define POOL_DEVICES      2
+#else
+#define POOL_CONNECTIONS  1
+#define POOL_DEVICES      1
+#endif
+
+/*
+ * Default concurrency of the multithreaded runs and of the scaling test.
+ * Without multiprocessing, only the process running the tests is used.
+ */
+#define REG_THREADS       4
+#define REG_MAX_THREADS   256
+#ifdef MULTIPROCESSING
+#define REG_PROCESSES     2
+#else
+#define REG_PROCESSES     1
+#endif
+#define REG_MAX_PROCESSES 64
+
+/* Parameters for the contention scaling test */
+#define SCALE_NUM_VEC     8
+#define SCALE_ITERATIONS  20
    
 /*******************************************************************************
  * Static data declaration
@@ -64,6 +178,18 @@ static uint8_t ref_uuid_set=0;
 static uint8_t print_version=1;
 /* Global declaration of uta struct */
 static uta_api_v1_t uta;
+/* Global declaration of the uta extension struct */
+static uta_api_v1_ext_t uta_ext;
+/* Options of the multithreaded runs and of the scaling test */
+static int num_threads = REG_THREADS;
+static int num_processes = REG_PROCESSES;
+static int scale_iterations = SCALE_ITERATIONS;
+static int scale_private = 0;
+/* Minimum throughput relative to a single worker, 0 to skip the check */
+static double scale_min_ratio = 0;
+/* Known vectors of the scaling test */
+static uint8_t scale_dvs[SCALE_NUM_VEC][DVLEN];
+static uint8_t scale_keys[SCALE_NUM_VEC][USED_KEY_SLOTS][KEYLEN];
 
 /*******************************************************************************
  * Private function prototypes
@@ -71,10 +197,36 @@ static uta_api_v1_t uta;
 static int run_self_test(uta_context_v1_t *uta_context);
 static int test_trng(uta_context_v1_t *uta_context);
 static int test_derive_key(uta_context_v1_t *uta_context);
+static int test_derive_key_batch(uta_context_v1_t *uta_context);
+static int test_get_random_v(uta_context_v1_t *uta_context);
+static int test_random_drbg(uta_context_v1_t *uta_context);
+static int test_random_prefetch(uta_context_v1_t *uta_context);
+static int test_derive_key_expand(uta_context_v1_t *uta_context);
+static int test_async(uta_context_v1_t *uta_context);
+static int test_timeout(uta_context_v1_t *uta_context);
+static int test_priority(uta_context_v1_t *uta_context);
+static void *priority_bulk_thread(void *arg);
+static int test_stats(uta_context_v1_t *uta_context);
+static int test_key_cache(uta_context_v1_t *uta_context);
+static int test_session_cache(uta_context_v1_t *uta_context);
+static int test_session_recovery(uta_context_v1_t *uta_context);
+static int test_fork(uta_context_v1_t *uta_context);
+static int test_self_test_result(uta_context_v1_t *uta_context);
+static int test_get_capabilities(uta_context_v1_t *uta_context);
+static int test_param_encryption(uta_context_v1_t *uta_context);
+static int test_scaling(void);
+static int scale_level(int processes, int threads, scale_result_t *result);
+static int scale_process(int threads, scale_result_t *result);
+static void *scale_thread(void *arg);
+static uint64_t scale_now_ns(void);
+static uta_rc wait_async(uta_context_v1_t *uta_context, int fd);
 static int test_read_uuid(uta_context_v1_t *uta_context);
 static int test_read_version(uta_context_v1_t *uta_context);
 static int read_keys(char **key_files, int num);
 static void print_usage(char *name);
+static int parse_options(int argc, char **argv);
+static int start_threads(pthread_t *threads, void *(*func)(void *), void *arg);
+static int join_threads(pthread_t *threads, int started);
 static void *thread_test_1(void *uta_context);
 static void *thread_test_2();
 
@@ -85,6 +237,13 @@ test_case_t test_cases[] = {\
                                  run_self_test, \
                                  test_trng, \
                                  test_derive_key, \
+                                 test_derive_key_batch, \
+                                 test_get_random_v, \
+                                 test_random_drbg, \
+                                 test_random_prefetch, \
+                                 test_derive_key_expand, \
+                                 test_get_capabilities, \
+                                 test_param_encryption, \
                                  0 };
 
 /*******************************************************************************
@@ -93,8 +252,8 @@ test_case_t test_cases[] = {\
 /**
  * @brief Performs a set of regression tests.
  * @param[in] argc Number of parameters.
- * @param[in] argv List of parameters. argv[1] Can optional provide the key for
- *      key_slot 0 and argv[2] the key for key slot 1.
+ * @param[in] argv List of parameters. The options are followed by optional key
+ *      files, the first one for key slot 0 and the second one for key slot 1.
  * @return Linux return code.
  */
 int main(int argc, char **argv)
@@ -105,16 +264,28 @@ int main(int argc, char **argv)
     uta_rc rc;
     time_t t;
     uta_context_v1_t *uta_context;
+    const char *device_files[POOL_DEVICES];
+    pthread_t threads[REG_MAX_THREADS];
+    int started;
+    int num_keys;
 #ifdef MULTIPROCESSING
-    int cpid;
+    int cpid = 1;
+    int stat;
 #endif
-    if(argc == 1)
+    if(parse_options(argc, argv) != 0)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    num_keys = argc - optind;
+
+    if(num_keys == 0)
     {
         printf("Running regression tests without reference keys. Only the return codes are verified.\n\n");
     }
-    else if(argc == 2)
+    else if(num_keys == 1)
     {
-        ret = read_keys(&argv[1], (argc - 1));
+        ret = read_keys(&argv[optind], num_keys);
         if(ret != 0)
         {
             printf("Error while reading the key from file\n");
@@ -123,9 +294,9 @@ int main(int argc, char **argv)
         }
         printf("Running regression tests with reference key of key slot 0. For key slot 1 only the return codes are verified.\n\n");
     }
-    else if(argc == 3)
+    else if(num_keys == 2)
     {
-        ret = read_keys(&argv[1], (argc - 1));
+        ret = read_keys(&argv[optind], num_keys);
         if(ret != 0)
         {
             printf("Error while reading the keys from files\n");
@@ -153,6 +324,13 @@ int main(int argc, char **argv)
         printf("ERROR during uta_init_v1!\n");
         return 1;
     }
+
+    rc = uta_init_v1_ext(&uta_ext);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta_init_v1_ext!\n");
+        return 1;
+    }
     
     /* Allocate memory for the context */
     uta_context = malloc(uta.context_v1_size());
@@ -186,18 +364,103 @@ int main(int argc, char **argv)
             return 1;
         }
     }
+
+    /*
+     * Only one asynchronous operation can be pending per context, so this
+     * test is not part of the multithreaded runs on a shared context
+     */
+    rc = uta.open(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta.open!\n");
+        return 1;
+    }
+
+    ret = test_async(uta_context);
+    if(ret != 0)
+    {
+        success = 0;
+    }
+
+    /* Holds the only connection of the context for a while */
+    ret = test_timeout(uta_context);
+    if(ret != 0)
+    {
+        success = 0;
+    }
+
+    /* Key derivations overtake bulk random requests on the same context */
+    ret = test_priority(uta_context);
+    if(ret != 0)
+    {
+        success = 0;
+    }
+
+    /* The counters are only exact without other threads on the context */
+    ret = test_stats(uta_context);
+    if(ret != 0)
+    {
+        success = 0;
+    }
+
+    ret = test_key_cache(uta_context);
+    if(ret != 0)
+    {
+        success = 0;
+    }
+
+    /* Expects the initial result of the open above */
+    ret = test_self_test_result(uta_context);
+    if(ret != 0)
+    {
+        success = 0;
+    }
+
+    /* Closes and reopens the context */
+    ret = test_session_cache(uta_context);
+    if(ret != 0)
+    {
+        success = 0;
+    }
+
+    ret = test_session_recovery(uta_context);
+    if(ret != 0)
+    {
+        success = 0;
+    }
+
+    /* A child uses and closes the context, which stays open in the parent */
+    ret = test_fork(uta_context);
+    if(ret != 0)
+    {
+        success = 0;
+    }
+
+    rc = uta.close(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta.close!\n");
+        return 1;
+    }
+
 #ifdef MULTIPROCESSING
     printf("\nFork the process and start multiple threads\n");
-    /* Fork the program here */
-    cpid = fork();
+    (void)fflush(stdout);
+    /* Fork the program here, the children do not fork again */
+    for (i = 1; (cpid > 0) && (i < num_processes); i++)
+    {
+        cpid = fork();
+        if (cpid < 0)
+        {
+            printf("ERROR during fork!\n");
+            success = 0;
+        }
+    }
 #else
     printf("\nStart multiple threads with the same context\n");
 #endif
 
     /* Start multiple threads and give them the same context */
-    pthread_t tr1, tr2, tr3, tr4;
-    int tr1_ret, tr2_ret, tr3_ret, tr4_ret;
-    
     rc = uta.open(uta_context);
     if (rc != UTA_SUCCESS)
     {
@@ -205,17 +468,9 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    pthread_create(&tr1, NULL, thread_test_1, (void*)uta_context);
-    pthread_create(&tr2, NULL, thread_test_1, (void*)uta_context);
-    pthread_create(&tr3, NULL, thread_test_1, (void*)uta_context);
-    pthread_create(&tr4, NULL, thread_test_1, (void*)uta_context);
+    started = start_threads(threads, thread_test_1, (void*)uta_context);
     
-    pthread_join(tr1, (void*)&tr1_ret);
-    pthread_join(tr2, (void*)&tr2_ret);
-    pthread_join(tr3, (void*)&tr3_ret);
-    pthread_join(tr4, (void*)&tr4_ret);
-    
-    if((tr1_ret != 0)||(tr2_ret != 0)||(tr3_ret != 0)||(tr4_ret != 0))
+    if(join_threads(threads, started) != 0)
     {
         success = 0;
     }
@@ -227,22 +482,104 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    /* A pool without connections must be rejected */
+    rc = uta_ext.open_pool(uta_context, 0);
+    if (rc != UTA_NOT_SUPPORTED)
+    {
+        printf("uta_ext.open_pool with 0 connections did not fail\n");
+        success = 0;
+        if (rc == UTA_SUCCESS)
+        {
+            (void)uta.close(uta_context);
+        }
+    }
+
+    /*
+     * Repeat the threads on a pooled context, while an asynchronous operation
+     * runs next to them on the same context
+     */
+    rc = uta_ext.open_pool(uta_context, POOL_CONNECTIONS);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta_ext.open_pool!\n");
+        return 1;
+    }
+
+    started = start_threads(threads, thread_test_1, (void*)uta_context);
+
+    ret = test_async(uta_context);
+    if(ret != 0)
+    {
+        success = 0;
+    }
+
+    if(join_threads(threads, started) != 0)
+    {
+        success = 0;
+    }
+
+    rc = uta.close(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta.close!\n");
+        return 1;
+    }
+
+    for (i = 0; i < POOL_DEVICES; i++)
+    {
+        device_files[i] = CONFIGURED_TPM_DEVICE;
+    }
+
+    /* A context without devices must be rejected */
+    rc = uta_ext.open_devices(uta_context, device_files, 0, 1);
+    if (rc != UTA_NOT_SUPPORTED)
+    {
+        printf("uta_ext.open_devices with 0 devices did not fail\n");
+        success = 0;
+        if (rc == UTA_SUCCESS)
+        {
+            (void)uta.close(uta_context);
+        }
+    }
+
+    /* Repeat the threads on a context, which spreads them over the devices */
+    rc = uta_ext.open_devices(uta_context, device_files, POOL_DEVICES,
+        POOL_CONNECTIONS / POOL_DEVICES);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta_ext.open_devices!\n");
+        return 1;
+    }
+
+    started = start_threads(threads, thread_test_1, (void*)uta_context);
+
+    if(join_threads(threads, started) != 0)
+    {
+        success = 0;
+    }
+
+    rc = uta.self_test(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta.self_test on all devices!\n");
+        success = 0;
+    }
+
+    rc = uta.close(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta.close!\n");
+        return 1;
+    }
+
     free(uta_context);
 
 #ifdef MULTIPROCESSING
 
     /* Start multiple threads and they handle the context themself */
-    pthread_create(&tr1, NULL, thread_test_2, NULL);
-    pthread_create(&tr2, NULL, thread_test_2, NULL);
-    pthread_create(&tr3, NULL, thread_test_2, NULL);
-    pthread_create(&tr4, NULL, thread_test_2, NULL);
+    started = start_threads(threads, thread_test_2, NULL);
     
-    pthread_join(tr1, (void*)&tr1_ret);
-    pthread_join(tr2, (void*)&tr2_ret);
-    pthread_join(tr3, (void*)&tr3_ret);
-    pthread_join(tr4, (void*)&tr4_ret);
-    
-    if((tr1_ret != 0)||(tr2_ret != 0)||(tr3_ret != 0)||(tr4_ret != 0))
+    if(join_threads(threads, started) != 0)
     {
         success = 0;
     }
@@ -258,16 +595,24 @@ int main(int argc, char **argv)
         exit(1);
     }
     
-    /* Wait for the termination of the child process and grep exit code */
-    int stat;
-    wait(&stat);
-    
-    if (WEXITSTATUS(stat) != 0)
+    /* Wait for the termination of the child processes and grep exit codes */
+    while (wait(&stat) > 0)
     {
-        success = 0;
+        if (!WIFEXITED(stat) || (WEXITSTATUS(stat) != 0))
+        {
+            success = 0;
+        }
     }
 
 #endif
+
+    /* Measure the contention in the parent only, after all other tests */
+    printf("\nMeasure the contention with an increasing number of workers\n");
+    ret = test_scaling();
+    if(ret != 0)
+    {
+        success = 0;
+    }
     
     if(success != 0)
     {
@@ -289,94 +634,1965 @@ int main(int argc, char **argv)
  */
 static void print_usage(char *name)
 {
-    printf("Usage: %s <key file for key slot 0> <key file for key slot 1>\n",name);
+    printf("Usage: %s [-t <threads>] [-p <processes>] [-n <iterations>] "
+           "[-s shared|private] [-r <ratio>] "
+           "[<key file for key slot 0> [<key file for key slot 1>]]\n",name);
+    printf("  -t  Threads per process of the multithreaded runs and the "
+           "highest level of the scaling test (default %d)\n", REG_THREADS);
+    printf("  -p  Processes of the multithreaded runs and the scaling test "
+           "(default %d)\n", REG_PROCESSES);
+    printf("  -n  derive_key calls per thread of the scaling test, 0 skips "
+           "the test (default %d)\n", SCALE_ITERATIONS);
+    printf("  -s  Threads of the scaling test share one context per process "
+           "or open their own (default shared)\n");
+    printf("  -r  Minimum throughput of each level relative to a single "
+           "worker, e.g. 0.8 (default 0, not checked)\n");
 }
 
 /**
- * @brief Runs the self test of the underlying trust anchor and reports the
- *      result.
- * 
- * @param[in,out] uta_context Pointer to the uta_context struct.
- *
- * @return In case of success the function returns 0, 1 otherwise. 
+ * @brief Parses the options of the multithreaded runs and of the scaling
+ *      test. The key files follow the options.
+ * @param[in] argc Number of parameters.
+ * @param[in] argv List of parameters.
+ * @return 0 on success, 1 if an option is invalid.
  */
-#pragma GCC diagnostic ignored "-Wunused-function"
-static int run_self_test(uta_context_v1_t *uta_context)
+static int parse_options(int argc, char **argv)
 {
-    uta_rc rc;
-    
-    printf("Executing %s\n",__FUNCTION__);
+    char *end;
+    int c;
 
-    // function call to be evaluated
-    rc = uta.self_test(uta_context);
-    if (rc != UTA_SUCCESS)
+    while ((c = getopt(argc, argv, "t:p:n:s:r:h")) != -1)
     {
-        printf("uta.self_test() returned error code %x\n",
-        (unsigned int)rc);
-        return 1;
+        switch (c)
+        {
+        case 't':
+            num_threads = (int)strtol(optarg, &end, 10);
+            if ((*end != '\0') || (num_threads < 1) ||
+                (num_threads > REG_MAX_THREADS))
+            {
+                printf("Error: Specify 1 to %d threads\n", REG_MAX_THREADS);
+                return 1;
+            }
+            break;
+        case 'p':
+            num_processes = (int)strtol(optarg, &end, 10);
+#ifdef MULTIPROCESSING
+            if ((*end != '\0') || (num_processes < 1) ||
+                (num_processes > REG_MAX_PROCESSES))
+            {
+                printf("Error: Specify 1 to %d processes\n", REG_MAX_PROCESSES);
+                return 1;
+            }
+#else
+            if ((*end != '\0') || (num_processes != 1))
+            {
+                printf("Error: Multiprocessing has been disabled during configure\n");
+                return 1;
+            }
+#endif
+            break;
+        case 'n':
+            scale_iterations = (int)strtol(optarg, &end, 10);
+            if ((*end != '\0') || (scale_iterations < 0))
+            {
+                printf("Error: Invalid number of iterations '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "shared") == 0)
+            {
+                scale_private = 0;
+            }
+            else if (strcmp(optarg, "private") == 0)
+            {
+                scale_private = 1;
+            }
+            else
+            {
+                printf("Error: Specify either 'shared' or 'private' contexts\n");
+                return 1;
+            }
+            break;
+        case 'r':
+            scale_min_ratio = strtod(optarg, &end);
+            if ((*end != '\0') || (scale_min_ratio < 0))
+            {
+                printf("Error: Invalid scaling threshold '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
     }
+
     return 0;
 }
 
 /**
- * @brief Test the RNG using a chi-squared test.
- *
- * NOTE: This statistical test is designed to find critical errors, such as
- * implementation errors. If the test passes, it does NOT automatically mean
- * that the random numbers have a high quality! Please refer to the NIST for
- * details about testing random number generators.
- * 
- * @param[in,out] uta_context Pointer to the uta_context struct.
- *
- * @return In case of success the function returns 0, 1 otherwise. 
+ * @brief Starts num_threads threads.
+ * @param[out] threads Thread handles.
+ * @param[in] func Thread function.
+ * @param[in] arg Argument of each thread.
+ * @return Number of started threads.
  */
-#pragma GCC diagnostic ignored "-Wunused-function"
-static int test_trng(uta_context_v1_t *uta_context)
+static int start_threads(pthread_t *threads, void *(*func)(void *), void *arg)
 {
-    uint8_t random_bytes[CHI2_N_SAMPLES/2];
-    uint8_t random_value; // 4 bit random value
-    uint8_t histogram[16];
-    double chisquared=0;
     int i;
-    int j;
-    uta_rc rc;
-    
-    printf("Executing %s\n",__FUNCTION__);
 
-    for(j=0; j<CHI2_NUM_REPEATS; j++){
-        /* Set histogram values and chisquared value to zero */
-        chisquared = 0;
-        for(i=0; i<16; i++){
-            histogram[i] = 0;
+    for (i = 0; i < num_threads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, func, arg) != 0)
+        {
+            printf("ERROR during pthread_create!\n");
+            break;
         }
+    }
 
-        /* Fill the buffer with random values */
-	    rc = uta.get_random(uta_context, random_bytes, CHI2_N_SAMPLES/2);
-	    if (rc != UTA_SUCCESS)
-	    {
-	    	printf("uta.get_random failed\n");
-		    return 1;
-	    }
+    return i;
+}
 
-        /* Calculate the chi-squared value of the buffer */
-        for (i=0; i<(CHI2_N_SAMPLES/2); i++){
-            /* extract the 4 lower bits */
-            random_value = random_bytes[i] & 0x0F;
+/**
+ * @brief Waits for the threads started with start_threads.
+ * @param[in] threads Thread handles.
+ * @param[in] started Number of started threads.
+ * @return 0 if all num_threads threads have succeeded, 1 otherwise.
+ */
+static int join_threads(pthread_t *threads, int started)
+{
+    void *thread_ret;
+    int ret = (started == num_threads) ? 0 : 1;
+    int i;
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], &thread_ret);
+        if (thread_ret != (void *)0)
+        {
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Measures the throughput and the worst case latency of derive_key
+ * with an increasing number of concurrent workers.
+ *
+ * The first level runs a single thread in a single process. Then every
+ * process runs 1, 2, 4, ... up to the number of threads given with -t. The
+ * threads of a process share one context or open a private context each.
+ * Every derived key is compared to a known vector, which is calculated in
+ * software if reference keys are provided and by a single derive_key call
+ * otherwise. The test fails on any wrong or failed derivation and, if a
+ * threshold is given with -r, if the aggregate throughput of a level falls
+ * below this share of the throughput of the single worker.
+ *
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+static int test_scaling(void)
+{
+    const mbedtls_md_info_t *sha256_hmac;
+    uta_context_v1_t *uta_context;
+    scale_result_t result;
+    double base_throughput = 0;
+    double throughput;
+    int processes = 1;
+    int threads = 1;
+    int ret = 0;
+    uta_rc rc;
+    int i;
+    int j;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    if (scale_iterations == 0)
+    {
+        return 0;
+    }
+
+    /* Calculate the known vectors */
+    sha256_hmac = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    uta_context = malloc(uta.context_v1_size());
+    if (uta_context == NULL)
+    {
+        printf("Failed to allocate memory!\n");
+        return 1;
+    }
+    rc = uta.open(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta.open!\n");
+        free(uta_context);
+        return 1;
+    }
+    for (i = 0; (rc == UTA_SUCCESS) && (i < SCALE_NUM_VEC); i++)
+    {
+        for (j = 0; j < DVLEN; j++)
+        {
+            scale_dvs[i][j] = (uint8_t)(rand() % 256);
+        }
+        for (j = 0; (rc == UTA_SUCCESS) && (j < USED_KEY_SLOTS); j++)
+        {
+            if (key_slots[j] != NULL)
+            {
+                (void)mbedtls_md_hmac(sha256_hmac, key_slots[j], KEYLEN,
+                    scale_dvs[i], DVLEN, scale_keys[i][j]);
+            }
+            else
+            {
+                rc = uta.derive_key(uta_context, scale_keys[i][j], KEYLEN,
+                    scale_dvs[i], UTA_LEN_DV_V1, j);
+            }
+        }
+    }
+    (void)uta.close(uta_context);
+    free(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.derive_key of the known vectors failed\n");
+        return 1;
+    }
+
+    printf("%9s %7s %10s %6s %12s %14s %6s\n", "processes", "threads",
+        "calls", "errors", "calls/s", "max latency ms", "ratio");
+
+    for (;;)
+    {
+        if (scale_level(processes, threads, &result) != 0)
+        {
+            printf("Workers of %d process(es) with %d thread(s) failed\n",
+                processes, threads);
+            return 1;
+        }
+
+        throughput = (result.elapsed_ns > 0) ?
+            ((double)result.ops * 1e9 / (double)result.elapsed_ns) : 0;
+        if (base_throughput == 0)
+        {
+            base_throughput = throughput;
+        }
+
+        printf("%9d %7d %10llu %6llu %12.1f %14.3f %6.2f\n", processes,
+            threads, (unsigned long long)result.ops,
+            (unsigned long long)result.errors, throughput,
+            (double)result.max_ns / 1e6,
+            (base_throughput > 0) ? (throughput / base_throughput) : 0);
+
+        if (result.errors != 0)
+        {
+            printf("Derivations under load failed or differ from the known vectors\n");
+            ret = 1;
+        }
+        if ((scale_min_ratio > 0) &&
+            (throughput < (scale_min_ratio * base_throughput)))
+        {
+            printf("Throughput fell below %.2f of a single worker\n",
+                scale_min_ratio);
+            ret = 1;
+        }
+
+        /* The next level, the single worker is only measured once */
+        if ((processes == 1) && (threads == 1) && (num_processes > 1))
+        {
+            processes = num_processes;
+        }
+        else if (threads < num_threads)
+        {
+            threads = ((threads * 2) < num_threads) ? (threads * 2) :
+                num_threads;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Runs the scaling test workers in the given number of processes. The
+ *      results of the child processes are passed to the parent over pipes.
+ * @param[in] processes Number of processes.
+ * @param[in] threads Number of threads per process.
+ * @param[out] result Merged result of all processes. The elapsed time is the
+ *      longest of all processes.
+ * @return 0 on success, 1 if a process could not be run.
+ */
+static int scale_level(int processes, int threads, scale_result_t *result)
+{
+    scale_result_t child_result;
+    pid_t pids[REG_MAX_PROCESSES];
+    int fds[REG_MAX_PROCESSES];
+    int pipefd[2];
+    int forked;
+    int stat;
+    int ret = 0;
+    int i;
+
+    if (processes == 1)
+    {
+        return scale_process(threads, result);
+    }
+
+    /* Do not duplicate buffered output in the children */
+    (void)fflush(stdout);
+
+    for (forked = 0; forked < processes; forked++)
+    {
+        if (pipe(pipefd) != 0)
+        {
+            ret = 1;
+            break;
+        }
+
+        pids[forked] = fork();
+        if (pids[forked] < 0)
+        {
+            (void)close(pipefd[0]);
+            (void)close(pipefd[1]);
+            ret = 1;
+            break;
+        }
+
+        if (pids[forked] == 0)
+        {
+            /* Worker process, the result fits into one atomic pipe write */
+            (void)close(pipefd[0]);
+            if ((scale_process(threads, &child_result) != 0) ||
+                (write(pipefd[1], &child_result, sizeof(child_result)) !=
+                 sizeof(child_result)))
+            {
+                exit(1);
+            }
+            exit(0);
+        }
+
+        (void)close(pipefd[1]);
+        fds[forked] = pipefd[0];
+    }
+
+    memset(result, 0, sizeof(*result));
+    for (i = 0; i < forked; i++)
+    {
+        if (read(fds[i], &child_result, sizeof(child_result)) ==
+            sizeof(child_result))
+        {
+            result->ops += child_result.ops;
+            result->errors += child_result.errors;
+            if (child_result.max_ns > result->max_ns)
+            {
+                result->max_ns = child_result.max_ns;
+            }
+            if (child_result.elapsed_ns > result->elapsed_ns)
+            {
+                result->elapsed_ns = child_result.elapsed_ns;
+            }
+        }
+        else
+        {
+            ret = 1;
+        }
+        (void)close(fds[i]);
+
+        if ((waitpid(pids[i], &stat, 0) < 0) || !WIFEXITED(stat) ||
+            (WEXITSTATUS(stat) != 0))
+        {
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Runs the scaling test threads of one process. The time is measured
+ *      from the moment all threads have opened their contexts.
+ * @param[in] threads Number of threads.
+ * @param[out] result Merged result of all threads.
+ * @return 0 on success, 1 if the shared context could not be opened.
+ */
+static int scale_process(int threads, scale_result_t *result)
+{
+    static scale_thread_t args[REG_MAX_THREADS];
+    pthread_t tids[REG_MAX_THREADS];
+    pthread_barrier_t barrier;
+    uta_context_v1_t *shared = NULL;
+    uint64_t start;
+    int i;
+
+    memset(result, 0, sizeof(*result));
+
+    if (scale_private == 0)
+    {
+        shared = malloc(uta.context_v1_size());
+        if (shared == NULL)
+        {
+            return 1;
+        }
+        if (uta.open(shared) != UTA_SUCCESS)
+        {
+            printf("ERROR during uta.open!\n");
+            free(shared);
+            return 1;
+        }
+    }
+
+    /* The threads and this thread start the measurement together */
+    (void)pthread_barrier_init(&barrier, NULL, threads + 1);
+    for (i = 0; i < threads; i++)
+    {
+        memset(&args[i], 0, sizeof(args[i]));
+        args[i].uta_context = shared;
+        args[i].barrier = &barrier;
+        args[i].index = i;
+        if (pthread_create(&tids[i], NULL, scale_thread, &args[i]) != 0)
+        {
+            /* The started threads would wait for it forever */
+            printf("ERROR during pthread_create!\n");
+            exit(1);
+        }
+    }
+
+    (void)pthread_barrier_wait(&barrier);
+    start = scale_now_ns();
+
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+        result->ops += args[i].result.ops;
+        result->errors += args[i].result.errors;
+        if (args[i].result.max_ns > result->max_ns)
+        {
+            result->max_ns = args[i].result.max_ns;
+        }
+    }
+    result->elapsed_ns = scale_now_ns() - start;
+
+    (void)pthread_barrier_destroy(&barrier);
+
+    if (shared != NULL)
+    {
+        (void)uta.close(shared);
+        free(shared);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Thread of the scaling test. It derives the known vectors in turn,
+ *      starting at its own index, and compares the keys. With private
+ *      contexts, the thread opens its own context before the measurement.
+ * @param[in,out] arg Pointer to the scale_thread_t of the thread.
+ * @return Always NULL, the result is written to the scale_thread_t.
+ */
+static void *scale_thread(void *arg)
+{
+    scale_thread_t *thread = (scale_thread_t *)arg;
+    uta_context_v1_t *uta_context = thread->uta_context;
+    uint8_t key[KEYLEN];
+    uint64_t start;
+    uint64_t ns;
+    uta_rc rc;
+    int slot;
+    int vec;
+    int i;
+
+    if (scale_private != 0)
+    {
+        uta_context = malloc(uta.context_v1_size());
+        if ((uta_context != NULL) && (uta.open(uta_context) != UTA_SUCCESS))
+        {
+            free(uta_context);
+            uta_context = NULL;
+        }
+        if (uta_context == NULL)
+        {
+            thread->result.errors++;
+        }
+    }
+
+    (void)pthread_barrier_wait(thread->barrier);
+
+    for (i = 0; (uta_context != NULL) && (i < scale_iterations); i++)
+    {
+        vec = (i + thread->index) % SCALE_NUM_VEC;
+        slot = ((i + thread->index) / SCALE_NUM_VEC) % USED_KEY_SLOTS;
+
+        start = scale_now_ns();
+        rc = uta.derive_key(uta_context, key, KEYLEN, scale_dvs[vec],
+            UTA_LEN_DV_V1, slot);
+        ns = scale_now_ns() - start;
+
+        thread->result.ops++;
+        if (ns > thread->result.max_ns)
+        {
+            thread->result.max_ns = ns;
+        }
+        if ((rc != UTA_SUCCESS) ||
+            (memcmp(key, scale_keys[vec][slot], KEYLEN) != 0))
+        {
+            thread->result.errors++;
+        }
+    }
+
+    if ((scale_private != 0) && (uta_context != NULL))
+    {
+        (void)uta.close(uta_context);
+        free(uta_context);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Returns the time of the monotonic clock.
+ * @return Nanoseconds since an unspecified starting point.
+ */
+static uint64_t scale_now_ns(void)
+{
+    struct timespec now;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * 1000000000u) + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Runs the self test of the underlying trust anchor and reports the
+ *      result.
+ * 
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ *
+ * @return In case of success the function returns 0, 1 otherwise. 
+ */
+#pragma GCC diagnostic ignored "-Wunused-function"
+static int run_self_test(uta_context_v1_t *uta_context)
+{
+    uta_rc rc;
+    
+    printf("Executing %s\n",__FUNCTION__);
+
+    // function call to be evaluated
+    rc = uta.self_test(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.self_test() returned error code %x\n",
+        (unsigned int)rc);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Test the RNG using a chi-squared test.
+ *
+ * NOTE: This statistical test is designed to find critical errors, such as
+ * implementation errors. If the test passes, it does NOT automatically mean
+ * that the random numbers have a high quality! Please refer to the NIST for
+ * details about testing random number generators.
+ * 
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ *
+ * @return In case of success the function returns 0, 1 otherwise. 
+ */
+#pragma GCC diagnostic ignored "-Wunused-function"
+static int test_trng(uta_context_v1_t *uta_context)
+{
+    uint8_t random_bytes[CHI2_N_SAMPLES/2];
+    uint8_t random_value; // 4 bit random value
+    uint8_t histogram[16];
+    double chisquared=0;
+    int i;
+    int j;
+    uta_rc rc;
+    
+    printf("Executing %s\n",__FUNCTION__);
+
+    for(j=0; j<CHI2_NUM_REPEATS; j++){
+        /* Set histogram values and chisquared value to zero */
+        chisquared = 0;
+        for(i=0; i<16; i++){
+            histogram[i] = 0;
+        }
+
+        /* Fill the buffer with random values */
+	    rc = uta.get_random(uta_context, random_bytes, CHI2_N_SAMPLES/2);
+	    if (rc != UTA_SUCCESS)
+	    {
+	    	printf("uta.get_random failed\n");
+		    return 1;
+	    }
+
+        /* Calculate the chi-squared value of the buffer */
+        for (i=0; i<(CHI2_N_SAMPLES/2); i++){
+            /* extract the 4 lower bits */
+            random_value = random_bytes[i] & 0x0F;
             histogram[random_value]++;
             /* extract the 4 higher bits */
             random_value = random_bytes[i] >> 4;
             histogram[random_value]++;
         }
-        for (i=0; i<16; i++){
-            chisquared += (histogram[i]-CHI2_N_SAMPLES/16.0)*(histogram[i]-CHI2_N_SAMPLES/16.0)/(CHI2_N_SAMPLES/16.0);
+        for (i=0; i<16; i++){
+            chisquared += (histogram[i]-CHI2_N_SAMPLES/16.0)*(histogram[i]-CHI2_N_SAMPLES/16.0)/(CHI2_N_SAMPLES/16.0);
+        }
+
+        /* Compare the calculated value with the lower and upper limits */
+        if ((chisquared > CHI2_LOWER) && (chisquared < CHI2_UPPER)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Test the vectored get_random_v command.
+ *
+ * Buffers of different sizes, including an empty one, are filled in one call.
+ * The bytes between the buffers must stay untouched and the larger buffers
+ * must not be left zero.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+#pragma GCC diagnostic ignored "-Wunused-function"
+static int test_get_random_v(uta_context_v1_t *uta_context)
+{
+    static const size_t lengths[RANDOM_V_BUFFERS] = {1, 0, 7, 33, 100, 64, 3};
+    uint8_t random_bytes[RANDOM_V_LEN_TOTAL + RANDOM_V_BUFFERS];
+    uta_random_buffer_v1_t buffers[RANDOM_V_BUFFERS];
+    uint8_t zero[RANDOM_V_LEN_TOTAL];
+    size_t used = 0;
+    uta_rc rc;
+    int i;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    /* Each buffer is followed by a guard byte */
+    memset(random_bytes, RANDOM_V_GUARD, sizeof(random_bytes));
+    memset(zero, 0, sizeof(zero));
+    for(i=0; i<RANDOM_V_BUFFERS; i++)
+    {
+        buffers[i].random = &random_bytes[used];
+        buffers[i].len_random = lengths[i];
+        memset(buffers[i].random, 0, lengths[i]);
+        used += lengths[i] + 1;
+    }
+
+    rc = uta_ext.get_random_v(uta_context, buffers, RANDOM_V_BUFFERS);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.get_random_v failed\n");
+        return 1;
+    }
+
+    for(i=0; i<RANDOM_V_BUFFERS; i++)
+    {
+        if (buffers[i].random[lengths[i]] != RANDOM_V_GUARD)
+        {
+            printf("uta_ext.get_random_v wrote behind buffer %d\n", i);
+            return 1;
+        }
+        if ((lengths[i] >= 7) &&
+            (memcmp(buffers[i].random, zero, lengths[i]) == 0))
+        {
+            printf("uta_ext.get_random_v did not fill buffer %d\n", i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Test the get_random command in the DRBG random mode.
+ *
+ * The statistical test of test_trng is repeated on the DRBG output, with a
+ * reseed limit which is reached multiple times during the test. Afterwards a
+ * bulk request is made and the context is switched back to the trust anchor
+ * random mode. If the library is built without DRBG support, only the return
+ * code of set_random_mode is checked.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+#pragma GCC diagnostic ignored "-Wunused-function"
+static int test_random_drbg(uta_context_v1_t *uta_context)
+{
+    uint8_t random_bytes[DRBG_LEN_BULK];
+    uta_random_config_v1_t config = {UTA_RANDOM_DRBG, DRBG_RESEED_BYTES, 0};
+    uta_rc rc;
+    int ret;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    rc = uta_ext.set_random_mode(uta_context, &config);
+    if (rc == UTA_NOT_SUPPORTED)
+    {
+        return 0;
+    }
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.set_random_mode failed\n");
+        return 1;
+    }
+
+    ret = test_trng(uta_context);
+    if (ret != 0)
+    {
+        printf("Statistical test of the DRBG output failed\n");
+        return 1;
+    }
+
+    rc = uta.get_random(uta_context, random_bytes, DRBG_LEN_BULK);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.get_random in DRBG mode failed\n");
+        return 1;
+    }
+
+    config.mode = UTA_RANDOM_TA;
+    rc = uta_ext.set_random_mode(uta_context, &config);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.set_random_mode failed\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Test the get_random command in the prefetch random mode.
+ *
+ * The statistical test of test_trng is repeated on the prefetched bytes. A
+ * bulk request, which is larger than the ring, has to be completed from the
+ * trust anchor, and two following requests must not return the same bytes.
+ * Afterwards the context is switched back to the trust anchor random mode.
+ * If the backend has no prefetch mode, only the return code of
+ * set_random_mode is checked.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+static int test_random_prefetch(uta_context_v1_t *uta_context)
+{
+    uint8_t random_bytes[PREFETCH_LEN_BULK];
+    uint8_t first[PREFETCH_LEN_PAIR];
+    uint8_t second[PREFETCH_LEN_PAIR];
+    uta_random_config_v1_t config = {UTA_RANDOM_PREFETCH, 0, 0};
+    uta_rc rc;
+    int ret;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    rc = uta_ext.set_random_mode(uta_context, &config);
+    if (rc == UTA_NOT_SUPPORTED)
+    {
+        return 0;
+    }
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.set_random_mode failed\n");
+        return 1;
+    }
+
+    ret = test_trng(uta_context);
+    if (ret != 0)
+    {
+        printf("Statistical test of the prefetched random numbers failed\n");
+        return 1;
+    }
+
+    rc = uta.get_random(uta_context, random_bytes, PREFETCH_LEN_BULK);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.get_random in prefetch mode failed\n");
+        return 1;
+    }
+
+    rc = uta.get_random(uta_context, first, PREFETCH_LEN_PAIR);
+    if (rc == UTA_SUCCESS)
+    {
+        rc = uta.get_random(uta_context, second, PREFETCH_LEN_PAIR);
+    }
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.get_random in prefetch mode failed\n");
+        return 1;
+    }
+    if (memcmp(first, second, PREFETCH_LEN_PAIR) == 0)
+    {
+        printf("Prefetched random numbers were handed out twice\n");
+        return 1;
+    }
+
+    config.mode = UTA_RANDOM_TA;
+    rc = uta_ext.set_random_mode(uta_context, &config);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.set_random_mode failed\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Test the HKDF key expansion.
+ *
+ * The pseudorandom key is read with derive_key and the expansion is
+ * calculated in software with the HMAC-SHA256 of mbedtls. Two labels have to
+ * give different subkeys and an invalid key length has to be rejected. The
+ * test is skipped, if the library was built without --enable-hkdf.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+#pragma GCC diagnostic ignored "-Wunused-function"
+static int test_derive_key_expand(uta_context_v1_t *uta_context)
+{
+    int j;
+    uta_rc rc;
+    uint8_t deriv_value[DVLEN];
+    uint8_t prk[KEYLEN];
+    uint8_t enc_key[EXPAND_LEN_KEY];
+    uint8_t mac_key[KEYLEN];
+    unsigned char ref_input[KEYLEN+EXPAND_LEN_LABEL+1];
+    unsigned char ref_output[2*KEYLEN];
+    uta_expand_request_v1_t requests[2] = {
+        {enc_key, EXPAND_LEN_KEY, (const uint8_t *)EXPAND_LABEL_ENC,
+            EXPAND_LEN_LABEL},
+        {mac_key, KEYLEN, (const uint8_t *)EXPAND_LABEL_MAC, EXPAND_LEN_LABEL}
+    };
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    const mbedtls_md_info_t *sha256_hmac = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+
+    // Get a random derivation value
+    for(j=0; j<DVLEN; j++)
+    {
+        deriv_value[j] = (uint8_t)(rand() % 256);
+    }
+
+    rc = uta_ext.derive_key_expand(uta_context, requests, 2, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if (rc == UTA_NOT_SUPPORTED)
+    {
+        return 0;
+    }
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.derive_key_expand failed\n");
+        return 1;
+    }
+
+    rc = uta.derive_key(uta_context, prk, KEYLEN, deriv_value, UTA_LEN_DV_V1,
+        0);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.derive_key using key slot 0 failed\n");
+        return 1;
+    }
+
+    /* T(1) = HMAC(PRK, info | 0x01), T(2) = HMAC(PRK, T(1) | info | 0x02) */
+    memcpy(ref_input, EXPAND_LABEL_ENC, EXPAND_LEN_LABEL);
+    ref_input[EXPAND_LEN_LABEL] = 1;
+    (void)mbedtls_md_hmac(sha256_hmac, prk, KEYLEN, ref_input,
+        EXPAND_LEN_LABEL+1, ref_output);
+    memcpy(ref_input, ref_output, KEYLEN);
+    memcpy(ref_input+KEYLEN, EXPAND_LABEL_ENC, EXPAND_LEN_LABEL);
+    ref_input[KEYLEN+EXPAND_LEN_LABEL] = 2;
+    (void)mbedtls_md_hmac(sha256_hmac, prk, KEYLEN, ref_input,
+        KEYLEN+EXPAND_LEN_LABEL+1, ref_output+KEYLEN);
+
+    if (memcmp(enc_key, ref_output, EXPAND_LEN_KEY) != 0)
+    {
+        printf("Wrong HKDF key expansion\n");
+        return 1;
+    }
+
+    if (memcmp(enc_key, mac_key, KEYLEN) == 0)
+    {
+        printf("Different labels gave the same subkey\n");
+        return 1;
+    }
+
+    requests[1].len_key = 0;
+    rc = uta_ext.derive_key_expand(uta_context, requests, 2, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if (rc != UTA_INVALID_KEY_LENGTH)
+    {
+        printf("uta_ext.derive_key_expand accepted an invalid key length\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Test the asynchronous derive_key and get_random calls.
+ *
+ * The derived key is compared to a synchronous derivation. The random request
+ * needs several TPM commands, which are continued by complete. A second
+ * submission while an operation is pending has to be rejected.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+#pragma GCC diagnostic ignored "-Wunused-function"
+static int test_async(uta_context_v1_t *uta_context)
+{
+    uint8_t deriv_value[DVLEN];
+    uint8_t async_output[KEYLEN];
+    uint8_t sync_output[KEYLEN];
+    uint8_t random_bytes[ASYNC_LEN_RANDOM];
+    uta_rc rc;
+    int fd;
+    int i;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    rc = uta_ext.get_poll_fd(uta_context, &fd);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.get_poll_fd failed\n");
+        return 1;
+    }
+
+    for(i=0; i<DVLEN; i++)
+    {
+        deriv_value[i] = (uint8_t)(rand() % 256);
+    }
+
+    rc = uta_ext.derive_key_submit(uta_context, async_output, KEYLEN,
+        deriv_value, UTA_LEN_DV_V1, 0);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.derive_key_submit failed\n");
+        return 1;
+    }
+
+    rc = uta_ext.get_random_submit(uta_context, random_bytes,
+        ASYNC_LEN_RANDOM);
+    if (rc != UTA_TRY_AGAIN)
+    {
+        printf("Second submission was not rejected\n");
+        return 1;
+    }
+
+    rc = wait_async(uta_context, fd);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("Asynchronous derive_key failed\n");
+        return 1;
+    }
+
+    rc = uta.derive_key(uta_context, sync_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if ((rc != UTA_SUCCESS) || (memcmp(async_output, sync_output, KEYLEN) != 0))
+    {
+        printf("Asynchronous and synchronous derive_key differ\n");
+        return 1;
+    }
+
+    rc = uta_ext.derive_key_submit(uta_context, async_output, KEYLEN,
+        deriv_value, UTA_LEN_DV_V1, USED_KEY_SLOTS);
+    if (rc != UTA_INVALID_KEY_SLOT)
+    {
+        printf("Invalid key slot was not rejected\n");
+        return 1;
+    }
+
+    rc = uta_ext.get_random_submit(uta_context, random_bytes,
+        ASYNC_LEN_RANDOM);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.get_random_submit failed\n");
+        return 1;
+    }
+
+    rc = wait_async(uta_context, fd);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("Asynchronous get_random failed\n");
+        return 1;
+    }
+
+    rc = uta_ext.complete(uta_context);
+    if (rc != UTA_TA_ERROR)
+    {
+        printf("uta_ext.complete without pending operation succeeded\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Test the timeout of the context.
+ *
+ * The calls have to succeed with a timeout, which a healthy trust anchor never
+ * reaches. With the TPM_TCG backend, a pending asynchronous operation holds
+ * the only connection of the context, so that a derive_key call with a short
+ * timeout has to return UTA_TIMEOUT instead of waiting for the connection.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+static int test_timeout(uta_context_v1_t *uta_context)
+{
+    uint8_t deriv_value[DVLEN];
+    uint8_t output[KEYLEN];
+    uint8_t random_bytes[ASYNC_LEN_RANDOM];
+    uta_rc rc;
+#ifdef HW_BACKEND_TPM_TCG
+    uint8_t async_output[KEYLEN];
+    uint8_t late_output[KEYLEN];
+    int fd;
+#endif
+    int i;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    for(i=0; i<DVLEN; i++)
+    {
+        deriv_value[i] = (uint8_t)(rand() % 256);
+    }
+
+    rc = uta_ext.set_timeout(uta_context, TIMEOUT_LONG_MS);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.set_timeout failed\n");
+        return 1;
+    }
+
+    rc = uta.derive_key(uta_context, output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if (rc == UTA_SUCCESS)
+    {
+        rc = uta.get_random(uta_context, random_bytes, ASYNC_LEN_RANDOM);
+    }
+    if (rc != UTA_SUCCESS)
+    {
+        printf("Call with a timeout returned error code %x\n",
+            (unsigned int)rc);
+        (void)uta_ext.set_timeout(uta_context, 0);
+        return 1;
+    }
+
+#ifdef HW_BACKEND_TPM_TCG
+    rc = uta_ext.get_poll_fd(uta_context, &fd);
+    if (rc == UTA_SUCCESS)
+    {
+        rc = uta_ext.derive_key_submit(uta_context, async_output, KEYLEN,
+            deriv_value, UTA_LEN_DV_V1, 0);
+    }
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.derive_key_submit failed\n");
+        (void)uta_ext.set_timeout(uta_context, 0);
+        return 1;
+    }
+
+    (void)uta_ext.set_timeout(uta_context, TIMEOUT_SHORT_MS);
+    rc = uta.derive_key(uta_context, late_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    (void)uta_ext.set_timeout(uta_context, 0);
+    if (rc != UTA_TIMEOUT)
+    {
+        printf("Waiting for the busy connection did not time out\n");
+        (void)wait_async(uta_context, fd);
+        return 1;
+    }
+
+    rc = wait_async(uta_context, fd);
+    if ((rc != UTA_SUCCESS) || (memcmp(async_output, output, KEYLEN) != 0))
+    {
+        printf("Asynchronous derive_key failed after the timeout\n");
+        return 1;
+    }
+#endif
+
+    rc = uta_ext.set_timeout(uta_context, 0);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.set_timeout failed\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Test key derivations next to bulk random requests.
+ *
+ * Bulk random requests in other threads are split into slices by the TPM
+ * backends, which give the connection to the key derivations in between. The
+ * only connection is saturated with bulk requests, one running and the
+ * others queued, before a key is derived. With the TPM backends, the key
+ * derivation has to finish before the queued bulk requests, so at most the
+ * running one may complete in between. The length of the bulk requests is
+ * doubled, until they are still pending, when the key derivation is issued.
+ * The derived key has to be correct and the random requests have to fill all
+ * of their buffers, although they are continued on another connection.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+static int test_priority(uta_context_v1_t *uta_context)
+{
+    priority_thread_t args[PRIORITY_THREADS];
+    pthread_t threads[PRIORITY_THREADS];
+    uint8_t deriv_value[DVLEN] = {0};
+    uint8_t busy_key[KEYLEN];
+    uint8_t idle_key[KEYLEN];
+    uint64_t issued_ns;
+    uint64_t derived_ns;
+    void *thread_ret;
+    int overtaken;
+    int measured = 0;
+    int pending;
+    int started;
+    int success = 1;
+    int round;
+    uta_rc rc;
+    int i;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    for (round = 0; (round < PRIORITY_ROUNDS) && (measured == 0) &&
+        (success == 1); round++)
+    {
+        for (started = 0; started < PRIORITY_THREADS; started++)
+        {
+            args[started].uta_context = uta_context;
+            args[started].len_bulk = (size_t)PRIORITY_LEN_BULK << round;
+            args[started].issued = 0;
+            args[started].done_ns = 0;
+            if (pthread_create(&threads[started], NULL, priority_bulk_thread,
+                (void *)&args[started]) != 0)
+            {
+                printf("ERROR during pthread_create!\n");
+                success = 0;
+                break;
+            }
+        }
+
+        // Wait until all bulk requests are issued and queued
+        for (i = 0; i < started; i++)
+        {
+            while (__atomic_load_n(&args[i].issued, __ATOMIC_ACQUIRE) == 0)
+            {
+                usleep(100);
+            }
+        }
+        usleep(PRIORITY_SETTLE_US);
+
+        issued_ns = scale_now_ns();
+        rc = uta.derive_key(uta_context, busy_key, KEYLEN, deriv_value,
+            UTA_LEN_DV_V1, 0);
+        derived_ns = scale_now_ns();
+        if (rc != UTA_SUCCESS)
+        {
+            printf("Key derivation next to bulk random requests failed\n");
+            success = 0;
+        }
+
+        pending = 0;
+        overtaken = 0;
+        for (i = 0; i < started; i++)
+        {
+            if ((pthread_join(threads[i], &thread_ret) != 0) ||
+                (thread_ret != NULL))
+            {
+                success = 0;
+                continue;
+            }
+            if (args[i].done_ns > issued_ns)
+            {
+                pending++;
+                if (args[i].done_ns < derived_ns)
+                {
+                    overtaken++;
+                }
+            }
+        }
+
+        // The result has to be the same without the bulk requests
+        rc = uta.derive_key(uta_context, idle_key, KEYLEN, deriv_value,
+            UTA_LEN_DV_V1, 0);
+        if ((rc != UTA_SUCCESS) || (memcmp(busy_key, idle_key, KEYLEN) != 0))
+        {
+            printf("Key derivation next to bulk random requests differs\n");
+            success = 0;
+        }
+
+        // A queued bulk request is pending besides the running one
+        if (pending >= 2)
+        {
+            measured = 1;
+#if defined(HW_BACKEND_TPM_IBM) || defined(HW_BACKEND_TPM_TCG)
+            if (overtaken > 1)
+            {
+                printf("Key derivation waited for %d of %d queued bulk "
+                    "random requests\n", overtaken - 1, pending - 1);
+                success = 0;
+            }
+#else
+            (void)overtaken;
+#endif
+        }
+    }
+
+#if defined(HW_BACKEND_TPM_IBM) || defined(HW_BACKEND_TPM_TCG)
+    if ((success == 1) && (measured == 0))
+    {
+        printf("The bulk random requests never saturated the connection\n");
+        success = 0;
+    }
+#endif
+
+    return (success == 1) ? 0 : 1;
+}
+
+/**
+ * @brief Reads a bulk random request into several buffers and checks, that
+ *      every part of them has been written.
+ * @param[in,out] arg Pointer to the priority_thread_t of the thread.
+ * @return NULL in case of success, a non NULL value otherwise.
+ */
+static void *priority_bulk_thread(void *arg)
+{
+    priority_thread_t *thread = (priority_thread_t *)arg;
+    size_t lengths[PRIORITY_BUFFERS];
+    uint8_t *storage;
+    uta_random_buffer_v1_t buffers[PRIORITY_BUFFERS];
+    size_t total = 0;
+    size_t run = 0;
+    size_t i;
+    uta_rc rc;
+
+    lengths[0] = thread->len_bulk;
+    lengths[1] = 1;
+    lengths[2] = thread->len_bulk / 2;
+    for (i = 0; i < PRIORITY_BUFFERS; i++)
+    {
+        total += lengths[i];
+    }
+
+    storage = calloc(1, total);
+    if (storage == NULL)
+    {
+        __atomic_store_n(&thread->issued, 1, __ATOMIC_RELEASE);
+        return (void *)1;
+    }
+
+    total = 0;
+    for (i = 0; i < PRIORITY_BUFFERS; i++)
+    {
+        buffers[i].random = &storage[total];
+        buffers[i].len_random = lengths[i];
+        total += lengths[i];
+    }
+
+    __atomic_store_n(&thread->issued, 1, __ATOMIC_RELEASE);
+    rc = uta_ext.get_random_v(thread->uta_context, buffers,
+        PRIORITY_BUFFERS);
+    thread->done_ns = scale_now_ns();
+    if (rc != UTA_SUCCESS)
+    {
+        printf("Bulk random request returned error code %x\n",
+            (unsigned int)rc);
+        free(storage);
+        return (void *)1;
+    }
+
+    // A slice, which has not been written, leaves a run of zero bytes
+    for (i = 0; (i < total) && (run < PRIORITY_ZERO_RUN); i++)
+    {
+        run = (storage[i] == 0) ? (run + 1) : 0;
+    }
+    free(storage);
+    if (run >= PRIORITY_ZERO_RUN)
+    {
+        printf("Bulk random request left a part of its buffers unwritten\n");
+        return (void *)1;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Test the statistics of the context.
+ *
+ * After a reset, one valid and one invalid key derivation and one random
+ * request are made. The counters have to match these calls exactly.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+static int test_stats(uta_context_v1_t *uta_context)
+{
+    uint8_t deriv_value[DVLEN] = {0};
+    uint8_t ta_output[KEYLEN];
+    uint8_t random_bytes[DVLEN];
+    uta_stats_v1_t stats;
+    uta_rc rc;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    rc = uta_ext.get_stats(uta_context, &stats);
+    if ((rc != UTA_SUCCESS) || (stats.ops[UTA_STATS_OPEN].calls != 1))
+    {
+        printf("uta_ext.get_stats did not count the open call\n");
+        return 1;
+    }
+
+    rc = uta_ext.reset_stats(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.reset_stats failed\n");
+        return 1;
+    }
+
+    rc = uta.derive_key(uta_context, ta_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.derive_key failed\n");
+        return 1;
+    }
+
+    rc = uta.derive_key(uta_context, ta_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, USED_KEY_SLOTS);
+    if (rc != UTA_INVALID_KEY_SLOT)
+    {
+        printf("Invalid key slot was not rejected\n");
+        return 1;
+    }
+
+    rc = uta.get_random(uta_context, random_bytes, sizeof(random_bytes));
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.get_random failed\n");
+        return 1;
+    }
+
+    rc = uta_ext.get_stats(uta_context, &stats);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.get_stats failed\n");
+        return 1;
+    }
+
+    if ((stats.ops[UTA_STATS_OPEN].calls != 0) ||
+        (stats.ops[UTA_STATS_DERIVE_KEY].calls != 2) ||
+        (stats.ops[UTA_STATS_DERIVE_KEY].errors != 1) ||
+        (stats.ops[UTA_STATS_GET_RANDOM].calls != 1) ||
+        (stats.ops[UTA_STATS_GET_RANDOM].errors != 0) ||
+        (stats.rc[UTA_SUCCESS] != 2) ||
+        (stats.rc[UTA_INVALID_KEY_SLOT] != 1) ||
+        (stats.random_bytes != sizeof(random_bytes)) ||
+        (stats.ta_accesses < 1))
+    {
+        printf("Statistics do not match the calls\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Test the key cache.
+ *
+ * Repeated derivations have to be served from the cache with the same key and
+ * without a trust anchor access. A flush and disabling the cache have to
+ * bring back the trust anchor derivation.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+#pragma GCC diagnostic ignored "-Wunused-function"
+static int test_key_cache(uta_context_v1_t *uta_context)
+{
+    uint8_t deriv_value[DVLEN];
+    uint8_t ta_output[KEYLEN];
+    uint8_t cached_output[KEYLEN];
+    uta_key_cache_config_v1_t config = {KEY_CACHE_ENTRIES, 0};
+    uta_stats_v1_t stats;
+    uint64_t ta_accesses;
+    uta_rc rc;
+    int j;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    // Get a random derivation value
+    for(j=0; j<DVLEN; j++)
+    {
+        deriv_value[j] = (uint8_t)(rand() % 256);
+    }
+
+    rc = uta_ext.set_key_cache(uta_context, &config);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.set_key_cache failed\n");
+        return 1;
+    }
+
+    (void)uta_ext.reset_stats(uta_context);
+    rc = uta.derive_key(uta_context, ta_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.derive_key with key cache failed\n");
+        return 1;
+    }
+    (void)uta_ext.get_stats(uta_context, &stats);
+    ta_accesses = stats.ta_accesses;
+
+    /* The second full and a truncated derivation are cache hits */
+    rc = uta.derive_key(uta_context, cached_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if ((rc != UTA_SUCCESS) || (memcmp(ta_output, cached_output, KEYLEN) != 0))
+    {
+        printf("Cached key differs from the derived key\n");
+        return 1;
+    }
+    memset(cached_output, 0, KEYLEN);
+    rc = uta.derive_key(uta_context, cached_output, KEYLEN/2, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if ((rc != UTA_SUCCESS) ||
+        (memcmp(ta_output, cached_output, KEYLEN/2) != 0) ||
+        (cached_output[KEYLEN/2] != 0))
+    {
+        printf("Truncated cached key differs from the derived key\n");
+        return 1;
+    }
+
+    rc = uta_ext.get_stats(uta_context, &stats);
+    if ((rc != UTA_SUCCESS) || (stats.key_cache_hits != 2) ||
+        (stats.key_cache_misses != 1) || (stats.ta_accesses != ta_accesses) ||
+        (stats.ops[UTA_STATS_DERIVE_KEY].calls != 3))
+    {
+        printf("Key cache statistics do not match the calls\n");
+        return 1;
+    }
+
+    /* After a flush, the key is derived by the trust anchor again */
+    (void)uta_ext.flush_key_cache(uta_context);
+    rc = uta.derive_key(uta_context, cached_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    (void)uta_ext.get_stats(uta_context, &stats);
+    if ((rc != UTA_SUCCESS) || (stats.key_cache_misses != 2) ||
+        (memcmp(ta_output, cached_output, KEYLEN) != 0))
+    {
+        printf("uta_ext.flush_key_cache failed\n");
+        return 1;
+    }
+
+    config.max_entries = 0;
+    rc = uta_ext.set_key_cache(uta_context, &config);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.set_key_cache failed\n");
+        return 1;
+    }
+    rc = uta.derive_key(uta_context, cached_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    (void)uta_ext.get_stats(uta_context, &stats);
+    if ((rc != UTA_SUCCESS) || (stats.key_cache_hits != 2) ||
+        (stats.key_cache_misses != 2) ||
+        (memcmp(ta_output, cached_output, KEYLEN) != 0))
+    {
+        printf("Disabling the key cache failed\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Test the HMAC session kept between processes.
+ *
+ * Closing the context has to leave the session in the configured file and the
+ * next open has to take it from there. The resumed session has to work for a
+ * key derivation. Without TPM_SESSION_CACHE_FILE the test is skipped.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+#pragma GCC diagnostic ignored "-Wunused-function"
+static int test_session_cache(uta_context_v1_t *uta_context)
+{
+    printf("Executing %s\n",__FUNCTION__);
+
+#if defined(CONFIGURED_SESSION_CACHE_FILE) && \
+    (defined(HW_BACKEND_TPM_IBM) || defined(HW_BACKEND_TPM_TCG))
+    uint8_t deriv_value[DVLEN];
+    uint8_t ta_output[KEYLEN];
+    uta_rc rc;
+    int j;
+
+
+    rc = uta.close(uta_context);
+    if ((rc != UTA_SUCCESS) || (access(CONFIGURED_SESSION_CACHE_FILE, F_OK) != 0))
+    {
+        printf("Session has not been saved on close\n");
+        (void)uta.open(uta_context);
+        return 1;
+    }
+
+    rc = uta.open(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.open with a saved session failed\n");
+        return 1;
+    }
+    if (access(CONFIGURED_SESSION_CACHE_FILE, F_OK) == 0)
+    {
+        printf("Saved session has not been taken on open\n");
+        return 1;
+    }
+
+    // Get a random derivation value
+    for(j=0; j<DVLEN; j++)
+    {
+        deriv_value[j] = (uint8_t)(rand() % 256);
+    }
+    rc = uta.derive_key(uta_context, ta_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.derive_key with the resumed session failed\n");
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * @brief Test the recovery of an HMAC session, which the TPM has lost.
+ *
+ * The test hook flushes the session of the connection from the TPM. The next
+ * key derivation has to start a new session and succeed with the single
+ * retry. If the new session is lost as well, the second session error has to
+ * be returned instead of another retry. Afterwards the connection has to
+ * recover again. All derived keys have to match the key derived before. The
+ * device UUID is read on a reopened context in the same way, unless it is
+ * persisted in TPM_UUID_CACHE_FILE. Without --enable-test-hooks the test is
+ * skipped.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+static int test_session_recovery(uta_context_v1_t *uta_context)
+{
+    printf("Executing %s\n",__FUNCTION__);
+
+#ifdef ENABLE_TEST_HOOKS
+    uint8_t deriv_value[DVLEN];
+    uint8_t expected[KEYLEN];
+    uint8_t ta_output[KEYLEN];
+#ifndef CONFIGURED_UUID_CACHE_FILE
+    uint8_t expected_uuid[UUIDLEN];
+    uint8_t uuid[UUIDLEN];
+#endif
+    uint32_t left;
+    uta_rc rc;
+    int j;
+
+    // Get a random derivation value
+    for(j=0; j<DVLEN; j++)
+    {
+        deriv_value[j] = (uint8_t)(rand() % 256);
+    }
+    rc = uta.derive_key(uta_context, expected, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.derive_key before the session loss failed\n");
+        return 1;
+    }
+
+    // Lose the session once, the retry has to succeed
+    (void)tpm_flush_sessions(1);
+    rc = uta.derive_key(uta_context, ta_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    left = tpm_flush_sessions(0);
+    if ((rc != UTA_SUCCESS) || (left != 0) ||
+        (memcmp(ta_output, expected, KEYLEN) != 0))
+    {
+        printf("uta.derive_key did not recover the session (rc %x, %u "
+            "flushes left)\n", (unsigned int)rc, (unsigned int)left);
+        return 1;
+    }
+
+    // Lose the new session as well, this has to fail after one retry
+    (void)tpm_flush_sessions(2);
+    rc = uta.derive_key(uta_context, ta_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    left = tpm_flush_sessions(0);
+    if ((rc != UTA_TA_ERROR) || (left != 0))
+    {
+        printf("uta.derive_key did not return the second session error "
+            "(rc %x, %u flushes left)\n", (unsigned int)rc,
+            (unsigned int)left);
+        return 1;
+    }
+
+    rc = uta.derive_key(uta_context, ta_output, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if ((rc != UTA_SUCCESS) || (memcmp(ta_output, expected, KEYLEN) != 0))
+    {
+        printf("uta.derive_key after the second session loss failed\n");
+        return 1;
+    }
+
+#ifndef CONFIGURED_UUID_CACHE_FILE
+    rc = uta.get_device_uuid(uta_context, expected_uuid);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.get_device_uuid before the session loss failed\n");
+        return 1;
+    }
+
+    // The UUID is kept in the context, a new one reads it from the TPM
+    (void)uta.close(uta_context);
+    rc = uta.open(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta.open!\n");
+        return 1;
+    }
+    (void)tpm_flush_sessions(1);
+    rc = uta.get_device_uuid(uta_context, uuid);
+    left = tpm_flush_sessions(0);
+    if ((rc != UTA_SUCCESS) || (left != 0) ||
+        (memcmp(uuid, expected_uuid, UUIDLEN) != 0))
+    {
+        printf("uta.get_device_uuid did not recover the session (rc %x, %u "
+            "flushes left)\n", (unsigned int)rc, (unsigned int)left);
+        return 1;
+    }
+
+    (void)uta.close(uta_context);
+    rc = uta.open(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("ERROR during uta.open!\n");
+        return 1;
+    }
+    (void)tpm_flush_sessions(2);
+    rc = uta.get_device_uuid(uta_context, uuid);
+    left = tpm_flush_sessions(0);
+    if ((rc != UTA_TA_ERROR) || (left != 0))
+    {
+        printf("uta.get_device_uuid did not return the second session error "
+            "(rc %x, %u flushes left)\n", (unsigned int)rc,
+            (unsigned int)left);
+        return 1;
+    }
+
+    rc = uta.get_device_uuid(uta_context, uuid);
+    if ((rc != UTA_SUCCESS) ||
+        (memcmp(uuid, expected_uuid, UUIDLEN) != 0))
+    {
+        printf("uta.get_device_uuid after the second session loss failed\n");
+        return 1;
+    }
+#endif
+#endif
+
+    return 0;
+}
+
+/**
+ * @brief Tests a context, which is opened before a fork. The child derives a
+ *      key and reads random numbers on the inherited context and closes it,
+ *      as a worker of a prefork server would do. Afterwards the parent must
+ *      still derive the same key on its context. With a TPM or the client
+ *      backend, the DRBG of the child must not repeat the random numbers of
+ *      the parent.
+ * @param[in,out] uta_context Pointer to the opened uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+static int test_fork(uta_context_v1_t *uta_context)
+{
+    printf("Executing %s\n",__FUNCTION__);
+
+#ifdef MULTIPROCESSING
+    uta_random_config_v1_t drbg_config = {UTA_RANDOM_DRBG, 0, 0};
+    uta_random_config_v1_t ta_config = {UTA_RANDOM_TA, 0, 0};
+    uint8_t parent_random[FORK_LEN_RANDOM];
+    uint8_t child_random[FORK_LEN_RANDOM];
+    uint8_t deriv_value[DVLEN];
+    uint8_t parent_key[KEYLEN];
+    uint8_t child_key[KEYLEN];
+    int drbg_mode;
+    int fds[2];
+    int status;
+    int ret = 0;
+    pid_t pid;
+    uta_rc rc;
+    int j;
+
+    // Get a random derivation value
+    for(j=0; j<DVLEN; j++)
+    {
+        deriv_value[j] = (uint8_t)(rand() % 256);
+    }
+
+    // The session of the parent is in use before the fork
+    rc = uta.derive_key(uta_context, parent_key, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.derive_key before the fork failed\n");
+        return 1;
+    }
+
+    rc = uta_ext.set_random_mode(uta_context, &drbg_config);
+    drbg_mode = (rc == UTA_SUCCESS) ? 1 : 0;
+    if ((rc != UTA_SUCCESS) && (rc != UTA_NOT_SUPPORTED))
+    {
+        printf("uta_ext.set_random_mode before the fork failed\n");
+        return 1;
+    }
+
+    if (pipe(fds) != 0)
+    {
+        printf("Failed to create the pipe\n");
+        return 1;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+    {
+        printf("Failed to fork\n");
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+
+    if (pid == 0)
+    {
+        /* Child process */
+        close(fds[0]);
+        rc = uta.derive_key(uta_context, child_key, KEYLEN, deriv_value,
+            UTA_LEN_DV_V1, 0);
+        if ((rc != UTA_SUCCESS) || (memcmp(child_key, parent_key, KEYLEN) != 0))
+        {
+            printf("uta.derive_key in the child failed\n");
+            ret = 1;
+        }
+        rc = uta.get_random(uta_context, child_random, FORK_LEN_RANDOM);
+        if ((rc != UTA_SUCCESS) ||
+            (write(fds[1], child_random, FORK_LEN_RANDOM) != FORK_LEN_RANDOM))
+        {
+            printf("uta.get_random in the child failed\n");
+            ret = 1;
+        }
+        close(fds[1]);
+        rc = uta.close(uta_context);
+        if (rc != UTA_SUCCESS)
+        {
+            printf("uta.close in the child failed\n");
+            ret = 1;
         }
+        exit(ret);
+    }
 
-        /* Compare the calculated value with the lower and upper limits */
-        if ((chisquared > CHI2_LOWER) && (chisquared < CHI2_UPPER)){
-            return 0;
+    /* Parent process */
+    close(fds[1]);
+    if (read(fds[0], child_random, FORK_LEN_RANDOM) != FORK_LEN_RANDOM)
+    {
+        ret = 1;
+    }
+    close(fds[0]);
+    if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) ||
+        (WEXITSTATUS(status) != 0))
+    {
+        printf("The child failed to use the inherited context\n");
+        ret = 1;
+    }
+
+    // The child must not have closed the session of the parent
+    rc = uta.derive_key(uta_context, child_key, KEYLEN, deriv_value,
+        UTA_LEN_DV_V1, 0);
+    if ((rc != UTA_SUCCESS) || (memcmp(child_key, parent_key, KEYLEN) != 0))
+    {
+        printf("uta.derive_key in the parent failed after the child closed\n");
+        ret = 1;
+    }
+
+    rc = uta.get_random(uta_context, parent_random, FORK_LEN_RANDOM);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.get_random in the parent failed after the fork\n");
+        ret = 1;
+    }
+
+#if defined(HW_BACKEND_TPM_IBM) || defined(HW_BACKEND_TPM_TCG) || \
+    defined(HW_BACKEND_UTA_CLIENT)
+    if ((drbg_mode != 0) &&
+        (memcmp(parent_random, child_random, FORK_LEN_RANDOM) == 0))
+    {
+        printf("The DRBG of the child repeated the random numbers\n");
+        ret = 1;
+    }
+#endif
+
+    if (drbg_mode != 0)
+    {
+        (void)uta_ext.set_random_mode(uta_context, &ta_config);
+    }
+
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Tests the self test, which is started without waiting, and the
+ *      cached result. After open, the result is the one of the self test
+ *      started with --enable-self-test-on-open, otherwise no result is
+ *      available. A finished result must be returned without an access to the
+ *      trust anchor. The UTA_CLIENT backend shares the result of the daemon
+ *      and reads it over the socket.
+ * @param[in,out] uta_context Pointer to the opened uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+static int test_self_test_result(uta_context_v1_t *uta_context)
+{
+    uta_self_test_result_v1_t result;
+    uta_stats_v1_t before;
+    uta_stats_v1_t after;
+    uta_rc rc;
+    int waited;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    rc = uta_ext.get_self_test_result(uta_context, &result);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.get_self_test_result after open failed\n");
+        return 1;
+    }
+#ifndef HW_BACKEND_UTA_CLIENT
+#ifdef ENABLE_SELF_TEST_ON_OPEN
+    if ((result.rc == UTA_NOT_SUPPORTED) ||
+        (result.mode != UTA_SELF_TEST_INCREMENTAL))
+    {
+        printf("No self test has been started on open\n");
+        return 1;
+    }
+#else
+    if (result.rc != UTA_NOT_SUPPORTED)
+    {
+        printf("A self test result is reported without a self test\n");
+        return 1;
+    }
+#endif
+#endif
+
+    rc = uta_ext.start_self_test(uta_context, (uta_self_test_mode_t)7);
+    if (rc != UTA_NOT_SUPPORTED)
+    {
+        printf("uta_ext.start_self_test accepted an invalid mode\n");
+        return 1;
+    }
+
+    rc = uta_ext.start_self_test(uta_context, UTA_SELF_TEST_INCREMENTAL);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.start_self_test returned error code %x\n",
+            (unsigned int)rc);
+        return 1;
+    }
+
+    // Poll the cached result until the self test has finished
+    for (waited = 0; waited < SELF_TEST_TIMEOUT_MS; waited += SELF_TEST_POLL_MS)
+    {
+        rc = uta_ext.get_self_test_result(uta_context, &result);
+        if ((rc != UTA_SUCCESS) || (result.rc != UTA_TRY_AGAIN))
+        {
+            break;
         }
+        usleep(SELF_TEST_POLL_MS * 1000);
     }
-    return 1;
+    if ((rc != UTA_SUCCESS) || (result.rc != UTA_SUCCESS) ||
+        (result.mode != UTA_SELF_TEST_INCREMENTAL))
+    {
+        printf("The incremental self test did not pass\n");
+        return 1;
+    }
+
+    rc = uta.self_test(uta_context);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta.self_test returned error code %x\n", (unsigned int)rc);
+        return 1;
+    }
+
+    // The finished result is served from the context
+    rc = uta_ext.get_stats(uta_context, &before);
+    if (rc == UTA_SUCCESS)
+    {
+        rc = uta_ext.get_self_test_result(uta_context, &result);
+    }
+    if (rc == UTA_SUCCESS)
+    {
+        rc = uta_ext.get_stats(uta_context, &after);
+    }
+    if ((rc != UTA_SUCCESS) || (result.rc != UTA_SUCCESS) ||
+        (result.mode != UTA_SELF_TEST_FULL))
+    {
+        printf("The result of uta.self_test is not cached\n");
+        return 1;
+    }
+#ifndef HW_BACKEND_UTA_CLIENT
+    if (after.ta_accesses != before.ta_accesses)
+    {
+        printf("uta_ext.get_self_test_result accessed the trust anchor\n");
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * @brief Waits on the poll fd until the pending asynchronous operation has
+ *      completed.
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @param[in] fd File descriptor returned by get_poll_fd.
+ * @return UTA return code of the operation, UTA_TA_ERROR if the fd did not
+ *      become readable in time.
+ */
+static uta_rc wait_async(uta_context_v1_t *uta_context, int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    uta_rc rc;
+
+    do
+    {
+        if (poll(&pfd, 1, ASYNC_TIMEOUT_MS) != 1)
+        {
+            return UTA_TA_ERROR;
+        }
+        rc = uta_ext.complete(uta_context);
+    } while (rc == UTA_TRY_AGAIN);
+
+    return rc;
 }
 
 /**
@@ -445,6 +2661,256 @@ static int test_derive_key(uta_context_v1_t *uta_context)
     return 0;
 }
 
+/**
+ * @brief Test the batched derive key command.
+ *
+ * The outputs of the batch are compared to single derive_key calls and, if
+ * reference keys are provided, to the software calculation. An additional
+ * entry with an invalid key slot checks the per-entry return codes.
+ *
+ * @param[in,out] uta_context Pointer to the uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+#pragma GCC diagnostic ignored "-Wunused-function"
+static int test_derive_key_batch(uta_context_v1_t *uta_context)
+{
+    int i;
+    int j;
+    int ret;
+    uta_rc rc;
+    uint8_t deriv_values[NR_VEC][DVLEN];
+    uint8_t ta_outputs[NR_VEC*USED_KEY_SLOTS+1][KEYLEN];
+    uta_derive_request_v1_t requests[NR_VEC*USED_KEY_SLOTS+1];
+    uint8_t ta_output[KEYLEN];
+    unsigned char ref_output[KEYLEN];
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    const mbedtls_md_info_t *sha256_hmac = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+
+    for(i=0; i<NR_VEC; i++)
+    {
+        // Get a random derivation value
+        for(j=0; j<DVLEN; j++)
+        {
+            deriv_values[i][j] = (uint8_t)(rand() % 256);
+        }
+
+        for(j=0; j<USED_KEY_SLOTS; j++)
+        {
+            requests[i*USED_KEY_SLOTS+j].key = ta_outputs[i*USED_KEY_SLOTS+j];
+            requests[i*USED_KEY_SLOTS+j].len_key = KEYLEN;
+            requests[i*USED_KEY_SLOTS+j].dv = deriv_values[i];
+            requests[i*USED_KEY_SLOTS+j].len_dv = UTA_LEN_DV_V1;
+            requests[i*USED_KEY_SLOTS+j].key_slot = j;
+        }
+    }
+
+    /* The last entry uses an invalid key slot */
+    requests[NR_VEC*USED_KEY_SLOTS].key = ta_outputs[NR_VEC*USED_KEY_SLOTS];
+    requests[NR_VEC*USED_KEY_SLOTS].len_key = KEYLEN;
+    requests[NR_VEC*USED_KEY_SLOTS].dv = deriv_values[0];
+    requests[NR_VEC*USED_KEY_SLOTS].len_dv = UTA_LEN_DV_V1;
+    requests[NR_VEC*USED_KEY_SLOTS].key_slot = USED_KEY_SLOTS;
+
+    rc = uta_ext.derive_key_batch(uta_context, requests,
+        NR_VEC*USED_KEY_SLOTS+1);
+    if ((rc != UTA_INVALID_KEY_SLOT) ||
+        (requests[NR_VEC*USED_KEY_SLOTS].rc != UTA_INVALID_KEY_SLOT))
+    {
+        printf("uta_ext.derive_key_batch did not report the invalid key slot\n");
+        return 1;
+    }
+
+    for(i=0; i<NR_VEC*USED_KEY_SLOTS; i++)
+    {
+        if (requests[i].rc != UTA_SUCCESS)
+        {
+            printf("uta_ext.derive_key_batch entry %d failed\n", i);
+            return 1;
+        }
+
+        rc = uta.derive_key(uta_context, ta_output, KEYLEN, requests[i].dv,
+            UTA_LEN_DV_V1, requests[i].key_slot);
+        if (rc != UTA_SUCCESS)
+        {
+            printf("uta.derive_key using key slot %d failed\n",
+                requests[i].key_slot);
+            return 1;
+        }
+
+        ret = memcmp(ta_outputs[i], ta_output, KEYLEN);
+        if (ret != 0)
+        {
+            printf("Batched key derivation differs from derive_key\n");
+            return 1;
+        }
+
+        if(key_slots[requests[i].key_slot] != NULL)
+        {
+            (void)mbedtls_md_hmac(sha256_hmac, key_slots[requests[i].key_slot],
+                KEYLEN, (unsigned char *)requests[i].dv, DVLEN, ref_output);
+
+            ret = memcmp(ta_outputs[i], ref_output, KEYLEN);
+            if (ret != 0)
+            {
+                printf("Wrong batched key derivation using key slot %d\n",
+                    requests[i].key_slot);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Tests the capabilities of the context. They must match the limits of
+ *      API version 1 and report at least one device and connection. The TPM
+ *      properties are printed once, they depend on the device.
+ * @param[in,out] uta_context Pointer to the opened uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+static int test_get_capabilities(uta_context_v1_t *uta_context)
+{
+    static int printed = 0;
+    uta_capabilities_v1_t capabilities;
+    uta_rc rc;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    rc = uta_ext.get_capabilities(uta_context, &capabilities);
+    if (rc != UTA_SUCCESS)
+    {
+        printf("uta_ext.get_capabilities failed\n");
+        return 1;
+    }
+
+    if ((capabilities.len_key_max != uta.len_key_max()) ||
+        (capabilities.num_key_slots != USED_KEY_SLOTS))
+    {
+        printf("The capabilities report %u key slots with keys of up to %u "
+            "bytes\n", (unsigned int)capabilities.num_key_slots,
+            (unsigned int)capabilities.len_key_max);
+        return 1;
+    }
+
+    if ((capabilities.num_devices < 1) ||
+        (capabilities.num_connections < capabilities.num_devices))
+    {
+        printf("The capabilities report %u connections to %u devices\n",
+            (unsigned int)capabilities.num_connections,
+            (unsigned int)capabilities.num_devices);
+        return 1;
+    }
+
+    if (printed == 0)
+    {
+        printf("MANUFACTURER: 0x%08x, FIRMWARE: 0x%08x.0x%08x, "
+            "MAX_DIGEST: %u, INPUT_BUFFER: %u\n",
+            (unsigned int)capabilities.manufacturer,
+            (unsigned int)capabilities.firmware_version_1,
+            (unsigned int)capabilities.firmware_version_2,
+            (unsigned int)capabilities.max_digest,
+            (unsigned int)capabilities.input_buffer);
+        printed = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Tests the parameter encryption policies. Each policy must derive the
+ *      same keys as the default policy and deliver random bytes. The
+ *      UTA_CLIENT backend only accepts the default. The default is restored
+ *      afterwards.
+ * @param[in,out] uta_context Pointer to the opened uta_context struct.
+ * @return In case of success the function returns 0, 1 otherwise.
+ */
+static int test_param_encryption(uta_context_v1_t *uta_context)
+{
+    static const uta_param_enc_t modes[] = {UTA_PARAM_ENC_RESPONSE,
+        UTA_PARAM_ENC_AUDIT, UTA_PARAM_ENC_FULL};
+    const uint8_t dv[UTA_LEN_DV_V1] = {0x50, 0x41, 0x52, 0x41, 0x4d, 0x45,
+        0x4e, 0x43};
+    uta_param_enc_policy_v1_t policy;
+    uint8_t reference[USED_KEY_SLOTS][KEYLEN];
+    uint8_t key[KEYLEN];
+    uint8_t random[64];
+    uta_rc rc;
+    size_t i;
+    uint8_t j;
+
+    printf("Executing %s\n",__FUNCTION__);
+
+    for (j = 0; j < USED_KEY_SLOTS; j++)
+    {
+        rc = uta.derive_key(uta_context, reference[j], KEYLEN, dv,
+            UTA_LEN_DV_V1, j);
+        if (rc != UTA_SUCCESS)
+        {
+            printf("uta.derive_key failed\n");
+            return 1;
+        }
+    }
+
+    policy.derive_key = (uta_param_enc_t)3;
+    policy.get_random = UTA_PARAM_ENC_FULL;
+    if (uta_ext.set_param_encryption(uta_context, &policy) !=
+        UTA_NOT_SUPPORTED)
+    {
+        printf("uta_ext.set_param_encryption accepted an invalid mode\n");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+        policy.derive_key = modes[i];
+        policy.get_random = modes[i];
+        rc = uta_ext.set_param_encryption(uta_context, &policy);
+#ifdef HW_BACKEND_UTA_CLIENT
+        if (modes[i] != UTA_PARAM_ENC_FULL)
+        {
+            if (rc != UTA_NOT_SUPPORTED)
+            {
+                printf("The client accepted parameter encryption %d\n",
+                    (int)modes[i]);
+                return 1;
+            }
+            continue;
+        }
+#endif
+        if (rc != UTA_SUCCESS)
+        {
+            printf("uta_ext.set_param_encryption %d failed\n",
+                (int)modes[i]);
+            return 1;
+        }
+
+        for (j = 0; j < USED_KEY_SLOTS; j++)
+        {
+            rc = uta.derive_key(uta_context, key, KEYLEN, dv, UTA_LEN_DV_V1,
+                j);
+            if ((rc != UTA_SUCCESS) ||
+                (memcmp(key, reference[j], KEYLEN) != 0))
+            {
+                printf("Parameter encryption %d derived a different key\n",
+                    (int)modes[i]);
+                return 1;
+            }
+        }
+
+        rc = uta.get_random(uta_context, random, sizeof(random));
+        if (rc != UTA_SUCCESS)
+        {
+            printf("uta.get_random with parameter encryption %d failed\n",
+                (int)modes[i]);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * @brief Test the read UUID function.
  * @param[in,out] uta_context Pointer to the uta_context struct.
@@ -0,0 +1,861 @@
+/** @file utad_main.c
+*
+* @brief Unified Trust Anchor (UTA) daemon. It holds one pooled context of the
+* trust anchor and serves derive_key, get_random, get_device_uuid, the self
+* tests, the self test result and the capabilities to the processes of the
+* UTA_CLIENT backend over a Unix domain socket. The requests of all clients
+* are collected in one queue; each worker takes all queued requests at once,
+* so that concurrent key derivations are executed with a single
+* derive_key_batch and concurrent random requests with a single get_random
+* call. Key slots are authorized by the credentials of the connected process
+* (SO_PEERCRED).
+*
+* @copyright Copyright (c) Siemens Mobility GmbH, 2026
+*
+* @license This work is licensed under the terms of the Apache Software License
+* 2.0. See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+#define _GNU_SOURCE /* struct ucred, accept4 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <config.h>
+
+#include <uta.h>
+#include <utad_protocol.h>
+
+/*******************************************************************************
+ * Defines
+ ******************************************************************************/
+#define UTAD_CONNECTIONS     4        // Default connections to the trust anchor
+#define UTAD_MAX_CLIENTS     1024
+#define UTAD_MAX_ACL         32
+#define UTAD_BATCH_MAX       64       // Requests taken by a worker at once
+#define UTAD_MAX_EVENTS      64
+#define UTAD_SOCKET_MODE     0660
+
+/*******************************************************************************
+ * Data types
+ ******************************************************************************/
+/**
+ * @brief Connected client. It is owned by the event loop while it waits in
+ *      epoll and by a worker from the queue until the response is sent, so
+ *      that it needs no lock.
+ */
+typedef struct utad_client
+{
+    int fd;
+    struct ucred cred;
+    utad_request_t request;
+    size_t received;
+    struct utad_client *next;
+} utad_client_t;
+
+/**
+ * @brief Access rule: the user or group id may use the key slot.
+ */
+typedef struct
+{
+    uint8_t key_slot;
+    uint8_t is_group;
+    uint32_t id;
+} utad_acl_t;
+
+/**
+ * @brief Response of one queued request, payload points to len bytes.
+ */
+typedef struct
+{
+    utad_client_t *client;
+    utad_response_t response;
+    const uint8_t *payload;
+} utad_reply_t;
+
+/**
+ * @brief Buffers of one worker.
+ */
+typedef struct
+{
+    utad_reply_t replies[UTAD_BATCH_MAX];
+    uta_derive_request_v1_t derive[UTAD_BATCH_MAX];
+    uint8_t keys[UTAD_BATCH_MAX][UTAD_LEN_KEY_MAX];
+    uint8_t random[UTAD_BATCH_MAX * UTAD_LEN_RANDOM_MAX];
+    utad_self_test_result_t self_test_result;
+} utad_worker_t;
+
+/*******************************************************************************
+ * Static data declaration
+ ******************************************************************************/
+static uta_api_v1_t uta;
+static uta_api_v1_ext_t uta_ext;
+static uta_context_v1_t *uta_context;
+
+/* Device UUID, read once on start */
+static uint8_t uuid[UTAD_LEN_UUID];
+static uta_rc uuid_rc;
+
+/* Capabilities of the trust anchor, read once on start */
+static uta_capabilities_v1_t capabilities;
+static uta_rc capabilities_rc;
+
+/* Command line options */
+static utad_acl_t acl[UTAD_MAX_ACL];
+static size_t num_acl = 0;
+
+/* Queue of complete requests, protected by queue_lock */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static utad_client_t *queue_head = NULL;
+static utad_client_t *queue_tail = NULL;
+static int stopping = 0;
+
+static int epoll_fd = -1;
+static size_t num_clients = 0;
+
+/* Markers of the listening socket and the signalfd in the epoll events */
+static utad_client_t listen_marker;
+static utad_client_t signal_marker;
+
+/*******************************************************************************
+ * Private function prototypes
+ ******************************************************************************/
+static void print_usage(void);
+static int parse_acl(const char *str, uint8_t is_group);
+static int open_socket(const char *path, mode_t mode);
+static void accept_clients(int listen_fd);
+static void receive_request(utad_client_t *client);
+static void close_client(utad_client_t *client);
+static int arm_client(utad_client_t *client, int op);
+static void queue_request(utad_client_t *client);
+static size_t take_requests(utad_client_t **clients);
+static int is_authorized(const struct ucred *cred, uint8_t key_slot);
+static void process_requests(utad_worker_t *worker, utad_client_t **clients,
+        size_t num);
+static void send_reply(const utad_reply_t *reply);
+static void *worker_thread(void *arg);
+
+/*******************************************************************************
+ * Public function bodies
+ ******************************************************************************/
+/**
+ * @brief Opens the trust anchor and serves the clients until SIGINT or
+ *      SIGTERM.
+ * @param[in] argc Number of parameters.
+ * @param[in] argv List of parameters, see print_usage.
+ * @return Linux return code.
+ */
+int main(int argc, char **argv)
+{
+    const char *socket_path = CONFIGURED_UTAD_SOCKET;
+    size_t connections = UTAD_CONNECTIONS;
+    mode_t mode = UTAD_SOCKET_MODE;
+    struct epoll_event events[UTAD_MAX_EVENTS];
+    struct epoll_event event;
+    struct signalfd_siginfo siginfo;
+    pthread_t *workers;
+    utad_worker_t *worker_buffers;
+    sigset_t signals;
+    utad_client_t *client;
+    int listen_fd;
+    int signal_fd;
+    size_t started = 0;
+    size_t i;
+    char *end;
+    int ret = 0;
+    int n;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:c:u:g:m:h")) != -1)
+    {
+        switch(c)
+        {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'c':
+            connections = strtoul(optarg, &end, 10);
+            if ((*end != '\0') || (connections < 1) || (connections > 64))
+            {
+                fprintf(stderr, "ERROR: Specify 1 to 64 connections\n");
+                return 1;
+            }
+            break;
+        case 'u':
+        case 'g':
+            if (parse_acl(optarg, (c == 'g') ? 1 : 0) != 0)
+            {
+                fprintf(stderr, "ERROR: Invalid access rule '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            mode = (mode_t)strtoul(optarg, &end, 8);
+            if ((*end != '\0') || (mode > 0777))
+            {
+                fprintf(stderr, "ERROR: Invalid socket mode '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case '?':
+        case 'h':
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+
+    if ((uta_init_v1(&uta) != UTA_SUCCESS) ||
+        (uta_init_v1_ext(&uta_ext) != UTA_SUCCESS))
+    {
+        fprintf(stderr, "ERROR during uta_init_v1!\n");
+        return 1;
+    }
+
+    uta_context = malloc(uta.context_v1_size());
+    workers = malloc(connections * sizeof(pthread_t));
+    /* Allocated here, so that no worker can fail after the start */
+    worker_buffers = malloc(connections * sizeof(utad_worker_t));
+    if ((uta_context == NULL) || (workers == NULL) ||
+        (worker_buffers == NULL))
+    {
+        fprintf(stderr, "Failed to allocate memory!\n");
+        return 1;
+    }
+
+    if (uta_ext.open_pool(uta_context, connections) != UTA_SUCCESS)
+    {
+        fprintf(stderr, "ERROR: The trust anchor could not be opened with %zu "
+            "connection(s)\n", connections);
+        return 1;
+    }
+
+    /* The device UUID does not change while the daemon runs */
+    uuid_rc = uta.get_device_uuid(uta_context, uuid);
+    capabilities_rc = uta_ext.get_capabilities(uta_context, &capabilities);
+
+    /* SIGINT and SIGTERM are only received through the signalfd */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    (void)pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    (void)signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = open_socket(socket_path, mode);
+    signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if ((listen_fd < 0) || (signal_fd < 0) || (epoll_fd < 0))
+    {
+        fprintf(stderr, "ERROR: Failed to listen on %s\n", socket_path);
+        (void)uta.close(uta_context);
+        return 1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &listen_marker;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0)
+    {
+        ret = 1;
+    }
+    event.data.ptr = &signal_marker;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) != 0)
+    {
+        ret = 1;
+    }
+
+    /* One worker per connection, so that every connection can be busy */
+    for (i = 0; (ret == 0) && (i < connections); i++)
+    {
+        if (pthread_create(&workers[i], NULL, worker_thread,
+            &worker_buffers[i]) != 0)
+        {
+            ret = 1;
+            break;
+        }
+        started++;
+    }
+
+    while (ret == 0)
+    {
+        n = epoll_wait(epoll_fd, events, UTAD_MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ret = 1;
+            break;
+        }
+
+        for (i = 0; i < (size_t)n; i++)
+        {
+            client = (utad_client_t *)events[i].data.ptr;
+            if (client == &listen_marker)
+            {
+                accept_clients(listen_fd);
+            }
+            else if (client == &signal_marker)
+            {
+                (void)read(signal_fd, &siginfo, sizeof(siginfo));
+                ret = -1;
+            }
+            else
+            {
+                receive_request(client);
+            }
+        }
+    }
+
+    /* Stop the workers after their current requests */
+    (void)pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    (void)pthread_cond_broadcast(&queue_cond);
+    (void)pthread_mutex_unlock(&queue_lock);
+    for (i = 0; i < started; i++)
+    {
+        (void)pthread_join(workers[i], NULL);
+    }
+
+    (void)close(listen_fd);
+    (void)unlink(socket_path);
+    (void)uta.close(uta_context);
+    free(uta_context);
+    free(workers);
+    free(worker_buffers);
+
+    return (ret > 0) ? 1 : 0;
+}
+
+/*******************************************************************************
+ * Private function bodies
+ ******************************************************************************/
+/**
+ * @brief Prints the usage of the program.
+ */
+static void print_usage(void)
+{
+    printf("Usage: utad [OPTIONS]\n\n");
+    printf("Serves the trust anchor to the UTA_CLIENT backend of other processes.\n\n");
+    printf("  -s PATH     Socket (default %s)\n", CONFIGURED_UTAD_SOCKET);
+    printf("  -c NUM      Connections to the trust anchor and worker threads (default %d)\n",
+        UTAD_CONNECTIONS);
+    printf("  -u SLOT:UID Allow derive_key with key slot SLOT to the user UID\n");
+    printf("  -g SLOT:GID Allow derive_key with key slot SLOT to the primary group GID\n");
+    printf("  -m MODE     Octal permissions of the socket (default %o)\n",
+        UTAD_SOCKET_MODE);
+    printf("  -h          Print this help\n\n");
+    printf("root and the user of the daemon may use all key slots. The options -u and -g\n");
+    printf("can be given up to %d times.\n", UTAD_MAX_ACL);
+}
+
+/**
+ * @brief Adds an access rule "SLOT:ID".
+ * @param[in] str Option argument.
+ * @param[in] is_group 1 if the id is a group id, 0 for a user id.
+ * @return 0 on success, 1 otherwise.
+ */
+static int parse_acl(const char *str, uint8_t is_group)
+{
+    unsigned long id;
+    char *end;
+
+    if ((num_acl == UTAD_MAX_ACL) || ((str[0] != '0') && (str[0] != '1')) ||
+        (str[1] != ':'))
+    {
+        return 1;
+    }
+
+    errno = 0;
+    id = strtoul(&str[2], &end, 10);
+    if ((errno != 0) || (end == &str[2]) || (*end != '\0') || (id > UINT32_MAX))
+    {
+        return 1;
+    }
+
+    acl[num_acl].key_slot = (uint8_t)(str[0] - '0');
+    acl[num_acl].is_group = is_group;
+    acl[num_acl].id = (uint32_t)id;
+    num_acl++;
+
+    return 0;
+}
+
+/**
+ * @brief Creates the listening socket. A stale socket of a previous run is
+ *      removed, other files are left untouched.
+ * @param[in] path Path of the socket.
+ * @param[in] mode Permissions of the socket.
+ * @return Socket descriptor, -1 on error.
+ */
+static int open_socket(const char *path, mode_t mode)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+
+    if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode))
+    {
+        (void)unlink(path);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if ((bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+        (chmod(path, mode) != 0) || (listen(fd, SOMAXCONN) != 0))
+    {
+        (void)close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Accepts all pending connections and adds them to epoll.
+ * @param[in] listen_fd Listening socket.
+ */
+static void accept_clients(int listen_fd)
+{
+    utad_client_t *client;
+    socklen_t len;
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL,
+        SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        client = calloc(1, sizeof(utad_client_t));
+        if ((client == NULL) ||
+            (__atomic_load_n(&num_clients, __ATOMIC_RELAXED) >=
+            UTAD_MAX_CLIENTS))
+        {
+            free(client);
+            (void)close(fd);
+            continue;
+        }
+
+        client->fd = fd;
+        len = sizeof(client->cred);
+        if ((getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &client->cred,
+            &len) != 0) || (arm_client(client, EPOLL_CTL_ADD) != 0))
+        {
+            free(client);
+            (void)close(fd);
+            continue;
+        }
+        (void)__atomic_add_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Reads the available part of the next request of a client. A
+ *      complete request is queued, otherwise the client waits in epoll again.
+ * @param[in,out] client Client, which has become readable.
+ */
+static void receive_request(utad_client_t *client)
+{
+    ssize_t n;
+
+    n = recv(client->fd, (uint8_t *)&client->request + client->received,
+        sizeof(client->request) - client->received, 0);
+    if (n <= 0)
+    {
+        if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR)) &&
+            (arm_client(client, EPOLL_CTL_MOD) == 0))
+        {
+            return;
+        }
+
+        /* The client closed the connection or it failed */
+        close_client(client);
+        return;
+    }
+
+    client->received += n;
+    if (client->received < sizeof(client->request))
+    {
+        if (arm_client(client, EPOLL_CTL_MOD) != 0)
+        {
+            close_client(client);
+        }
+        return;
+    }
+
+    client->received = 0;
+    if (client->request.magic != UTAD_MAGIC)
+    {
+        close_client(client);
+        return;
+    }
+
+    queue_request(client);
+}
+
+/**
+ * @brief Closes the connection of a client and releases it.
+ * @param[in] client Client.
+ */
+static void close_client(utad_client_t *client)
+{
+    (void)close(client->fd);
+    free(client);
+    (void)__atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Waits for the next request of a client. The client is reported once
+ *      and is not reported again until it is armed again.
+ * @param[in] client Client.
+ * @param[in] op EPOLL_CTL_ADD for a new client, EPOLL_CTL_MOD otherwise.
+ * @return 0 on success, -1 otherwise.
+ */
+static int arm_client(utad_client_t *client, int op)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = client;
+
+    return epoll_ctl(epoll_fd, op, client->fd, &event);
+}
+
+/**
+ * @brief Appends a client with a complete request to the queue.
+ * @param[in] client Client.
+ */
+static void queue_request(utad_client_t *client)
+{
+    client->next = NULL;
+
+    (void)pthread_mutex_lock(&queue_lock);
+    if (queue_tail == NULL)
+    {
+        queue_head = client;
+    }
+    else
+    {
+        queue_tail->next = client;
+    }
+    queue_tail = client;
+    (void)pthread_cond_signal(&queue_cond);
+    (void)pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * @brief Waits for queued requests and takes up to UTAD_BATCH_MAX of them.
+ * @param[out] clients Array for the clients of the taken requests.
+ * @return Number of taken requests, 0 if the daemon stops.
+ */
+static size_t take_requests(utad_client_t **clients)
+{
+    size_t num = 0;
+
+    (void)pthread_mutex_lock(&queue_lock);
+    while ((stopping == 0) && (queue_head == NULL))
+    {
+        (void)pthread_cond_wait(&queue_cond, &queue_lock);
+    }
+
+    while ((stopping == 0) && (queue_head != NULL) && (num < UTAD_BATCH_MAX))
+    {
+        clients[num++] = queue_head;
+        queue_head = queue_head->next;
+    }
+    if (queue_head == NULL)
+    {
+        queue_tail = NULL;
+    }
+    (void)pthread_mutex_unlock(&queue_lock);
+
+    return num;
+}
+
+/**
+ * @brief Checks whether a client may derive keys with a key slot.
+ * @param[in] cred Credentials of the client.
+ * @param[in] key_slot Key slot of the request.
+ * @return 1 if the client is authorized, 0 otherwise.
+ */
+static int is_authorized(const struct ucred *cred, uint8_t key_slot)
+{
+    size_t i;
+
+    if ((cred->uid == 0) || (cred->uid == geteuid()))
+    {
+        return 1;
+    }
+
+    for (i = 0; i < num_acl; i++)
+    {
+        if ((acl[i].key_slot == key_slot) &&
+            (acl[i].id == (acl[i].is_group ? cred->gid : cred->uid)))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Executes the requests taken by a worker and sends the responses.
+ *      All key derivations are done with one derive_key_batch call, all
+ *      random requests with one get_random call and the self test runs, is
+ *      started and is queried once for all requests of the batch. A full self
+ *      test is started, if any request of the batch asks for it.
+ * @param[in,out] worker Buffers of the worker.
+ * @param[in] clients Clients of the requests.
+ * @param[in] num Number of requests.
+ */
+static void process_requests(utad_worker_t *worker, utad_client_t **clients,
+        size_t num)
+{
+    utad_reply_t *reply;
+    const utad_request_t *request;
+    size_t num_derive = 0;
+    size_t len_random = 0;
+    int self_test = 0;
+    int start_self_test = 0;
+    int self_test_result = 0;
+    uta_self_test_mode_t start_mode = UTA_SELF_TEST_INCREMENTAL;
+    uta_self_test_result_v1_t result;
+    uta_rc random_rc = UTA_SUCCESS;
+    uta_rc self_test_rc = UTA_SUCCESS;
+    uta_rc start_rc = UTA_SUCCESS;
+    uta_rc result_rc = UTA_SUCCESS;
+    size_t i;
+
+    /* Check the requests and collect the derivations and random bytes */
+    for (i = 0; i < num; i++)
+    {
+        reply = &worker->replies[i];
+        request = &clients[i]->request;
+
+        reply->client = clients[i];
+        reply->response.magic = UTAD_MAGIC;
+        reply->response.rc = UTA_SUCCESS;
+        reply->response.len = request->len;
+        reply->response.reserved = 0;
+        reply->payload = NULL;
+
+        switch (request->op)
+        {
+        case UTAD_OP_DERIVE_KEY:
+            if (is_authorized(&clients[i]->cred, request->key_slot) == 0)
+            {
+                reply->response.rc = UTA_INVALID_KEY_SLOT;
+                break;
+            }
+            worker->derive[num_derive].key = worker->keys[num_derive];
+            worker->derive[num_derive].len_key = request->len;
+            worker->derive[num_derive].dv = request->dv;
+            worker->derive[num_derive].len_dv = UTA_LEN_DV_V1;
+            worker->derive[num_derive].key_slot = request->key_slot;
+            reply->payload = worker->keys[num_derive];
+            num_derive++;
+            break;
+        case UTAD_OP_GET_RANDOM:
+            if (request->len > UTAD_LEN_RANDOM_MAX)
+            {
+                reply->response.rc = UTA_NOT_SUPPORTED;
+                break;
+            }
+            reply->payload = &worker->random[len_random];
+            len_random += request->len;
+            break;
+        case UTAD_OP_GET_DEVICE_UUID:
+            reply->response.rc = uuid_rc;
+            reply->response.len = UTAD_LEN_UUID;
+            reply->payload = uuid;
+            break;
+        case UTAD_OP_GET_CAPABILITIES:
+            if (request->len != UTAD_LEN_CAPABILITIES)
+            {
+                reply->response.rc = UTA_NOT_SUPPORTED;
+                break;
+            }
+            reply->response.rc = capabilities_rc;
+            reply->payload = (const uint8_t *)&capabilities;
+            break;
+        case UTAD_OP_SELF_TEST:
+            reply->response.len = 0;
+            self_test = 1;
+            break;
+        case UTAD_OP_START_SELF_TEST:
+            reply->response.len = 0;
+            if ((request->key_slot != UTA_SELF_TEST_FULL) &&
+                (request->key_slot != UTA_SELF_TEST_INCREMENTAL))
+            {
+                reply->response.rc = UTA_NOT_SUPPORTED;
+                break;
+            }
+            if (request->key_slot == UTA_SELF_TEST_FULL)
+            {
+                start_mode = UTA_SELF_TEST_FULL;
+            }
+            start_self_test = 1;
+            break;
+        case UTAD_OP_GET_SELF_TEST_RESULT:
+            if (request->len != UTAD_LEN_SELF_TEST_RESULT)
+            {
+                reply->response.rc = UTA_NOT_SUPPORTED;
+                break;
+            }
+            reply->payload = (const uint8_t *)&worker->self_test_result;
+            self_test_result = 1;
+            break;
+        default:
+            reply->response.rc = UTA_NOT_SUPPORTED;
+            break;
+        }
+    }
+
+    if (num_derive > 0)
+    {
+        (void)uta_ext.derive_key_batch(uta_context, worker->derive,
+            num_derive);
+    }
+    if (len_random > 0)
+    {
+        random_rc = uta.get_random(uta_context, worker->random, len_random);
+    }
+    if (self_test != 0)
+    {
+        self_test_rc = uta.self_test(uta_context);
+    }
+    if (start_self_test != 0)
+    {
+        start_rc = uta_ext.start_self_test(uta_context, start_mode);
+    }
+    if (self_test_result != 0)
+    {
+        result_rc = uta_ext.get_self_test_result(uta_context, &result);
+        worker->self_test_result.rc = result.rc;
+        worker->self_test_result.mode = (uint32_t)result.mode;
+        worker->self_test_result.age = result.age;
+    }
+
+    /* Distribute the results in the order of the requests */
+    num_derive = 0;
+    for (i = 0; i < num; i++)
+    {
+        reply = &worker->replies[i];
+        if (reply->response.rc == UTA_SUCCESS)
+        {
+            switch (reply->client->request.op)
+            {
+            case UTAD_OP_DERIVE_KEY:
+                reply->response.rc = worker->derive[num_derive++].rc;
+                break;
+            case UTAD_OP_GET_RANDOM:
+                reply->response.rc = random_rc;
+                break;
+            case UTAD_OP_SELF_TEST:
+                reply->response.rc = self_test_rc;
+                break;
+            case UTAD_OP_START_SELF_TEST:
+                reply->response.rc = start_rc;
+                break;
+            case UTAD_OP_GET_SELF_TEST_RESULT:
+                reply->response.rc = result_rc;
+                break;
+            default:
+                break;
+            }
+        }
+        send_reply(reply);
+    }
+
+    /* Clear the derived keys and random bytes */
+    memset(worker->keys, 0, num_derive * UTAD_LEN_KEY_MAX);
+    memset(worker->random, 0, len_random);
+}
+
+/**
+ * @brief Sends the response of one request with a single system call. The
+ *      client has at most one request pending, so the socket buffer takes the
+ *      whole response; a client, which does not read its responses, is
+ *      dropped. Otherwise it waits in epoll for its next request.
+ * @param[in] reply Response and client.
+ */
+static void send_reply(const utad_reply_t *reply)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t len = sizeof(reply->response);
+    ssize_t n;
+
+    iov[0].iov_base = (void *)&reply->response;
+    iov[0].iov_len = sizeof(reply->response);
+    iov[1].iov_base = (void *)reply->payload;
+    iov[1].iov_len = 0;
+    if ((reply->response.rc == UTA_SUCCESS) && (reply->payload != NULL))
+    {
+        iov[1].iov_len = reply->response.len;
+        len += reply->response.len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    do
+    {
+        n = sendmsg(reply->client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while ((n < 0) && (errno == EINTR));
+
+    if ((n != (ssize_t)len) || (arm_client(reply->client, EPOLL_CTL_MOD) != 0))
+    {
+        close_client(reply->client);
+    }
+}
+
+/**
+ * @brief Worker thread, which executes the queued requests until the daemon
+ *      stops.
+ * @param[in,out] arg Pointer to the utad_worker_t buffers of the worker.
+ * @return Always NULL.
+ */
+static void *worker_thread(void *arg)
+{
+    utad_client_t *clients[UTAD_BATCH_MAX];
+    utad_worker_t *worker = (utad_worker_t *)arg;
+    size_t num;
+
+    while ((num = take_requests(clients)) > 0)
+    {
+        process_requests(worker, clients, num);
+    }
+
+    return NULL;
+}